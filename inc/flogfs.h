@@ -35,6 +35,10 @@ either expressed or implied, of the FLogFS Project.
  * @ingroup FLogFS
  *
  * @brief Public interface for FLogFS
+ *
+ * Built as C, the file system is one set of globals, so a program gets one
+ * volume on the flash driver from flogfs_conf.h. More than one volume takes
+ * @ref FLOG_BUILD_CPP and calling from C++.
  */
 
 #ifndef __FLOGFS_H_
@@ -45,8 +49,11 @@ either expressed or implied, of the FLogFS Project.
 //! @addtogroup FLogPublic
 //! @{
 
-//! Compile as C++
+#ifndef FLOG_BUILD_CPP
+//! Compile as C++, with the file system as a class template (see flogfs.hpp)
+//! so a program can have more than one volume. The C build has just the one.
 #define FLOG_BUILD_CPP        (0)
+#endif
 
 //! @name Version Number
 //! @{
@@ -64,6 +71,124 @@ either expressed or implied, of the FLogFS Project.
 
 #include "flogfs_conf.h"
 
+//! @name Optional features
+//! These may be enabled in flogfs_conf.h
+//! @{
+#ifndef FLOG_ENABLE_STATS
+//! Collect flash operation counters and API latency histograms
+#define FLOG_ENABLE_STATS      (0)
+#endif
+
+#ifndef FLOG_ENABLE_CHECKPOINT
+//! Keep a checkpoint of the allocation state so mounting needn't scan
+#define FLOG_ENABLE_CHECKPOINT (0)
+#endif
+
+#ifndef FLOG_CHECKPOINT_JOURNAL_LEN
+//! The number of journal entries before a new checkpoint record is written
+#define FLOG_CHECKPOINT_JOURNAL_LEN (16)
+#endif
+
+#ifndef FS_PAGE_CACHE_SIZE
+//! The number of pages to keep metadata for in RAM (0 to disable)
+#define FS_PAGE_CACHE_SIZE     (0)
+#endif
+
+#ifndef FS_PAGE_CACHE_BYTES
+//! The number of bytes cached from the start of each sector
+#define FS_PAGE_CACHE_BYTES    (64)
+#endif
+
+#ifndef FS_FILE_INDEX_SIZE
+//! The number of slots in the RAM filename hash index (0 to disable)
+#define FS_FILE_INDEX_SIZE     (0)
+#endif
+
+#ifndef FLOG_DELETE_QUEUE_LEN
+//! The number of deleted files whose blocks flogfs_background_step() may
+//! erase later (0 to erase them in flogfs_rm())
+#define FLOG_DELETE_QUEUE_LEN  (0)
+#endif
+
+#ifndef FLOG_LAZY_ERASE
+//! Leave queued deletions unerased until the allocator reuses their blocks
+//! (requires @ref FLOG_DELETE_QUEUE_LEN)
+#define FLOG_LAZY_ERASE        (0)
+#endif
+
+#ifndef FLOG_NUM_FILE_LOCKS
+//! The number of locks shared out among open files by address. Calls on
+//! files with different locks don't wait for each other except at the flash.
+#define FLOG_NUM_FILE_LOCKS    (4)
+#endif
+
+#ifndef FLOG_ASYNC_FLASH
+//! Start page programs with flash_commit_start() and only wait for them with
+//! flash_wait() before the next access to the same plane
+#define FLOG_ASYNC_FLASH       (0)
+#endif
+
+#ifndef FS_NUM_PLANES
+//! The number of planes or dies which can be busy independently. Block b is
+//! on plane b % FS_NUM_PLANES. A file's blocks go round the planes in turn.
+#define FS_NUM_PLANES          (1)
+#endif
+
+#ifndef FLOG_WEAR_LEVEL_SPREAD
+//! Have flogfs_background_step() move a file onto worn blocks when its
+//! youngest block is more than this many erases younger than the average free
+//! block (0 to disable). This costs about FS_SECTOR_SIZE * 2 bytes of RAM.
+#define FLOG_WEAR_LEVEL_SPREAD (0)
+#endif
+
+#ifndef FLOG_BAD_BLOCK_SPARES
+//! The number of erased blocks to keep aside for taking over from blocks that
+//! fail to program or erase (0 to disable). Needs flash_commit_to().
+#define FLOG_BAD_BLOCK_SPARES  (0)
+#endif
+
+#ifndef FLOG_BAD_BLOCK_TABLE_LEN
+//! The number of spares and taken over blocks the bad block table can hold
+#define FLOG_BAD_BLOCK_TABLE_LEN (16)
+#endif
+
+#ifndef FLOG_ENABLE_COMPRESSION
+//! Allow files to be written compressed (see flogfs_open_write_compressed()).
+//! Each volume then holds a @ref FLOG_COMPRESS_FRAME_SIZE frame buffer, which
+//! its read files take turns decoding into.
+#define FLOG_ENABLE_COMPRESSION (0)
+#endif
+
+#ifndef FLOG_COMPRESS_FRAME_SIZE
+//! The most data one compressed frame decodes to. Volumes must be read with
+//! the size they were written with, or larger.
+#define FLOG_COMPRESS_FRAME_SIZE (1024)
+#endif
+
+#ifndef FLOG_SECTOR_CRC
+//! @brief Store a CRC-32 of each file sector in its spare for
+//! flogfs_set_verify()
+//! 1 computes it in software with 8 KB of constant slice-by-8 tables (see
+//! flogfs_crc32.h), which every volume shares. 2 calls the port's
+//! flash_crc32() instead, which can use a CRC peripheral. Either needs
+//! flash_read_spare_check() and flash_write_spare_check().
+//! @note A volume must always be mounted with the same setting
+#define FLOG_SECTOR_CRC (0)
+#endif
+
+#ifndef FLOG_MOUNT_PREFETCH
+//! Have flash_prefetch_page() load the next block's first page while the
+//! mount scan reads the current one
+#define FLOG_MOUNT_PREFETCH    (0)
+#endif
+
+#ifndef FLOG_TAIL_PREFETCH
+//! Have flash_prefetch_page() load the next page of a file's last block while
+//! the current one is read in finding where the file ends
+#define FLOG_TAIL_PREFETCH     (0)
+#endif
+//! @}
+
 
 #if !FLOG_BUILD_CPP
 #ifdef __cplusplus
@@ -71,6 +196,10 @@ extern "C" {
 #endif
 #endif
 
+#if FLOG_BUILD_CPP
+//! A file system on one flash device (see flogfs_volume in flogfs.hpp)
+typedef struct flogfs_vol flogfs_vol_t;
+#endif
 
 typedef enum {
 	FLOG_FAILURE,
@@ -112,10 +241,67 @@ typedef struct {
 	uint16_t sector;
 } flog_inode_iterator_t;
 
-typedef flog_inode_iterator_t flogfs_ls_iterator_t;
+//! @brief A listing started by flogfs_start_ls()
+typedef struct {
+	//! The next inode entry to look at
+	flog_inode_iterator_t inode;
+	//! Files created after the listing started have newer timestamps
+	flog_timestamp_t timestamp;
+#if FLOG_BUILD_CPP
+	//! The volume being listed
+	flogfs_vol_t * vol;
+#endif
+} flogfs_ls_iterator_t;
+
+//! @brief A file found by flogfs_ls_iterate_entry()
+typedef struct {
+	char name[FLOG_MAX_FNAME_LEN];
+	flog_file_id_t file_id;
+	//! The first block of the file's chain
+	flog_block_idx_t first_block;
+	//! @brief The size as flogfs_size() would give it
+	//! For a compressed file, this is the bytes stored.
+	uint32_t size;
+	//! When the file was created, in the volume's own sequence of timestamps
+	flog_timestamp_t timestamp;
+} flogfs_ls_entry_t;
+
+//! @brief Codecs for compressed files (see flogfs_open_write_compressed())
+typedef enum {
+	//! LZ77 matches within each frame, for text and repetitive records
+	FLOG_COMPRESS_LZ = 2,
+	//! @brief Little-endian 16-bit samples as varint deltas from the same
+	//! field of the previous record, for fixed-size sensor records
+	FLOG_COMPRESS_DELTA = 3
+} flog_compression_t;
 
 #define FLOG_RESULT(x) ((x)?FLOG_SUCCESS:FLOG_FAILURE)
 
+//! @brief The location of a block in a file
+typedef struct {
+	flog_block_idx_t block;
+	//! The offset of the first byte of the block from the start of the file
+	uint32_t offset;
+} flog_skip_entry_t;
+
+/*!
+ @brief A sparse index of file blocks for seeking
+
+ Entry i is the block at position i * interval in the file's chain. Entries
+ are recorded as blocks are passed by reads and seeks. When the index fills,
+ every other entry is dropped and the interval doubles.
+ */
+typedef struct {
+	//! Storage provided by the application
+	flog_skip_entry_t * entries;
+	//! The number of entries available
+	uint16_t size;
+	//! The number of entries recorded
+	uint16_t n;
+	//! The number of blocks between entries
+	uint16_t interval;
+} flog_skip_index_t;
+
 /*!
  @brief The state of a currently-open file
 
@@ -123,7 +309,8 @@ typedef flog_inode_iterator_t flogfs_ls_iterator_t;
  for access to a file
  */
 typedef struct flog_read_file_t {
-	//! Offset of read head from the start of the file
+	//! Offset of read head from the start of the file (in decompressed bytes
+	//! for compressed files, as are the other offsets here)
 	uint32_t read_head;
 	//! Block index of read head
 	uint16_t block;
@@ -135,6 +322,41 @@ typedef struct flog_read_file_t {
 	uint16_t sector_remaining_bytes;
 	
 	uint32_t id;
+
+	//! The first block of the file
+	flog_block_idx_t first_block;
+	//! The position of the current block in the chain
+	uint16_t block_idx;
+	//! Offset of the first byte of the current block from the start of the file
+	uint32_t block_start;
+	//! An optional index to speed up seeking (see flogfs_set_skip_index())
+	flog_skip_index_t * skip_index;
+#if FLOG_ENABLE_COMPRESSION
+	//! Set if the file holds compressed frames
+	uint8_t compressed;
+	//! The number of bytes the frame at the read head decodes to
+	uint16_t frame_len;
+	//! The number of those already read
+	uint16_t frame_pos;
+	//! @brief Where that frame's header is
+	//! It's decoded again from here if another file has used the volume's
+	//! frame buffer since.
+	flog_block_idx_t frame_block;
+	uint16_t frame_sector;
+	uint16_t frame_offset;
+#endif
+#if FLOG_SECTOR_CRC
+	//! Set to check each sector against its CRC (see flogfs_set_verify())
+	uint8_t verify;
+	//! Set once the sector at the read head has passed its check
+	uint8_t checked;
+	//! Set when reading stopped at a sector which failed its check
+	uint8_t corrupt;
+#endif
+#if FLOG_BUILD_CPP
+	//! The volume the file is open on
+	flogfs_vol_t * vol;
+#endif
 	
 	struct flog_read_file_t * next;
 } flog_read_file_t;
@@ -158,19 +380,143 @@ typedef struct flog_write_file_t {
 	//! The number of bytes remaining in the sector before forcing a cache flush
 	uint16_t sector_remaining_bytes;
 	//! Bytes in block (so far)
-	uint16_t bytes_in_block;
+	uint32_t bytes_in_block;
 	uint32_t block_age;
 	uint32_t id;
+	//! @brief flogfs_t::lost_programs when opened
+	//! Once that moves, flushing and closing fail.
+	uint32_t lost_programs;
 	
 	int32_t base_threshold;
 
 	uint8_t sector_buffer[FS_SECTOR_SIZE];
+
+	//! Optional page of buffering (see flogfs_set_page_buffer())
+	uint8_t * page_buffer;
+	//! The number of bytes waiting in page_buffer
+	uint16_t page_fill;
+	//! Optional second sector buffer (see flogfs_set_back_buffer())
+	uint8_t * back_buffer;
+	//! @brief The number of bytes waiting in back_buffer
+	//! These only go into write_head once they move to sector_buffer.
+	uint16_t back_fill;
+	//! Set if the init sector of this block was written without our data
+	//! to make way for another allocation
+	uint8_t init_written;
+	//! Flush once this many bytes are buffered (see flogfs_set_group_commit())
+	uint32_t commit_bytes;
+	//! Flush once buffered data is this many microseconds old
+	uint32_t commit_us;
+	//! When buffered data was first seen waiting (valid if commit_armed)
+	uint32_t commit_since;
+	uint8_t commit_armed;
+	//! @brief Set for data which is expected to stay put
+	//! Its blocks come from the most worn free blocks.
+	uint8_t cold;
+#if FLOG_ENABLE_COMPRESSION
+	//! @brief Data waiting to be compressed, or null for a plain file
+	//! (see flogfs_open_write_compressed())
+	uint8_t * compress_buffer;
+	//! The number of bytes waiting in compress_buffer
+	uint16_t compress_fill;
+	//! The flog_compression_t
+	uint8_t codec;
+	//! The record size in 16-bit samples for @ref FLOG_COMPRESS_DELTA
+	uint8_t codec_param;
+#endif
+#if FLOG_BUILD_CPP
+	//! The volume the file is open on
+	flogfs_vol_t * vol;
+#endif
 	
 	struct flog_write_file_t * next;
 } flog_write_file_t;
 
+//! One piece of data for flogfs_writev()
+typedef struct {
+	uint8_t const * base;
+	uint32_t len;
+} flog_iovec_t;
+
+#if FLOG_ENABLE_STATS
+//! The number of latency buckets in each histogram
+#define FLOG_STATS_NUM_BUCKETS (16)
+
+/*!
+ @brief The public calls for which latency is tracked
+
+ flogfs_read_pages() on a compressed file counts as flogfs_read(), which it
+ does the work of.
+ */
+typedef enum {
+	FLOG_STATS_API_FORMAT,
+	FLOG_STATS_API_MOUNT,
+	FLOG_STATS_API_OPEN_READ,
+	FLOG_STATS_API_OPEN_WRITE,
+	FLOG_STATS_API_CLOSE_READ,
+	FLOG_STATS_API_CLOSE_WRITE,
+	FLOG_STATS_API_RM,
+	FLOG_STATS_API_READ,
+	FLOG_STATS_API_WRITE,
+	FLOG_STATS_API_FORMAT_QUICK,
+	FLOG_STATS_API_SEEK,
+	FLOG_STATS_API_READ_PAGES,
+	FLOG_STATS_API_WRITEV,
+	FLOG_STATS_API_WRITE_TRY,
+	FLOG_STATS_API_SIZE,
+	FLOG_STATS_API_COUNT
+} flog_stats_api_t;
+
+/*!
+ @brief A coarse log2 latency histogram
+
+ Bucket 0 counts calls under 1us and bucket i counts calls taking
+ [2^(i-1), 2^i) us. The last bucket also takes everything longer.
+ */
+typedef struct {
+	uint32_t calls;
+	uint32_t max_us;
+	uint32_t buckets[FLOG_STATS_NUM_BUCKETS];
+} flog_latency_hist_t;
+
+/*!
+ @brief File system operation statistics
+ */
+typedef struct {
+	//! Pages loaded from the array (flash_open_page)
+	uint32_t page_opens;
+	//! Page opens avoided because the page was already in the cache
+	uint32_t page_cache_hits;
+	//! Sector spare reads
+	uint32_t spare_reads;
+	//! Page programs (flash_commit)
+	uint32_t sector_programs;
+	//! Block erases
+	uint32_t erases;
+	//! Blocks inspected by the allocator
+	uint32_t allocator_iterations;
+	//! Files moved onto worn blocks (@ref FLOG_WEAR_LEVEL_SPREAD)
+	uint32_t wear_level_moves;
+	//! Page programs and block erases the flash reported as failed
+	uint32_t program_failures;
+	uint32_t erase_failures;
+	//! Blocks taken over by a spare (@ref FLOG_BAD_BLOCK_SPARES)
+	uint32_t blocks_replaced;
+	//! Bytes given to compressed files and the bytes their frames took
+	uint32_t compress_in;
+	uint32_t compress_out;
+	//! Sectors which failed their check on reading (@ref FLOG_SECTOR_CRC)
+	uint32_t crc_failures;
+	//! Latency of each public call, from entry (including lock waits) to exit
+	flog_latency_hist_t api[FLOG_STATS_API_COUNT];
+} flogfs_stats_t;
+#endif
+
 /*!
  @brief Initialize flogfs filesystem structures
+
+ Everything held in RAM is forgotten, including the stats, as if the power had
+ just come up.
  */
 flog_result_t flogfs_init();
 
@@ -179,11 +525,69 @@ flog_result_t flogfs_init();
  */
 flog_result_t flogfs_format();
 
+/*!
+ @brief Format the flash memory without erasing most of it
+
+ This erases only the checkpoint blocks and the block for a new inode table,
+ whose timestamp starts a new generation. Blocks left from before it are
+ free, and each is erased when it's first allocated. Blocks still blank from
+ the factory are given block stats. The age of every block is kept.
+
+ It still reads the first page of every block to find the newest timestamp.
+ */
+flog_result_t flogfs_format_quick();
+
 /*!
  @brief Mount the FLogFS filesystem and prepare it for use
+
+ Volumes formatted before the format was recorded in the first inode block
+ still mount. Their file tails are read with the 16-bit block byte counts
+ they were written with, which can't count past 64 KiB of data in a block,
+ until the volume is formatted again.
  */
 flog_result_t flogfs_mount();
 
+/*!
+ @brief Unmount the file system
+
+ All files should be closed first. With @ref FLOG_ENABLE_CHECKPOINT this
+ writes a checkpoint so the next mount needn't replay anything.
+ @retval FLOG_FAILURE if a checkpoint failed to program since the last
+         flogfs_checkpoint(). The next mount scans instead.
+ */
+flog_result_t flogfs_unmount();
+
+/*!
+ @brief Do some deferred maintenance work
+ @param budget_us Stop starting new work after this long
+ @retval 1 if there is more work to do
+ @retval 0 if there is nothing left for now
+
+ This is meant to be called from an idle thread. It flushes write files past
+ their group commit age (see flogfs_set_group_commit()), erases the blocks of
+ files deleted with @ref FLOG_DELETE_QUEUE_LEN (unless @ref FLOG_LAZY_ERASE
+ leaves that to the allocator) and then fills the block preallocation list.
+ Each unit of work is one block erase or one block checked, so a call may run
+ over its budget by about one erase.
+
+ With @ref FLOG_WEAR_LEVEL_SPREAD it then looks over the blocks for cold data
+ holding young blocks, and moves it. Moving a file is one unit of work, so a
+ call that does one may run over by the time to copy the file. It waits for
+ any ls to finish and keeps other files from being opened or removed
+ meanwhile.
+ */
+uint_fast8_t flogfs_background_step(uint32_t budget_us);
+
+/*!
+ @brief Write a checkpoint of the allocation state now
+ @retval FLOG_FAILURE if not mounted, checkpoints are unavailable or one
+         failed to program since the last call
+
+ Checkpoints are also written automatically as the journal fills. This is just
+ a way to choose when to pay for it.
+ */
+flog_result_t flogfs_checkpoint();
+
 /*!
  @brief Open a file to read
  @param file The file structure to use
@@ -203,9 +607,80 @@ flog_result_t flogfs_open_read(flog_read_file_t * file, char const * filename);
  Since the system is append-only, it automatically seeks to the end of the file
  if it exists. Check the flog_write_file_t::write_head value to see where you
  are writing.
+
+ A compressed file can only be appended to with flogfs_open_write_compressed().
  */
 flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename);
 
+#if FLOG_ENABLE_COMPRESSION
+/*!
+ @brief Open a file to write compressed
+ @param file The file structure to use
+ @param filename The name of the file to use
+ @param codec The flog_compression_t for the data written from now on
+ @param record_size For @ref FLOG_COMPRESS_DELTA, the size of each record in
+                    bytes (even, up to 510), or 0 for a plain series of samples
+ @param buffer @ref FLOG_COMPRESS_FRAME_SIZE bytes for data waiting to be
+               compressed, which must stay valid while the file is open
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE otherwise, including if the file exists uncompressed
+
+ Data collects in buffer and is compressed a frame at a time on its way to the
+ sector buffer. Frames never straddle sectors, so reading can start at any
+ sector. flogfs_read() and flogfs_seek() decompress transparently. Whether a
+ file is compressed is settled when it's created, but each opening may use a
+ different codec.
+
+ flog_write_file_t::write_head and flogfs_size() count the bytes stored
+ (flogfs_size_decompressed() counts the bytes that read back). The data in
+ buffer goes out with flogfs_flush() and flogfs_close_write(), and counts
+ towards the byte limit of flogfs_set_group_commit().
+ flogfs_write_try() takes nothing for compressed files.
+ */
+flog_result_t flogfs_open_write_compressed(flog_write_file_t * file,
+                                           char const * filename,
+                                           flog_compression_t codec,
+                                           uint16_t record_size,
+                                           uint8_t * buffer);
+#endif
+
+/*!
+ @brief Buffer writes a page at a time instead of a sector at a time
+ @param file The currently-open write file
+ @param buffer FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE bytes which must stay valid
+               while the file is open, or null to go back to sector buffering
+
+ Small writes then collect in RAM until a whole page can be programmed at once.
+ Use flogfs_flush() where the data must be durable.
+ */
+void flogfs_set_page_buffer(flog_write_file_t * file, uint8_t * buffer);
+
+/*!
+ @brief Give a file a second sector buffer so it can take data while the first
+        waits for the flash
+ @param file The currently-open write file
+ @param buffer FS_SECTOR_SIZE bytes which must stay valid while the file is
+               open, or null to stop using one
+
+ While a full sector waits to be programmed, flogfs_write_try() puts what
+ follows in this buffer instead of giving up. Every other call moves the
+ contents along before doing anything else.
+ */
+void flogfs_set_back_buffer(flog_write_file_t * file, uint8_t * buffer);
+
+/*!
+ @brief Write out any data buffered for a file
+ @param file The currently-open write file
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE otherwise, including when a program failed anywhere
+         since the file was opened and no spare could take over. The data
+         might not all be there, so this keeps failing until it's closed.
+
+ The rest of a partly-written sector can't be used afterwards, so flushing
+ little and often wastes space.
+ */
+flog_result_t flogfs_flush(flog_write_file_t * file);
+
 /*!
  @brief Close a file which has been opened for reading
  @param file The currently-open read file
@@ -218,16 +693,50 @@ flog_result_t flogfs_close_read(flog_read_file_t * file);
  @brief Close a file which has been opened for writing
  @param file The currently-open write file
  @retval FLOG_SUCCESS if successful
- @retval FLOG_FAILURE otherwise
+ @retval FLOG_FAILURE otherwise, or if flogfs_flush() would have failed
  */
 flog_result_t flogfs_close_write(flog_write_file_t * file);
 
 /*!
  @brief Remove a file from the filesystem
  @param filename The name of the file
+ @retval FLOG_FAILURE if it doesn't exist, or a program failed and the file
+         may still be there
  */
 flog_result_t flogfs_rm(char const * filename);
 
+/*!
+ @brief Get the length of a file
+ @param filename The name of the file
+ @param[out] size The number of bytes written to it
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE if the file doesn't exist
+
+ With the file index (@ref FS_FILE_INDEX_SIZE) this is answered from RAM once
+ the file has been closed, opened or measured since mounting. A file open for
+ writing counts everything given to flogfs_write() so far.
+
+ A compressed file is measured in the bytes its frames take on the flash, not
+ the offsets flogfs_read() and flogfs_seek() use. See
+ flogfs_size_decompressed() for those.
+ */
+flog_result_t flogfs_size(char const * filename, uint32_t * size);
+
+#if FLOG_ENABLE_COMPRESSION
+/*!
+ @brief Get the length of a file as it reads back
+ @param filename The name of the file
+ @param[out] size The number of bytes flogfs_read() would give from the start
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE if the file doesn't exist
+
+ For a compressed file, the header of every frame is read, but none are
+ decoded. Data still waiting in a writer's compress buffer isn't counted.
+ Otherwise this is flogfs_size().
+ */
+flog_result_t flogfs_size_decompressed(char const * filename, uint32_t * size);
+#endif
+
 /*!
  @brief Read data from an open file
  @param file The file structure to read from
@@ -237,6 +746,70 @@ flog_result_t flogfs_rm(char const * filename);
  */
 uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst, uint32_t nbytes);
 
+/*!
+ @brief Read a large amount of data from an open file
+ @param file The file structure to read from
+ @param dst The destination for the data
+ @param nbytes The number of bytes to try to read
+ @returns The number of bytes read
+
+ This is equivalent to flogfs_read() but fetches each page's spares in one
+ transaction and transfers runs of full sectors straight into dst with one
+ read. It pays off for reads of several sectors or more. Compressed files are
+ read just as by flogfs_read().
+ */
+uint32_t flogfs_read_pages(flog_read_file_t * file, uint8_t * dst,
+                           uint32_t nbytes);
+
+/*!
+ @brief Move the read head of an open file
+ @param file The file structure
+ @param index The offset from the start of the file
+ @retval FLOG_SUCCESS if the read head is now at index
+ @retval FLOG_FAILURE if the file is shorter; the read head is left at the end
+
+ Whole blocks are skipped using their tail sectors, starting from the current
+ block or the nearest skip index entry, whichever is closer.
+
+ In a compressed file, only the frame holding index is decoded. The headers of
+ the frames before it are read from the current frame or the nearest skip
+ index entry on, which takes a read for each.
+ */
+flog_result_t flogfs_seek(flog_read_file_t * file, uint32_t index);
+
+/*!
+ @brief Attach a sparse block index to an open file to speed up seeking
+ @param file The file structure
+ @param index The index structure, which must stay valid while the file is open
+ @param entries Storage for the index
+ @param size The number of entries available
+ @param interval The initial number of blocks between entries (at least 1)
+
+ With N entries, a seek costs a binary search in RAM plus at most about
+ (blocks in file / N) tail sector reads.
+ */
+void flogfs_set_skip_index(flog_read_file_t * file, flog_skip_index_t * index,
+                           flog_skip_entry_t * entries, uint16_t size,
+                           uint16_t interval);
+
+#if FLOG_SECTOR_CRC
+/*!
+ @brief Check sectors against their CRCs before reading from them
+ @param file The file structure
+ @param verify Nonzero to check
+
+ Each sector is checked the first time flogfs_read() or flogfs_read_pages()
+ takes data from it. Reading a whole sector at once checks what was read
+ into dst, so that costs only the CRC. A read which starts or ends part way
+ through a sector reads the whole sector again to check it.
+
+ Reads stop short at a sector which fails, and keep doing so until the file
+ seeks past it. flog_read_file_t::corrupt is set to tell this from the end
+ of the file.
+ */
+void flogfs_set_verify(flog_read_file_t * file, uint8_t verify);
+#endif
+
 /*!
  @brief Write data to an open file
  @param file The file structure to write to
@@ -248,7 +821,69 @@ uint32_t flogfs_write(flog_write_file_t * file, uint8_t const * src,
                       uint32_t nbytes);
 
 /*!
- @brief Start listing files (lock inode table)
+ @brief Write several pieces of data to an open file in one call
+ @param file The file structure to write to
+ @param iov The data, in order
+ @param iovcnt The number of entries in iov
+ @returns The number of bytes written
+
+ This is equivalent to calling flogfs_write() for each entry but takes the
+ locks once, so a batch of small records from one or many threads costs one
+ lock acquisition and they share sector and page programs. It stops at the
+ first entry that can't be written in full.
+ */
+uint32_t flogfs_writev(flog_write_file_t * file, flog_iovec_t const * iov,
+                       uint16_t iovcnt);
+
+/*!
+ @brief Flush a file automatically once enough data is waiting or it has
+        waited long enough
+ @param file The currently-open write file
+ @param max_bytes Flush after a write leaves at least this many bytes in RAM
+                  (0 for no limit)
+ @param max_ms Flush once data has been waiting this long (0 for no limit)
+
+ Writers then get durability bounded in bytes and time without each one
+ flushing, which would waste the rest of a sector every time. The byte limit
+ is checked by flogfs_write() and flogfs_writev(). The age limit is checked by
+ those too and by flogfs_background_step(), which must be called (at least
+ every max_ms) for data to be flushed when nothing more is written. Both are
+ off when a file is opened.
+ */
+void flogfs_set_group_commit(flog_write_file_t * file, uint32_t max_bytes,
+                             uint32_t max_ms);
+
+/*!
+ @brief Write as much to an open file as can be taken without waiting
+ @param file The file structure to write to
+ @param src The data source
+ @param nbytes The number of bytes to try to write
+ @returns The number of bytes taken, which may be short or 0
+
+ This never waits for a lock or for a program to finish. Data collects in
+ RAM and a full sector is only handed over if the flash is free right then.
+ Without @ref FLOG_ASYNC_FLASH that hand-over includes the program itself.
+ Starting a new block may also have to allocate (and even erase) one. Call
+ flogfs_write() or flogfs_flush() from somewhere that can wait if this keeps
+ coming up short.
+
+ @note Files with a page buffer (see flogfs_set_page_buffer()) always need
+       the flash to take data, so this returns 0 for them. So does a
+       compressed file.
+ */
+uint32_t flogfs_write_try(flog_write_file_t * file, uint8_t const * src,
+                          uint32_t nbytes);
+
+/*!
+ @brief Start listing files
+
+ Nothing is locked between calls, so files can be written, created and
+ removed while the listing goes on. The listing covers the files that existed
+ when it started. Each is listed once unless it's removed before the listing
+ gets to it. Files created since are left out.
+
+ @note Wear leveling moves no files until the listing is stopped (see
+       @ref FLOG_WEAR_LEVEL_SPREAD)
  */
 void flogfs_start_ls(flogfs_ls_iterator_t * iter);
 
@@ -261,10 +896,86 @@ void flogfs_start_ls(flogfs_ls_iterator_t * iter);
 uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t * iter, char * fname_dst);
 
 /*!
- @brief Unlock the inode table when done listing
+ @brief Read the details of another file
+ @param prefix Only list files whose names start with this, or null for all
+ @param[out] entry The file
+ @retval 1 Successful
+ @retval 0 This is the end of the data
+
+ The inode table has the name, ID, first block and creation time. The size
+ comes from an open writer or the file index without reading the file, or
+ from one walk of its chain otherwise (see flogfs_size()).
+ */
+uint_fast8_t flogfs_ls_iterate_entry(flogfs_ls_iterator_t * iter,
+                                     char const * prefix,
+                                     flogfs_ls_entry_t * entry);
+
+/*!
+ @brief Finish a listing
+
+ Every listing started must be stopped, including one left before the end.
+ With @ref FLOG_WEAR_LEVEL_SPREAD, one that never is keeps wear leveling from
+ moving any file until the next mount. Iterating a stopped listing finds
+ nothing, and stopping it again does nothing.
  */
 void flogfs_stop_ls(flogfs_ls_iterator_t * iter);
 
+#if FLOG_ENABLE_STATS
+/*!
+ @brief Get a snapshot of the operation statistics
+ @param[out] stats The destination
+ @note Requires @ref FLOG_ENABLE_STATS
+ */
+void flogfs_get_stats(flogfs_stats_t * stats);
+
+/*!
+ @brief Zero all operation statistics
+ @note Requires @ref FLOG_ENABLE_STATS
+ */
+void flogfs_reset_stats();
+#endif
+
+#if FLOG_BUILD_CPP
+//! @name Explicit volumes
+//! These act on the volume given instead of the one built from flogfs_conf.h.
+//! Calls on a file or listing go to the volume it was opened on either way.
+//! They are C++ overloads, like the rest of the API in this build, so there
+//! are no C entry points for volumes. A C build has only the one volume.
+//! @{
+flog_result_t flogfs_init(flogfs_vol_t * vol);
+flog_result_t flogfs_format(flogfs_vol_t * vol);
+flog_result_t flogfs_format_quick(flogfs_vol_t * vol);
+flog_result_t flogfs_mount(flogfs_vol_t * vol);
+flog_result_t flogfs_unmount(flogfs_vol_t * vol);
+uint_fast8_t flogfs_background_step(flogfs_vol_t * vol, uint32_t budget_us);
+flog_result_t flogfs_checkpoint(flogfs_vol_t * vol);
+flog_result_t flogfs_open_read(flogfs_vol_t * vol, flog_read_file_t * file,
+                               char const * filename);
+flog_result_t flogfs_open_write(flogfs_vol_t * vol, flog_write_file_t * file,
+                                char const * filename);
+#if FLOG_ENABLE_COMPRESSION
+flog_result_t flogfs_open_write_compressed(flogfs_vol_t * vol,
+                                           flog_write_file_t * file,
+                                           char const * filename,
+                                           flog_compression_t codec,
+                                           uint16_t record_size,
+                                           uint8_t * buffer);
+#endif
+flog_result_t flogfs_rm(flogfs_vol_t * vol, char const * filename);
+flog_result_t flogfs_size(flogfs_vol_t * vol, char const * filename,
+                          uint32_t * size);
+#if FLOG_ENABLE_COMPRESSION
+flog_result_t flogfs_size_decompressed(flogfs_vol_t * vol,
+                                       char const * filename, uint32_t * size);
+#endif
+void flogfs_start_ls(flogfs_vol_t * vol, flogfs_ls_iterator_t * iter);
+#if FLOG_ENABLE_STATS
+void flogfs_get_stats(flogfs_vol_t * vol, flogfs_stats_t * stats);
+void flogfs_reset_stats(flogfs_vol_t * vol);
+#endif
+//! @}
+#endif
+
 #if !FLOG_BUILD_CPP
 #ifdef __cplusplus
 };
@@ -0,0 +1,376 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs.hpp
+ * @author Ben Nahill <bnahill@gmail.com>
+ *
+ * @ingroup FLogFS
+ *
+ * @brief The file system as a class template, for the C++ build
+ *
+ * flogfs.c is compiled inside flogfs_volume with the geometry macros pointing
+ * at the template's geometry, so sector arithmetic folds at compile time and
+ * volumes on different chips can coexist. The C API in flogfs.cpp runs on a
+ * default volume built from flogfs_conf.h.
+ */
+
+#ifndef __FLOGFS_HPP_
+#define __FLOGFS_HPP_
+
+#include "flogfs_private.h"
+#include "flogfs.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if !FLOG_BUILD_CPP
+#error "flogfs.hpp needs FLOG_BUILD_CPP"
+#endif
+
+#include "flogfs_conf_implement.h"
+
+//! @addtogroup FLogPublic
+//! @{
+
+/*!
+ @brief The shape of a flash device
+ @tparam SectorSize The size of a sector in bytes
+ @tparam SectorsPerPage The number of sectors in a page
+ @tparam PagesPerBlock The number of pages in an erase block
+ @tparam NumBlocks The number of blocks in the device
+ @tparam NumPlanes The number of planes which can be busy independently
+ */
+template<uint16_t SectorSize, uint16_t SectorsPerPage, uint16_t PagesPerBlock,
+         uint16_t NumBlocks, uint8_t NumPlanes = 1>
+struct flog_geometry {
+	static constexpr uint16_t sector_size = SectorSize;
+	static constexpr uint16_t sectors_per_page = SectorsPerPage;
+	static constexpr uint16_t pages_per_block = PagesPerBlock;
+	static constexpr uint16_t num_blocks = NumBlocks;
+	static constexpr uint8_t num_planes = NumPlanes;
+};
+
+template<uint16_t SectorSize, uint16_t SectorsPerPage, uint16_t PagesPerBlock,
+         uint16_t NumBlocks, uint8_t NumPlanes>
+constexpr uint16_t flog_geometry<SectorSize, SectorsPerPage, PagesPerBlock,
+                                 NumBlocks, NumPlanes>::sector_size;
+template<uint16_t SectorSize, uint16_t SectorsPerPage, uint16_t PagesPerBlock,
+         uint16_t NumBlocks, uint8_t NumPlanes>
+constexpr uint16_t flog_geometry<SectorSize, SectorsPerPage, PagesPerBlock,
+                                 NumBlocks, NumPlanes>::sectors_per_page;
+template<uint16_t SectorSize, uint16_t SectorsPerPage, uint16_t PagesPerBlock,
+         uint16_t NumBlocks, uint8_t NumPlanes>
+constexpr uint16_t flog_geometry<SectorSize, SectorsPerPage, PagesPerBlock,
+                                 NumBlocks, NumPlanes>::pages_per_block;
+template<uint16_t SectorSize, uint16_t SectorsPerPage, uint16_t PagesPerBlock,
+         uint16_t NumBlocks, uint8_t NumPlanes>
+constexpr uint16_t flog_geometry<SectorSize, SectorsPerPage, PagesPerBlock,
+                                 NumBlocks, NumPlanes>::num_blocks;
+template<uint16_t SectorSize, uint16_t SectorsPerPage, uint16_t PagesPerBlock,
+         uint16_t NumBlocks, uint8_t NumPlanes>
+constexpr uint8_t flog_geometry<SectorSize, SectorsPerPage, PagesPerBlock,
+                                NumBlocks, NumPlanes>::num_planes;
+
+//! The geometry from flogfs_conf.h
+typedef flog_geometry<FS_SECTOR_SIZE, FS_SECTORS_PER_PAGE, FS_PAGES_PER_BLOCK,
+                      FS_NUM_BLOCKS, FS_NUM_PLANES> flog_conf_geometry;
+
+/*!
+ @brief The flash driver from flogfs_conf_implement.h
+
+ Any other driver passed to flogfs_volume needs the same members. The
+ arguments and results are those of the flash_* shims they stand in for.
+ */
+struct flog_conf_flash {
+	flog_result_t init(){return flash_init();}
+	void lock(){flash_lock();}
+	void unlock(){flash_unlock();}
+	uint_fast8_t trylock(){return flash_trylock();}
+	flog_result_t open_page(uint16_t block, uint16_t page){
+		return flash_open_page(block, page);
+	}
+	flog_result_t erase_block(uint16_t block){return flash_erase_block(block);}
+#if FLOG_MOUNT_PREFETCH || FLOG_TAIL_PREFETCH
+	flog_result_t prefetch_page(uint16_t block, uint16_t page){
+		return flash_prefetch_page(block, page);
+	}
+#endif
+	flog_result_t block_is_bad(){return flash_block_is_bad();}
+	void set_bad_block(uint16_t block){flash_set_bad_block(block);}
+	flog_result_t commit(){return flash_commit();}
+#if FLOG_BAD_BLOCK_SPARES
+	flog_result_t commit_to(uint16_t block, uint16_t page){
+		return flash_commit_to(block, page);
+	}
+#endif
+#if FLOG_ASYNC_FLASH
+	void commit_start(){flash_commit_start();}
+	flog_result_t wait(uint8_t plane){return flash_wait(plane);}
+	uint_fast8_t busy(uint8_t plane){return flash_busy(plane);}
+#endif
+	flog_result_t read_sector(uint8_t * dst, uint8_t sector, uint16_t offset,
+	                          uint16_t n){
+		return flash_read_sector(dst, sector, offset, n);
+	}
+	flog_result_t read_spare(uint8_t * dst, uint8_t sector){
+		return flash_read_spare(dst, sector);
+	}
+	flog_result_t read_spares(uint8_t * dst){return flash_read_spares(dst);}
+	void write_sector(uint8_t const * src, uint8_t sector, uint16_t offset,
+	                  uint16_t n){
+		flash_write_sector(src, sector, offset, n);
+	}
+	void write_spare(uint8_t const * src, uint8_t sector){
+		flash_write_spare(src, sector);
+	}
+#if FLOG_SECTOR_CRC
+	flog_result_t read_spare_check(uint8_t * dst, uint8_t sector){
+		return flash_read_spare_check(dst, sector);
+	}
+	void write_spare_check(uint8_t const * src, uint8_t sector){
+		flash_write_spare_check(src, sector);
+	}
+#endif
+#if FLOG_SECTOR_CRC == 2
+	uint32_t crc32(uint32_t crc, uint8_t const * data, uint32_t n){
+		return flash_crc32(crc, data, n);
+	}
+#endif
+};
+
+/*!
+ @brief The public API of any flogfs_volume
+
+ This is what a flogfs_vol_t handle points to, so the calls in flogfs.h can
+ take volumes of different geometries and drivers.
+ */
+struct flogfs_vol {
+	virtual flog_result_t flogfs_init() = 0;
+	virtual flog_result_t flogfs_format() = 0;
+	virtual flog_result_t flogfs_format_quick() = 0;
+	virtual flog_result_t flogfs_mount() = 0;
+	virtual flog_result_t flogfs_unmount() = 0;
+	virtual uint_fast8_t flogfs_background_step(uint32_t budget_us) = 0;
+	virtual flog_result_t flogfs_checkpoint() = 0;
+	virtual flog_result_t flogfs_open_read(flog_read_file_t * file,
+	                                       char const * filename) = 0;
+	virtual flog_result_t flogfs_open_write(flog_write_file_t * file,
+	                                        char const * filename) = 0;
+#if FLOG_ENABLE_COMPRESSION
+	virtual flog_result_t flogfs_open_write_compressed(
+	   flog_write_file_t * file, char const * filename,
+	   flog_compression_t codec, uint16_t record_size, uint8_t * buffer) = 0;
+#endif
+	virtual void flogfs_set_page_buffer(flog_write_file_t * file,
+	                                    uint8_t * buffer) = 0;
+	virtual void flogfs_set_back_buffer(flog_write_file_t * file,
+	                                    uint8_t * buffer) = 0;
+	virtual flog_result_t flogfs_flush(flog_write_file_t * file) = 0;
+	virtual flog_result_t flogfs_close_read(flog_read_file_t * file) = 0;
+	virtual flog_result_t flogfs_close_write(flog_write_file_t * file) = 0;
+	virtual flog_result_t flogfs_rm(char const * filename) = 0;
+	virtual flog_result_t flogfs_size(char const * filename,
+	                                  uint32_t * size) = 0;
+#if FLOG_ENABLE_COMPRESSION
+	virtual flog_result_t flogfs_size_decompressed(char const * filename,
+	                                               uint32_t * size) = 0;
+#endif
+	virtual uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst,
+	                             uint32_t nbytes) = 0;
+	virtual uint32_t flogfs_read_pages(flog_read_file_t * file, uint8_t * dst,
+	                                   uint32_t nbytes) = 0;
+	virtual flog_result_t flogfs_seek(flog_read_file_t * file,
+	                                  uint32_t index) = 0;
+	virtual void flogfs_set_skip_index(flog_read_file_t * file,
+	                                   flog_skip_index_t * index,
+	                                   flog_skip_entry_t * entries,
+	                                   uint16_t size, uint16_t interval) = 0;
+#if FLOG_SECTOR_CRC
+	virtual void flogfs_set_verify(flog_read_file_t * file,
+	                               uint8_t verify) = 0;
+#endif
+	virtual uint32_t flogfs_write(flog_write_file_t * file, uint8_t const * src,
+	                              uint32_t nbytes) = 0;
+	virtual uint32_t flogfs_writev(flog_write_file_t * file,
+	                               flog_iovec_t const * iov,
+	                               uint16_t iovcnt) = 0;
+	virtual void flogfs_set_group_commit(flog_write_file_t * file,
+	                                     uint32_t max_bytes,
+	                                     uint32_t max_ms) = 0;
+	virtual uint32_t flogfs_write_try(flog_write_file_t * file,
+	                                  uint8_t const * src, uint32_t nbytes) = 0;
+	virtual void flogfs_start_ls(flogfs_ls_iterator_t * iter) = 0;
+	virtual uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t * iter,
+	                                       char * fname_dst) = 0;
+	virtual uint_fast8_t flogfs_ls_iterate_entry(flogfs_ls_iterator_t * iter,
+	                                             char const * prefix,
+	                                             flogfs_ls_entry_t * entry) = 0;
+	virtual void flogfs_stop_ls(flogfs_ls_iterator_t * iter) = 0;
+#if FLOG_ENABLE_STATS
+	virtual void flogfs_get_stats(flogfs_stats_t * stats) = 0;
+	virtual void flogfs_reset_stats() = 0;
+#endif
+};
+
+#pragma push_macro("FS_SECTOR_SIZE")
+#pragma push_macro("FS_SECTORS_PER_PAGE")
+#pragma push_macro("FS_PAGES_PER_BLOCK")
+#pragma push_macro("FS_SECTORS_PER_BLOCK")
+#pragma push_macro("FS_NUM_BLOCKS")
+#pragma push_macro("FS_NUM_PLANES")
+#undef FS_SECTOR_SIZE
+#undef FS_SECTORS_PER_PAGE
+#undef FS_PAGES_PER_BLOCK
+#undef FS_SECTORS_PER_BLOCK
+#undef FS_NUM_BLOCKS
+#undef FS_NUM_PLANES
+#define FS_SECTOR_SIZE       (Geometry::sector_size)
+#define FS_SECTORS_PER_PAGE  (Geometry::sectors_per_page)
+#define FS_PAGES_PER_BLOCK   (Geometry::pages_per_block)
+#define FS_SECTORS_PER_BLOCK (FS_SECTORS_PER_PAGE * FS_PAGES_PER_BLOCK)
+#define FS_NUM_BLOCKS        (Geometry::num_blocks)
+#define FS_NUM_PLANES        (Geometry::num_planes)
+
+/*!
+ @brief A file system on one flash device
+ @tparam Geometry A flog_geometry describing the device
+ @tparam Flash The driver for the device, with the members of flog_conf_flash
+
+ The API is that of flogfs.h as member functions, so flogfs_mount() on a
+ volume is volume.flogfs_mount(), or flogfs_mount(&volume) through the
+ flogfs_vol_t handle. Each volume has its own locks, so files on different
+ volumes can be written in parallel.
+
+ Every volume needs a driver of its own. flog_conf_flash keeps its state in
+ the static globals of flogfs_conf_implement.h, so it can only back one.
+
+ The file and iterator structures are shared by every volume; their sector
+ buffers are sized by the FS_SECTOR_SIZE in flogfs_conf.h, which is the
+ largest a volume may use.
+
+ @note The RTOS locks and debug messages still come from
+       flogfs_conf_implement.h
+ */
+template<class Geometry = flog_conf_geometry, class Flash = flog_conf_flash>
+struct flogfs_volume final : public flogfs_vol {
+	static_assert(Geometry::sector_size <= flog_conf_geometry::sector_size,
+	              "Sectors can't be larger than FS_SECTOR_SIZE");
+	static_assert(Geometry::sectors_per_page >= 4,
+	              "The stat, init, first data and tail sectors share page 0");
+	static_assert((Geometry::num_planes >= 1) && (Geometry::num_planes <= 8),
+	              "There must be from 1 to 8 planes");
+#if FLOG_ENABLE_CHECKPOINT
+	static_assert((Geometry::num_blocks / 4 + 32 +
+	               FLOG_BAD_BLOCK_TABLE_LEN * 4) <=
+	              (Geometry::sectors_per_page * Geometry::sector_size),
+	              "The block bitmaps don't fit in a checkpoint page");
+#endif
+
+	//! The flash driver, which may be set up before flogfs_init()
+	Flash flash;
+
+	//! @name Flash shims
+	//! These stand in for flogfs_conf_implement.h inside flogfs.c
+	//! @{
+	flog_result_t flash_init(){return flash.init();}
+	void flash_lock(){flash.lock();}
+	void flash_unlock(){flash.unlock();}
+	uint_fast8_t flash_trylock(){return flash.trylock();}
+	flog_result_t flash_open_page(uint16_t block, uint16_t page){
+		return flash.open_page(block, page);
+	}
+	flog_result_t flash_erase_block(uint16_t block){
+		return flash.erase_block(block);
+	}
+#if FLOG_MOUNT_PREFETCH || FLOG_TAIL_PREFETCH
+	flog_result_t flash_prefetch_page(uint16_t block, uint16_t page){
+		return flash.prefetch_page(block, page);
+	}
+#endif
+	flog_result_t flash_block_is_bad(){return flash.block_is_bad();}
+	void flash_set_bad_block(uint16_t block){flash.set_bad_block(block);}
+	flog_result_t flash_commit(){return flash.commit();}
+#if FLOG_BAD_BLOCK_SPARES
+	flog_result_t flash_commit_to(uint16_t block, uint16_t page){
+		return flash.commit_to(block, page);
+	}
+#endif
+#if FLOG_ASYNC_FLASH
+	void flash_commit_start(){flash.commit_start();}
+	flog_result_t flash_wait(uint8_t plane){return flash.wait(plane);}
+	uint_fast8_t flash_busy(uint8_t plane){return flash.busy(plane);}
+#endif
+	flog_result_t flash_read_sector(uint8_t * dst, uint8_t sector,
+	                                uint16_t offset, uint16_t n){
+		return flash.read_sector(dst, sector, offset, n);
+	}
+	flog_result_t flash_read_spare(uint8_t * dst, uint8_t sector){
+		return flash.read_spare(dst, sector);
+	}
+	flog_result_t flash_read_spares(uint8_t * dst){
+		return flash.read_spares(dst);
+	}
+	void flash_write_sector(uint8_t const * src, uint8_t sector,
+	                        uint16_t offset, uint16_t n){
+		flash.write_sector(src, sector, offset, n);
+	}
+	void flash_write_spare(uint8_t const * src, uint8_t sector){
+		flash.write_spare(src, sector);
+	}
+#if FLOG_SECTOR_CRC
+	flog_result_t flash_read_spare_check(uint8_t * dst, uint8_t sector){
+		return flash.read_spare_check(dst, sector);
+	}
+	void flash_write_spare_check(uint8_t const * src, uint8_t sector){
+		flash.write_spare_check(src, sector);
+	}
+#endif
+#if FLOG_SECTOR_CRC == 2
+	uint32_t flash_crc32(uint32_t crc, uint8_t const * data, uint32_t n){
+		return flash.crc32(crc, data, n);
+	}
+#endif
+	//! @}
+
+#ifndef IS_DOXYGEN
+#include "../src/flogfs.c"
+#endif
+};
+
+#pragma pop_macro("FS_SECTOR_SIZE")
+#pragma pop_macro("FS_SECTORS_PER_PAGE")
+#pragma pop_macro("FS_PAGES_PER_BLOCK")
+#pragma pop_macro("FS_SECTORS_PER_BLOCK")
+#pragma pop_macro("FS_NUM_BLOCKS")
+#pragma pop_macro("FS_NUM_PLANES")
+
+//! @}
+
+#endif // __FLOGFS_HPP_
@@ -54,13 +54,77 @@ either expressed or implied, of the FLogFS Project.
 #define FS_SECTORS_PER_PAGE  (4)
 #define FS_PAGES_PER_BLOCK   (64)
 #define FS_NUM_BLOCKS        (1024)
+//! Planes or dies which can work independently (even and odd blocks on a
+//! two-plane part)
+#define FS_NUM_PLANES        (1)
 //! @}
 
 #define FS_SECTORS_PER_BLOCK (FS_SECTORS_PER_PAGE * FS_PAGES_PER_BLOCK)
 
-//! The number of blocks to preallocate
+/*!
+ @brief The number of free blocks to keep sorted by age in RAM
+
+ Set this to FS_NUM_BLOCKS to keep every free block on hand, so allocation
+ never has to read the flash looking for candidates.
+ */
 #define FS_PREALLOCATE_SIZE  (10)
 
+//! Collect operation counters for flogfs_get_stats()
+#define FLOG_ENABLE_STATS    (0)
+
+//! Reserve two blocks for checkpoints so mounting needn't scan every block
+//! @note A volume must always be mounted with the same setting
+#define FLOG_ENABLE_CHECKPOINT (1)
+
+//! @name Page metadata cache
+//! Each entry costs about FS_SECTORS_PER_PAGE * (FS_PAGE_CACHE_BYTES + 6) bytes
+//! @{
+#define FS_PAGE_CACHE_SIZE   (4)
+#define FS_PAGE_CACHE_BYTES  (64)
+//! @}
+
+//! @brief Slots in the filename hash index (24 bytes each)
+//! Opens fall back to walking the inode table if there are more files
+#define FS_FILE_INDEX_SIZE   (128)
+
+//! @brief Deleted files to leave for flogfs_background_step() to erase
+//! flogfs_rm() erases the oldest itself if the queue is full
+#define FLOG_DELETE_QUEUE_LEN (4)
+
+//! @brief Erase queued deletions only when the allocator takes their blocks
+//! Spreads the erase cost over writes for systems without idle time
+#define FLOG_LAZY_ERASE      (0)
+
+//! @brief Let page programs run while the caller carries on
+//! The next sector can be buffered while the last one is still programming
+#define FLOG_ASYNC_FLASH     (0)
+
+//! @brief Load the next block while reading the last one in a mount scan
+//! Needs a cache read mode like SPI NAND's READ PAGE CACHE RANDOM
+#define FLOG_MOUNT_PREFETCH  (0)
+
+//! @brief Load the next page while reading the last when finding a file's end
+//! Needs the same cache read mode as @ref FLOG_MOUNT_PREFETCH
+#define FLOG_TAIL_PREFETCH   (0)
+
+//! @brief Erase gap that makes flogfs_background_step() move a cold file
+//! The file is copied onto the most worn free blocks; 0 disables this
+#define FLOG_WEAR_LEVEL_SPREAD (0)
+
+//! @brief Erased blocks to keep aside for blocks that fail to program or erase
+//! Needs flash_commit_to(); 0 leaves failed blocks to be marked bad
+#define FLOG_BAD_BLOCK_SPARES (0)
+
+//! @brief Let flogfs_open_write_compressed() store files compressed
+//! Adds a @ref FLOG_COMPRESS_FRAME_SIZE frame buffer to each volume, which its
+//! read files take turns decoding into
+#define FLOG_ENABLE_COMPRESSION (0)
+
+//! @brief Store a CRC-32 of each sector for flogfs_set_verify() to check
+//! 1 computes it in software, 2 with flash_crc32(); both need the spare check
+//! functions
+//! @note A volume must always be mounted with the same setting
+#define FLOG_SECTOR_CRC      (0)
 
 //! @} // FLogConf
 
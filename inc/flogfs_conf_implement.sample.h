@@ -58,7 +58,76 @@ static inline void fs_unlock(fs_lock_t * lock){
 	chMtxUnlock();
 }
 
+//! Take the lock only if it's free, returning nonzero if it was taken
+static inline uint_fast8_t fs_trylock(fs_lock_t * lock){
+	return chMtxTryLock(lock);
+}
+
+//! A reader/writer lock built from a mutex and a condition variable
+typedef struct {
+	Mutex mutex;
+	CondVar cond;
+	uint16_t readers;
+	uint8_t writer;
+} fs_rwlock_t;
+
+static inline void fs_rwlock_init(fs_rwlock_t * lock){
+	chMtxInit(&lock->mutex);
+	chCondInit(&lock->cond);
+	lock->readers = 0;
+	lock->writer = 0;
+}
+
+static inline void fs_lock_read(fs_rwlock_t * lock){
+	chMtxLock(&lock->mutex);
+	while(lock->writer){
+		chCondWait(&lock->cond);
+	}
+	lock->readers += 1;
+	chMtxUnlock();
+}
+
+static inline void fs_unlock_read(fs_rwlock_t * lock){
+	chMtxLock(&lock->mutex);
+	if(--lock->readers == 0){
+		chCondBroadcast(&lock->cond);
+	}
+	chMtxUnlock();
+}
+
+static inline void fs_lock_write(fs_rwlock_t * lock){
+	chMtxLock(&lock->mutex);
+	while(lock->writer || lock->readers){
+		chCondWait(&lock->cond);
+	}
+	lock->writer = 1;
+	chMtxUnlock();
+}
+
+static inline void fs_unlock_write(fs_rwlock_t * lock){
+	chMtxLock(&lock->mutex);
+	lock->writer = 0;
+	chCondBroadcast(&lock->cond);
+	chMtxUnlock();
+}
+
+//! A free-running microsecond clock (for statistics, background budgets and
+//! group commit ages)
+static inline uint32_t fs_get_time_us(){
+	return ST2US(chTimeNow());
+}
+
 static flash_spare_t flog_spare_buffer;
+
+//! Sectors are passed as block-relative indices; get the column in the page
+static inline uint16_t flash_sector_offset(uint8_t sector){
+	return FS_SECTOR_SIZE * (sector % FS_SECTORS_PER_PAGE);
+}
+
+//! The column of the user bytes in a sector's spare area
+static inline uint16_t flash_spare_offset(uint8_t sector){
+	return 0x804 + (sector % FS_SECTORS_PER_PAGE) * 0x10;
+}
 static uint16_t flash_block;
 static uint16_t flash_page;
 static uint8_t have_metadata;
@@ -77,6 +146,11 @@ static inline void flash_unlock(){
 	flash.unlock();
 }
 
+//! Take the flash lock only if it's free, returning nonzero if it was taken
+static inline uint_fast8_t flash_trylock(){
+	return flash.try_lock();
+}
+
 static inline flog_result_t flash_open_page(uint16_t block, uint16_t page){
 	flash_block = block;
 	flash_page = page;
@@ -91,6 +165,19 @@ static inline void flash_close_page(){
 	flash.unlock();
 }
 
+/*!
+ @brief Start loading a page while the open one can still be read
+ @param block The block to load
+ @param page The page to load
+
+ READ PAGE CACHE RANDOM moves the open page to the cache register and starts
+ the array on the next. The driver's page_open() finishes the cache read when
+ that page is asked for, or ends it with READ PAGE CACHE LAST otherwise.
+ */
+static inline flog_result_t flash_prefetch_page(uint16_t block, uint16_t page){
+	return FLOG_RESULT(flash.page_read_cache_random(block, page));
+}
+
 static inline flog_result_t flash_erase_block(uint16_t block){
 	page_open = 0;
 	return FLOG_RESULT(flash.erase_block(block));
@@ -106,7 +193,7 @@ static inline flog_result_t flash_get_spares(){
 }
 
 static inline uint8_t * flash_spare(uint8_t sector){
-	return &flog_spare_buffer[sector * 16 + 4];
+	return &flog_spare_buffer[(sector % FS_SECTORS_PER_PAGE) * 16 + 4];
 }
 
 static inline flog_result_t flash_block_is_bad(){
@@ -115,16 +202,67 @@ static inline flog_result_t flash_block_is_bad(){
 	return FLOG_RESULT(buffer == 0);
 }
 
-static inline void flash_set_bad_block(){
-
+/*!
+ @brief Set the bad block marker on a block
+ @note This opens page 0 of the block in the flash cache
+ */
+static inline void flash_set_bad_block(uint16_t block){
+	uint8_t const marker = 0;
+	flash_open_page(block, 0);
+	flash.page_write_continued(&marker, 0x800, 1);
+	flash.page_commit();
+	page_open = 0;
 }
 
 /*!
  @brief Commit the changes to the active page
+ @return The program status
  */
-static inline void flash_commit(){
+static inline flog_result_t flash_commit(){
 	page_open = 0;
-	flash.page_commit();
+	return FLOG_RESULT(flash.page_commit());
+}
+
+/*!
+ @brief Program the flash cache into another page
+ @note Only used with @ref FLOG_BAD_BLOCK_SPARES
+
+ PROGRAM EXECUTE takes any row address, so a page loaded from a failing block
+ can go straight into its spare.
+ */
+static inline flog_result_t flash_commit_to(uint16_t block, uint16_t page){
+	page_open = 0;
+	return FLOG_RESULT(flash.page_commit_to(block, page));
+}
+
+/*!
+ @brief Start committing the active page without waiting for it to finish
+ @note Only used with @ref FLOG_ASYNC_FLASH
+
+ The driver issues the program and returns. Its ready interrupt (or DMA
+ completion) can signal a semaphore for flash_wait() to sleep on.
+ */
+static inline void flash_commit_start(){
+	page_open = 0;
+	flash.page_commit_start();
+}
+
+/*!
+ @brief Wait for a program started with flash_commit_start()
+ @param plane The plane (or die) the program was on
+ @return The success or failure of the program
+ */
+static inline flog_result_t flash_wait(uint8_t plane){
+	return FLOG_RESULT(flash.wait_ready(plane));
+}
+
+/*!
+ @brief Check if a program started with flash_commit_start() is still running
+ @param plane The plane (or die) the program was on
+ @note Only used with @ref FLOG_ASYNC_FLASH
+ */
+static inline uint_fast8_t flash_busy(uint8_t plane){
+	return flash.is_busy(plane);
 }
 
 /*!
@@ -136,11 +274,38 @@ static inline void flash_commit(){
  @return The success or failure of the operation
  */
 static inline flog_result_t flash_read_sector(uint8_t * dst, uint8_t sector, uint16_t offset, uint16_t n){
-	return FLOG_RESULT(flash.page_read_continued(dst, FS_SECTOR_SIZE * sector + offset, n));
+	return FLOG_RESULT(flash.page_read_continued(dst, flash_sector_offset(sector) + offset, n));
 }
 
 static inline flog_result_t flash_read_spare(uint8_t * dst, uint8_t sector){
-	return FLOG_RESULT(flash.page_read_continued(dst, FS_SECTOR_SIZE * sector, 4));
+	return FLOG_RESULT(flash.page_read_continued(dst, flash_spare_offset(sector), 4));
+}
+
+/*!
+ @brief Read the 4-byte CRC flogfs keeps for a sector with FLOG_SECTOR_CRC
+ @param sector The sector index within the block
+
+ It goes in the second user bytes of the sector's spare, which parts with
+ on-die ECC keep for themselves.
+ */
+static inline flog_result_t flash_read_spare_check(uint8_t * dst,
+                                                   uint8_t sector){
+	return FLOG_RESULT(flash.page_read_continued(dst, flash_spare_offset(sector) + 4, 4));
+}
+
+/*!
+ @brief Read the spare data for every sector in the current page at once
+ @param dst FS_SECTORS_PER_PAGE * 4 bytes, in sector order
+ */
+static inline flog_result_t flash_read_spares(uint8_t * dst){
+	uint8_t buffer[(FS_SECTORS_PER_PAGE - 1) * 0x10 + 4];
+	if(!flash.page_read_continued(buffer, flash_spare_offset(0), sizeof(buffer))){
+		return FLOG_FAILURE;
+	}
+	for(uint8_t i = 0; i < FS_SECTORS_PER_PAGE; i++){
+		memcpy(dst + 4 * i, buffer + 0x10 * i, 4);
+	}
+	return FLOG_SUCCESS;
 }
 
 /*!
@@ -151,7 +316,7 @@ static inline flog_result_t flash_read_spare(uint8_t * dst, uint8_t sector){
  @param n The number of bytes to write
  */
 static inline void flash_write_sector(uint8_t const * src, uint8_t sector, uint16_t offset, uint16_t n){
-	flash.page_write_continued(src, FS_SECTOR_SIZE * sector + offset, n);
+	flash.page_write_continued(src, flash_sector_offset(sector) + offset, n);
 }
 
 
@@ -162,8 +327,38 @@ static inline void flash_write_sector(uint8_t const * src, uint8_t sector, uint1
  @note This doesn't commit the transaction
  */
 static inline void flash_write_spare(uint8_t const * src, uint8_t sector){
-	flash.page_write_continued(src, 0x804 + sector * 0x10, 4);
+	flash.page_write_continued(src, flash_spare_offset(sector), 4);
+}
+
+/*!
+ @brief Write a sector's CRC alongside its spare data
+
+ @note This doesn't commit the transaction
+ */
+static inline void flash_write_spare_check(uint8_t const * src,
+                                           uint8_t sector){
+	flash.page_write_continued(src, flash_spare_offset(sector) + 4, 4);
+}
+
+#if FLOG_SECTOR_CRC == 2
+/*!
+ @brief Update a CRC-32 (reflected 0xEDB88320, inverted) with more data
+
+ This uses a CRC unit that takes a starting value and reflects its input and
+ output, as on the STM32F0/F3/F7/L4.
+
+ @note Nothing else may use the CRC unit while the flash lock is held
+ */
+static inline uint32_t flash_crc32(uint32_t crc, uint8_t const * data,
+                                   uint32_t n){
+	CRC->INIT = ~crc;
+	CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET;
+	while(n--){
+		*(uint8_t volatile *)&CRC->DR = *data++;
+	}
+	return ~CRC->DR;
 }
+#endif
 
 static inline void flash_debug_warn(char const * msg){
 	evt_log.add(msg, EventItem::SEVERITY_WARNING);
@@ -42,6 +42,9 @@ either expressed or implied, of the FLogFS Project.
 
 #include "flogfs.h"
 #include "flogfs_conf.h"
+#if FLOG_SECTOR_CRC == 1
+#include "flogfs_crc32.h"
+#endif
 
 // KDevelop wants to be a jerk about the __restrict__ keyword
 // #ifdef USE_RESTRICT
@@ -69,6 +72,13 @@ either expressed or implied, of the FLogFS Project.
 #define MAX(a,b) ((a > b) ? a : b)
 #define MIN(a,b) ((a > b) ? b : a)
 
+//! File-local in C, a member of flogfs_volume in the C++ build
+#if FLOG_BUILD_CPP
+#define FLOG_STATIC
+#else
+#define FLOG_STATIC static
+#endif
+
 
 //! @addtogroup FLogPrivate
 //! @{
@@ -87,7 +97,8 @@ typedef enum {
 	FLOG_BLOCK_TYPE_ERROR = 0,
 	FLOG_BLOCK_TYPE_UNALLOCATED = 0xFF,
 	FLOG_BLOCK_TYPE_INODE = 1,
-	FLOG_BLOCK_TYPE_FILE = 2
+	FLOG_BLOCK_TYPE_FILE = 2,
+	FLOG_BLOCK_TYPE_CHECKPOINT = 3
 } flog_block_type_t;
 
 //! @name Invalid values
@@ -116,13 +127,65 @@ typedef struct {
 	flog_block_age_t next_age;
 } flog_block_stat_sector_t;
 
-//! @defgroup FLogInodeBlockStructs Inode block structures
-//! @brief Descriptions of the data in inode blocks
+//! Identifies the spare of a block stat sector as a bad block table stamp
+#define FLOG_BLOCK_STAT_SPARE_KEY (0x5A)
+
+/*!
+ @brief The spare of the block stat sector of a spare or stand-in block
+
+ This is blank on every other block. It lets a full mount scan find the bad
+ block table without a checkpoint. Going from a spare to a stand-in only
+ clears bits, so the spare's stamp can be programmed over.
+ */
+typedef struct {
+	//! @ref FLOG_BLOCK_STAT_SPARE_KEY
+	uint8_t key;
+	uint8_t nothing;
+	//! The bad block this stands in for, or FLOG_BLOCK_IDX_INVALID for a spare
+	flog_block_idx_t replaces;
+} flog_block_stat_spare_t;
+
+/*!
+ @brief An entry in the bad block table
+
+ A block which goes bad is taken over by a spare, and every access to it goes
+ to the spare instead. Spares have no bad block yet.
+ */
+typedef struct {
+	//! The block taken over, or FLOG_BLOCK_IDX_INVALID for a spare
+	flog_block_idx_t bad;
+	//! The block standing in for it
+	flog_block_idx_t block;
+} flog_bad_block_entry_t;
+
+/*!
+ @defgroup FLogInodeBlockStructs Inode block structures
+ @brief Descriptions of the data in inode blocks
+
+ Each file takes a pair of sectors from @ref FLOG_INODE_FIRST_ENTRY_SECTOR on:
+ its flog_inode_file_allocation_t, then its flog_inode_file_invalidation_t
+ once deleted. Entries aren't packed several to a sector: parts with on-die
+ ECC don't allow a sector to be programmed again, and an entry is written as
+ its file is created, long before the sector around it would be full. What
+ packing would save in reads comes from the flog_inode_entry_spare_t
+ summaries instead.
+ */
 //! @{
+//! @brief Volume formats, recorded in the init sector of the first inode block
+typedef enum {
+	//! Written before the format was recorded, so the byte is erased. File
+	//! tails count only 16 bits of flog_file_tail_sector_header_t::bytes_in_block.
+	FLOG_VOLUME_FORMAT_LEGACY = 0xFF,
+	//! File tails count all 32 bits of bytes_in_block
+	FLOG_VOLUME_FORMAT_WIDE_TAIL = 1
+} flog_volume_format_t;
+
 typedef struct {
 	//flog_block_age_t age;
 	flog_timestamp_t timestamp;
 	flog_block_idx_t previous;
+	//! The flog_volume_format_t, which only counts in the first inode block
+	uint8_t format;
 } flog_inode_init_sector_t;
 
 typedef struct {
@@ -149,9 +212,41 @@ typedef struct {
 	char filename[FLOG_MAX_FNAME_LEN];
 } flog_inode_file_allocation_t;
 
+//! @brief Inode entry formats, recorded in the spares of the entry's sectors
+typedef enum {
+	//! Written before entries had a summary. The spares are blank.
+	FLOG_INODE_ENTRY_FORMAT_LEGACY = 0xFF,
+	//! The spares say whether the entry is deleted and hash its file name
+	FLOG_INODE_ENTRY_FORMAT_SUMMARY = 1
+} flog_inode_entry_format_t;
+
+//! @brief Flags in the spare of an inode entry's allocation sector
+typedef enum {
+	//! @brief A copy of an earlier entry with the same name made to move its
+	//! data (see @ref FLOG_WEAR_LEVEL_SPREAD)
+	//! The earlier entry is removed once the copy is complete, so while both
+	//! are live the earlier one is current.
+	FLOG_INODE_ENTRY_COPY = 0x01,
+	//! The file's data is a series of compressed frames
+	//! (see flog_frame_header_t)
+	FLOG_INODE_ENTRY_COMPRESSED = 0x02
+} flog_inode_entry_flags_t;
+
+/*!
+ @brief The spare of either sector of an inode entry
+
+ This is written with the allocation and again with the invalidation, so a
+ scan can tell live and deleted entries apart and rule out most names from
+ the spares alone.
+ */
 typedef struct {
-	uint8_t copy_complete_marker;
-} flog_inode_file_allocation_spare_t;
+	//! A flog_inode_entry_format_t
+	uint8_t format;
+	//! flog_inode_entry_flags_t (0 for the invalidation sector)
+	uint8_t flags;
+	//! flog_filename_hash() of the file name
+	uint16_t name_hash;
+} flog_inode_entry_spare_t;
 
 typedef struct {
 	flog_timestamp_t timestamp;
@@ -193,7 +288,11 @@ typedef struct {
 	flog_block_idx_t next_block;
 	flog_block_age_t next_age;
 	flog_timestamp_t timestamp;
-	flog_sector_nbytes_t bytes_in_block;
+	//! @brief The data bytes in the block (more than fit in
+	//! flog_sector_nbytes_t)
+	//! Legacy volumes only wrote the first 16 bits. Read this with
+	//! flog_tail_bytes_in_block().
+	uint32_t bytes_in_block;
 } flog_file_tail_sector_header_t;
 
 typedef struct {
@@ -212,6 +311,116 @@ typedef struct {
 	flog_block_age_t next_age;
 } flog_file_invalidation_sector_t;
 
+//! @brief A frame of padding, running to the end of its sector
+//! Fewer bytes than a frame header at the end of a sector are also padding.
+#define FLOG_FRAME_PAD    (0)
+//! A frame stored as it was given
+#define FLOG_FRAME_STORED (1)
+
+/*!
+ @brief The start of a frame in a compressed file
+
+ The data of a compressed file is a series of these, each followed by its
+ encoded data. A frame decodes on its own and never straddles sectors, so
+ decoding can start at the first frame of any sector.
+ */
+typedef struct {
+	//! @ref FLOG_FRAME_PAD, @ref FLOG_FRAME_STORED or a flog_compression_t
+	uint8_t codec;
+	//! The record size in 16-bit samples for @ref FLOG_COMPRESS_DELTA
+	uint8_t param;
+	//! The number of bytes the frame decodes to
+	uint16_t raw_len;
+	//! The number of encoded bytes following the header
+	uint16_t stored_len;
+} flog_frame_header_t;
+
+//! @}
+
+
+//! @defgroup FLogCheckpointStructs Checkpoint block structures
+//! @brief Descriptions of the data in checkpoint blocks
+//!
+//! A checkpoint block starts with the usual block stat and init sectors in
+//! page 0. Each following page is either a record, holding the full allocation
+//! state, or part of the journal of allocations made since the last record.
+//! Journal entries take one sector each and are written in order.
+//! @{
+
+//! The number of blocks reserved for checkpoints (used alternately)
+#define FLOG_CHECKPOINT_NUM_BLOCKS (2)
+
+//! Identifies the first sector of a record page
+#define FLOG_CHECKPOINT_RECORD_MAGIC  (0x46434B50)
+//! Identifies a journal sector
+#define FLOG_CHECKPOINT_JOURNAL_MAGIC (0x464A4E4C)
+
+typedef struct {
+	uint8_t type_id;
+	uint8_t nothing;
+	uint16_t reserved;
+} flog_checkpoint_init_sector_spare_t;
+
+/*!
+ @brief The start of a record page
+
+ The free block bitmap immediately follows this header in the page, then the
+ bitmap of blocks out of use and the bad block table entries.
+ */
+typedef struct {
+	uint32_t magic;
+	//! Increments with every record written
+	uint32_t sequence;
+	//! The most recent timestamp
+	flog_timestamp_t t;
+	flog_file_id_t max_file_id;
+	uint32_t free_block_sum;
+	flog_block_idx_t inode0;
+	flog_block_idx_t allocate_head;
+	flog_block_idx_t num_free_blocks;
+	//! The number of flog_bad_block_entry_t after the bitmaps
+	flog_block_idx_t num_bad_entries;
+	//! flogfs_t::num_stale_blocks
+	flog_block_idx_t num_stale_blocks;
+	//! CRC32 of this header (with crc = 0) followed by the rest of the record
+	uint32_t crc;
+} flog_checkpoint_header_t;
+
+typedef enum {
+	//! Blocks removed from the free pool
+	FLOG_CHECKPOINT_JOURNAL_ALLOC = 1,
+	//! Blocks returned to the free pool
+	FLOG_CHECKPOINT_JOURNAL_FREE  = 2,
+	//! Blocks erased and set aside as spares
+	FLOG_CHECKPOINT_JOURNAL_SPARE = 3,
+	//! A block gone bad, with the spare taking over in previous (if any)
+	FLOG_CHECKPOINT_JOURNAL_BAD   = 4
+} flog_checkpoint_journal_type_t;
+
+typedef struct {
+	uint32_t magic;
+	//! The sequence number of the record this follows
+	uint32_t sequence;
+	//! The most recent timestamp when written
+	flog_timestamp_t t;
+	uint8_t type;
+	//! The number of flog_checkpoint_journal_block_t that follow
+	uint8_t count;
+	//! For allocations, the block whose tail will point to the new block.
+	//! For bad blocks, the spare taking over.
+	flog_block_idx_t previous;
+} flog_checkpoint_journal_header_t;
+
+typedef struct {
+	flog_block_idx_t block;
+	flog_block_age_t age;
+} flog_checkpoint_journal_block_t;
+
+//! The number of blocks that fit in a journal sector
+#define FLOG_CHECKPOINT_JOURNAL_MAX_BLOCKS \
+   ((FS_SECTOR_SIZE - sizeof(flog_checkpoint_journal_header_t)) / \
+    sizeof(flog_checkpoint_journal_block_t))
+
 //! @}
 
 
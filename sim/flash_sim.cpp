@@ -0,0 +1,448 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flash_sim.cpp
+ * @ingroup FLogSim
+ *
+ * @brief RAM-backed NAND flash simulator
+ */
+
+#include "flash_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+//! @addtogroup FLogSim
+//! @{
+
+//! The size of a whole block in the array
+#define FLASH_SIM_BLOCK_SIZE (FLASH_SIM_PAGE_SIZE * FS_PAGES_PER_BLOCK)
+
+//! Offset of the factory bad block marker in the page
+#define FLASH_SIM_BAD_BLOCK_MARKER (FLASH_SIM_PAGE_DATA_SIZE)
+
+static char const flash_sim_image_key[] = "FLogSim";
+
+typedef struct {
+	//! Block storage -- A null block is erased
+	uint8_t * blocks[FS_NUM_BLOCKS];
+	//! The page cache
+	uint8_t cache[FLASH_SIM_PAGE_SIZE];
+	//! The block loaded in the cache
+	uint16_t cache_block;
+	//! The page loaded in the cache
+	uint16_t cache_page;
+
+	flash_sim_timing_t timing;
+	flash_sim_counters_t counters;
+	//! @brief The device clock
+	//! Atomic because the file system reads it for its stats, and the bench
+	//! lets it idle, without the flash lock
+	std::atomic<uint64_t> t_ns;
+	//! When a program started by flash_sim_commit_start() finishes, by plane
+	uint64_t busy_until_ns[FS_NUM_PLANES];
+	//! The block being loaded by flash_sim_prefetch_page(), if not 0xFFFF
+	uint16_t prefetch_block;
+	uint16_t prefetch_page;
+	//! When the prefetched page finishes loading
+	uint64_t prefetch_ready_ns;
+	//! Blocks set to fail by flash_sim_fail_block()
+	uint8_t failing[FS_NUM_BLOCKS / 8];
+	//! A program started by flash_sim_commit_start() failed, by plane
+	uint8_t program_failed[FS_NUM_PLANES];
+} flash_sim_t;
+
+static flash_sim_t flash_sim;
+
+//! Defaults roughly matching an MT29F1G01 on a 50MHz SPI bus
+static flash_sim_timing_t const flash_sim_default_timing = {
+	25000,   // page_read_ns
+	200000,  // program_ns
+	2000000, // erase_ns
+	160,     // byte_ns
+	1000     // command_ns
+};
+
+//! Check if a block was set to fail by flash_sim_fail_block()
+static uint_fast8_t flash_sim_failing(uint16_t block){
+	return (flash_sim.failing[block / 8] >> (block % 8)) & 1;
+}
+
+static uint8_t * flash_sim_page(uint16_t block, uint16_t page){
+	if(!flash_sim.blocks[block]){
+		return 0;
+	}
+	return flash_sim.blocks[block] + page * FLASH_SIM_PAGE_SIZE;
+}
+
+/*!
+ @brief Account for a command on the bus
+ @param block The block the command is for
+
+ Like polling the status register, a command waits out any program on the
+ block's plane. The other planes carry on.
+ */
+static void flash_sim_command(uint16_t block){
+	uint_fast8_t const plane = block % FS_NUM_PLANES;
+	// A failed program is left for flash_sim_wait() to report
+	if(flash_sim.t_ns < flash_sim.busy_until_ns[plane]){
+		flash_sim.t_ns = flash_sim.busy_until_ns[plane];
+	}
+	flash_sim.counters.commands += 1;
+	flash_sim.t_ns += flash_sim.timing.command_ns;
+}
+
+//! Wait for a page read started by flash_sim_prefetch_page() and drop it
+static void flash_sim_end_prefetch(){
+	if(flash_sim.prefetch_block == 0xFFFF){
+		return;
+	}
+	if(flash_sim.t_ns < flash_sim.prefetch_ready_ns){
+		flash_sim.t_ns = flash_sim.prefetch_ready_ns;
+	}
+	flash_sim.prefetch_block = 0xFFFF;
+}
+
+flog_result_t flash_sim_init(){
+	flash_sim_deinit();
+	flash_sim.timing = flash_sim_default_timing;
+	flash_sim.cache_block = 0xFFFF;
+	flash_sim.cache_page = 0;
+	memset(flash_sim.cache, 0xFF, sizeof(flash_sim.cache));
+	flash_sim_reset_counters();
+	flash_sim.t_ns = 0;
+	memset(flash_sim.busy_until_ns, 0, sizeof(flash_sim.busy_until_ns));
+	flash_sim.prefetch_block = 0xFFFF;
+	memset(flash_sim.failing, 0, sizeof(flash_sim.failing));
+	memset(flash_sim.program_failed, 0, sizeof(flash_sim.program_failed));
+	return FLOG_SUCCESS;
+}
+
+void flash_sim_deinit(){
+	for(uint32_t i = 0; i < FS_NUM_BLOCKS; i++){
+		free(flash_sim.blocks[i]);
+		flash_sim.blocks[i] = 0;
+	}
+}
+
+void flash_sim_set_timing(flash_sim_timing_t const * timing){
+	flash_sim.timing = *timing;
+}
+
+uint64_t flash_sim_time_ns(){
+	return flash_sim.t_ns;
+}
+
+void flash_sim_idle(uint32_t ns){
+	flash_sim.t_ns += ns;
+}
+
+void flash_sim_get_counters(flash_sim_counters_t * counters){
+	*counters = flash_sim.counters;
+}
+
+void flash_sim_reset_counters(){
+	memset(&flash_sim.counters, 0, sizeof(flash_sim.counters));
+}
+
+flog_result_t flash_sim_open_page(uint16_t block, uint16_t page){
+	uint8_t const * src;
+	if((block >= FS_NUM_BLOCKS) || (page >= FS_PAGES_PER_BLOCK)){
+		return FLOG_FAILURE;
+	}
+	flash_sim_command(block);
+	if((block == flash_sim.prefetch_block) &&
+	   (page == flash_sim.prefetch_page)){
+		// It has been loading since flash_sim_prefetch_page()
+		flash_sim_end_prefetch();
+	} else {
+		flash_sim_end_prefetch();
+		flash_sim.counters.page_reads += 1;
+		flash_sim.t_ns += flash_sim.timing.page_read_ns;
+	}
+
+	flash_sim.cache_block = block;
+	flash_sim.cache_page = page;
+	src = flash_sim_page(block, page);
+	if(src){
+		memcpy(flash_sim.cache, src, FLASH_SIM_PAGE_SIZE);
+	} else {
+		memset(flash_sim.cache, 0xFF, FLASH_SIM_PAGE_SIZE);
+	}
+	return FLOG_SUCCESS;
+}
+
+flog_result_t flash_sim_prefetch_page(uint16_t block, uint16_t page){
+	if((block >= FS_NUM_BLOCKS) || (page >= FS_PAGES_PER_BLOCK)){
+		return FLOG_FAILURE;
+	}
+	flash_sim_end_prefetch();
+	flash_sim_command(block);
+	flash_sim.counters.page_reads += 1;
+	flash_sim.prefetch_block = block;
+	flash_sim.prefetch_page = page;
+	flash_sim.prefetch_ready_ns = flash_sim.t_ns + flash_sim.timing.page_read_ns;
+	return FLOG_SUCCESS;
+}
+
+void flash_sim_read(uint8_t * dst, uint16_t addr, uint16_t n){
+	if(addr + n > FLASH_SIM_PAGE_SIZE){
+		n = (addr < FLASH_SIM_PAGE_SIZE) ? FLASH_SIM_PAGE_SIZE - addr : 0;
+	}
+	flash_sim_command(flash_sim.cache_block);
+	flash_sim.counters.bytes_read += n;
+	flash_sim.t_ns += (uint64_t)flash_sim.timing.byte_ns * n;
+	memcpy(dst, flash_sim.cache + addr, n);
+}
+
+void flash_sim_write(uint8_t const * src, uint16_t addr, uint16_t n){
+	if(addr + n > FLASH_SIM_PAGE_SIZE){
+		n = (addr < FLASH_SIM_PAGE_SIZE) ? FLASH_SIM_PAGE_SIZE - addr : 0;
+	}
+	flash_sim_command(flash_sim.cache_block);
+	flash_sim.counters.bytes_written += n;
+	flash_sim.t_ns += (uint64_t)flash_sim.timing.byte_ns * n;
+	memcpy(flash_sim.cache + addr, src, n);
+}
+
+/*!
+ @brief Program the page cache into the array
+ @note The caller accounts for the program time
+ */
+static flog_result_t flash_sim_program(){
+	uint8_t * dst;
+	if(flash_sim.cache_block >= FS_NUM_BLOCKS){
+		return FLOG_FAILURE;
+	}
+	flash_sim_end_prefetch();
+	flash_sim_command(flash_sim.cache_block);
+	flash_sim.counters.programs += 1;
+
+	if(!flash_sim.blocks[flash_sim.cache_block]){
+		flash_sim.blocks[flash_sim.cache_block] =
+		   (uint8_t *)malloc(FLASH_SIM_BLOCK_SIZE);
+		if(!flash_sim.blocks[flash_sim.cache_block]){
+			return FLOG_FAILURE;
+		}
+		memset(flash_sim.blocks[flash_sim.cache_block], 0xFF,
+		       FLASH_SIM_BLOCK_SIZE);
+	}
+	dst = flash_sim_page(flash_sim.cache_block, flash_sim.cache_page);
+	// Programming can only clear bits
+	for(uint32_t i = 0; i < FLASH_SIM_PAGE_SIZE; i++){
+		dst[i] &= flash_sim.cache[i];
+	}
+	return FLOG_SUCCESS;
+}
+
+/*!
+ @brief Program the page cache as a failing block does
+ @return FLOG_FAILURE with only the first half of the page programmed
+ */
+static flog_result_t flash_sim_program_failing(){
+	uint8_t * dst;
+	flash_sim_end_prefetch();
+	flash_sim_command(flash_sim.cache_block);
+	flash_sim.counters.programs += 1;
+	if(!flash_sim.blocks[flash_sim.cache_block]){
+		flash_sim.blocks[flash_sim.cache_block] =
+		   (uint8_t *)malloc(FLASH_SIM_BLOCK_SIZE);
+		if(!flash_sim.blocks[flash_sim.cache_block]){
+			return FLOG_FAILURE;
+		}
+		memset(flash_sim.blocks[flash_sim.cache_block], 0xFF,
+		       FLASH_SIM_BLOCK_SIZE);
+	}
+	dst = flash_sim_page(flash_sim.cache_block, flash_sim.cache_page);
+	for(uint32_t i = 0; i < FLASH_SIM_PAGE_SIZE / 2; i++){
+		dst[i] &= flash_sim.cache[i];
+	}
+	return FLOG_FAILURE;
+}
+
+flog_result_t flash_sim_commit(){
+	flog_result_t result;
+	if((flash_sim.cache_block < FS_NUM_BLOCKS) &&
+	   flash_sim_failing(flash_sim.cache_block)){
+		result = flash_sim_program_failing();
+		flash_sim.t_ns += flash_sim.timing.program_ns;
+		return result;
+	}
+	result = flash_sim_program();
+	if(result == FLOG_SUCCESS){
+		flash_sim.t_ns += flash_sim.timing.program_ns;
+	}
+	return result;
+}
+
+flog_result_t flash_sim_commit_to(uint16_t block, uint16_t page){
+	if((block >= FS_NUM_BLOCKS) || (page >= FS_PAGES_PER_BLOCK)){
+		return FLOG_FAILURE;
+	}
+	flash_sim.cache_block = block;
+	flash_sim.cache_page = page;
+	return flash_sim_commit();
+}
+
+flog_result_t flash_sim_commit_start(){
+	flog_result_t result;
+	uint_fast8_t plane;
+	if((flash_sim.cache_block < FS_NUM_BLOCKS) &&
+	   flash_sim_failing(flash_sim.cache_block)){
+		// Like the status register, this only shows once it's finished
+		plane = flash_sim.cache_block % FS_NUM_PLANES;
+		flash_sim_program_failing();
+		flash_sim.program_failed[plane] = 1;
+		flash_sim.busy_until_ns[plane] =
+		   flash_sim.t_ns + flash_sim.timing.program_ns;
+		return FLOG_SUCCESS;
+	}
+	result = flash_sim_program();
+	if(result == FLOG_SUCCESS){
+		flash_sim.busy_until_ns[flash_sim.cache_block % FS_NUM_PLANES] =
+		   flash_sim.t_ns + flash_sim.timing.program_ns;
+	}
+	return result;
+}
+
+flog_result_t flash_sim_wait(uint8_t plane){
+	if(flash_sim.t_ns < flash_sim.busy_until_ns[plane]){
+		flash_sim.t_ns = flash_sim.busy_until_ns[plane];
+	}
+	if(flash_sim.program_failed[plane]){
+		flash_sim.program_failed[plane] = 0;
+		return FLOG_FAILURE;
+	}
+	return FLOG_SUCCESS;
+}
+
+uint_fast8_t flash_sim_busy(uint8_t plane){
+	return flash_sim.t_ns < flash_sim.busy_until_ns[plane];
+}
+
+flog_result_t flash_sim_erase_block(uint16_t block){
+	if(block >= FS_NUM_BLOCKS){
+		return FLOG_FAILURE;
+	}
+	flash_sim_end_prefetch();
+	flash_sim_command(block);
+	flash_sim.counters.erases += 1;
+	flash_sim.t_ns += flash_sim.timing.erase_ns;
+	if(flash_sim_failing(block)){
+		return FLOG_FAILURE;
+	}
+	free(flash_sim.blocks[block]);
+	flash_sim.blocks[block] = 0;
+	return FLOG_SUCCESS;
+}
+
+void flash_sim_mark_bad(uint16_t block){
+	flash_sim_open_page(block, 0);
+	flash_sim.cache[FLASH_SIM_BAD_BLOCK_MARKER] = 0;
+	// The marker byte still goes in on a failing block
+	if(flash_sim_program() == FLOG_SUCCESS){
+		flash_sim.t_ns += flash_sim.timing.program_ns;
+	}
+}
+
+void flash_sim_fail_block(uint16_t block){
+	if(block < FS_NUM_BLOCKS){
+		flash_sim.failing[block / 8] |= 1 << (block % 8);
+	}
+}
+
+flog_result_t flash_sim_load(char const * path){
+	char key[sizeof(flash_sim_image_key)];
+	uint8_t present;
+	flash_sim_timing_t const timing = flash_sim.timing;
+	FILE * f = fopen(path, "rb");
+	if(!f){
+		return FLOG_FAILURE;
+	}
+	flash_sim_init();
+	flash_sim.timing = timing;
+	if((fread(key, sizeof(key), 1, f) != 1) ||
+	   (memcmp(key, flash_sim_image_key, sizeof(key)) != 0)){
+		goto failure;
+	}
+	for(uint32_t i = 0; i < FS_NUM_BLOCKS; i++){
+		if(fread(&present, 1, 1, f) != 1){
+			goto failure;
+		}
+		if(!present){
+			continue;
+		}
+		flash_sim.blocks[i] = (uint8_t *)malloc(FLASH_SIM_BLOCK_SIZE);
+		if(!flash_sim.blocks[i] ||
+		   (fread(flash_sim.blocks[i], FLASH_SIM_BLOCK_SIZE, 1, f) != 1)){
+			goto failure;
+		}
+	}
+	fclose(f);
+	return FLOG_SUCCESS;
+
+failure:
+	fclose(f);
+	flash_sim_init();
+	flash_sim.timing = timing;
+	return FLOG_FAILURE;
+}
+
+flog_result_t flash_sim_save(char const * path){
+	uint8_t present;
+	FILE * f = fopen(path, "wb");
+	if(!f){
+		return FLOG_FAILURE;
+	}
+	if(fwrite(flash_sim_image_key, sizeof(flash_sim_image_key), 1, f) != 1){
+		goto failure;
+	}
+	for(uint32_t i = 0; i < FS_NUM_BLOCKS; i++){
+		present = flash_sim.blocks[i] ? 1 : 0;
+		if(fwrite(&present, 1, 1, f) != 1){
+			goto failure;
+		}
+		if(present &&
+		   (fwrite(flash_sim.blocks[i], FLASH_SIM_BLOCK_SIZE, 1, f) != 1)){
+			goto failure;
+		}
+	}
+	fclose(f);
+	return FLOG_SUCCESS;
+
+failure:
+	fclose(f);
+	return FLOG_FAILURE;
+}
+
+//! @}
@@ -0,0 +1,195 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flash_sim.h
+ * @ingroup FLogSim
+ *
+ * @brief A host-side NAND flash simulator for exercising FLogFS off-target
+ *
+ * The simulator models a Micron MT29F-style SPI NAND: a single page cache which
+ * is loaded from the array with a page read, modified with random data input
+ * and programmed back with a commit. Programming can only clear bits, just like
+ * the real thing. Blocks are allocated lazily so large geometries are cheap.
+ *
+ * Rather than sleeping, every operation advances a virtual device clock by its
+ * configured latency. Benchmarks read this clock to report device-limited
+ * throughput independent of the host. A program started with
+ * flash_sim_commit_start() only holds up the clock when the next command for
+ * its plane (block % FS_NUM_PLANES) is issued. Time the host spends in between,
+ * and work on other planes, overlaps with it. Likewise a page read started with
+ * flash_sim_prefetch_page() overlaps with reading out the page already open.
+ */
+
+#ifndef __FLASH_SIM_H_
+#define __FLASH_SIM_H_
+
+#include "flogfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! @addtogroup FLogSim
+//! @{
+
+//! The data area of a page
+#define FLASH_SIM_PAGE_DATA_SIZE  (FS_SECTOR_SIZE * FS_SECTORS_PER_PAGE)
+//! The spare area of a page (16 bytes per sector)
+#define FLASH_SIM_PAGE_SPARE_SIZE (16 * FS_SECTORS_PER_PAGE)
+//! Total bytes addressable in the page cache
+#define FLASH_SIM_PAGE_SIZE (FLASH_SIM_PAGE_DATA_SIZE + FLASH_SIM_PAGE_SPARE_SIZE)
+
+/*!
+ @brief Latencies applied to the virtual clock
+ */
+typedef struct {
+	//! Array to cache transfer (tR)
+	uint32_t page_read_ns;
+	//! Cache to array program (tPROG)
+	uint32_t program_ns;
+	//! Block erase (tBERS)
+	uint32_t erase_ns;
+	//! Bus transfer time per byte in either direction
+	uint32_t byte_ns;
+	//! Fixed overhead for each command issued on the bus
+	uint32_t command_ns;
+} flash_sim_timing_t;
+
+/*!
+ @brief Operation counters maintained by the simulator
+ */
+typedef struct {
+	uint32_t page_reads;
+	uint32_t programs;
+	uint32_t erases;
+	uint32_t commands;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+} flash_sim_counters_t;
+
+/*!
+ @brief Allocate the simulated array (all blocks erased)
+ @note Calling this again discards the current contents
+ */
+flog_result_t flash_sim_init();
+
+//! Release all memory held by the simulator
+void flash_sim_deinit();
+
+//! Set the latencies applied to subsequent operations
+void flash_sim_set_timing(flash_sim_timing_t const * timing);
+
+//! Get the current virtual device time in nanoseconds
+uint64_t flash_sim_time_ns();
+
+/*!
+ @brief Let time pass on the host side without using the flash
+ @param ns How long the host is busy
+
+ This stands in for the application's own work between calls, which a
+ program started with flash_sim_commit_start() can overlap with.
+ */
+void flash_sim_idle(uint32_t ns);
+
+//! Get a snapshot of the operation counters
+void flash_sim_get_counters(flash_sim_counters_t * counters);
+
+//! Zero the operation counters (the clock keeps running)
+void flash_sim_reset_counters();
+
+//! Load the page at (block, page) into the page cache
+flog_result_t flash_sim_open_page(uint16_t block, uint16_t page);
+
+/*!
+ @brief Start loading a page without disturbing the page cache
+ @note Like READ PAGE CACHE RANDOM, the page cache stays readable until
+       flash_sim_open_page() takes over the new page. Any other array
+       operation waits for the load and drops it.
+ */
+flog_result_t flash_sim_prefetch_page(uint16_t block, uint16_t page);
+
+//! Read from the page cache
+void flash_sim_read(uint8_t * dst, uint16_t addr, uint16_t n);
+
+//! Write into the page cache
+void flash_sim_write(uint8_t const * src, uint16_t addr, uint16_t n);
+
+//! Program the page cache into the page last opened
+flog_result_t flash_sim_commit();
+
+//! Program the page cache into another page, like PROGRAM EXECUTE can
+flog_result_t flash_sim_commit_to(uint16_t block, uint16_t page);
+
+/*!
+ @brief Start programming the page cache into the page last opened
+ @note The next command (or flash_sim_wait()) waits for the program to finish
+ */
+flog_result_t flash_sim_commit_start();
+
+//! Wait for a program started with flash_sim_commit_start() on a plane
+flog_result_t flash_sim_wait(uint8_t plane);
+
+//! Check if a program started with flash_sim_commit_start() is still running
+uint_fast8_t flash_sim_busy(uint8_t plane);
+
+//! Erase a block
+flog_result_t flash_sim_erase_block(uint16_t block);
+
+//! Set the factory bad block marker on a block
+void flash_sim_mark_bad(uint16_t block);
+
+/*!
+ @brief Make a block wear out
+
+ Its erases fail and leave it as it was. Its programs fail after programming
+ only the first half of the page, which flash_sim_wait() reports for those
+ started with flash_sim_commit_start(). The bad block marker can still be set.
+ */
+void flash_sim_fail_block(uint16_t block);
+
+/*!
+ @brief Load the array contents from an image file
+ @param path The file to read, as written by flash_sim_save()
+ */
+flog_result_t flash_sim_load(char const * path);
+
+/*!
+ @brief Save the array contents to an image file
+ @param path The file to write
+ */
+flog_result_t flash_sim_save(char const * path);
+
+//! @}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // __FLASH_SIM_H_
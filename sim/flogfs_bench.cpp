@@ -0,0 +1,437 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_bench.cpp
+ * @ingroup FLogSim
+ *
+ * @brief End-to-end FLogFS benchmarks on the host flash simulator
+ *
+ * Build from the repository root with something like:
+ *
+ *     g++ -std=c++11 -O2 -Iinc -Isim src/flogfs.cpp sim/flash_sim.cpp \
+ *         sim/flogfs_bench.cpp -lpthread -o flogfs_bench
+ *
+ * Add -DFS_NUM_BLOCKS=<n> to compare mount time across device sizes, and
+ * build with -DFLOG_MOUNT_PREFETCH=0 to see the scan without cache reads.
+ * Build with -DFLOG_ASYNC_FLASH=0 and run with -t to see how much of the
+ * program time is hidden behind the application's own work. Build with
+ * -DFLOG_SECTOR_CRC=1 (or 2) to read the file a second time with
+ * flogfs_set_verify() and compare the two.
+ *
+ * Throughput and latency are reported against the simulator's virtual device
+ * clock so results reflect flash traffic, not host speed. Host CPU time is
+ * reported alongside for the file system's own overhead.
+ */
+
+#include "flogfs.h"
+#include "flash_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//! @addtogroup FLogSim
+//! @{
+
+typedef struct {
+	//! Total bytes to write and read back
+	uint32_t total_bytes;
+	//! Bytes per flogfs_write/flogfs_read call
+	uint32_t chunk_bytes;
+	//! An optional image to save after writing
+	char const * image;
+	//! Buffer writes a page at a time
+	uint8_t page_buffered;
+	//! Read with flogfs_read_pages()
+	uint8_t bulk_read;
+	//! Application time spent between write calls
+	uint32_t think_ns;
+} bench_config_t;
+
+typedef struct {
+	uint64_t t_dev_ns;
+	uint64_t t_host_ns;
+	flash_sim_counters_t counters;
+#if FLOG_ENABLE_STATS
+	flogfs_stats_t stats;
+#endif
+} bench_mark_t;
+
+//! Per-call device latencies for percentile reporting
+typedef struct {
+	uint64_t * samples;
+	uint32_t n;
+} bench_latency_t;
+
+static uint64_t bench_host_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench_start(bench_mark_t * mark){
+	flash_sim_reset_counters();
+#if FLOG_ENABLE_STATS
+	flogfs_reset_stats();
+#endif
+	mark->t_dev_ns = flash_sim_time_ns();
+	mark->t_host_ns = bench_host_ns();
+}
+
+static void bench_stop(bench_mark_t * mark){
+	mark->t_dev_ns = flash_sim_time_ns() - mark->t_dev_ns;
+	mark->t_host_ns = bench_host_ns() - mark->t_host_ns;
+	flash_sim_get_counters(&mark->counters);
+#if FLOG_ENABLE_STATS
+	flogfs_get_stats(&mark->stats);
+#endif
+}
+
+static void bench_report(char const * name, bench_mark_t const * mark,
+                         uint32_t nbytes){
+	printf("%-8s dev %10.3f ms  host %9.3f ms", name,
+	       mark->t_dev_ns / 1e6, mark->t_host_ns / 1e6);
+	if(nbytes){
+		printf("  %7.3f MB/s", (nbytes / 1e6) / (mark->t_dev_ns / 1e9));
+	}
+	printf("\n         reads %u  programs %u  erases %u  commands %u\n",
+	       mark->counters.page_reads, mark->counters.programs,
+	       mark->counters.erases, mark->counters.commands);
+#if FLOG_ENABLE_STATS
+	printf("         opens %u  cache hits %u  spares %u  alloc iterations %u\n",
+	       mark->stats.page_opens, mark->stats.page_cache_hits,
+	       mark->stats.spare_reads, mark->stats.allocator_iterations);
+#endif
+}
+
+static int bench_compare_u64(void const * a, void const * b){
+	uint64_t const x = *(uint64_t const *)a;
+	uint64_t const y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+static void bench_report_latency(char const * name, bench_latency_t * lat){
+	static double const percentiles[] = {50.0, 90.0, 99.0, 99.9};
+	if(lat->n == 0){
+		return;
+	}
+	qsort(lat->samples, lat->n, sizeof(uint64_t), bench_compare_u64);
+	printf("         %s latency (us):", name);
+	for(uint32_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++){
+		uint32_t idx = (uint32_t)(percentiles[i] / 100.0 * (lat->n - 1));
+		printf("  p%g %.1f", percentiles[i], lat->samples[idx] / 1e3);
+	}
+	printf("  max %.1f\n", lat->samples[lat->n - 1] / 1e3);
+}
+
+//! A cheap reproducible pattern so read-back can be verified
+static inline uint8_t bench_pattern(uint32_t offset){
+	return (uint8_t)((offset * 2654435761u) >> 24);
+}
+
+/*!
+ @brief Read bench.dat back and check it against the pattern
+ @param name The name to report it under
+ @param check_crc Set to read with flogfs_set_verify()
+ @returns Nonzero on failure
+ */
+static int bench_read(bench_config_t const * config, uint8_t * buffer,
+                      bench_latency_t * lat, char const * name,
+                      uint8_t check_crc){
+	flog_read_file_t read_file;
+	bench_mark_t mark;
+	uint32_t offset, n, got;
+	uint64_t t_call;
+
+	if(flogfs_open_read(&read_file, "bench.dat") != FLOG_SUCCESS){
+		fprintf(stderr, "Open for read failed\n");
+		return 1;
+	}
+#if FLOG_SECTOR_CRC
+	flogfs_set_verify(&read_file, check_crc);
+#else
+	(void)check_crc;
+#endif
+	lat->n = 0;
+	bench_start(&mark);
+	for(offset = 0; offset < config->total_bytes; offset += n){
+		n = config->total_bytes - offset;
+		if(n > config->chunk_bytes){
+			n = config->chunk_bytes;
+		}
+		t_call = flash_sim_time_ns();
+		if(config->bulk_read){
+			got = flogfs_read_pages(&read_file, buffer, n);
+		} else {
+			got = flogfs_read(&read_file, buffer, n);
+		}
+		lat->samples[lat->n++] = flash_sim_time_ns() - t_call;
+		if(got != n){
+			fprintf(stderr, "Short read at %u\n", offset + got);
+			return 1;
+		}
+		for(uint32_t i = 0; i < n; i++){
+			if(buffer[i] != bench_pattern(offset + i)){
+				fprintf(stderr, "Data mismatch at %u\n", offset + i);
+				return 1;
+			}
+		}
+	}
+	bench_stop(&mark);
+	flogfs_close_read(&read_file);
+	bench_report(name, &mark, config->total_bytes);
+	bench_report_latency(name, lat);
+	return 0;
+}
+
+static int bench_run(bench_config_t const * config){
+	flog_write_file_t write_file;
+	flog_read_file_t read_file;
+	bench_mark_t mark;
+	bench_latency_t lat;
+	uint8_t * buffer;
+	uint32_t offset, n, got;
+	uint64_t t_call;
+	static uint8_t page_buffer[FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE];
+
+	buffer = (uint8_t *)malloc(config->chunk_bytes);
+	lat.samples = (uint64_t *)malloc(sizeof(uint64_t) *
+	              (config->total_bytes / config->chunk_bytes + 1));
+	if(!buffer || !lat.samples){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	printf("Geometry: %u blocks x %u pages x %u sectors x %uB\n",
+	       FS_NUM_BLOCKS, FS_PAGES_PER_BLOCK, FS_SECTORS_PER_PAGE,
+	       FS_SECTOR_SIZE);
+	printf("Workload: %u bytes in %u byte calls, %u us between writes\n",
+	       config->total_bytes, config->chunk_bytes, config->think_ns / 1000);
+
+	flash_sim_init();
+	if(flogfs_init() != FLOG_SUCCESS){
+		fprintf(stderr, "Init failed\n");
+		return 1;
+	}
+
+	bench_start(&mark);
+	if(flogfs_format() != FLOG_SUCCESS){
+		fprintf(stderr, "Format failed\n");
+		return 1;
+	}
+	bench_stop(&mark);
+	bench_report("format", &mark, 0);
+
+	bench_start(&mark);
+	if(flogfs_mount() != FLOG_SUCCESS){
+		fprintf(stderr, "Mount failed\n");
+		return 1;
+	}
+	bench_stop(&mark);
+	bench_report("mount", &mark, 0);
+
+	////////////////////////////////////////////////////////////
+	// Sequential write
+	////////////////////////////////////////////////////////////
+	if(flogfs_open_write(&write_file, "bench.dat") != FLOG_SUCCESS){
+		fprintf(stderr, "Open for write failed\n");
+		return 1;
+	}
+	if(config->page_buffered){
+		flogfs_set_page_buffer(&write_file, page_buffer);
+	}
+	lat.n = 0;
+	bench_start(&mark);
+	for(offset = 0; offset < config->total_bytes; offset += n){
+		n = config->total_bytes - offset;
+		if(n > config->chunk_bytes){
+			n = config->chunk_bytes;
+		}
+		for(uint32_t i = 0; i < n; i++){
+			buffer[i] = bench_pattern(offset + i);
+		}
+		t_call = flash_sim_time_ns();
+		got = flogfs_write(&write_file, buffer, n);
+		lat.samples[lat.n++] = flash_sim_time_ns() - t_call;
+		if(got != n){
+			fprintf(stderr, "Short write at %u\n", offset + got);
+			return 1;
+		}
+		flash_sim_idle(config->think_ns);
+	}
+	flogfs_close_write(&write_file);
+	bench_stop(&mark);
+	bench_report("write", &mark, config->total_bytes);
+	bench_report_latency("write", &lat);
+
+	if(config->image && (flash_sim_save(config->image) != FLOG_SUCCESS)){
+		fprintf(stderr, "Couldn't save image to %s\n", config->image);
+	}
+
+	////////////////////////////////////////////////////////////
+	// Remount a populated file system
+	////////////////////////////////////////////////////////////
+	flogfs_unmount();
+	flogfs_init();
+	bench_start(&mark);
+	if(flogfs_mount() != FLOG_SUCCESS){
+		fprintf(stderr, "Remount failed\n");
+		return 1;
+	}
+	bench_stop(&mark);
+	bench_report("remount", &mark, 0);
+
+	////////////////////////////////////////////////////////////
+	// Sequential read and verify
+	////////////////////////////////////////////////////////////
+	if(bench_read(config, buffer, &lat, "read", 0)){
+		return 1;
+	}
+#if FLOG_SECTOR_CRC
+	// Again with each sector checked against its CRC
+	if(bench_read(config, buffer, &lat, "verify", 1)){
+		return 1;
+	}
+#endif
+
+	////////////////////////////////////////////////////////////
+	// Quick format over the data and write it again, which erases the
+	// blocks left from before as it takes them
+	////////////////////////////////////////////////////////////
+	bench_start(&mark);
+	if(flogfs_format_quick() != FLOG_SUCCESS){
+		fprintf(stderr, "Quick format failed\n");
+		return 1;
+	}
+	bench_stop(&mark);
+	bench_report("qformat", &mark, 0);
+
+	bench_start(&mark);
+	if(flogfs_mount() != FLOG_SUCCESS){
+		fprintf(stderr, "Mount after quick format failed\n");
+		return 1;
+	}
+	bench_stop(&mark);
+	bench_report("mount", &mark, 0);
+
+	if(flogfs_open_read(&read_file, "bench.dat") == FLOG_SUCCESS){
+		fprintf(stderr, "File survived the quick format\n");
+		return 1;
+	}
+	if(flogfs_open_write(&write_file, "bench.dat") != FLOG_SUCCESS){
+		fprintf(stderr, "Open for rewrite failed\n");
+		return 1;
+	}
+	bench_start(&mark);
+	for(offset = 0; offset < config->total_bytes; offset += n){
+		n = config->total_bytes - offset;
+		if(n > config->chunk_bytes){
+			n = config->chunk_bytes;
+		}
+		for(uint32_t i = 0; i < n; i++){
+			buffer[i] = bench_pattern(offset + i);
+		}
+		if(flogfs_write(&write_file, buffer, n) != n){
+			fprintf(stderr, "Rewrite failed at %u\n", offset);
+			return 1;
+		}
+	}
+	flogfs_close_write(&write_file);
+	bench_stop(&mark);
+	bench_report("rewrite", &mark, config->total_bytes);
+
+	////////////////////////////////////////////////////////////
+	// Delete
+	////////////////////////////////////////////////////////////
+	bench_start(&mark);
+	if(flogfs_rm("bench.dat") != FLOG_SUCCESS){
+		fprintf(stderr, "Remove failed\n");
+		return 1;
+	}
+	bench_stop(&mark);
+	bench_report("rm", &mark, 0);
+
+	bench_start(&mark);
+	while(flogfs_background_step(10000));
+	bench_stop(&mark);
+	bench_report("idle", &mark, 0);
+
+	free(buffer);
+	free(lat.samples);
+	flash_sim_deinit();
+	return 0;
+}
+
+static void bench_usage(char const * argv0){
+	fprintf(stderr, "Usage: %s [-s total_kB] [-c chunk_bytes] [-t think_us] [-p] [-b]\n"
+	                "       [-o image]\n"
+	                "  -t  time the application spends between write calls\n"
+	                "  -p  buffer writes a page at a time\n"
+	                "  -b  read with flogfs_read_pages()\n",
+	        argv0);
+}
+
+int main(int argc, char ** argv){
+	bench_config_t config;
+	config.total_bytes = 4 * 1024 * 1024;
+	config.chunk_bytes = 256;
+	config.image = 0;
+	config.page_buffered = 0;
+	config.bulk_read = 0;
+	config.think_ns = 0;
+
+	for(int i = 1; i < argc; i++){
+		if((strcmp(argv[i], "-s") == 0) && (i + 1 < argc)){
+			config.total_bytes = strtoul(argv[++i], 0, 0) * 1024;
+		} else if((strcmp(argv[i], "-c") == 0) && (i + 1 < argc)){
+			config.chunk_bytes = strtoul(argv[++i], 0, 0);
+		} else if((strcmp(argv[i], "-t") == 0) && (i + 1 < argc)){
+			config.think_ns = strtoul(argv[++i], 0, 0) * 1000;
+		} else if((strcmp(argv[i], "-o") == 0) && (i + 1 < argc)){
+			config.image = argv[++i];
+		} else if(strcmp(argv[i], "-p") == 0){
+			config.page_buffered = 1;
+		} else if(strcmp(argv[i], "-b") == 0){
+			config.bulk_read = 1;
+		} else {
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+	if((config.chunk_bytes == 0) || (config.total_bytes == 0)){
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	return bench_run(&config);
+}
+
+//! @}
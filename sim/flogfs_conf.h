@@ -0,0 +1,128 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_conf.h
+ * @ingroup FLogSim
+ *
+ * @brief Configuration for building FLogFS against the host flash simulator
+ *
+ * The geometry may be overridden on the command line (e.g. -DFS_NUM_BLOCKS=4096)
+ * to compare builds for different parts.
+ */
+
+#ifndef __FLOGFS_CONF_H_
+#define __FLOGFS_CONF_H_
+
+#include "flogfs.h"
+
+//! @addtogroup FLogConf
+//! @{
+
+//! @name Flash module parameters
+//! @{
+#ifndef FS_SECTOR_SIZE
+#define FS_SECTOR_SIZE       (512)
+#endif
+#ifndef FS_SECTORS_PER_PAGE
+#define FS_SECTORS_PER_PAGE  (4)
+#endif
+#ifndef FS_PAGES_PER_BLOCK
+#define FS_PAGES_PER_BLOCK   (64)
+#endif
+#ifndef FS_NUM_BLOCKS
+#define FS_NUM_BLOCKS        (1024)
+#endif
+#ifndef FS_NUM_PLANES
+#define FS_NUM_PLANES        (1)
+#endif
+//! @}
+
+#define FS_SECTORS_PER_BLOCK (FS_SECTORS_PER_PAGE * FS_PAGES_PER_BLOCK)
+
+/*!
+ @brief The number of free blocks to keep sorted by age in RAM
+
+ Set this to FS_NUM_BLOCKS to keep every free block on hand, so allocation
+ never has to read the flash looking for candidates.
+ */
+#ifndef FS_PREALLOCATE_SIZE
+#define FS_PREALLOCATE_SIZE  (10)
+#endif
+
+//! Collect operation counters for flogfs_get_stats()
+#ifndef FLOG_ENABLE_STATS
+#define FLOG_ENABLE_STATS    (1)
+#endif
+
+#ifndef FLOG_ENABLE_CHECKPOINT
+#define FLOG_ENABLE_CHECKPOINT (1)
+#endif
+
+//! @name Page metadata cache
+//! @{
+#ifndef FS_PAGE_CACHE_SIZE
+#define FS_PAGE_CACHE_SIZE   (4)
+#endif
+#ifndef FS_PAGE_CACHE_BYTES
+#define FS_PAGE_CACHE_BYTES  (64)
+#endif
+//! @}
+
+#ifndef FS_FILE_INDEX_SIZE
+#define FS_FILE_INDEX_SIZE   (256)
+#endif
+
+#ifndef FLOG_DELETE_QUEUE_LEN
+#define FLOG_DELETE_QUEUE_LEN (4)
+#endif
+
+#ifndef FLOG_ASYNC_FLASH
+#define FLOG_ASYNC_FLASH     (1)
+#endif
+
+#ifndef FLOG_MOUNT_PREFETCH
+#define FLOG_MOUNT_PREFETCH  (1)
+#endif
+
+#ifndef FLOG_TAIL_PREFETCH
+#define FLOG_TAIL_PREFETCH   (1)
+#endif
+
+#ifndef FLOG_BAD_BLOCK_SPARES
+#define FLOG_BAD_BLOCK_SPARES (2)
+#endif
+
+#ifndef FLOG_ENABLE_COMPRESSION
+#define FLOG_ENABLE_COMPRESSION (1)
+#endif
+
+//! @} // FLogConf
+
+#endif
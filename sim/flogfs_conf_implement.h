@@ -0,0 +1,305 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_conf_implement.h
+ * @ingroup FLogSim
+ *
+ * @brief Flash interface shims backed by the host flash simulator
+ *
+ * This mirrors flogfs_conf_implement.sample.h with the SPI NAND driver replaced
+ * by flash_sim.h and the RTOS mutexes replaced by pthreads.
+ */
+
+#include "flogfs.h"
+#include "flash_sim.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+typedef uint8_t flash_spare_t[FLASH_SIM_PAGE_SPARE_SIZE];
+
+typedef pthread_mutex_t fs_lock_t;
+
+
+static inline void fs_lock_init(fs_lock_t * lock){
+	pthread_mutex_init(lock, 0);
+}
+
+static inline void fs_lock(fs_lock_t * lock){
+	pthread_mutex_lock(lock);
+}
+
+static inline void fs_unlock(fs_lock_t * lock){
+	pthread_mutex_unlock(lock);
+}
+
+//! Take the lock only if it's free, returning nonzero if it was taken
+static inline uint_fast8_t fs_trylock(fs_lock_t * lock){
+	return pthread_mutex_trylock(lock) == 0;
+}
+
+typedef pthread_rwlock_t fs_rwlock_t;
+
+static inline void fs_rwlock_init(fs_rwlock_t * lock){
+	pthread_rwlock_init(lock, 0);
+}
+
+static inline void fs_lock_read(fs_rwlock_t * lock){
+	pthread_rwlock_rdlock(lock);
+}
+
+static inline void fs_unlock_read(fs_rwlock_t * lock){
+	pthread_rwlock_unlock(lock);
+}
+
+static inline void fs_lock_write(fs_rwlock_t * lock){
+	pthread_rwlock_wrlock(lock);
+}
+
+static inline void fs_unlock_write(fs_rwlock_t * lock){
+	pthread_rwlock_unlock(lock);
+}
+
+//! Statistics are timed against the simulated device clock
+static inline uint32_t fs_get_time_us(){
+	return (uint32_t)(flash_sim_time_ns() / 1000);
+}
+
+static flash_spare_t flog_spare_buffer;
+
+//! Sectors are passed as block-relative indices; get the column in the page
+static inline uint16_t flash_sector_offset(uint8_t sector){
+	return FS_SECTOR_SIZE * (sector % FS_SECTORS_PER_PAGE);
+}
+
+//! The column of the user bytes in a sector's spare area
+static inline uint16_t flash_spare_offset(uint8_t sector){
+	return FLASH_SIM_PAGE_DATA_SIZE + 4 + (sector % FS_SECTORS_PER_PAGE) * 16;
+}
+static fs_lock_t flash_sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline flog_result_t flash_init(){
+	return FLOG_SUCCESS;
+}
+
+static inline void flash_lock(){
+	fs_lock(&flash_sim_lock);
+}
+
+static inline void flash_unlock(){
+	fs_unlock(&flash_sim_lock);
+}
+
+static inline uint_fast8_t flash_trylock(){
+	return fs_trylock(&flash_sim_lock);
+}
+
+static inline flog_result_t flash_open_page(uint16_t block, uint16_t page){
+	return flash_sim_open_page(block, page);
+}
+
+static inline void flash_close_page(){
+}
+
+/*!
+ @brief Start loading a page while the open one can still be read
+ @param block The block to load
+ @param page The page to load
+
+ The next flash_open_page() of that page takes it over. Any other command
+ on the array waits for it to finish and drops it.
+ */
+static inline flog_result_t flash_prefetch_page(uint16_t block, uint16_t page){
+	return flash_sim_prefetch_page(block, page);
+}
+
+static inline flog_result_t flash_erase_block(uint16_t block){
+	return flash_sim_erase_block(block);
+}
+
+static inline flog_result_t flash_get_spares(){
+	flash_sim_read(flog_spare_buffer, FLASH_SIM_PAGE_DATA_SIZE,
+	               sizeof(flog_spare_buffer));
+	return FLOG_SUCCESS;
+}
+
+static inline uint8_t * flash_spare(uint8_t sector){
+	return &flog_spare_buffer[(sector % FS_SECTORS_PER_PAGE) * 16 + 4];
+}
+
+static inline flog_result_t flash_block_is_bad(){
+	uint8_t buffer;
+	flash_sim_read(&buffer, FLASH_SIM_PAGE_DATA_SIZE, 1);
+	return FLOG_RESULT(buffer == 0);
+}
+
+static inline void flash_set_bad_block(uint16_t block){
+	flash_sim_mark_bad(block);
+}
+
+/*!
+ @brief Commit the changes to the active page
+ */
+static inline flog_result_t flash_commit(){
+	return flash_sim_commit();
+}
+
+/*!
+ @brief Program the flash cache into another page
+ */
+static inline flog_result_t flash_commit_to(uint16_t block, uint16_t page){
+	return flash_sim_commit_to(block, page);
+}
+
+/*!
+ @brief Start committing the active page without waiting for it to finish
+ */
+static inline void flash_commit_start(){
+	flash_sim_commit_start();
+}
+
+/*!
+ @brief Wait for a program started with flash_commit_start()
+ @param plane The plane the program was on
+ @return The success or failure of the program
+ */
+static inline flog_result_t flash_wait(uint8_t plane){
+	return flash_sim_wait(plane);
+}
+
+//! Check if a program started with flash_commit_start() is still running
+static inline uint_fast8_t flash_busy(uint8_t plane){
+	return flash_sim_busy(plane);
+}
+
+/*!
+ @brief Read data from the flash cache (current page only)
+ @param dst The destination buffer to fill
+ @param sector The sector index within the block
+ @param offset The offset data to retrieve
+ @param n The number of bytes to transfer
+ @return The success or failure of the operation
+ */
+static inline flog_result_t flash_read_sector(uint8_t * dst, uint8_t sector,
+                                              uint16_t offset, uint16_t n){
+	flash_sim_read(dst, flash_sector_offset(sector) + offset, n);
+	return FLOG_SUCCESS;
+}
+
+static inline flog_result_t flash_read_spare(uint8_t * dst, uint8_t sector){
+	flash_sim_read(dst, flash_spare_offset(sector), 4);
+	return FLOG_SUCCESS;
+}
+
+/*!
+ @brief Read the 4-byte CRC flogfs keeps for a sector with FLOG_SECTOR_CRC
+ @param sector The sector index within the block
+
+ It goes in the second user bytes of the sector's spare, which parts with
+ on-die ECC keep for themselves.
+ */
+static inline flog_result_t flash_read_spare_check(uint8_t * dst,
+                                                   uint8_t sector){
+	flash_sim_read(dst, flash_spare_offset(sector) + 4, 4);
+	return FLOG_SUCCESS;
+}
+
+/*!
+ @brief Read the spare data for every sector in the current page at once
+ @param dst FS_SECTORS_PER_PAGE * 4 bytes, in sector order
+ */
+static inline flog_result_t flash_read_spares(uint8_t * dst){
+	uint8_t buffer[16 * (FS_SECTORS_PER_PAGE - 1) + 4];
+	flash_sim_read(buffer, flash_spare_offset(0), sizeof(buffer));
+	for(uint8_t i = 0; i < FS_SECTORS_PER_PAGE; i++){
+		memcpy(dst + 4 * i, buffer + 16 * i, 4);
+	}
+	return FLOG_SUCCESS;
+}
+
+/*!
+ @brief Write sector data to the flash cache
+ @param src A pointer to the data to transfer
+ @param sector The sector index within the block
+ @param offset The offset to write the data
+ @param n The number of bytes to write
+ */
+static inline void flash_write_sector(uint8_t const * src, uint8_t sector,
+                                      uint16_t offset, uint16_t n){
+	flash_sim_write(src, flash_sector_offset(sector) + offset, n);
+}
+
+
+/*!
+ @brief Write the spare data for a sector
+ @param sector The sector index within the block
+
+ @note This doesn't commit the transaction
+ */
+static inline void flash_write_spare(uint8_t const * src, uint8_t sector){
+	flash_sim_write(src, flash_spare_offset(sector), 4);
+}
+
+/*!
+ @brief Write a sector's CRC alongside its spare data
+
+ @note This doesn't commit the transaction
+ */
+static inline void flash_write_spare_check(uint8_t const * src,
+                                           uint8_t sector){
+	flash_sim_write(src, flash_spare_offset(sector) + 4, 4);
+}
+
+#if FLOG_SECTOR_CRC == 2
+/*!
+ @brief Update a CRC-32 (reflected 0xEDB88320, inverted) with more data
+
+ This stands in for a CRC peripheral.
+ */
+static inline uint32_t flash_crc32(uint32_t crc, uint8_t const * data,
+                                   uint32_t n){
+	crc = ~crc;
+	while(n--){
+		crc ^= *data++;
+		for(uint8_t i = 0; i < 8; i++){
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+#endif
+
+static inline void flash_debug_warn(char const * msg){
+	fprintf(stderr, "warning: %s\n", msg);
+}
+
+static inline void flash_debug_error(char const * msg){
+	fprintf(stderr, "error: %s\n", msg);
+}
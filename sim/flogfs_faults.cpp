@@ -0,0 +1,1213 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_faults.cpp
+ * @ingroup FLogSim
+ *
+ * @brief Random file traffic against a simulated part with failing blocks
+ *
+ * The file system and the simulator are built into this file, on a small part
+ * so the failing blocks are soon in use. Build from the repository root with
+ * something like:
+ *
+ *     g++ -std=c++11 -O1 -g -Iinc -Isim sim/flogfs_faults.cpp -lpthread \
+ *         -o flogfs_faults
+ *
+ * Add -DFLOG_BAD_BLOCK_SPARES=0 to run out of spares straight away,
+ * -fsanitize=address,undefined to catch chains followed off the end of the
+ * part, and -fsanitize=thread for races in the threads check.
+ *
+ * Each run appends to, removes, reads back and remounts a handful of files
+ * while blocks start failing at random (or the ones given with -b). Whatever a
+ * call reported as done has to still be there. A call that failed may have got
+ * partway, so the file is allowed anything in between. The exit status is
+ * nonzero if any run broke that.
+ *
+ * Every check of a file also has to find the length it reads back with
+ * flogfs_size(). Calls the random traffic doesn't make (seeking through a skip
+ * index, sizes of open files, flogfs_write_try(), flogfs_writev() with group
+ * commit, compressed files, and files written from threads of their own while
+ * another thread lists the volume) are checked once first, then the seeds that
+ * have failed before are run. -q skips both, and -b the seeds.
+ */
+
+#ifndef FS_NUM_BLOCKS
+#define FS_NUM_BLOCKS        (64)
+#endif
+
+#include "../src/flogfs.cpp"
+#include "flash_sim.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include <atomic>
+
+#if FLOG_BUILD_CPP
+#error "The fault runs call into the C build"
+#endif
+
+//! @addtogroup FLogSim
+//! @{
+
+//! The number of files written to
+#define FAULT_NUM_FILES (10)
+
+//! The most blocks set to fail in one run
+#define FAULT_MAX_FAILURES (16)
+
+//! What a file should hold, as far as the calls made on it said
+typedef struct {
+	//! The shortest it can be
+	uint32_t lo;
+	//! The longest it can be
+	uint32_t hi;
+	//! Set once it has been created
+	uint8_t exists;
+	//! @brief Set if it's unknown whether it exists
+	//! It's left alone from then on, except to be removed again.
+	uint8_t unsure;
+} fault_file_t;
+
+static fault_file_t fault_files[FAULT_NUM_FILES];
+
+//! Operations per run unless -n is given
+#define FAULT_DEFAULT_OPS (2000)
+
+//! Operations per run
+static uint32_t fault_ops = FAULT_DEFAULT_OPS;
+
+//! Blocks set to fail in each run
+static uint32_t fault_failures = 3;
+
+//! Blocks given with -b, which fail in place of random ones
+static uint16_t fault_blocks[FAULT_MAX_FAILURES];
+static uint32_t fault_num_blocks;
+
+//! Print each operation
+static uint_fast8_t fault_verbose;
+
+//! A run that has failed before, with @ref FAULT_DEFAULT_OPS operations
+typedef struct {
+	uint32_t seed;
+	//! Blocks set to fail
+	uint32_t failures;
+} fault_regression_t;
+
+/*!
+ @brief Runs that broke the file system once, made before the random ones
+
+ Most were found with spares and the rest without, but both builds make all
+ of them.
+ */
+static fault_regression_t const fault_regressions[] = {
+	// Refill took a block with a stand-in for its own spare
+	{50, 8}, {168, 8},
+	// Page 0 lost with no spare to take over
+	{54, 8}, {240, 8}, {275, 8}, {308, 8},
+	// Stray files from creates that failed partway
+	{47, 5}, {171, 5}, {240, 5},
+	// The inode table's link to its next block failed
+	{191, 5},
+};
+
+static void fault_file_name(char * name, uint32_t f){
+	snprintf(name, FLOG_MAX_FNAME_LEN, "f%u", f);
+}
+
+//! The byte at an offset of a file, different for each file
+static uint8_t fault_pattern(uint32_t f, uint32_t offset){
+	return (uint8_t)(offset * 7 + (offset >> 8) * 13 + f * 31 + 1);
+}
+
+/*!
+ @brief Read a file back and check it against what it should hold
+ @param listed Nonzero if ls found it
+ @returns The number of problems found
+ */
+static uint32_t fault_check_file(uint32_t op, uint32_t f, uint_fast8_t listed){
+	static uint8_t buffer[4096];
+	fault_file_t * const file = &fault_files[f];
+	flog_read_file_t read_file;
+	char name[FLOG_MAX_FNAME_LEN];
+	uint32_t length = 0;
+	uint32_t wrong = 0;
+	uint32_t first_wrong = 0;
+	uint32_t size = 0;
+	uint32_t n;
+	uint32_t problems = 0;
+
+	fault_file_name(name, f);
+	if(!file->unsure && (listed != file->exists)){
+		printf("op %u: %s %s\n", op, name,
+		       listed ? "listed after removal" : "not listed");
+		problems += 1;
+	}
+	if(FLOG_SUCCESS != flogfs_open_read(&read_file, name)){
+		if(file->exists && !file->unsure){
+			printf("op %u: %s won't open\n", op, name);
+			problems += 1;
+		}
+		return problems;
+	}
+	if(!file->exists && !file->unsure){
+		printf("op %u: %s opens after removal\n", op, name);
+		problems += 1;
+	}
+	while((n = flogfs_read(&read_file, buffer, sizeof(buffer))) != 0){
+		for(uint32_t i = 0; i < n; i++){
+			if(buffer[i] != fault_pattern(f, length + i)){
+				if(!wrong){
+					first_wrong = length + i;
+				}
+				wrong += 1;
+			}
+		}
+		length += n;
+		if(length > file->hi){
+			break;
+		}
+	}
+	flogfs_close_read(&read_file);
+
+	if((FLOG_SUCCESS != flogfs_size(name, &size)) || (size != length)){
+		printf("op %u: %s reads back %u bytes but has size %u\n", op, name,
+		       length, size);
+		problems += 1;
+	}
+	if(wrong){
+		printf("op %u: %s has %u wrong bytes from %u\n", op, name, wrong,
+		       first_wrong);
+		problems += 1;
+	}
+	if((length > file->hi) || (!file->unsure && (length < file->lo))){
+		printf("op %u: %s is %u bytes, not %u to %u\n", op, name, length,
+		       file->unsure ? 0 : file->lo, file->hi);
+		problems += 1;
+	}
+	if(!file->unsure){
+		// It's only allowed to stay this way now
+		file->lo = length;
+		file->hi = length;
+	}
+	return problems;
+}
+
+/*!
+ @brief Check every file, and that ls lists each at most once
+
+ The listing is made again through a name prefix, for one file, all of them
+ or none as the operation number comes, which has to list the same files.
+ */
+static uint32_t fault_check_all(uint32_t op){
+	uint8_t listed[FAULT_NUM_FILES] = {};
+	uint8_t filtered[FAULT_NUM_FILES] = {};
+	flogfs_ls_iterator_t iter;
+	flogfs_ls_entry_t entry;
+	char name[FLOG_MAX_FNAME_LEN];
+	char prefix[FLOG_MAX_FNAME_LEN];
+	uint32_t problems = 0;
+
+	flogfs_start_ls(&iter);
+	while(flogfs_ls_iterate(&iter, name)){
+		uint32_t const f = strtoul(name + 1, 0, 10);
+		if((name[0] != 'f') || (f >= FAULT_NUM_FILES)){
+			printf("op %u: stray file %s\n", op, name);
+			problems += 1;
+		} else if(listed[f]++){
+			printf("op %u: %s listed again\n", op, name);
+			problems += 1;
+		}
+	}
+	flogfs_stop_ls(&iter);
+
+	switch(op % 3){
+	case 0:
+		fault_file_name(prefix, (op / 3) % FAULT_NUM_FILES);
+		break;
+	case 1:
+		strcpy(prefix, "f");
+		break;
+	default:
+		strcpy(prefix, "g");
+		break;
+	}
+	flogfs_start_ls(&iter);
+	while(flogfs_ls_iterate_entry(&iter, prefix, &entry)){
+		uint32_t const f = strtoul(entry.name + 1, 0, 10);
+		if(strncmp(entry.name, prefix, strlen(prefix)) != 0){
+			printf("op %u: %s listed for prefix %s\n", op, entry.name, prefix);
+			problems += 1;
+		} else if((entry.name[0] == 'f') && (f < FAULT_NUM_FILES)){
+			filtered[f] += 1;
+		}
+	}
+	flogfs_stop_ls(&iter);
+	if(flogfs_ls_iterate_entry(&iter, nullptr, &entry)){
+		printf("op %u: listing went on after it was stopped\n", op);
+		problems += 1;
+	}
+	for(uint32_t f = 0; f < FAULT_NUM_FILES; f++){
+		fault_file_name(name, f);
+		uint_fast8_t const expected = listed[f] &&
+		                              !strncmp(name, prefix, strlen(prefix));
+		if((filtered[f] != 0) != expected){
+			printf("op %u: %s %s for prefix %s\n", op, name,
+			       filtered[f] ? "listed" : "not listed", prefix);
+			problems += 1;
+		}
+	}
+
+	for(uint32_t f = 0; f < FAULT_NUM_FILES; f++){
+		problems += fault_check_file(op, f, listed[f] != 0);
+	}
+	return problems;
+}
+
+//! Append a random amount to a file, sometimes flushing along the way
+static uint32_t fault_append(uint32_t op, uint32_t f){
+	static uint8_t buffer[1000];
+	fault_file_t * const file = &fault_files[f];
+	flog_write_file_t write_file;
+	char name[FLOG_MAX_FNAME_LEN];
+	uint32_t const length = 1 + rand() % ((rand() % 4) ? 3000 : 60000);
+	uint32_t written = 0;
+	uint_fast8_t ok = 1;
+	uint_fast8_t created;
+	uint32_t problems = 0;
+
+	if(file->unsure){
+		// There's no telling where it would carry on from
+		return 0;
+	}
+	if(file->lo != file->hi){
+		// Find where the last one got to
+		problems += fault_check_file(op, f, file->exists);
+	}
+
+	fault_file_name(name, f);
+	if(FLOG_SUCCESS != flogfs_open_write(&write_file, name)){
+		if(!file->exists){
+			// Creating it may have got partway
+			file->unsure = 1;
+			file->lo = 0;
+		}
+		return problems;
+	}
+	created = !file->exists;
+	file->exists = 1;
+	while(written < length){
+		uint32_t const n = MIN(sizeof(buffer), length - written);
+		for(uint32_t i = 0; i < n; i++){
+			buffer[i] = fault_pattern(f, file->hi + written + i);
+		}
+		uint32_t const accepted = flogfs_write(&write_file, buffer, n);
+		written += accepted;
+		if(accepted < n){
+			ok = 0;
+			break;
+		}
+		if(!(rand() % 8) && (FLOG_SUCCESS != flogfs_flush(&write_file))){
+			ok = 0;
+			break;
+		}
+	}
+	if(FLOG_SUCCESS != flogfs_close_write(&write_file)){
+		ok = 0;
+	}
+	file->hi += written;
+	if(ok){
+		file->lo = file->hi;
+	} else if(created){
+		// The inode entry is programmed in the background too
+		file->unsure = 1;
+		file->lo = 0;
+	}
+	if(fault_verbose){
+		printf("op %u: append %u to %s %s\n", op, written, name,
+		       ok ? "ok" : "failed");
+	}
+	return problems;
+}
+
+static void fault_rm(uint32_t op, uint32_t f){
+	fault_file_t * const file = &fault_files[f];
+	char name[FLOG_MAX_FNAME_LEN];
+	flog_result_t result;
+
+	fault_file_name(name, f);
+	result = flogfs_rm(name);
+	if(result == FLOG_SUCCESS){
+		file->exists = 0;
+		file->unsure = 0;
+		file->lo = 0;
+		file->hi = 0;
+	} else if(file->exists){
+		file->unsure = 1;
+		file->lo = 0;
+	}
+	if(fault_verbose){
+		printf("op %u: rm %s %s\n", op, name,
+		       (result == FLOG_SUCCESS) ? "ok" : "failed");
+	}
+}
+
+/*!
+ @name Calls the random traffic doesn't make
+ Each is checked once on a fresh volume, with no blocks failing.
+ @{
+ */
+
+//! Set up an empty volume for a check
+static uint32_t fault_calls_volume(char const * check){
+	flash_sim_init();
+	flogfs_init();
+	if((FLOG_SUCCESS != flogfs_format()) || (FLOG_SUCCESS != flogfs_mount())){
+		printf("%s: couldn't set up a volume\n", check);
+		return 1;
+	}
+	return 0;
+}
+
+//! The most entries fault_calls_read() gives a skip index
+#define FAULT_MAX_SKIP_ENTRIES (16)
+
+/*!
+ @brief Read a file back in odd-sized pieces, then seek around it
+ @param f The pattern it was written with (see fault_pattern())
+ @param length The bytes it should read back
+ @param skip_entries The size of skip index to seek with, or 0 for none
+ @returns The number of problems found
+ */
+static uint32_t fault_calls_read(char const * check, char const * name,
+                                 uint32_t f, uint32_t length,
+                                 uint16_t skip_entries){
+	static uint8_t buffer[777];
+	static flog_skip_entry_t entries[FAULT_MAX_SKIP_ENTRIES];
+	uint32_t seeks[22] = {length / 2, 0, length - length / 3, length / 7,
+	                      length - 1, length};
+	flog_skip_index_t index;
+	flog_read_file_t read_file;
+	uint32_t read = 0;
+	uint32_t n;
+	uint32_t problems = 0;
+
+	// Then back and forth at random
+	for(uint32_t s = 6; s < sizeof(seeks) / sizeof(seeks[0]); s++){
+		seeks[s] = (uint32_t)(s * 2654435761u) % (length + 1);
+	}
+	if(FLOG_SUCCESS != flogfs_open_read(&read_file, name)){
+		printf("%s: %s won't open\n", check, name);
+		return 1;
+	}
+	if(skip_entries){
+		flogfs_set_skip_index(&read_file, &index, entries,
+		                      MIN(skip_entries, FAULT_MAX_SKIP_ENTRIES), 1);
+	}
+	while((n = flogfs_read(&read_file, buffer, sizeof(buffer))) != 0){
+		for(uint32_t i = 0; i < n; i++){
+			if(buffer[i] != fault_pattern(f, read + i)){
+				printf("%s: %s is wrong at %u\n", check, name, read + i);
+				problems += 1;
+				break;
+			}
+		}
+		read += n;
+		if(problems || (read > length)){
+			break;
+		}
+	}
+	if(read != length){
+		printf("%s: %s read back %u bytes, not %u\n", check, name, read, length);
+		problems += 1;
+	}
+	for(uint32_t s = 0; s < sizeof(seeks) / sizeof(seeks[0]); s++){
+		uint32_t const expected = MIN(100, length - seeks[s]);
+		if(FLOG_SUCCESS != flogfs_seek(&read_file, seeks[s])){
+			printf("%s: %s won't seek to %u\n", check, name, seeks[s]);
+			problems += 1;
+			continue;
+		}
+		n = flogfs_read(&read_file, buffer, 100);
+		if(n != expected){
+			printf("%s: %s read %u bytes at %u, not %u\n", check, name, n,
+			       seeks[s], expected);
+			problems += 1;
+		}
+		for(uint32_t i = 0; i < MIN(n, expected); i++){
+			if(buffer[i] != fault_pattern(f, seeks[s] + i)){
+				printf("%s: %s is wrong at %u after a seek\n", check, name,
+				       seeks[s] + i);
+				problems += 1;
+				break;
+			}
+		}
+	}
+	if(skip_entries && (index.n > index.size)){
+		printf("%s: %s has %u skip entries in %u\n", check, name, index.n,
+		       index.size);
+		problems += 1;
+	}
+	flogfs_close_read(&read_file);
+	return problems;
+}
+
+/*!
+ @brief Write a file in one opening with flogfs_write()
+ @param f The pattern to write (see fault_pattern())
+ @returns The number of problems found
+ */
+static uint32_t fault_calls_write(char const * check, char const * name,
+                                  uint32_t f, uint32_t length){
+	static uint8_t buffer[1000];
+	flog_write_file_t write_file;
+	uint32_t problems = 0;
+
+	if(FLOG_SUCCESS != flogfs_open_write(&write_file, name)){
+		printf("%s: %s won't open to write\n", check, name);
+		return 1;
+	}
+	for(uint32_t written = write_file.write_head; written < length;
+	    written += sizeof(buffer)){
+		uint32_t const n = MIN(sizeof(buffer), length - written);
+		for(uint32_t i = 0; i < n; i++){
+			buffer[i] = fault_pattern(f, written + i);
+		}
+		if(flogfs_write(&write_file, buffer, n) != n){
+			printf("%s: %s write failed\n", check, name);
+			problems += 1;
+			break;
+		}
+	}
+	if(FLOG_SUCCESS != flogfs_close_write(&write_file)){
+		printf("%s: %s close failed\n", check, name);
+		problems += 1;
+	}
+	return problems;
+}
+
+/*!
+ @brief Seek around a file of many blocks through skip indexes small enough
+        to have to thin out, and through none
+ */
+static uint32_t fault_calls_skip_index(){
+	uint16_t const sizes[] = {0, 1, 4, FAULT_MAX_SKIP_ENTRIES};
+	// Some blocks, ending part way through one
+	uint32_t const length = 11 * FS_SECTORS_PER_BLOCK * FS_SECTOR_SIZE + 12345;
+	uint32_t problems = fault_calls_volume("skip index");
+
+	if(!problems){
+		problems += fault_calls_write("skip index", "seek", 0, length);
+	}
+	for(uint32_t i = 0; !problems && (i < sizeof(sizes) / sizeof(sizes[0]));
+	    i++){
+		problems += fault_calls_read("skip index", "seek", 0, length, sizes[i]);
+	}
+	return problems;
+}
+
+/*!
+ @brief Check flogfs_size() while a file is written, once it's closed and
+        after a remount, when it has to walk the file
+ */
+static uint32_t fault_calls_size(){
+	static uint8_t buffer[1000];
+	uint32_t const length = 3 * FS_SECTORS_PER_BLOCK * FS_SECTOR_SIZE + 777;
+	flog_write_file_t write_file;
+	uint32_t size;
+	uint32_t problems = fault_calls_volume("size");
+
+	if(!problems && (FLOG_SUCCESS != flogfs_open_write(&write_file, "size"))){
+		printf("size: size won't open to write\n");
+		problems += 1;
+	}
+	for(uint32_t written = 0; !problems && (written < length);){
+		uint32_t const n = MIN(sizeof(buffer), length - written);
+		for(uint32_t i = 0; i < n; i++){
+			buffer[i] = fault_pattern(0, written + i);
+		}
+		if(flogfs_write(&write_file, buffer, n) != n){
+			printf("size: write failed\n");
+			problems += 1;
+		}
+		written += n;
+		if((FLOG_SUCCESS != flogfs_size("size", &size)) || (size != written)){
+			printf("size: %u written but size %u while open\n", written, size);
+			problems += 1;
+		}
+	}
+	if(!problems){
+		flogfs_close_write(&write_file);
+	}
+	for(uint32_t remount = 0; !problems && (remount < 2); remount++){
+		if((FLOG_SUCCESS != flogfs_size("size", &size)) || (size != length)){
+			printf("size: %u written but size %u %s\n", length, size,
+			       remount ? "after a remount" : "once closed");
+			problems += 1;
+		}
+		flogfs_unmount();
+		flogfs_init();
+		if(FLOG_SUCCESS != flogfs_mount()){
+			printf("size: remount failed\n");
+			problems += 1;
+		}
+	}
+	if(!problems && (FLOG_SUCCESS == flogfs_size("missing", &size))){
+		printf("size: a missing file has size %u\n", size);
+		problems += 1;
+	}
+	if(!problems){
+		problems += fault_calls_read("size", "size", 0, length, 0);
+	}
+	return problems;
+}
+
+/*!
+ @brief Write a file with flogfs_write_try() and a back buffer, letting time
+        pass whenever it comes up short, with a blocking write now and then
+ */
+static uint32_t fault_calls_write_try(){
+	static uint8_t back[FS_SECTOR_SIZE];
+	static uint8_t page[FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE];
+	static uint8_t buffer[300];
+	uint32_t const length = 2 * FS_SECTORS_PER_BLOCK * FS_SECTOR_SIZE + 999;
+	flog_write_file_t write_file;
+	uint32_t written = 0;
+	uint32_t calls = 0;
+	uint32_t short_calls = 0;
+	uint32_t size;
+	uint32_t problems = fault_calls_volume("write try");
+
+	if(!problems && (FLOG_SUCCESS != flogfs_open_write(&write_file, "try"))){
+		printf("write try: try won't open to write\n");
+		problems += 1;
+	}
+	if(!problems){
+		flogfs_set_back_buffer(&write_file, back);
+	}
+	while(!problems && (written < length)){
+		uint32_t const n = MIN(sizeof(buffer), length - written);
+		uint32_t taken;
+		for(uint32_t i = 0; i < n; i++){
+			buffer[i] = fault_pattern(0, written + i);
+		}
+		if(++calls % 7){
+			taken = flogfs_write_try(&write_file, buffer, n);
+		} else {
+			taken = flogfs_write(&write_file, buffer, n);
+		}
+		if(taken > n){
+			printf("write try: %u of %u bytes taken\n", taken, n);
+			problems += 1;
+		}
+		written += taken;
+		if(taken < n){
+			// The flash is busy, so do something else for a while
+			flash_sim_idle(20000);
+			if(++short_calls > 100000){
+				printf("write try: stuck at %u\n", written);
+				problems += 1;
+			}
+		}
+		if((FLOG_SUCCESS != flogfs_size("try", &size)) || (size != written)){
+			printf("write try: %u taken but size %u\n", written, size);
+			problems += 1;
+		}
+	}
+	if(!problems && !short_calls){
+		printf("write try: the flash was never busy\n");
+		problems += 1;
+	}
+	if(!problems){
+		// A page buffer always needs the flash
+		flogfs_set_page_buffer(&write_file, page);
+		if(flogfs_write_try(&write_file, buffer, 1) != 0){
+			printf("write try: took data with a page buffer\n");
+			problems += 1;
+		}
+		if(FLOG_SUCCESS != flogfs_close_write(&write_file)){
+			printf("write try: close failed\n");
+			problems += 1;
+		}
+	}
+	if(!problems){
+		problems += fault_calls_read("write try", "try", 0, length, 0);
+	}
+	return problems;
+}
+
+/*!
+ @brief Append a record with flogfs_writev(), in three pieces
+ @param f The pattern to write (see fault_pattern())
+ @param[in,out] written The length of the file so far
+ @returns The number of problems found
+ */
+static uint32_t fault_calls_record(flog_write_file_t * file, uint32_t f,
+                                   uint32_t length, uint32_t * written){
+	static uint8_t record[200];
+	flog_iovec_t const iov[3] = {
+		{record, 4}, {record + 4, length - 6}, {record + length - 2, 2}
+	};
+	for(uint32_t i = 0; i < length; i++){
+		record[i] = fault_pattern(f, *written + i);
+	}
+	uint32_t const n = flogfs_writev(file, iov, 3);
+	*written += n;
+	if(n != length){
+		printf("group commit: %u of a %u byte record written\n", n, length);
+		return 1;
+	}
+	return 0;
+}
+
+/*!
+ @brief Write records to two files with group commit, one by bytes and one by
+        age, then lose the power with data still waiting
+
+ Whatever was due to be committed has to be there after the remount, and the
+ files have to carry on from where they were left.
+ */
+static uint32_t fault_calls_group_commit(){
+	char const * const names[2] = {"bytes", "age"};
+	uint32_t const max_bytes = 300;
+	uint32_t const max_ms = 5;
+	flog_write_file_t write_files[2];
+	uint32_t written[2] = {0, 0};
+	// What has to survive
+	uint32_t durable[2] = {0, 0};
+	uint32_t problems = fault_calls_volume("group commit");
+
+	for(uint32_t f = 0; !problems && (f < 2); f++){
+		if(FLOG_SUCCESS != flogfs_open_write(&write_files[f], names[f])){
+			printf("group commit: %s won't open to write\n", names[f]);
+			problems += 1;
+		}
+	}
+	if(!problems){
+		flogfs_set_group_commit(&write_files[0], max_bytes, 0);
+		flogfs_set_group_commit(&write_files[1], 0, max_ms);
+	}
+	for(uint32_t r = 0; !problems && (r < 395); r++){
+		problems += fault_calls_record(&write_files[0], 0, 20 + (r * 37) % 100,
+		                               &written[0]);
+		// Nothing waits for the byte limit to be reached
+		durable[0] = written[0] - MIN(written[0], max_bytes - 1);
+		problems += fault_calls_record(&write_files[1], 1, 20 + (r * 53) % 100,
+		                               &written[1]);
+		if(r % 10 == 9){
+			// Long enough for the age limit, which the idle work checks
+			flash_sim_idle((max_ms + 1) * 1000000);
+			while(flogfs_background_step(100000));
+			durable[1] = written[1];
+		}
+	}
+
+	// The power goes with the last records still in RAM
+	flogfs_init();
+	if(!problems && (FLOG_SUCCESS != flogfs_mount())){
+		printf("group commit: mount failed\n");
+		problems += 1;
+	}
+	for(uint32_t f = 0; !problems && (f < 2); f++){
+		flog_read_file_t read_file;
+		uint8_t byte;
+		uint32_t length = 0;
+		if(FLOG_SUCCESS != flogfs_open_read(&read_file, names[f])){
+			printf("group commit: %s won't open\n", names[f]);
+			problems += 1;
+			break;
+		}
+		while(flogfs_read(&read_file, &byte, 1)){
+			if(byte != fault_pattern(f, length)){
+				printf("group commit: %s is wrong at %u\n", names[f], length);
+				problems += 1;
+				break;
+			}
+			length += 1;
+		}
+		flogfs_close_read(&read_file);
+		if(!problems && ((length < durable[f]) || (length > written[f]))){
+			printf("group commit: %s is %u bytes, not %u to %u\n", names[f],
+			       length, durable[f], written[f]);
+			problems += 1;
+		}
+		if(!problems && (written[f] == durable[f])){
+			printf("group commit: nothing of %s was left waiting\n", names[f]);
+			problems += 1;
+		}
+		written[f] = length;
+	}
+
+	// Appending carries on from what survived
+	for(uint32_t f = 0; !problems && (f < 2); f++){
+		flog_write_file_t * const write_file = &write_files[f];
+		if(FLOG_SUCCESS != flogfs_open_write(write_file, names[f])){
+			printf("group commit: %s won't open to write again\n", names[f]);
+			problems += 1;
+			break;
+		}
+		if(write_file->write_head != written[f]){
+			printf("group commit: %s opens at %u, not %u\n", names[f],
+			       write_file->write_head, written[f]);
+			problems += 1;
+		}
+		for(uint32_t r = 0; !problems && (r < 50); r++){
+			problems += fault_calls_record(write_file, f, 20 + r, &written[f]);
+		}
+		if(FLOG_SUCCESS != flogfs_close_write(write_file)){
+			printf("group commit: %s close failed\n", names[f]);
+			problems += 1;
+		}
+		if(!problems){
+			problems += fault_calls_read("group commit", names[f], f,
+			                             written[f], 0);
+		}
+	}
+	return problems;
+}
+
+#if FLOG_ENABLE_COMPRESSION
+/*!
+ @brief Write a file with each codec, then read, seek and measure it, with the
+        two files taking turns at the volume's frame buffer
+ */
+static uint32_t fault_calls_compression(){
+	static uint8_t frames[2][FLOG_COMPRESS_FRAME_SIZE];
+	static uint8_t buffer[300];
+	flog_compression_t const codecs[2] = {FLOG_COMPRESS_LZ,
+	                                      FLOG_COMPRESS_DELTA};
+	char const * const names[2] = {"lz", "delta"};
+	uint32_t const length = 40000;
+	flog_read_file_t read_files[2];
+	uint32_t problems = fault_calls_volume("compression");
+
+	for(uint32_t c = 0; !problems && (c < 2); c++){
+		flog_write_file_t write_file;
+		uint32_t stored;
+		uint32_t size;
+		// Two openings, so the second carries on from the first's frames
+		for(uint32_t half = 0; half < 2; half++){
+			if(FLOG_SUCCESS != flogfs_open_write_compressed(&write_file, names[c],
+			                                                codecs[c], 8,
+			                                                frames[c])){
+				printf("compression: %s won't open to write\n", names[c]);
+				return problems + 1;
+			}
+			uint32_t const end = (half + 1) * length / 2;
+			for(uint32_t written = half * length / 2; written < end;
+			    written += sizeof(buffer)){
+				uint32_t const n = MIN(sizeof(buffer), end - written);
+				for(uint32_t i = 0; i < n; i++){
+					buffer[i] = fault_pattern(c, written + i);
+				}
+				if(flogfs_write(&write_file, buffer, n) != n){
+					printf("compression: %s write failed\n", names[c]);
+					problems += 1;
+				}
+			}
+			if(FLOG_SUCCESS != flogfs_close_write(&write_file)){
+				printf("compression: %s close failed\n", names[c]);
+				problems += 1;
+			}
+		}
+		// The pattern isn't samples, so only LZ has to shrink it
+		if((FLOG_SUCCESS != flogfs_size(names[c], &stored)) ||
+		   (FLOG_SUCCESS != flogfs_size_decompressed(names[c], &size))){
+			printf("compression: %s can't be measured\n", names[c]);
+			problems += 1;
+		} else if((size != length) ||
+		          ((codecs[c] == FLOG_COMPRESS_LZ) && (stored >= length))){
+			printf("compression: %s is %u bytes stored as %u\n", names[c],
+			       size, stored);
+			problems += 1;
+		}
+		problems += fault_calls_read("compression", names[c], c, length, 0);
+	}
+
+	// Interleaved, so each read decodes its frame again
+	for(uint32_t c = 0; !problems && (c < 2); c++){
+		if(FLOG_SUCCESS != flogfs_open_read(&read_files[c], names[c])){
+			printf("compression: %s won't open\n", names[c]);
+			problems += 1;
+		}
+	}
+	for(uint32_t offset = 0; !problems && (offset < length);
+	    offset += sizeof(buffer)){
+		for(uint32_t c = 0; c < 2; c++){
+			uint32_t const n = flogfs_read(&read_files[c], buffer,
+			                               sizeof(buffer));
+			if(n != MIN(sizeof(buffer), length - offset)){
+				printf("compression: %s read %u bytes at %u\n", names[c], n,
+				       offset);
+				problems += 1;
+			}
+			for(uint32_t i = 0; i < n; i++){
+				if(buffer[i] != fault_pattern(c, offset + i)){
+					printf("compression: %s is wrong at %u taking turns\n",
+					       names[c], offset + i);
+					problems += 1;
+					break;
+				}
+			}
+		}
+	}
+	if(!problems){
+		flogfs_close_read(&read_files[0]);
+		flogfs_close_read(&read_files[1]);
+	}
+
+	// And again from the flash
+	flogfs_unmount();
+	flogfs_init();
+	if(!problems && (FLOG_SUCCESS != flogfs_mount())){
+		printf("compression: remount failed\n");
+		problems += 1;
+	}
+	for(uint32_t c = 0; !problems && (c < 2); c++){
+		problems += fault_calls_read("compression", names[c], c, length, 0);
+	}
+	return problems;
+}
+#endif
+
+//! The writer threads in fault_calls_threads()
+#define FAULT_NUM_THREADS (3)
+
+//! A file fault_calls_threads() writes from a thread of its own
+typedef struct {
+	uint32_t f;
+	uint32_t length;
+	uint32_t problems;
+} fault_thread_t;
+
+//! Set once the writers in fault_calls_threads() are done
+static std::atomic<uint_fast8_t> fault_threads_done;
+
+//! Write a file in pieces of a sector or so, each thread with its own file
+static void * fault_thread_write(void * arg){
+	fault_thread_t * const thread = (fault_thread_t *)arg;
+	uint8_t buffer[FS_SECTOR_SIZE + 13];
+	flog_write_file_t write_file;
+	char name[FLOG_MAX_FNAME_LEN];
+
+	fault_file_name(name, thread->f);
+	if(FLOG_SUCCESS != flogfs_open_write(&write_file, name)){
+		printf("threads: %s won't open to write\n", name);
+		thread->problems += 1;
+		return 0;
+	}
+	for(uint32_t written = 0; written < thread->length;){
+		uint32_t const n = MIN(sizeof(buffer), thread->length - written);
+		for(uint32_t i = 0; i < n; i++){
+			buffer[i] = fault_pattern(thread->f, written + i);
+		}
+		if(flogfs_write(&write_file, buffer, n) != n){
+			printf("threads: %s write failed\n", name);
+			thread->problems += 1;
+			break;
+		}
+		written += n;
+		sched_yield();
+	}
+	if(FLOG_SUCCESS != flogfs_close_write(&write_file)){
+		printf("threads: %s close failed\n", name);
+		thread->problems += 1;
+	}
+	return 0;
+}
+
+/*!
+ @brief List the volume over and over, an entry at a time, until the writers
+        are done
+ @param arg Where to count the problems found
+
+ Files there before the writers started have to be in every listing, and
+ nothing else but the writers' files may turn up.
+ */
+static void * fault_thread_ls(void * arg){
+	uint32_t * const problems = (uint32_t *)arg;
+	flogfs_ls_iterator_t iter;
+	char name[FLOG_MAX_FNAME_LEN];
+	char expected[FLOG_MAX_FNAME_LEN];
+	uint32_t listings = 0;
+	uint32_t seen;
+
+	while(!*problems && (!fault_threads_done || (listings < 2))){
+		seen = 0;
+		flogfs_start_ls(&iter);
+		while(flogfs_ls_iterate(&iter, name)){
+			uint32_t f;
+			for(f = 0; f < FAULT_NUM_FILES; f++){
+				fault_file_name(expected, f);
+				if(strcmp(name, expected) == 0){
+					break;
+				}
+			}
+			if(f == FAULT_NUM_FILES){
+				printf("threads: %s was listed\n", name);
+				*problems += 1;
+			} else if(seen & (1u << f)){
+				printf("threads: %s was listed twice\n", name);
+				*problems += 1;
+			}
+			seen |= 1u << f;
+			// Let the writers get on with it mid listing
+			sched_yield();
+		}
+		flogfs_stop_ls(&iter);
+		for(uint32_t f = FAULT_NUM_THREADS; f < FAULT_NUM_FILES; f++){
+			if(!(seen & (1u << f))){
+				fault_file_name(expected, f);
+				printf("threads: %s wasn't listed\n", expected);
+				*problems += 1;
+			}
+		}
+		listings += 1;
+	}
+	return 0;
+}
+
+/*!
+ @brief Write files from threads of their own while another thread lists the
+        volume, then read them all back
+
+ Build with -fsanitize=thread to check the locking as well.
+ */
+static uint32_t fault_calls_threads(){
+	fault_thread_t threads[FAULT_NUM_THREADS];
+	pthread_t writers[FAULT_NUM_THREADS];
+	pthread_t lister;
+	char name[FLOG_MAX_FNAME_LEN];
+	uint32_t ls_problems = 0;
+	uint32_t problems = fault_calls_volume("threads");
+
+	// Files for the listing to find among the ones being written
+	for(uint32_t f = FAULT_NUM_THREADS; !problems && (f < FAULT_NUM_FILES);
+	    f++){
+		fault_file_name(name, f);
+		problems += fault_calls_write("threads", name, f, 100 * f);
+	}
+	if(problems){
+		return problems;
+	}
+	fault_threads_done = 0;
+	pthread_create(&lister, 0, fault_thread_ls, &ls_problems);
+	for(uint32_t t = 0; t < FAULT_NUM_THREADS; t++){
+		threads[t].f = t;
+		threads[t].length = (t + 2) * FS_SECTORS_PER_BLOCK * FS_SECTOR_SIZE +
+		                    111 * t;
+		threads[t].problems = 0;
+		pthread_create(&writers[t], 0, fault_thread_write, &threads[t]);
+	}
+	for(uint32_t t = 0; t < FAULT_NUM_THREADS; t++){
+		pthread_join(writers[t], 0);
+		problems += threads[t].problems;
+	}
+	fault_threads_done = 1;
+	pthread_join(lister, 0);
+	problems += ls_problems;
+
+	for(uint32_t f = 0; !problems && (f < FAULT_NUM_FILES); f++){
+		fault_file_name(name, f);
+		problems += fault_calls_read("threads", name, f,
+		                             (f < FAULT_NUM_THREADS) ?
+		                             threads[f].length : 100 * f, 0);
+	}
+	return problems;
+}
+
+/*!
+ @brief Run all the checks of calls
+ @returns The number of problems found
+ */
+static uint32_t fault_calls(){
+	uint32_t problems = 0;
+
+	problems += fault_calls_skip_index();
+	problems += fault_calls_size();
+	problems += fault_calls_write_try();
+	problems += fault_calls_group_commit();
+#if FLOG_ENABLE_COMPRESSION
+	problems += fault_calls_compression();
+#endif
+	problems += fault_calls_threads();
+	flash_sim_deinit();
+	printf("calls: %s\n", problems ? "FAILED" : "ok");
+	return problems;
+}
+
+//! @}
+
+//! @returns The number of problems found
+static uint32_t fault_run(uint32_t seed){
+	uint32_t fail_op[FAULT_MAX_FAILURES];
+	uint16_t fail_block[FAULT_MAX_FAILURES];
+	uint32_t problems = 0;
+
+	srand(seed);
+	memset(fault_files, 0, sizeof(fault_files));
+	flash_sim_init();
+	flogfs_init();
+	if((FLOG_SUCCESS != flogfs_format()) || (FLOG_SUCCESS != flogfs_mount())){
+		printf("seed %u: couldn't set up a volume\n", seed);
+		flash_sim_deinit();
+		return 1;
+	}
+	for(uint32_t i = 0; i < fault_failures; i++){
+		fail_op[i] = rand() % fault_ops;
+		fail_block[i] = rand() % FS_NUM_BLOCKS;
+		if(i < fault_num_blocks){
+			fail_block[i] = fault_blocks[i];
+		}
+	}
+
+	for(uint32_t op = 0; (op < fault_ops) && !problems; op++){
+		for(uint32_t i = 0; i < fault_failures; i++){
+			if(fail_op[i] == op){
+				flash_sim_fail_block(fail_block[i]);
+				if(fault_verbose){
+					printf("op %u: block %u fails\n", op, fail_block[i]);
+				}
+			}
+		}
+		uint32_t const f = rand() % FAULT_NUM_FILES;
+		uint32_t const what = rand() % 20;
+		if(what < 3){
+			fault_rm(op, f);
+		} else if(what < 15){
+			problems += fault_append(op, f);
+		} else if(what < 18){
+			problems += fault_check_all(op);
+		} else if(what < 19){
+			while(flogfs_background_step(100000));
+		} else {
+			// Half the time as if the power went
+			if(rand() % 2){
+				flogfs_unmount();
+			}
+			flogfs_init();
+			if(FLOG_SUCCESS != flogfs_mount()){
+				printf("op %u: mount failed\n", op);
+				problems += 1;
+				break;
+			}
+			problems += fault_check_all(op);
+		}
+	}
+	if(!problems){
+		flogfs_unmount();
+		flogfs_init();
+		if(FLOG_SUCCESS != flogfs_mount()){
+			printf("op %u: mount failed\n", fault_ops);
+			problems += 1;
+		} else {
+			problems += fault_check_all(fault_ops);
+		}
+	}
+	flash_sim_deinit();
+	printf("seed %u: %s\n", seed, problems ? "FAILED" : "ok");
+	return problems;
+}
+
+static void fault_usage(char const * argv0){
+	fprintf(stderr, "Usage: %s [-s first seed] [-r runs] [-n ops] "
+	                "[-f failing blocks] [-b block]... [-q] [-v]\n"
+	                "  -q skips the checks of calls and the runs that failed before\n", argv0);
+}
+
+int main(int argc, char ** argv){
+	uint32_t seed = 1;
+	uint32_t runs = 20;
+	uint32_t failed = 0;
+	uint_fast8_t quick = 0;
+
+	for(int i = 1; i < argc; i++){
+		if((strcmp(argv[i], "-s") == 0) && (i + 1 < argc)){
+			seed = strtoul(argv[++i], 0, 0);
+		} else if((strcmp(argv[i], "-r") == 0) && (i + 1 < argc)){
+			runs = strtoul(argv[++i], 0, 0);
+		} else if((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)){
+			fault_ops = strtoul(argv[++i], 0, 0);
+		} else if((strcmp(argv[i], "-f") == 0) && (i + 1 < argc)){
+			fault_failures = strtoul(argv[++i], 0, 0);
+		} else if((strcmp(argv[i], "-b") == 0) && (i + 1 < argc) &&
+		          (fault_num_blocks < FAULT_MAX_FAILURES)){
+			fault_blocks[fault_num_blocks++] = strtoul(argv[++i], 0, 0);
+		} else if(strcmp(argv[i], "-q") == 0){
+			quick = 1;
+		} else if(strcmp(argv[i], "-v") == 0){
+			fault_verbose = 1;
+		} else {
+			fault_usage(argv[0]);
+			return 1;
+		}
+	}
+	fault_failures = MAX(fault_failures, fault_num_blocks);
+	if(!fault_ops || (fault_failures > FAULT_MAX_FAILURES)){
+		fault_usage(argv[0]);
+		return 1;
+	}
+
+	printf("Geometry: %u blocks x %u pages x %u sectors x %uB, %u spares\n",
+	       FS_NUM_BLOCKS, FS_PAGES_PER_BLOCK, FS_SECTORS_PER_PAGE,
+	       FS_SECTOR_SIZE, FLOG_BAD_BLOCK_SPARES);
+	if(!quick && fault_calls()){
+		failed += 1;
+	}
+	if(!quick && !fault_num_blocks){
+		uint32_t const n = sizeof(fault_regressions) /
+		                   sizeof(fault_regressions[0]);
+		uint32_t const failures = fault_failures;
+		uint32_t const ops = fault_ops;
+		uint32_t regressed = 0;
+		fault_ops = FAULT_DEFAULT_OPS;
+		for(uint32_t i = 0; i < n; i++){
+			fault_failures = fault_regressions[i].failures;
+			if(fault_run(fault_regressions[i].seed)){
+				regressed += 1;
+			}
+		}
+		fault_failures = failures;
+		fault_ops = ops;
+		printf("%u of %u earlier failures came back\n", regressed, n);
+		failed += regressed;
+	}
+	for(uint32_t i = 0; i < runs; i++){
+		if(fault_run(seed + i)){
+			failed += 1;
+		}
+	}
+	printf("%u of %u runs failed\n", failed, runs);
+	return failed != 0;
+}
+
+//! @}
@@ -0,0 +1,794 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_microbench.cpp
+ * @ingroup FLogSim
+ *
+ * @brief Benchmarks of FLogFS internals on the host flash simulator
+ *
+ * The file system and the simulator are built into this file so the static
+ * functions can be called directly. Build from the repository root with
+ * something like:
+ *
+ *     g++ -std=c++11 -O2 -Iinc -Isim sim/flogfs_microbench.cpp -lpthread \
+ *         -o flogfs_microbench
+ *
+ * Each case reports the flash operations and the device and host time per
+ * call. A file needs a block of its own, so the part is bigger than the other
+ * sim builds to fit the 10000 file lookups. Its pages are 4KiB to keep the
+ * block bitmaps in one checkpoint record page.
+ *
+ * The inode_summary case times one volume with the inode entry summaries and
+ * then with them blanked, as a volume written before them has them. The
+ * reopen and planes cases are meant to be run again with
+ * -DFLOG_TAIL_PREFETCH=0, -DFS_FILE_INDEX_SIZE=0 or -DFS_NUM_PLANES=2 to see
+ * what those options are worth. The options in the build are printed first.
+ */
+
+#ifndef FS_NUM_BLOCKS
+#define FS_NUM_BLOCKS        (12288)
+#endif
+#ifndef FS_SECTORS_PER_PAGE
+#define FS_SECTORS_PER_PAGE  (8)
+#endif
+#ifndef FS_PAGES_PER_BLOCK
+#define FS_PAGES_PER_BLOCK   (16)
+#endif
+
+#include "../src/flogfs.cpp"
+#include "flash_sim.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if FLOG_BUILD_CPP
+#error "The microbenchmarks call into the C build"
+#endif
+
+//! The most files looked up among
+#define MICRO_MAX_FILES (10000)
+
+#if FS_NUM_BLOCKS < MICRO_MAX_FILES + MICRO_MAX_FILES * 2 / \
+                    FS_SECTORS_PER_BLOCK + 16
+#error "The part needs a block for each of MICRO_MAX_FILES files"
+#endif
+
+//! @addtogroup FLogSim
+//! @{
+
+//! Totals over the calls measured so far
+typedef struct {
+	uint32_t calls;
+	uint64_t t_dev_ns;
+	uint64_t t_host_ns;
+	flash_sim_counters_t counters;
+#if FLOG_ENABLE_STATS
+	flogfs_stats_t stats;
+#endif
+} micro_mark_t;
+
+//! Where a call started from
+typedef struct {
+	uint64_t t_dev_ns;
+	uint64_t t_host_ns;
+	flash_sim_counters_t counters;
+#if FLOG_ENABLE_STATS
+	flogfs_stats_t stats;
+#endif
+} micro_start_t;
+
+//! Calls to time per case
+static uint32_t micro_calls = 1000;
+
+static uint64_t micro_host_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void micro_reset(micro_mark_t * mark){
+	memset(mark, 0, sizeof(*mark));
+}
+
+//! @note The statistics are read directly, so this is fine under the locks
+static void micro_begin(micro_start_t * start){
+	flash_sim_get_counters(&start->counters);
+#if FLOG_ENABLE_STATS
+	start->stats = flogfs.stats;
+#endif
+	start->t_dev_ns = flash_sim_time_ns();
+	start->t_host_ns = micro_host_ns();
+}
+
+static void micro_end(micro_mark_t * mark, micro_start_t const * start){
+	flash_sim_counters_t counters;
+	mark->t_host_ns += micro_host_ns() - start->t_host_ns;
+	mark->t_dev_ns += flash_sim_time_ns() - start->t_dev_ns;
+	flash_sim_get_counters(&counters);
+	mark->counters.page_reads += counters.page_reads -
+	                             start->counters.page_reads;
+	mark->counters.programs += counters.programs - start->counters.programs;
+	mark->counters.erases += counters.erases - start->counters.erases;
+	mark->counters.commands += counters.commands - start->counters.commands;
+#if FLOG_ENABLE_STATS
+	mark->stats.page_opens += flogfs.stats.page_opens -
+	                          start->stats.page_opens;
+	mark->stats.page_cache_hits += flogfs.stats.page_cache_hits -
+	                               start->stats.page_cache_hits;
+	mark->stats.spare_reads += flogfs.stats.spare_reads -
+	                           start->stats.spare_reads;
+	mark->stats.allocator_iterations += flogfs.stats.allocator_iterations -
+	                                    start->stats.allocator_iterations;
+#endif
+	mark->calls += 1;
+}
+
+static void micro_report(char const * name, micro_mark_t const * mark){
+	double const n = mark->calls ? mark->calls : 1;
+	printf("%-28s calls %6u  dev %9.2f us  host %8.3f us\n", name,
+	       mark->calls, mark->t_dev_ns / n / 1e3, mark->t_host_ns / n / 1e3);
+	printf("%-28s reads %7.2f  programs %5.2f  erases %5.2f  commands %7.2f\n",
+	       "", mark->counters.page_reads / n, mark->counters.programs / n,
+	       mark->counters.erases / n, mark->counters.commands / n);
+#if FLOG_ENABLE_STATS
+	printf("%-28s opens %7.2f  cache hits %7.2f  spares %7.2f"
+	       "  alloc iterations %7.2f\n", "",
+	       mark->stats.page_opens / n, mark->stats.page_cache_hits / n,
+	       mark->stats.spare_reads / n, mark->stats.allocator_iterations / n);
+#endif
+}
+
+static int micro_new_volume(){
+	flash_sim_init();
+	if((flogfs_init() != FLOG_SUCCESS) ||
+	   (flogfs_format() != FLOG_SUCCESS) ||
+	   (flogfs_mount() != FLOG_SUCCESS)){
+		fprintf(stderr, "Couldn't set up a volume\n");
+		return 0;
+	}
+	return 1;
+}
+
+static void micro_file_name(char * name, uint32_t i){
+	snprintf(name, FLOG_MAX_FNAME_LEN, "file_%05u", i);
+}
+
+//! Create count empty files named by micro_file_name()
+static int micro_create_files(uint32_t count){
+	flog_write_file_t file;
+	char name[FLOG_MAX_FNAME_LEN];
+
+	for(uint32_t i = 0; i < count; i++){
+		micro_file_name(name, i);
+		if(flogfs_open_write(&file, name) != FLOG_SUCCESS){
+			fprintf(stderr, "Couldn't create %s\n", name);
+			return 0;
+		}
+		flogfs_close_write(&file);
+	}
+	return 1;
+}
+
+/*!
+ @brief Time flog_allocate_block() with pool free blocks of ages 0 to spread
+
+ A new volume has every free block given a random age below spread, and
+ blocks are taken out until pool are left. Then half of those are allocated
+ one call at a time, starting from the preallocation list which
+ flogfs_background_step() fills, and given back for the next round.
+ */
+static void micro_allocate(uint32_t pool, uint32_t spread){
+	static flog_block_alloc_t taken[FS_NUM_BLOCKS];
+	flog_block_stat_sector_t stat;
+	micro_mark_t mark;
+	micro_start_t start;
+	char name[64];
+	uint32_t const burst = MAX(pool / 2, 1u);
+	uint32_t n;
+
+	if(!micro_new_volume()){
+		return;
+	}
+	srand(pool + spread);
+	flash_lock();
+	flog_lock_allocate();
+	if(flogfs.num_free_blocks < pool){
+		flog_unlock_allocate();
+		flash_unlock();
+		printf("allocate: only %u free blocks\n", flogfs.num_free_blocks);
+		return;
+	}
+	flogfs.free_block_sum = 0;
+	for(flog_block_idx_t i = 0; i < FS_NUM_BLOCKS; i++){
+		if(!(flogfs.free_block_bitmap[i / 8] & (1 << (i % 8)))){
+			continue;
+		}
+		stat.age = spread ? rand() % spread : 0;
+		stat.timestamp = 0;
+		stat.next_block = FLOG_BLOCK_IDX_INVALID;
+		stat.next_age = FLOG_BLOCK_AGE_INVALID;
+		flog_erase_block(i);
+		flog_write_block_stat(i, &stat);
+		flogfs.free_block_sum += stat.age;
+	}
+	flog_update_mean_free_age();
+	flog_prealloc_reset();
+	while(flogfs.num_free_blocks > pool){
+		flog_allocate_block(0, FLOG_PLANE_ANY);
+	}
+	flog_unlock_allocate();
+	flash_unlock();
+
+	micro_reset(&mark);
+	while(mark.calls < micro_calls){
+		while(flogfs_background_step(1000000));
+
+		flash_lock();
+		flog_lock_allocate();
+		for(n = 0; n < burst; n++){
+			micro_begin(&start);
+			taken[n] = flog_allocate_block(0, FLOG_PLANE_ANY);
+			micro_end(&mark, &start);
+			if(taken[n].block == FLOG_BLOCK_IDX_INVALID){
+				fprintf(stderr, "Allocation failed\n");
+				break;
+			}
+		}
+		while(n--){
+			flog_free_block(taken[n].block, taken[n].age);
+		}
+		flog_unlock_allocate();
+		flash_unlock();
+	}
+
+	snprintf(name, sizeof(name), "allocate pool %u ages <%u", pool,
+	         MAX(spread, 1u));
+	micro_report(name, &mark);
+}
+
+/*!
+ @brief Time flog_find_file() for names among count files and names not there
+ */
+static void micro_find_file(uint32_t count){
+	flog_inode_iterator_t iter;
+	flog_file_find_result_t result;
+	micro_mark_t hit, miss;
+	micro_start_t start;
+	char name[FLOG_MAX_FNAME_LEN];
+	char label[64];
+
+	if(!micro_new_volume() || !micro_create_files(count)){
+		return;
+	}
+	// Start from what a mount knows
+	flogfs_unmount();
+	flogfs_init();
+	flogfs_mount();
+
+	micro_reset(&hit);
+	micro_reset(&miss);
+	srand(count);
+	flog_lock_inodes_read();
+	flash_lock();
+	for(uint32_t i = 0; i < micro_calls; i++){
+		micro_file_name(name, rand() % count);
+		micro_begin(&start);
+		result = flog_find_file(name, &iter);
+		micro_end(&hit, &start);
+		if(result.first_block == FLOG_BLOCK_IDX_INVALID){
+			fprintf(stderr, "Lost %s\n", name);
+		}
+
+		micro_file_name(name, count + rand() % count);
+		micro_begin(&start);
+		flog_find_file(name, &iter);
+		micro_end(&miss, &start);
+	}
+	flash_unlock();
+	flog_unlock_inodes_read();
+
+	snprintf(label, sizeof(label), "find_file %u files hit", count);
+	micro_report(label, &hit);
+	snprintf(label, sizeof(label), "find_file %u files miss", count);
+	micro_report(label, &miss);
+}
+
+/*!
+ @brief Delete a chain of blocks in one go
+
+ This is flog_invalidate_chain(), which only exists without a delete queue.
+ The queue takes the same steps in flog_delete_queue_take().
+ */
+static void micro_delete_chain(flog_block_idx_t base, flog_file_id_t file_id){
+	flog_deletion_t deletion;
+	flog_block_alloc_t block;
+
+	deletion.next = base;
+	deletion.file_id = file_id;
+
+	flog_lock_delete();
+	flogfs.t_allocation_ceiling = flogfs.t;
+	while(flog_deletion_step(&deletion, &block)){
+		flog_free_block(block.block, block.age);
+	}
+	flog_checkpoint_journal_flush();
+	flogfs.t_allocation_ceiling = FLOG_TIMESTAMP_INVALID;
+	flog_unlock_delete();
+}
+
+/*!
+ @brief Time deleting the chain of a file of nblocks blocks
+
+ The calls are reported per block as well since each one is a whole chain.
+ */
+static void micro_invalidate_chain(uint32_t nblocks){
+	static uint8_t buffer[FS_SECTOR_SIZE];
+	flog_write_file_t file;
+	flog_read_file_t read_file;
+	flog_block_idx_t first_block;
+	flog_file_id_t file_id;
+	micro_mark_t mark;
+	micro_start_t start;
+	char label[64];
+	uint32_t const block_bytes = (FS_SECTORS_PER_BLOCK - 2) * FS_SECTOR_SIZE;
+	uint32_t const rounds = MAX(micro_calls / 100, 1u);
+
+	if(nblocks + 16 > FS_NUM_BLOCKS){
+		printf("invalidate_chain %u blocks: too long for the part\n", nblocks);
+		return;
+	}
+	memset(buffer, 0x5A, sizeof(buffer));
+	micro_reset(&mark);
+	for(uint32_t r = 0; r < rounds; r++){
+		if(!micro_new_volume()){
+			return;
+		}
+		flogfs_open_write(&file, "chain");
+		for(uint32_t n = 0; n < nblocks * block_bytes; n += sizeof(buffer)){
+			flogfs_write(&file, buffer, sizeof(buffer));
+		}
+		flogfs_close_write(&file);
+		flogfs_open_read(&read_file, "chain");
+		first_block = read_file.first_block;
+		file_id = read_file.id;
+		flogfs_close_read(&read_file);
+
+		// As flog_file_remove() does it once the entry is invalidated
+		flog_lock_inodes_write();
+		flash_lock();
+		micro_begin(&start);
+		micro_delete_chain(first_block, file_id);
+		micro_end(&mark, &start);
+		flash_unlock();
+		flog_unlock_inodes_write();
+	}
+
+	snprintf(label, sizeof(label), "invalidate_chain %u blocks", nblocks);
+	micro_report(label, &mark);
+	mark.calls *= nblocks;
+	snprintf(label, sizeof(label), "  per block");
+	micro_report(label, &mark);
+}
+
+/*!
+ @brief Time flog_inode_iterator_next() through an inode table of count files
+
+ Steps onto a new inode block are reported apart from steps within one.
+ */
+static void micro_inode_iterator_next(uint32_t count){
+	flog_inode_iterator_t iter;
+	micro_mark_t within, across;
+	micro_start_t start;
+	flog_block_idx_t block;
+	char label[64];
+	uint32_t const needed = count + count * 2 / FS_SECTORS_PER_BLOCK + 16;
+
+	if(needed > FS_NUM_BLOCKS){
+		printf("inode_iterator_next %u files: needs about %u blocks\n", count,
+		       needed);
+		return;
+	}
+	if(!micro_new_volume() || !micro_create_files(count)){
+		return;
+	}
+
+	micro_reset(&within);
+	micro_reset(&across);
+	flog_lock_inodes_read();
+	flash_lock();
+	while(within.calls + across.calls < micro_calls){
+		flog_inode_iterator_init(&iter, flogfs.inode0);
+		for(uint32_t i = 1; i < count; i++){
+			block = iter.block;
+			micro_begin(&start);
+			flog_inode_iterator_next(&iter);
+			micro_end((iter.block == block) ? &within : &across, &start);
+		}
+	}
+	flash_unlock();
+	flog_unlock_inodes_read();
+
+	snprintf(label, sizeof(label), "inode_iterator_next within");
+	micro_report(label, &within);
+	snprintf(label, sizeof(label), "inode_iterator_next across");
+	micro_report(label, &across);
+}
+
+/*!
+ @brief Blank the entry summaries in the inode table
+
+ The entries then read like ones written before the summaries were. The
+ volume has to be mounted again afterwards.
+ */
+static void micro_blank_inode_summaries(){
+	uint8_t * page;
+
+	flash_lock();
+	for(flog_block_idx_t block = flogfs.inode0; block < FS_NUM_BLOCKS;
+	    block = flog_universal_get_next_block(block)){
+		for(uint16_t sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
+		    sector < FS_SECTORS_PER_BLOCK; sector++){
+			page = flash_sim_page(block, sector / FS_SECTORS_PER_PAGE);
+			if(page && (page[flash_spare_offset(sector)] ==
+			            FLOG_INODE_ENTRY_FORMAT_SUMMARY)){
+				memset(page + flash_spare_offset(sector), 0xFF,
+				       sizeof(flog_inode_entry_spare_t));
+			}
+		}
+	}
+	flash_sim.cache_block = 0xFFFF;
+	flash_unlock();
+}
+
+/*!
+ @brief Time a mount, a listing and lookups without the file index over count
+        files with every other one removed, with the entry summaries and then
+        without them
+ */
+static void micro_inode_summary(uint32_t count){
+	flogfs_ls_iterator_t ls;
+	flog_inode_iterator_t iter;
+	micro_mark_t mount, list, find;
+	micro_start_t start;
+	char name[FLOG_MAX_FNAME_LEN];
+	char label[64];
+	uint32_t const rounds = MAX(micro_calls / 100, 1u);
+	uint32_t listed;
+
+	if(!micro_new_volume() || !micro_create_files(count)){
+		return;
+	}
+	for(uint32_t i = 1; i < count; i += 2){
+		micro_file_name(name, i);
+		flogfs_rm(name);
+	}
+	flogfs_unmount();
+
+	for(uint_fast8_t legacy = 0; legacy < 2; legacy++){
+		if(legacy){
+			micro_blank_inode_summaries();
+		}
+		micro_reset(&mount);
+		micro_reset(&list);
+		micro_reset(&find);
+		for(uint32_t r = 0; r < rounds; r++){
+			flogfs_init();
+			micro_begin(&start);
+			if(flogfs_mount() != FLOG_SUCCESS){
+				fprintf(stderr, "Couldn't mount\n");
+				return;
+			}
+			micro_end(&mount, &start);
+
+			micro_begin(&start);
+			flogfs_start_ls(&ls);
+			for(listed = 0; flogfs_ls_iterate(&ls, name); listed++);
+			flogfs_stop_ls(&ls);
+			micro_end(&list, &start);
+			if(listed != (count + 1) / 2){
+				fprintf(stderr, "Listed %u files\n", listed);
+			}
+			flogfs_unmount();
+		}
+
+		// Every lookup walks the table with the index out of the way
+		flogfs_init();
+		flogfs_mount();
+		srand(count);
+		flog_lock_inodes_read();
+		flash_lock();
+		for(uint32_t i = 0; i < micro_calls; i++){
+#if FS_FILE_INDEX_SIZE
+			flog_file_index_clear();
+#endif
+			micro_file_name(name, rand() % count);
+			micro_begin(&start);
+			flog_find_file(name, &iter);
+			micro_end(&find, &start);
+		}
+		flash_unlock();
+		flog_unlock_inodes_read();
+		flogfs_unmount();
+
+		snprintf(label, sizeof(label), "inode_%s %u mount",
+		         legacy ? "legacy" : "summary", count);
+		micro_report(label, &mount);
+		snprintf(label, sizeof(label), "inode_%s %u ls",
+		         legacy ? "legacy" : "summary", count);
+		micro_report(label, &list);
+		snprintf(label, sizeof(label), "inode_%s %u find_file",
+		         legacy ? "legacy" : "summary", count);
+		micro_report(label, &find);
+	}
+}
+
+/*!
+ @brief Check the end the file index keeps for a file against a fresh walk
+ */
+static int micro_check_tail(char const * name){
+#if FS_FILE_INDEX_SIZE
+	flog_inode_iterator_t iter;
+	flog_file_find_result_t result;
+	flog_file_tail_t kept, walked;
+
+	flog_lock_inodes_read();
+	flash_lock();
+	result = flog_find_file(name, &iter);
+	flog_file_get_tail(result.first_block, result.file_id, &kept);
+	flog_file_set_tail(result.file_id, 0);
+	flog_file_get_tail(result.first_block, result.file_id, &walked);
+	flash_unlock();
+	flog_unlock_inodes_read();
+	if((kept.block != walked.block) || (kept.sector != walked.sector) ||
+	   (kept.bytes_in_block != walked.bytes_in_block) ||
+	   (kept.length != walked.length)){
+		fprintf(stderr, "The end kept for %s is off: %u bytes, walked %u\n",
+		        name, kept.length, walked.length);
+		return 0;
+	}
+#else
+	(void)name;
+#endif
+	return 1;
+}
+
+/*!
+ @brief Time flogfs_open_write() on count files of min_kb to max_kb KiB
+        appended to a page at a time
+
+ The first opening of each file after a mount walks to its end, loading the
+ spares of the last block ahead with FLOG_TAIL_PREFETCH, and the file index
+ keeps the end for the openings after. Each end kept is checked against a
+ fresh walk. Build with -DFLOG_TAIL_PREFETCH=0 or -DFS_FILE_INDEX_SIZE=0 to
+ compare.
+ */
+static void micro_reopen(uint32_t count, uint32_t min_kb, uint32_t max_kb){
+	static uint8_t buffer[FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE];
+	flog_write_file_t file;
+	micro_mark_t walk, kept;
+	micro_start_t start;
+	char name[FLOG_MAX_FNAME_LEN];
+	char label[64];
+	uint32_t const rounds = MAX(micro_calls / (count * 10), 2u);
+	uint32_t length;
+
+	if(!micro_new_volume()){
+		return;
+	}
+	memset(buffer, 0x5A, sizeof(buffer));
+	for(uint32_t i = 0; i < count; i++){
+		micro_file_name(name, i);
+		length = (min_kb + (max_kb - min_kb) * i / MAX(count - 1, 1u)) * 1024;
+		flogfs_open_write(&file, name);
+		for(uint32_t n = 0; n < length; n += sizeof(buffer)){
+			flogfs_write(&file, buffer, MIN(length - n, sizeof(buffer)));
+		}
+		flogfs_close_write(&file);
+	}
+
+	micro_reset(&walk);
+	micro_reset(&kept);
+	for(uint32_t r = 0; r < rounds; r++){
+		flogfs_unmount();
+		flogfs_init();
+		flogfs_mount();
+		for(uint32_t k = 0; k < 10; k++){
+			for(uint32_t i = 0; i < count; i++){
+				micro_file_name(name, i);
+				micro_begin(&start);
+				flogfs_open_write(&file, name);
+				micro_end(k ? &kept : &walk, &start);
+				flogfs_write(&file, buffer, sizeof(buffer));
+				flogfs_close_write(&file);
+				if(!micro_check_tail(name)){
+					return;
+				}
+			}
+		}
+	}
+
+	snprintf(label, sizeof(label), "reopen %ux%u-%uK walk", count, min_kb,
+	         max_kb);
+	micro_report(label, &walk);
+	snprintf(label, sizeof(label), "reopen %ux%u-%uK kept", count, min_kb,
+	         max_kb);
+	micro_report(label, &kept);
+}
+
+/*!
+ @brief Time writing chunk bytes to one file and then reading as many from
+        another
+
+ With more than one plane, a program on one file's plane can overlap reads
+ on the other's. Build with -DFS_NUM_PLANES=2 to compare.
+ */
+static void micro_planes(uint32_t chunk, uint32_t byte_ns){
+	static uint8_t buffer[FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE];
+	flog_write_file_t writer;
+	flog_read_file_t reader;
+	flash_sim_timing_t timing;
+	micro_mark_t mark;
+	micro_start_t start;
+	char label[64];
+
+	if(!micro_new_volume()){
+		return;
+	}
+	chunk = MIN(chunk, (uint32_t)sizeof(buffer));
+	timing = flash_sim_default_timing;
+	timing.byte_ns = byte_ns;
+	flash_sim_set_timing(&timing);
+	memset(buffer, 0x5A, sizeof(buffer));
+	flogfs_open_write(&writer, "source");
+	for(uint32_t n = 0; n < micro_calls; n++){
+		flogfs_write(&writer, buffer, chunk);
+	}
+	flogfs_close_write(&writer);
+
+	flogfs_open_read(&reader, "source");
+	flogfs_open_write(&writer, "sink");
+	micro_reset(&mark);
+	while(mark.calls < micro_calls){
+		micro_begin(&start);
+		flogfs_write(&writer, buffer, chunk);
+		if(flogfs_read(&reader, buffer, chunk) != chunk){
+			fprintf(stderr, "Short read\n");
+			break;
+		}
+		micro_end(&mark, &start);
+	}
+	flogfs_close_write(&writer);
+	flogfs_close_read(&reader);
+
+	flash_sim_set_timing(&flash_sim_default_timing);
+
+	snprintf(label, sizeof(label), "planes %uB %uns/B", chunk, byte_ns);
+	micro_report(label, &mark);
+}
+
+static void micro_usage(char const * argv0){
+	fprintf(stderr, "Usage: %s [-n calls] [case...]\n"
+	                "  cases: allocate find_file invalidate_chain inode_next\n"
+	                "         inode_summary reopen planes\n",
+	        argv0);
+}
+
+int main(int argc, char ** argv){
+	static uint32_t const pools[] = {10, 100, FS_NUM_BLOCKS};
+	static uint32_t const spreads[] = {0, 1000};
+	static uint32_t const file_counts[] = {10, 1000, MICRO_MAX_FILES};
+	static uint32_t const chain_lengths[] = {10, 100, FS_NUM_BLOCKS / 2};
+	// The default SPI bus and an 8 bit one at 40MHz
+	static uint32_t const byte_times[] = {
+		flash_sim_default_timing.byte_ns, 25
+	};
+	uint32_t cases = 0;
+
+	for(int i = 1; i < argc; i++){
+		if((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)){
+			micro_calls = strtoul(argv[++i], 0, 0);
+		} else if(strcmp(argv[i], "allocate") == 0){
+			cases |= 1;
+		} else if(strcmp(argv[i], "find_file") == 0){
+			cases |= 2;
+		} else if(strcmp(argv[i], "invalidate_chain") == 0){
+			cases |= 4;
+		} else if(strcmp(argv[i], "inode_next") == 0){
+			cases |= 8;
+		} else if(strcmp(argv[i], "inode_summary") == 0){
+			cases |= 16;
+		} else if(strcmp(argv[i], "reopen") == 0){
+			cases |= 32;
+		} else if(strcmp(argv[i], "planes") == 0){
+			cases |= 64;
+		} else {
+			micro_usage(argv[0]);
+			return 1;
+		}
+	}
+	if(!cases){
+		cases = 0x7F;
+	}
+	if(micro_calls == 0){
+		micro_usage(argv[0]);
+		return 1;
+	}
+
+	printf("Geometry: %u blocks x %u pages x %u sectors x %uB\n",
+	       FS_NUM_BLOCKS, FS_PAGES_PER_BLOCK, FS_SECTORS_PER_PAGE,
+	       FS_SECTOR_SIZE);
+	printf("Planes %u, file index %u, tail prefetch %u\n", FS_NUM_PLANES,
+	       FS_FILE_INDEX_SIZE, FLOG_TAIL_PREFETCH);
+
+	if(cases & 1){
+		for(uint32_t p = 0; p < sizeof(pools) / sizeof(pools[0]); p++){
+			for(uint32_t s = 0; s < sizeof(spreads) / sizeof(spreads[0]); s++){
+				// Most of the part is left once the volume's own blocks are out
+				micro_allocate(MIN(pools[p], FS_NUM_BLOCKS - 16u), spreads[s]);
+			}
+		}
+	}
+	if(cases & 2){
+		for(uint32_t f = 0; f < sizeof(file_counts) / sizeof(file_counts[0]);
+		    f++){
+			micro_find_file(file_counts[f]);
+		}
+	}
+	if(cases & 4){
+		for(uint32_t c = 0; c < sizeof(chain_lengths) / sizeof(chain_lengths[0]);
+		    c++){
+			micro_invalidate_chain(chain_lengths[c]);
+		}
+	}
+	if(cases & 8){
+		micro_inode_iterator_next(1000);
+	}
+	if(cases & 16){
+		micro_inode_summary(300);
+	}
+	if(cases & 32){
+		micro_reopen(40, 3, 120);
+		micro_reopen(3, 2048, 4096);
+	}
+	if(cases & 64){
+		for(uint32_t b = 0; b < sizeof(byte_times) / sizeof(byte_times[0]);
+		    b++){
+			micro_planes(FS_SECTOR_SIZE, byte_times[b]);
+			micro_planes(FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE, byte_times[b]);
+		}
+	}
+
+	flash_sim_deinit();
+	return 0;
+}
+
+//! @}
@@ -37,6 +37,7 @@ either expressed or implied, of the FLogFS Project.
 #include "flogfs_private.h"
 #include "flogfs.h"
 
+#include <stddef.h>
 #include <string.h>
 
 #ifndef IS_DOXYGEN
@@ -47,7 +48,10 @@ extern "C" {
 #endif
 #endif
 
+// flogfs.hpp has already brought in the shims, outside of the class
+#if !FLOG_BUILD_CPP
 #include "flogfs_conf_implement.h"
+#endif
 
 //! @addtogroup FLogPrivate
 //! @{
@@ -58,25 +62,150 @@ typedef struct {
 	flog_block_age_t age;
 } flog_block_alloc_t;
 
+//! @brief A file block chain being deleted
+typedef struct {
+	//! The next block to erase
+	flog_block_idx_t next;
+	flog_file_id_t file_id;
+} flog_deletion_t;
+
+//! The number of recent deletions to verify when mounting
+#define FLOG_RECENT_DELETIONS MAX(FLOG_DELETE_QUEUE_LEN, 1)
+
+#if FLOG_LAZY_ERASE && !FLOG_DELETE_QUEUE_LEN
+#error "FLOG_LAZY_ERASE needs FLOG_DELETE_QUEUE_LEN"
+#endif
+
+// flogfs_volume checks its own geometry
+#if !FLOG_BUILD_CPP
+#if (FS_NUM_PLANES < 1) || (FS_NUM_PLANES > 8)
+#error "FS_NUM_PLANES must be from 1 to 8"
+#endif
+#endif
+
+//! Don't care which plane a block is on (see flog_allocate_block())
+#define FLOG_PLANE_ANY (0xFF)
+
+//! @brief The largest frame of a compressed file
+//! This fits in any sector of a block, so frames can be copied between files.
+#define FLOG_FRAME_MAX (FS_SECTOR_SIZE - sizeof(flog_file_tail_sector_header_t))
+//! Less room than this at the end of a sector is left as padding
+#define FLOG_FRAME_MIN_SPACE (16)
+
+#if FLOG_ENABLE_COMPRESSION
+//! The number of bits hashed to find LZ matches (two bytes of RAM an entry)
+#define FLOG_LZ_HASH_BITS (8)
+
+#if FLOG_COMPRESS_FRAME_SIZE > 0xFFFE
+#error "FLOG_COMPRESS_FRAME_SIZE must fit in a frame header"
+#endif
+#endif
+
+/*!
+ @brief A pool of free blocks, kept as a binary min-heap keyed by age
+
+ Every block in here is also free in flogfs_t::free_block_bitmap. When the
+ pool holds every free block (n == flogfs_t::num_free_blocks), allocation
+ needn't touch the flash at all.
+ */
 typedef struct {
-	//! Block indices and ages
+	//! Block indices and ages, youngest at the root
 	flog_block_alloc_t blocks[FS_PREALLOCATE_SIZE];
 	//! The number of entries
 	uint16_t n;
-	//! The sum of all ages
-	flog_block_age_t age_sum;
+	//! The blocks currently in the heap
+	uint8_t member[FS_NUM_BLOCKS / 8];
 } flog_prealloc_list_t;
 
+/*!
+ @brief A block allocated to a file that has nothing written to it yet
+
+ The file's information is copied here so that the block can be claimed without
+ touching the file structure, which may be in use by another thread.
+ */
 typedef struct {
 	flog_block_idx_t block;
+	flog_block_age_t age;
+	flog_file_id_t file_id;
 	flog_write_file_t * file;
 } flog_dirty_block_t;
 
 typedef struct {
 	flog_file_id_t file_id;
 	flog_block_idx_t first_block;
+	//! The flog_inode_entry_flags_t of the entry
+	uint8_t flags;
 } flog_file_find_result_t;
 
+//! @brief Where a file ends, as found by walking its chain
+typedef struct {
+	//! The last block, or FLOG_BLOCK_IDX_INVALID if not known
+	flog_block_idx_t block;
+	//! The first sector of the block with nothing in it
+	uint16_t sector;
+	uint32_t bytes_in_block;
+	//! The length of the file
+	uint32_t length;
+} flog_file_tail_t;
+
+//! @brief The spares of one page, fetched together
+typedef struct {
+	flog_block_idx_t block;
+	uint16_t page;
+	flog_file_sector_spare_t spares[FS_SECTORS_PER_PAGE];
+} flog_spare_batch_t;
+
+//! @brief What an inode entry holds, from flog_inode_get_entry_state()
+typedef enum {
+	//! Never allocated; the end of the inode table
+	FLOG_INODE_ENTRY_FREE,
+	//! A file whose name hash is known from the spare
+	FLOG_INODE_ENTRY_LIVE,
+	//! A file from before the summary format; the name has to be read
+	FLOG_INODE_ENTRY_LIVE_UNHASHED,
+	FLOG_INODE_ENTRY_DELETED
+} flog_inode_entry_state_t;
+
+#if FS_PAGE_CACHE_SIZE
+/*!
+ @brief A cached page
+
+ Only the first @ref FS_PAGE_CACHE_BYTES of each sector are kept, which is
+ plenty for all headers. Each sector fills from its start as it is read.
+ */
+typedef struct {
+	flog_block_idx_t block;
+	uint16_t page;
+	//! The reference bit for clock replacement
+	uint8_t referenced;
+	//! A bitmask of sectors with a valid spare copy
+	uint8_t spare_valid;
+	//! The number of valid bytes from the start of each sector
+	uint16_t valid[FS_SECTORS_PER_PAGE];
+	uint8_t spare[FS_SECTORS_PER_PAGE][sizeof(flog_file_sector_spare_t)];
+	uint8_t data[FS_SECTORS_PER_PAGE][FS_PAGE_CACHE_BYTES];
+} flog_page_cache_entry_t;
+#endif
+
+#if FS_FILE_INDEX_SIZE
+/*!
+ @brief A live inode entry in the filename index
+
+ The table uses linear probing from (hash % FS_FILE_INDEX_SIZE). Empty slots
+ have inode_block == FLOG_BLOCK_IDX_INVALID.
+ */
+typedef struct {
+	uint16_t hash;
+	flog_block_idx_t inode_block;
+	uint16_t inode_sector;
+	flog_block_idx_t first_block;
+	flog_file_id_t file_id;
+	//! @brief The end of the file, if known (see flog_file_get_tail())
+	//! This is guarded by the flash lock
+	flog_file_tail_t tail;
+} flog_file_index_entry_t;
+#endif
+
 /*!
  @brief The complete FLogFS state structure
  */
@@ -99,37 +228,124 @@ typedef struct {
 
 	//! The most recent timestamp (sequence number)
 	//! @note To put a stamp on a new operation, you should preincrement. This
-	//! is the timestamp of the most recent operation
+	//! is the timestamp of the most recent operation. It is protected by the
+	//! flash lock, as it's always stamped on something being written.
 	flog_timestamp_t t;
 
 	//! The location of the first inode block
 	flog_block_idx_t inode0;
+	//! The flog_volume_format_t found there by mount
+	uint8_t format;
 	//! The number of files in the system
 	flog_file_id_t   num_files;
 
 	//! @brief Flash cache status
-	//! @note This must be protected under @ref flogfs_t::lock !
+	//! @note This must be protected under the flash lock!
 	struct {
+	//! The page selected by the last flog_open_page()
 	flog_block_idx_t current_open_block;
 	uint16_t         current_open_page;
+	//! The page actually loaded in the flash cache
+	flog_block_idx_t loaded_block;
+	uint16_t         loaded_page;
+	//! Is loaded_block/loaded_page valid?
 	uint_fast8_t     page_open;
 	flog_result_t    page_open_result;
+	//! @brief Planes with a program started and not waited for, one bit each
+	//! (FLOG_ASYNC_FLASH)
+	uint_fast8_t     busy;
+#if FLOG_ASYNC_FLASH
+	//! The page each busy plane is programming, in case it fails
+	flog_block_idx_t busy_block[FS_NUM_PLANES];
+	uint16_t         busy_page[FS_NUM_PLANES];
+	//! The busy plane whose page is still in the flash cache, as a bit
+	uint_fast8_t     cache_busy;
+#endif
 	} cache_status;
+
+#if FS_PAGE_CACHE_SIZE
+	//! @brief RAM copies of recently-read page metadata
+	//! @note This is protected along with @ref flogfs_t::cache_status
+	struct {
+	flog_page_cache_entry_t entries[FS_PAGE_CACHE_SIZE];
+	//! The entry for the selected page (may be null)
+	flog_page_cache_entry_t * current;
+	//! The clock hand for replacement
+	uint_fast8_t hand;
+	} page_cache;
+#endif
+
+#if FS_FILE_INDEX_SIZE
+	//! @brief Filename hash index of the inode table
+	//! @note This is protected under @ref flogfs_t::inode_lock
+	struct {
+	flog_file_index_entry_t entries[FS_FILE_INDEX_SIZE];
+	//! The first free inode entry
+	flog_inode_iterator_t tail;
+	uint16_t count;
+	//! Set while every live file is indexed and tail is valid, so that not
+	//! finding a file in the table means it doesn't exist
+	uint8_t complete;
+	} file_index;
+#endif
 	
 	uint8_t free_block_bitmap[FS_NUM_BLOCKS / 8];
+	//! @brief Blocks out of use: bad blocks, spares and their stand-ins
+	//! A block taken over by a spare is still in use, through the spare.
+	//! @note This is protected under the flash lock
+	uint8_t bad_block_bitmap[FS_NUM_BLOCKS / 8];
+	//! @brief The number of failed programs nothing could make good
+	//! Write files are failed if this moves while they're open.
+	//! @note This is protected under the flash lock
+	uint32_t lost_programs;
+	//! @brief Set when the flash fails on a checkpoint block
+	//! flogfs_checkpoint() and flogfs_unmount() report and clear it.
+	uint8_t checkpoint_failed;
+
+#if FLOG_BAD_BLOCK_SPARES
+	//! @brief Spares and the blocks they stand in for
+	//! @note This is protected under the flash lock
+	struct {
+	flog_bad_block_entry_t entries[FLOG_BAD_BLOCK_TABLE_LEN];
+	uint8_t n;
+	//! The number of entries which are spares
+	uint8_t num_spares;
+	} bad_block_table;
+#endif
 	
 	flog_block_age_t mean_free_age;
+	//! The plane after the last block allocated from the preallocation list
+	uint_fast8_t next_plane;
 	uint32_t free_block_sum;
 	//! The number of free blocks
 	flog_block_idx_t num_free_blocks;
+	//! At most this many free blocks still hold data from before
+	//! flogfs_format_quick(). They're erased when they're allocated.
+	flog_block_idx_t num_stale_blocks;
 	
 
-	//! A lock to serialize some FS operations
-	fs_lock_t lock;
+	/*!
+	 @name Locks
+	 Where more than one is needed, they are taken in the order listed here,
+	 with the flash lock between inode_lock and allocate_lock. The calls that
+	 stream data only hold the flash lock around each page operation.
+	 @{
+	 */
+	//! Locks for file structures, shared out by address (see flog_lock_file())
+	fs_lock_t file_locks[FLOG_NUM_FILE_LOCKS];
+	//! @brief A lock on the inode table
+	//! Lookups take it for reading. Anything that adds or removes a file, and
+	//! mounting and formatting, take it for writing. This also protects
+	//! flogfs_t::state, flogfs_t::max_file_id and flogfs_t::inode0.
+	fs_rwlock_t inode_lock;
 	//! A lock to block any allocation-related operations
 	fs_lock_t allocate_lock;
 	//! A lock to serialize deletion operations
 	fs_lock_t delete_lock;
+	//! A lock for the lists of open files and the latency histograms. Nothing
+	//! else is waited for while holding it.
+	fs_lock_t lock;
+	//! @}
 
 	flog_timestamp_t t_allocation_ceiling;
 
@@ -138,25 +354,254 @@ typedef struct {
 	flog_dirty_block_t dirty_block;
 	//! The moving allocator head
 	flog_block_idx_t allocate_head;
+
+#if FLOG_DELETE_QUEUE_LEN
+	//! @brief Deletions waiting for flogfs_background_step()
+	//! @note This may only be accessed under @ref flogfs_t::delete_lock
+	struct {
+		flog_deletion_t entries[FLOG_DELETE_QUEUE_LEN];
+		//! The oldest entry
+		uint8_t head;
+		uint8_t n;
+	} delete_queue;
+#endif
+
+#if FLOG_WEAR_LEVEL_SPREAD
+	//! @brief Static wear leveling (see flog_wear_level_scan_step())
+	//! @note This may only be accessed under @ref flogfs_t::allocate_lock,
+	//! except for the copy and its buffer which belong to the inode write lock
+	struct {
+		//! Blocks allocated since the last sweep, up to FS_NUM_BLOCKS
+		flog_block_idx_t allocations;
+		//! The next block to look at, or FS_NUM_BLOCKS between sweeps
+		flog_block_idx_t cursor;
+		//! The youngest file block seen in this sweep
+		flog_block_age_t youngest_age;
+		flog_file_id_t youngest_file;
+		//! The file to move, or FLOG_FILE_ID_INVALID
+		flog_file_id_t migrate;
+		//! Listings started and not stopped, which hold moves off
+		uint8_t listings;
+		//! The copy being written by flog_wear_level_migrate()
+		flog_write_file_t copy;
+		//! Data on its way from the original to the copy
+		uint8_t buffer[FS_SECTOR_SIZE];
+	} wear;
+#endif
+
+#if FLOG_ENABLE_COMPRESSION
+	//! @brief Scratch space for compressing and decompressing frames
+	//! @note This is protected under the flash lock
+	struct {
+		//! The last position of each hash of four bytes in the frame data
+		uint16_t lz_table[1 << FLOG_LZ_HASH_BITS];
+		//! The encoded data of a frame being read
+		uint8_t frame[FS_SECTOR_SIZE];
+		//! The frame decoded for a read file
+		uint8_t decoded[FLOG_COMPRESS_FRAME_SIZE];
+		//! The file it was decoded for, or null
+		flog_read_file_t const * decoded_file;
+	} compress;
+#endif
+
+
+#if FLOG_ENABLE_CHECKPOINT
+	//! @brief Checkpoint state
+	//! @note This may only be accessed under @ref flogfs_t::allocate_lock
+	struct {
+	//! The reserved blocks, or FLOG_BLOCK_IDX_INVALID if there are none
+	flog_block_idx_t blocks[FLOG_CHECKPOINT_NUM_BLOCKS];
+	//! The index in blocks of the block being written
+	uint_fast8_t current;
+	//! The sequence number of the most recent record
+	uint32_t sequence;
+	//! The next sector to write in the current block
+	uint16_t sector;
+	//! The number of journal entries since the most recent record
+	uint16_t journal_len;
+	//! Freed blocks waiting to be journaled
+	flog_checkpoint_journal_block_t pending_free[8];
+	uint_fast8_t num_pending_free;
+	} checkpoint;
+#endif
+
+#if FLOG_ENABLE_STATS
+	//! Operation counters and latency histograms
+	//! @note The counters are protected under the flash lock and the
+	//! histograms under @ref flogfs_t::lock
+	flogfs_stats_t stats;
+#endif
 } flogfs_t;
 
 
 
-//! A single static instance
-static flogfs_t flogfs;
+//! A single static instance (one per flogfs_volume in the C++ build)
+FLOG_STATIC flogfs_t flogfs;
+
+//! The lock for a file structure
+FLOG_STATIC inline fs_lock_t * flog_file_lock(void const * file){
+	uint32_t const hash = (uint32_t)((uintptr_t)file >> 3) * 2654435761u;
+	return &flogfs.file_locks[(hash >> 16) % FLOG_NUM_FILE_LOCKS];
+}
+
+FLOG_STATIC inline void flog_lock_file(void const * file){
+	fs_lock(flog_file_lock(file));
+}
+FLOG_STATIC inline void flog_unlock_file(void const * file){
+	fs_unlock(flog_file_lock(file));
+}
+FLOG_STATIC inline uint_fast8_t flog_trylock_file(void const * file){
+	return fs_trylock(flog_file_lock(file));
+}
+
+FLOG_STATIC inline void flog_lock_inodes_read(){
+	fs_lock_read(&flogfs.inode_lock);
+}
+FLOG_STATIC inline void flog_unlock_inodes_read(){
+	fs_unlock_read(&flogfs.inode_lock);
+}
+
+FLOG_STATIC inline void flog_lock_inodes_write(){
+	fs_lock_write(&flogfs.inode_lock);
+}
+FLOG_STATIC inline void flog_unlock_inodes_write(){
+	fs_unlock_write(&flogfs.inode_lock);
+}
+
+FLOG_STATIC inline void flog_lock_fs(){fs_lock(&flogfs.lock);}
+FLOG_STATIC inline void flog_unlock_fs(){fs_unlock(&flogfs.lock);}
+FLOG_STATIC inline uint_fast8_t flog_trylock_fs(){
+	return fs_trylock(&flogfs.lock);
+}
+
+//! Let anybody waiting have the flash between two page operations
+FLOG_STATIC inline void flog_flash_yield(){
+	flash_unlock();
+	flash_lock();
+}
+
+//! Take the flash lock only if that doesn't mean waiting for anything
+FLOG_STATIC inline uint_fast8_t flog_flash_trylock(){
+	if(!flash_trylock()){
+		return 0;
+	}
+#if FLOG_ASYNC_FLASH
+	for(uint_fast8_t i = 0; i < FS_NUM_PLANES; i++){
+		if((flogfs.cache_status.busy & (1 << i)) && flash_busy(i)){
+			flash_unlock();
+			return 0;
+		}
+	}
+#endif
+	return 1;
+}
+
+//! The block on the flash holding a block's contents
+FLOG_STATIC inline flog_block_idx_t
+flog_block_physical(flog_block_idx_t block){
+#if FLOG_BAD_BLOCK_SPARES
+	if(flogfs.bad_block_table.n != flogfs.bad_block_table.num_spares){
+		for(uint_fast8_t i = 0; i < flogfs.bad_block_table.n; i++){
+			if(flogfs.bad_block_table.entries[i].bad == block){
+				return flogfs.bad_block_table.entries[i].block;
+			}
+		}
+	}
+#endif
+	return block;
+}
+
+//! The plane (or die) a block is on
+FLOG_STATIC inline uint_fast8_t flog_block_plane(flog_block_idx_t block){
+	return flog_block_physical(block) % FS_NUM_PLANES;
+}
+
+//! Check if a block is out of use (see flogfs_t::bad_block_bitmap)
+FLOG_STATIC inline uint_fast8_t flog_block_out_of_use(flog_block_idx_t block){
+	return (flogfs.bad_block_bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+//! Check if a block holds checkpoints, which are never replaced
+FLOG_STATIC inline uint_fast8_t
+flog_block_is_checkpoint(flog_block_idx_t block){
+#if FLOG_ENABLE_CHECKPOINT
+	for(uint_fast8_t i = 0; i < FLOG_CHECKPOINT_NUM_BLOCKS; i++){
+		if(flogfs.checkpoint.blocks[i] == block){
+			return 1;
+		}
+	}
+#else
+	(void)block;
+#endif
+	return 0;
+}
+
+FLOG_STATIC inline void flog_lock_allocate(){fs_lock(&flogfs.allocate_lock);}
+FLOG_STATIC inline void flog_unlock_allocate(){
+	fs_unlock(&flogfs.allocate_lock);
+}
 
-static inline void flog_lock_fs(){fs_lock(&flogfs.lock);}
-static inline void flog_unlock_fs(){fs_unlock(&flogfs.lock);}
+FLOG_STATIC inline void flog_lock_delete(){fs_lock(&flogfs.delete_lock);}
+FLOG_STATIC inline void flog_unlock_delete(){fs_unlock(&flogfs.delete_lock);}
 
-static inline void flog_lock_allocate(){fs_lock(&flogfs.allocate_lock);}
-static inline void flog_unlock_allocate(){fs_unlock(&flogfs.allocate_lock);}
+//! @name Statistics collection
+//! These compile to nothing unless @ref FLOG_ENABLE_STATS is set
+//! @{
+#if FLOG_ENABLE_STATS
+#define FLOG_STATS_INC(field) (flogfs.stats.field += 1)
+#define FLOG_STATS_ADD(field, n) (flogfs.stats.field += (n))
+//! Mark the start of a public call, before taking any locks
+#define FLOG_STATS_START() uint32_t const flog_stats_t0 = fs_get_time_us()
+#define FLOG_STATS_RECORD(api) flog_stats_record(api, flog_stats_t0, 1)
+//! For calls which never wait: the call goes uncounted if the FS lock is busy
+#define FLOG_STATS_TRY_RECORD(api) flog_stats_record(api, flog_stats_t0, 0)
 
-static inline void flog_lock_delete(){fs_lock(&flogfs.delete_lock);}
-static inline void flog_unlock_delete(){fs_unlock(&flogfs.delete_lock);}
+/*!
+ @brief Add a call to the latency histogram of a public API
+ @param api The API called
+ @param t0 The time (us) at which the call started
+ @param wait Nonzero to wait for the FS lock, or 0 to drop the call if it's
+             busy
+ */
+FLOG_STATIC void flog_stats_record(flog_stats_api_t api, uint32_t t0,
+                                   uint_fast8_t wait){
+	uint32_t const dt = fs_get_time_us() - t0;
+	flog_latency_hist_t * const hist = &flogfs.stats.api[api];
+	uint_fast8_t bucket = 0;
+	// Bucket by bit length of the duration
+	for(uint32_t x = dt; x && (bucket < FLOG_STATS_NUM_BUCKETS - 1); x >>= 1){
+		bucket += 1;
+	}
+	if(wait){
+		flog_lock_fs();
+	} else if(!flog_trylock_fs()){
+		return;
+	}
+	hist->calls += 1;
+	hist->buckets[bucket] += 1;
+	if(dt > hist->max_us){
+		hist->max_us = dt;
+	}
+	flog_unlock_fs();
+}
+#else
+#define FLOG_STATS_INC(field)
+#define FLOG_STATS_ADD(field, n)
+#define FLOG_STATS_START()
+#define FLOG_STATS_RECORD(api)
+#define FLOG_STATS_TRY_RECORD(api)
+#endif
+//! @}
 
+// Redeclaring a class member is an error, and members can be used before they
+// are declared anyway, so the C++ build skips these
+#if !FLOG_BUILD_CPP
 
 /*!
  @brief Go find a suitable free block to use
+ @param threshold The age threshold the block must meet
+ @param plane The plane to take a block from if one is on hand, or
+              FLOG_PLANE_ANY to carry on round from the last allocation
  @return A block. The index will be FLOG_BLOCK_IDX_INVALID if invalid.
 
  This attempts to claim a block from the block preallocation list and searches
@@ -164,7 +609,33 @@ static inline void flog_unlock_delete(){fs_unlock(&flogfs.delete_lock);}
 
  @note This requires flogfs_t::allocate_lock
  */
-static flog_block_alloc_t flog_allocate_block(int32_t threshold);
+static flog_block_alloc_t flog_allocate_block(int32_t threshold,
+                                              uint_fast8_t plane);
+
+/*!
+ @brief Find a free block at least as worn as the average for data which will
+        stay put
+ @return A block. The index will be FLOG_BLOCK_IDX_INVALID if invalid.
+
+ Free blocks outside the preallocation list are searched first; younger ones
+ found on the way go into the list for everyone else. Failing that, the oldest
+ in the list is taken.
+
+ @note This requires flogfs_t::allocate_lock
+ */
+static flog_block_alloc_t flog_allocate_worn_block();
+
+/*!
+ @brief Take a block out of the free pool for an allocation
+ @retval FLOG_FAILURE if it was left from before flogfs_format_quick() and
+         went bad being erased
+
+ @note This requires flogfs_t::allocate_lock
+ */
+static flog_result_t flog_claim_free_block(flog_block_alloc_t * block);
+
+//! Recompute flogfs_t::mean_free_age after the free pool changes
+static void flog_update_mean_free_age();
 
 /*!
  @brief Iterate the block allocation routine and return the result
@@ -178,7 +649,8 @@ static flog_block_alloc_t flog_allocate_block_iterate();
 
  This is fine for both inode and file blocks
 
- If block == FLOG_BLOCK_IDX_INVALID, it will be returned
+ If block == FLOG_BLOCK_IDX_INVALID, it will be returned. So is anything
+ past the end of the part, which only a torn tail sector can hold.
  */
 static inline flog_block_idx_t
 flog_universal_get_next_block(flog_block_idx_t block);
@@ -193,1417 +665,6027 @@ flog_universal_get_next_block(flog_block_idx_t block);
 static inline void flog_prealloc_iterate();
 
 /*!
- @brief Find a file inode entry
- @param[in] filename The filename to check for
- @param[out] iter An inode iterator -- If nothing is found, this will point to
-                  the next free inode iterator
- @retval Fileinfo with first_block == FLOG_BLOCK_IDX_INVALID if not found
-
- @note This requires the FS lock, \ref flogfs_t::lock
+ @brief Get the spare of a file sector
+ @param batch If not null, the spares from the last page fetched. They are
+              reused, or the whole page is fetched in one transaction.
+ @param spare The destination (may be null when filling only the batch)
  */
-static flog_file_find_result_t flog_find_file(char const * filename,
-                                       flog_inode_iterator_t * iter);
+static void flog_get_file_spare(flog_spare_batch_t * batch,
+                                flog_block_idx_t block, uint16_t sector,
+                                flog_file_sector_spare_t * spare);
 
 /*!
- @brief Open a page (read to flash cache) only if necessary
+ @brief Move a read file to the next sector with data
+ @param batch Optional spare batch (see flog_get_file_spare())
+ @retval FLOG_FAILURE at the end of the file
+
+ This sets the block, sector, offset and sector_remaining_bytes.
  */
-static inline flog_result_t flog_open_page(uint16_t block, uint16_t page);
+static flog_result_t flog_read_file_advance(flog_read_file_t * file,
+                                            flog_spare_batch_t * batch);
 
 /*!
- @brief Open the page corresponding to a sector
- @param block The block
- @param sector The sector you wish to access
+ @brief Read from the sector at a read file's head, checking it first if need
+        be
+ @param n The number of bytes to read, no more than are left in the sector
+ @retval FLOG_FAILURE if the sector failed its check (nothing is read)
+
+ This doesn't move the read head.
+
+ @note This requires the file and flash locks
  */
-static inline flog_result_t flog_open_sector(uint16_t block, uint16_t sector);
+static flog_result_t flog_read_file_sector(flog_read_file_t * file,
+                                           uint8_t * dst, uint16_t n);
 
+#if FLOG_SECTOR_CRC
+/*!
+ @brief Check a file sector against its CRC
+ @param nbytes The number of data bytes in the sector
+ @param data Those bytes if they've already been read, or null to read them
+ @retval FLOG_FAILURE if it doesn't match
 
-static void flog_close_sector();
+ @note This requires the flash lock
+ */
+static flog_result_t flog_check_sector(flog_block_idx_t block, uint16_t sector,
+                                       uint16_t nbytes, uint8_t const * data);
 
 /*!
- @brief Initialize an inode iterator
- @param[in,out] iter The iterator structure
- @param[in] inode0 The first inode block to use
+ @brief Check the sector at a read file's head if it hasn't been yet
+ @param data All of the sector's data if it's already been read, or null
+ @retval FLOG_FAILURE if it failed, which sets flog_read_file_t::corrupt
+
+ @note This requires the file and flash locks
  */
-static void flog_inode_iterator_init(flog_inode_iterator_t * iter,
-                                     flog_block_idx_t inode0);
+static flog_result_t flog_check_file_sector(flog_read_file_t * file,
+                                            uint8_t const * data);
 
 /*!
- @brief Advance an inode iterator to the next entry
- @param[in,out] iter The iterator structure
+ @brief Check the full sectors just read by flogfs_read_pages()
+ @param data What was read
+ @param run The number of sectors, which end at the read head
+ @returns The number of bytes in the sectors before any which failed
 
- This doesn't deal with any allocation. That is done with
- flog_inode_prepare_new.
+ If one fails, the read head goes back to the start of it.
 
- @warning You MUST check on every iteration for the validity of the entry and
- not iterate past an unallocated entry.
+ @note This requires the file and flash locks
  */
-static void flog_inode_iterator_next(flog_inode_iterator_t * iter);
+static uint16_t flog_check_run(flog_read_file_t * file, uint8_t const * data,
+                               uint_fast8_t run);
+#endif
 
 /*!
- @brief Claim a new inode entry as your own.
+ @brief Record the current block of a read file in its skip index, if due
+ */
+static void flog_skip_index_record(flog_read_file_t * file);
 
- @note This requires the @ref flogfs_t::allocate_lock. It might allocate
- something.
+/*!
+ @brief Find a file inode entry
+ @param[in] filename The filename to check for
+ @param[out] iter An inode iterator -- If nothing is found, this will point to
+                  the next free inode iterator
+ @retval Fileinfo with first_block == FLOG_BLOCK_IDX_INVALID if not found
 
- @warning Please be sure that iter points to the first unallocated entry
+ With the file index, only iter->block and iter->sector are meaningful when the
+ file is found.
+
+ @note This requires the inode lock, \ref flogfs_t::inode_lock, and the flash
+       lock
  */
-static flog_result_t flog_inode_prepare_new(flog_inode_iterator_t * iter);
+static flog_file_find_result_t flog_find_file(char const * filename,
+                                       flog_inode_iterator_t * iter);
 
 /*!
- @brief Get the value of the next sector in sequence
- @param sector The previous sector
- @return Next sector
+ @brief Find the end of a file
+ @param first_block The first block of the file
+ @param file_id The file
+ @param[out] tail Where the next write goes and the length so far
 
- Sectors are written and read out of order so this is used to get the correct
- sequence
+ A tail remembered in the file index costs nothing. Otherwise the tail sector
+ of each full block and the spares of the last block are walked, and the
+ result is remembered.
+
+ @note This requires the flash lock and a file not open for writing
  */
-static inline uint16_t flog_increment_sector(uint16_t sector);
+static void flog_file_get_tail(flog_block_idx_t first_block,
+                               flog_file_id_t file_id,
+                               flog_file_tail_t * tail);
 
-static flog_result_t flog_flush_write(flog_write_file_t * file);
+/*!
+ @brief Remember the end of a file in the file index
+ @param tail The tail, or null to forget it while the file changes
+ @note This requires the flash lock. Without the index it does nothing.
+ */
+static void flog_file_set_tail(flog_file_id_t file_id,
+                               flog_file_tail_t const * tail);
 
 /*!
- @brief Add a free block candidate to the preallocation list
+ @brief Get the size of a file as flogfs_size() gives it
+ @note This requires the flash lock, which it may give up briefly while the
+       file is being written
+ */
+static uint32_t flog_file_size(flog_block_idx_t first_block,
+                               flog_file_id_t file_id);
 
- @note This requires the allocation lock
+/*!
+ @brief Set up the parts of a write file which don't depend on where it is
  */
-static void flog_prealloc_push(flog_block_idx_t block,
-                               flog_block_age_t age);
+static void flog_write_file_reset(flog_write_file_t * file);
 
 /*!
- @brief Take the youngest block from the preallocation list
- @retval Index The allocated block index
- @retval FLOG_BLOCK_IDX_INVALID if empty
+ @brief Add the inode entry for a new file and start writing it
+ @param file The write file, set up with flog_write_file_reset()
+ @param filename The name of the file
+ @param flags flog_inode_entry_flags_t for the entry. Entries made with
+              @ref FLOG_INODE_ENTRY_COPY are left out of the file index.
+ @param iter The first free inode entry, left at the new one
+ @note This requires the inode write lock and the flash lock
+ */
+static flog_result_t flog_file_create(flog_write_file_t * file,
+                                      char const * filename, uint8_t flags,
+                                      flog_inode_iterator_t * iter);
 
- @note This requires the allocation lock
+/*!
+ @brief Write out everything a write file holds and settle its last block
+ @note This requires the file and flash locks
  */
-static flog_block_alloc_t flog_prealloc_pop(int32_t threshold);
+static flog_result_t flog_finish_write(flog_write_file_t * file);
 
 /*!
- @brief Invalidate a chain of blocks
- @param base The first block in the chain
+ @brief Remember where a finished write file ends in the file index
+ @param result The result of flog_finish_write(). The end is forgotten if it
+               failed.
  */
-static void
-flog_invalidate_chain(flog_block_idx_t base, flog_file_id_t file_id);
+static void flog_remember_write_tail(flog_write_file_t const * file,
+                                     flog_result_t result);
 
 /*!
- @brief Check for a dirty block and flush it to allow for a new allocation
+ @brief Invalidate a file's inode entry and delete its blocks
+ @param iter The inode entry
+ @param file Where the file is
+ @param filename The name of the file
+ @note This requires the inode write lock and the flash lock
+
+ @retval FLOG_FAILURE The invalidation failed to program, so the blocks were
+         left alone
+ */
+static flog_result_t flog_file_remove(flog_inode_iterator_t const * iter,
+                                      flog_file_find_result_t const * file,
+                                      char const * filename);
 
- @note This requires the allocation lock
+#if FLOG_WEAR_LEVEL_SPREAD
+/*!
+ @brief Find the first free inode entry
+ @note This requires the inode lock and the flash lock
  */
-static void flog_flush_dirty_block();
+static void flog_inode_find_free(flog_inode_iterator_t * iter);
+#endif
 
 /*!
- @brief check to see if a block is sufficiently new against a threshold
- @retval 1 if okay
- @retval 0 if too old
+ @brief Remove a wear leveling copy of a file if it didn't get to replace the
+        original
+ @param iter The copy's inode entry
+ @note This is for cleaning up after an interruption while mounting
  */
-static uint_fast8_t
-flog_age_is_sufficient(int32_t threshold, flog_block_age_t age);
+static void flog_mount_check_copy(flog_inode_iterator_t const * iter);
 
-static flog_result_t flog_commit_file_sector(flog_write_file_t * file,
-                                             uint8_t const * data,
-                                             flog_sector_nbytes_t n);
+/*!
+ @brief Step a listing to its next live file
+ @param[out] entry The file's inode entry
+ @retval 0 at the end of the table or of the files around at the start, or
+         once the listing is stopped
+ @note This requires the inode read lock and the flash lock
+ */
+static uint_fast8_t flog_ls_next(flogfs_ls_iterator_t * iter,
+                                 flog_inode_file_allocation_t * entry);
 
-static flog_timestamp_t flog_block_get_init_timestamp(flog_block_idx_t block);
+#if FLOG_WEAR_LEVEL_SPREAD
+/*!
+ @brief Look at one block in the search for cold data on young blocks
+ @retval 1 if a block was looked at
+ @retval 0 if there's nothing to do until more blocks are allocated, or a
+         file is waiting for flog_wear_level_migrate()
 
-static flog_block_age_t flog_block_get_age(flog_block_idx_t block);
+ A sweep over every block starts once a device's worth of blocks has been
+ allocated since the last one. It finds the youngest file block. If that is
+ more than @ref FLOG_WEAR_LEVEL_SPREAD younger than the average free block,
+ its file is picked to move.
 
-static void flog_get_file_tail_sector(flog_block_idx_t block,
-                                      flog_file_tail_sector_header_t * header);
+ @note This requires the flash lock
+ */
+static uint_fast8_t flog_wear_level_scan_step();
 
-static void flog_get_file_init_sector(flog_block_idx_t block,
-                                      flog_file_init_sector_header_t * header);
+/*!
+ @brief Move the file picked by the last sweep onto worn blocks
 
-static void
-flog_get_universal_tail_sector(flog_block_idx_t block,
-                               flog_universal_tail_sector_t * header);
+ The file is copied to a new inode entry marked @ref FLOG_INODE_ENTRY_COPY
+ with its blocks from flog_allocate_worn_block(). Then the original is
+ removed, which frees its young blocks. Files open at the time are skipped.
+ Nothing moves while a listing is open (see flogfs_start_ls()).
 
-static flog_block_type_t
-flog_get_block_type(flog_block_idx_t block);
+ @note This takes the inode write lock and the flash lock
+ */
+static void flog_wear_level_migrate();
 
-static flog_file_id_t
-flog_block_get_file_id(flog_block_idx_t block);
+/*!
+ @brief Check whether a file is waiting to be moved and no listing holds it
+        up
+ */
+static uint_fast8_t flog_wear_level_pending();
+#endif
 
-static void
-flog_write_block_stat(flog_block_idx_t block,
-                      flog_block_stat_sector_t const * stat);
+/*!
+ @brief Open a file to write, creating it if need be
+ @param file The write file, set up with flog_write_file_reset() and for
+             compression if wanted
+ @retval FLOG_FAILURE if the file can't be created, or exists and is
+         compressed if file isn't or the other way round
+ */
+static flog_result_t flog_open_write(flog_write_file_t * file,
+                                     char const * filename);
 
-static void
-flog_get_block_stat(flog_block_idx_t block, flog_block_stat_sector_t * stat);
+#if FLOG_ENABLE_COMPRESSION
+/*!
+ @brief Find where the next frame of a compressed file goes
+ @param[out] space The room for it, up to the end of the sector
+ @return Where to put the frame, or null if a full sector couldn't be written
 
-//! @}
+ Frames go in the page buffer if the file is filling one, and otherwise in the
+ sector buffer.
 
+ @note This requires the file and flash locks
+ */
+static uint8_t * flog_frame_space(flog_write_file_t * file, uint16_t * space);
 
-///////////////////////////////////////////////////////////////////////////////
-// Public implementations
-///////////////////////////////////////////////////////////////////////////////
+/*!
+ @brief Take n bytes put at flog_frame_space() into a file, writing whatever
+        they fill
+ */
+static flog_result_t flog_frame_commit(flog_write_file_t * file, uint16_t n);
 
-flog_result_t flogfs_init(){
-	// Initialize locks
-	fs_lock_init(&flogfs.allocate_lock);
-	fs_lock_init(&flogfs.lock);
-	fs_lock_init(&flogfs.delete_lock);
+#if FLOG_WEAR_LEVEL_SPREAD
+/*!
+ @brief Write an encoded frame, padding out the sector first if it won't fit
+ @param frame The frame header and its data
+ @param n The size of the frame, up to @ref FLOG_FRAME_MAX
+ */
+static flog_result_t flog_write_frame(flog_write_file_t * file,
+                                      uint8_t const * frame, uint16_t n);
 
-	flogfs.state = FLOG_STATE_RESET;
-	flogfs.cache_status.page_open = 0;
-	flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
-	return flash_init();
-}
+/*!
+ @brief Write the frames read from one sector of a compressed file
+ @param data The data of the sector
+ @param n The number of bytes in data
 
-flog_result_t flogfs_format(){
-	flog_block_idx_t i;
-	flog_block_idx_t first_valid = FLOG_BLOCK_IDX_INVALID;
+ This is how a compressed file is copied. The frames are repacked into the
+ sectors of the copy without being decoded.
+ */
+static flog_result_t flog_write_frames(flog_write_file_t * file,
+                                       uint8_t const * data, uint16_t n);
+#endif
+#endif
 
-	union {
-		flog_inode_init_sector_t main_buffer;
-		flog_inode_init_sector_spare_t spare_buffer;
-	};
-	
-	struct {
-		flog_block_stat_sector_t stat;
-		char key[sizeof(flog_block_stat_key)];
-	} stat_sector;
-	
-	flash_lock();
-	flog_lock_fs();
-	
-	if(flogfs.state == FLOG_STATE_MOUNTED){
-		flogfs.state = FLOG_STATE_RESET;
-	}
+/*!
+ @brief Move a read file to the nearest skip index entry at or before index
+ @retval 1 if the file moved to a later block
+ @retval 0 if no entry is closer than the current block
+ */
+static uint_fast8_t flog_skip_index_seek(flog_read_file_t * file,
+                                         uint32_t index);
 
-	for(i = 0; i < FS_NUM_BLOCKS; i++){
-		flog_open_page(i, 0);
-		if(FLOG_SUCCESS == flash_block_is_bad()){
-			continue;
-		}
-		flash_read_sector((uint8_t *)&stat_sector, FLOG_BLK_STAT_SECTOR,
-		                  0, sizeof(stat_sector));
-		if(memcmp(stat_sector.key, flog_block_stat_key,
-		   sizeof(flog_block_stat_key)) != 0){
-			// Actually need to initialize this block
-			stat_sector.stat.age = 0;
-			memcpy(stat_sector.key, flog_block_stat_key,
-			       sizeof(flog_block_stat_key));
-		}
-		stat_sector.stat.next_block = FLOG_BLOCK_IDX_INVALID;
-		stat_sector.stat.next_age = FLOG_BLOCK_AGE_INVALID;
-		stat_sector.stat.timestamp = 0;
-		flog_close_sector();
-		// Go erase it
-		if(FLOG_FAILURE == flash_erase_block(i)){
-			flog_unlock_fs();
-			flash_unlock();
-			flash_debug_error("FLogFS:" LINESTR);
-			return FLOG_FAILURE;
-		}
-		flog_open_sector(i, FLOG_BLK_STAT_SECTOR);
-		flash_write_sector((uint8_t *)&stat_sector, FLOG_BLK_STAT_SECTOR,
-		                   0, sizeof(stat_sector));
-		flash_commit();
-		if(first_valid == FLOG_BLOCK_IDX_INVALID){
-			first_valid = i;
-		}
-	}
+#if FLOG_ENABLE_COMPRESSION
+/*!
+ @brief Take data for a compressed file, compressing each full buffer
+ @returns The number of bytes taken
+ @note This requires the file and flash locks
+ */
+static uint32_t flog_compress_write(flog_write_file_t * file,
+                                    uint8_t const * src, uint32_t nbytes);
 
-	// Really just assuming that at least 1 valid block was found
+/*!
+ @brief Compress the start of a file's compress buffer into one frame
+ @retval FLOG_FAILURE if the frame couldn't be written (out of space)
 
-	// Write the first file table
-	flog_open_sector(first_valid, FLOG_INIT_SECTOR);
-	main_buffer.timestamp = 0;
-	main_buffer.previous = FLOG_BLOCK_IDX_INVALID;
-	flash_write_sector((const uint8_t *)&main_buffer,
-	                   FLOG_INIT_SECTOR, 0, sizeof(main_buffer));
-	spare_buffer.inode_index = 0;
-	spare_buffer.type_id = FLOG_BLOCK_TYPE_INODE;
-	flash_write_spare((const uint8_t *)&spare_buffer, FLOG_INIT_SECTOR);
-	flash_commit();
+ The frame takes as much of the buffer as fits in the rest of the sector.
+ */
+static flog_result_t flog_compress_step(flog_write_file_t * file);
 
-	flog_unlock_fs();
-	flash_unlock();
-	return FLOG_SUCCESS;
-}
+/*!
+ @brief Compress and write everything in a file's compress buffer
+ */
+static flog_result_t flog_compress_flush(flog_write_file_t * file);
 
+/*!
+ @brief Encode a frame from the start of a file's compress buffer
+ @param dst Where the frame goes
+ @param space The room at dst, at least @ref FLOG_FRAME_MIN_SPACE
+ @param[in,out] n The number of bytes in the buffer, then the number taken
+ @returns The size of the frame, header included
 
-flog_result_t flogfs_mount(){
-	uint32_t i, done_scanning;
+ The frame is stored as it was given if the codec can't make it smaller.
+ */
+static uint16_t flog_frame_encode(flog_write_file_t const * file,
+                                  uint8_t * dst, uint16_t space, uint16_t * n);
 
-	////////////////////////////////////////////////////////////
-	// Data structures
-	////////////////////////////////////////////////////////////
+/*!
+ @brief Check and decode the data of a frame
+ @param header The frame header
+ @param src The encoded data after it
+ @param dst header->raw_len bytes for the decoded data
+ */
+static flog_result_t flog_frame_decode(flog_frame_header_t const * header,
+                                       uint8_t const * src, uint8_t * dst);
 
-	// Use in search for highest allocation timestamp
-	struct {
-		flog_block_idx_t block;
-		flog_block_age_t age;
-		union {
-		flog_file_id_t file_id;
-		flog_block_idx_t previous_inode;
-		};
-		flog_timestamp_t timestamp;
-		flog_block_type_t block_type;
-	} last_allocation;
+/*!
+ @brief LZ compress as much of src as fits in dst
+ @param[in,out] n The number of bytes in src, then the number taken
+ @param cap The room in dst
+ @returns The number of bytes in dst
+
+ Each sequence is a token (literal count and match length less 4 in a nibble
+ each, 15 meaning more follow in bytes until one isn't 255), the literals, and
+ a little-endian match offset. The last sequence may stop after its literals.
+ */
+static uint16_t flog_lz_encode(uint8_t const * src, uint16_t * n, uint8_t * dst,
+                               uint16_t cap);
 
-	struct {
-		flog_block_idx_t first_block, last_block;
-		flog_file_id_t   file_id;
-		flog_timestamp_t timestamp;
-	} last_deletion;
+/*!
+ @brief Decode flog_lz_encode() data of exactly raw_len bytes
+ */
+static flog_result_t flog_lz_decode(uint8_t const * src, uint16_t n,
+                                    uint8_t * dst, uint16_t raw_len);
 
-	// Find the freshest block to allocate. Why not?
-	struct {
-		flog_block_idx_t block;
-		flog_block_age_t age;
-	} min_age_block;
+/*!
+ @brief Delta encode as many 16-bit samples from src as fit in dst
+ @param stride The distance in samples of the one each is predicted from
+ @param[in,out] n The number of bytes in src, then the number taken
+ @param cap The room in dst
+ @returns The number of bytes in dst
+
+ Each difference is zigzag encoded and written as a varint of 7 bits a byte.
+ The first stride samples are predicted from 0.
+ */
+static uint16_t flog_delta_encode(uint8_t stride, uint8_t const * src,
+                                  uint16_t * n, uint8_t * dst, uint16_t cap);
 
-	flog_block_idx_t inode0_idx, new_inode0_idx;
-	flog_timestamp_t inode0_ts;
+/*!
+ @brief Decode flog_delta_encode() data of exactly raw_len bytes
+ */
+static flog_result_t flog_delta_decode(uint8_t stride, uint8_t const * src,
+                                       uint16_t n, uint8_t * dst,
+                                       uint16_t raw_len);
 
-	// Find the maximum block age
-	flog_block_age_t max_block_age;
+/*!
+ @brief Decode the next frame of a compressed read file
+ @param skip_to Frames which end at or before this offset are passed over
+                without being decoded
+ @retval FLOG_FAILURE at the end of the file or a frame that doesn't decode
 
-	flog_inode_iterator_t inode_iter;
+ This is only called once the last frame has been read. The read head moves
+ over the frames passed.
 
-	////////////////////////////////////////////////////////////
-	// Flexible buffers for flash reads
-	////////////////////////////////////////////////////////////
+ @note This requires the file and flash locks
+ */
+static flog_result_t flog_read_frame(flog_read_file_t * file, uint32_t skip_to);
 
-	union {
-		uint8_t init_sector_buffer;
-		flog_file_init_sector_header_t file_init_sector_header;
-		flog_inode_init_sector_t inode_init_sector;
-		flog_inode_file_invalidation_t inode_file_invalidation_sector;
-	};
+/*!
+ @brief Decode a frame into the volume's frame buffer for a read file
+ @param header The header at file->frame_block, frame_sector and frame_offset
+ @note This requires the flash lock
+ */
+static flog_result_t flog_frame_load(flog_read_file_t * file,
+                                     flog_frame_header_t const * header);
 
-	union {
-		uint8_t sector_buffer;
-		flog_file_tail_sector_header_t file_tail_sector_header;
-		flog_inode_file_allocation_header_t inode_file_allocation_sector;
-		flog_universal_invalidation_header_t universal_invalidation_header;
-		flog_block_stat_sector_t stat_sector;
-	};
+/*!
+ @brief Get the decoded frame at a compressed file's read head
+ @returns The frame, or null if it can't be decoded again
 
-	union {
-		uint8_t spare_buffer;
-		flog_inode_init_sector_spare_t inode_spare0;
-		flog_file_sector_spare_t file_spare0;
-	};
-	
-	flog_universal_tail_sector_t universal_tail_sector;
+ If another file has decoded a frame since, this one is decoded again from the
+ flash.
 
-	flog_block_age_t age;
+ @note This requires the flash lock
+ */
+static uint8_t const * flog_frame_data(flog_read_file_t * file);
 
-	////////////////////////////////////////////////////////////
-	// Claim the disk and get this show started
-	////////////////////////////////////////////////////////////
+/*!
+ @brief flogfs_read() for a compressed file
+ */
+static uint32_t flog_read_compressed(flog_read_file_t * file, uint8_t * dst,
+                                     uint32_t nbytes);
 
-	flog_lock_fs();
+/*!
+ @brief flogfs_seek() for a compressed file
+ @note This requires the file and flash locks
+ */
+static flog_result_t flog_seek_frames(flog_read_file_t * file, uint32_t index);
+#endif
 
-	if(flogfs.state == FLOG_STATE_MOUNTED){
-		flog_unlock_fs();
-		return FLOG_SUCCESS;
-	}
+/*!
+ @brief Hash a filename for the file index and inode entry spares
+ */
+static uint16_t flog_filename_hash(char const * filename);
 
-	flash_lock();
-	
-	for(uint32_t i = 0; i < FS_NUM_BLOCKS/8; i++){
-		flogfs.free_block_bitmap[i] = 0;
-	}
-	
-	////////////////////////////////////////////////////////////
-	// Initialize data structures
-	////////////////////////////////////////////////////////////
+#if FS_FILE_INDEX_SIZE
+/*!
+ @brief Empty the file index
+ @note The index stays incomplete until mount finishes the inode pass
+ */
+static void flog_file_index_clear();
 
-	last_allocation.block = FLOG_BLOCK_IDX_INVALID;
-	last_allocation.timestamp = 0;
-	last_allocation.age = 0;
+/*!
+ @brief Add a live inode entry to the file index
+ @param hash flog_filename_hash() of the file name
+ @param iter The inode iterator pointing to the entry
 
-	last_deletion.timestamp = 0;
-	last_deletion.file_id = FLOG_FILE_ID_INVALID;
+ If the table is full the index is marked incomplete and lookups that miss fall
+ back to walking the inode table.
+ */
+static void flog_file_index_add(uint16_t hash,
+                                flog_inode_iterator_t const * iter,
+                                flog_block_idx_t first_block,
+                                flog_file_id_t file_id);
 
-	flogfs.num_free_blocks = 0;
-	flogfs.t_allocation_ceiling = FLOG_TIMESTAMP_INVALID;
-	flogfs.max_file_id = 0;
-	
-	flogfs.cache_status = {0};
-	
-	flogfs.read_head = nullptr;
-	flogfs.write_head = nullptr;
-	flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+/*!
+ @brief Remove an inode entry from the file index
+ */
+static void flog_file_index_remove(char const * filename,
+                                   flog_inode_iterator_t const * iter);
 
-	min_age_block.age = 0xFFFFFFFF;
-	min_age_block.block = FLOG_BLOCK_IDX_INVALID;
+/*!
+ @brief Look up a file in the index by ID
+ @return The entry, or null if it isn't indexed
+ */
+static flog_file_index_entry_t * flog_file_index_find_id(flog_file_id_t id);
+#endif
 
-	inode0_idx = FLOG_BLOCK_IDX_INVALID;
-	new_inode0_idx = FLOG_BLOCK_IDX_INVALID;
-	inode0_ts = FLOG_TIMESTAMP_INVALID;
+/*!
+ @brief Open a page (read to flash cache) only if necessary
+ */
+static inline flog_result_t flog_open_page(uint16_t block, uint16_t page);
 
-	max_block_age = 0;
+/*!
+ @brief Open the page corresponding to a sector
+ @param block The block
+ @param sector The sector you wish to access
+ */
+static inline flog_result_t flog_open_sector(uint16_t block, uint16_t sector);
 
-	////////////////////////////////////////////////////////////
-	// First, iterate through all blocks to find:
-	// - Most recent allocation time in a file block
-	// - Number of free blocks
-	// - Some free blocks that are fair to use
-	// - Oldest block age
-	// - Inode table 0
-	////////////////////////////////////////////////////////////
-	for(i = 0; i < FS_NUM_BLOCKS; i++){
-		// Everything can be determined from page 0
-		if(FLOG_FAILURE == flash_open_page(i, 0)){
-			continue;
-		}
-		if(FLOG_SUCCESS == flash_block_is_bad()){
-			flash_debug_warn("FLogFS:" LINESTR);
-			continue;
-		}
-		// Read the sector 0 spare to identify valid blocks
-		flash_read_spare((uint8_t *)&spare_buffer, FLOG_INIT_SECTOR);
-		
-		switch(inode_spare0.type_id) {
-		case FLOG_BLOCK_TYPE_INODE:
-			flog_get_universal_tail_sector(i, &universal_tail_sector);
-			if(inode_spare0.inode_index == 0){
-				// Found the original gangster!
-				if(inode0_idx == FLOG_BLOCK_IDX_INVALID){
-					inode0_idx = i;
-				} else if(flog_block_get_init_timestamp(inode0_idx) >
-				          flog_block_get_init_timestamp(i)){
-					// This is the older inode chain
-					new_inode0_idx = inode0_idx;
-					inode0_idx = i;
-				} else {
-					// This is the NEW inode chain!
-					new_inode0_idx = i;
-				}
-			} else {
-				// Not the first, but valid!
-			}
-	
-			if((universal_tail_sector.timestamp != FLOG_TIMESTAMP_INVALID) &&
-			   (universal_tail_sector.timestamp > last_allocation.timestamp)){
-				// This is now the most recent allocation timestamp!
-				last_allocation.previous_inode = i;
-				last_allocation.block_type = FLOG_BLOCK_TYPE_INODE;
-				goto update_last_allocation;
-			}
-			break;
-		case FLOG_BLOCK_TYPE_FILE:
-			flog_get_universal_tail_sector(i, &universal_tail_sector);
+
+static void flog_close_sector();
+
+/*!
+ @brief Make sure the page selected by flog_open_page() is in the flash cache
+ */
+static flog_result_t flog_load_page();
+
+#if FLOG_MOUNT_PREFETCH || FLOG_TAIL_PREFETCH
+/*!
+ @brief Start loading a page that is about to be opened
+ @param block The block
+ @param page The page
+
+ The open page can still be read meanwhile. Opening some other page first
+ just waits for this one to finish loading.
+ */
+static void flog_prefetch_page(uint16_t block, uint16_t page);
+#endif
+
+/*!
+ @brief Read data from a sector in the open page
+ */
+static flog_result_t flog_read_sector(uint8_t * dst, uint8_t sector,
+                                      uint16_t offset, uint16_t n);
+
+/*!
+ @brief Read the spare data for a sector in the open page
+ */
+static flog_result_t flog_read_spare(uint8_t * dst, uint8_t sector);
+
+/*!
+ @brief Read the spare data for every sector in the open page at once
+ @param dst FS_SECTORS_PER_PAGE * 4 bytes
+ */
+static flog_result_t flog_read_spares(uint8_t * dst);
+
+/*!
+ @brief Write data to a sector in the open page
+ @note This doesn't commit the transaction
+ */
+static void flog_write_sector(uint8_t const * src, uint8_t sector,
+                              uint16_t offset, uint16_t n);
+
+/*!
+ @brief Write the spare data for a sector in the open page
+ @note This doesn't commit the transaction
+ */
+static void flog_write_spare(uint8_t const * src, uint8_t sector);
+
+#if FLOG_SECTOR_CRC
+/*!
+ @brief Read the CRC of a sector in the open page
+ */
+static uint32_t flog_read_spare_check(uint8_t sector);
+
+/*!
+ @brief Write the CRC of a sector in the open page
+ @note This doesn't commit the transaction
+ */
+static void flog_write_spare_check(uint32_t crc, uint8_t sector);
+
+/*!
+ @brief Update a running CRC of sector data (start with 0)
+
+ This is flog_crc32(), or the port's flash_crc32() with @ref FLOG_SECTOR_CRC 2.
+ */
+static uint32_t flog_sector_crc(uint32_t crc, uint8_t const * data,
+                                uint32_t n);
+#endif
+
+/*!
+ @brief Check the bad block marker of the open block
+ @retval FLOG_SUCCESS if the block is bad
+ */
+static flog_result_t flog_block_is_bad();
+
+/*!
+ @brief Program the open page
+ @retval FLOG_FAILURE if it failed and no spare could take over the block
+
+ With @ref FLOG_ASYNC_FLASH a failure only shows up in flog_flash_wait_plane(),
+ after the data has gone, so this always succeeds. Either way the failure is
+ left in flogfs_t::lost_programs for whoever was writing.
+ */
+static flog_result_t flog_commit();
+
+/*!
+ @brief Erase a block
+ @retval FLOG_FAILURE if it failed and no spare could take over the block
+ */
+static flog_result_t flog_erase_block(uint16_t block);
+
+/*!
+ @brief Deal with a page program the flash reported as failed
+ @param block The block programmed
+ @param page The page programmed
+ @param in_cache Nonzero if the flash cache still holds what was programmed
+ @retval FLOG_FAILURE if nothing could take over. Losing data this way counts
+         in flogfs_t::lost_programs, and losing a checkpoint sets
+         flogfs_t::checkpoint_failed.
+ */
+static flog_result_t flog_program_failed(flog_block_idx_t block,
+                                         uint16_t page, uint_fast8_t in_cache);
+
+/*!
+ @brief Take a block out of use after the flash failed on it
+ @param block The block
+ @param page The page which failed to program, or FS_PAGES_PER_BLOCK if the
+        block failed to erase
+ @param in_cache Nonzero if the flash cache still holds what the page was to
+        be programmed with. Otherwise the page is taken as it reads back.
+ @retval FLOG_SUCCESS A spare now holds what the block did and stands in for it
+ @retval FLOG_FAILURE There was no spare. The block stays where it is, but it
+         won't go back into the free pool.
+
+ Blocks can't just be swapped for another in the chains that lead to them,
+ since those were programmed once. Instead the spare takes over the block
+ index, and flog_block_physical() sends every access there.
+ */
+static flog_result_t flog_bad_block(flog_block_idx_t block, uint16_t page,
+                                    uint_fast8_t in_cache);
+
+/*!
+ @brief Put the bad block marker on a block
+ @param block The block on the flash, which may be standing in for another
+ */
+static void flog_set_bad_block(flog_block_idx_t block);
+
+/*!
+ @brief Forget all bad blocks and spares (before a mount or format finds them)
+ */
+static void flog_bad_block_reset();
+
+#if FLOG_BAD_BLOCK_SPARES
+/*!
+ @brief Copy a block onto a spare for flog_bad_block()
+ @param block The block to stand in for
+ @param old Where its contents are now
+ @param spare The spare
+ @param failed The page which failed to program, or FS_PAGES_PER_BLOCK
+ @param failed_src Where to read the failed page, or FLOG_BLOCK_IDX_INVALID to
+        program the flash cache as it is. This is set to spare once it has the
+        page.
+ */
+static flog_result_t flog_bad_block_copy(flog_block_idx_t block,
+                                         flog_block_idx_t old,
+                                         flog_block_idx_t spare,
+                                         uint16_t failed,
+                                         flog_block_idx_t * failed_src);
+
+/*!
+ @brief Check if the page in the flash cache has never been programmed
+ */
+static uint_fast8_t flog_flash_page_is_blank();
+
+/*!
+ @brief Write the stamp of a spare or stand-in into the open page
+ @param replaces The block it stands in for, or FLOG_BLOCK_IDX_INVALID
+ @note This doesn't commit the transaction
+ */
+static void flog_bad_block_stamp(flog_block_idx_t replaces);
+
+/*!
+ @brief Take a spare out of the bad block table
+ @return The spare, or FLOG_BLOCK_IDX_INVALID if there are none
+ */
+static flog_block_idx_t flog_bad_block_take_spare();
+
+/*!
+ @brief Record a block as standing in for another in the bad block table
+ */
+static void flog_bad_block_set(flog_block_idx_t bad, flog_block_idx_t block);
+
+/*!
+ @brief Add a spare to the bad block table and take it out of use
+ @note Without room in the table it's only taken out of use
+
+ A free block may have a stand-in from going bad before. It's the stand-in
+ that becomes the spare then, and the block is left out of use for good.
+ */
+static void flog_bad_block_add_spare(flog_block_idx_t block);
+
+/*!
+ @brief Remove a spare from the bad block table
+ @note It stays out of use
+ */
+static void flog_bad_block_drop_spare(flog_block_idx_t block);
+
+//! Check if a block is a spare in the bad block table
+static uint_fast8_t flog_bad_block_is_spare(flog_block_idx_t block);
+
+/*!
+ @brief Erase a block for use as a spare and stamp it
+ @param block The spare on the flash. Nothing stands in for a spare, so this
+        is where every access goes.
+ */
+static flog_result_t flog_bad_block_prepare(flog_block_idx_t block);
+
+/*!
+ @brief Set aside another spare if there are too few
+ @return Nonzero if one was set aside, so there may be more to do
+ @note This must be called with the allocate lock held
+ */
+static uint_fast8_t flog_bad_block_refill();
+
+/*!
+ @brief Prepare the spares again which were found not to be blank
+
+ A spare which was being copied to when power failed has a stamp for the block
+ it was going to stand in for. That block never stopped being used.
+ */
+static void flog_bad_block_check_spares();
+
+/*!
+ @brief Take in a spare or stand-in found by the mount scan
+ @param block The block with the stamp
+ @param replaces The block it stands in for, or FLOG_BLOCK_IDX_INVALID
+ @return Nonzero if the scan has to look at replaces again
+ */
+static uint_fast8_t flog_mount_bad_block_stamp(flog_block_idx_t block,
+                                               flog_block_idx_t replaces);
+#endif
+
+/*!
+ @brief Wait for a program started by flog_commit() on one plane to finish
+
+ With @ref FLOG_ASYNC_FLASH, flog_commit() returns as soon as the program is
+ started. Every other access to that plane waits here first.
+ */
+static void flog_flash_wait_plane(uint_fast8_t plane);
+
+/*!
+ @brief Wait for programs on every plane to finish
+
+ This is for the calls which promise that data is on the flash when they
+ return.
+ */
+static void flog_flash_wait();
+
+/*!
+ @brief Forget all cached page contents
+ */
+static void flog_page_cache_clear();
+
+#if FLOG_ENABLE_CHECKPOINT
+/*!
+ @brief Read a run of bytes which may span several sectors of the open page
+ @param offset The byte offset from the start of the page
+ */
+static void flog_read_page_data(uint8_t * dst, uint16_t offset, uint16_t n);
+
+/*!
+ @brief Write a run of bytes which may span several sectors of the open page
+ @param offset The byte offset from the start of the page
+ @note This doesn't commit the transaction
+ */
+static void flog_write_page_data(uint8_t const * src, uint16_t offset,
+                                 uint16_t n);
+#endif
+
+#if FLOG_ENABLE_CHECKPOINT || (FLOG_SECTOR_CRC == 1)
+/*!
+ @brief Update a running CRC32
+ @param crc The CRC so far (start with 0)
+
+ This goes a byte at a time, or eight with @ref FLOG_SECTOR_CRC 1.
+ */
+static uint32_t flog_crc32(uint32_t crc, uint8_t const * data, uint32_t n);
+#endif
+
+/*!
+ @brief Return a block to the free pool
+ */
+static void flog_free_block(flog_block_idx_t block, flog_block_age_t age);
+
+/*!
+ @brief Take a block that turned out to be in use out of the free pool
+ @note This is only for fixing up incomplete allocations while mounting
+ */
+static void flog_mount_claim_block(flog_block_idx_t block,
+                                   flog_block_age_t age);
+
+#if FLOG_ENABLE_CHECKPOINT
+/*!
+ @brief Reset checkpoint state to indicate no checkpoint blocks
+ */
+static void flog_checkpoint_reset();
+
+/*!
+ @brief Stop using checkpoints after the flash failed on one of their blocks
+ @param block The checkpoint block
+
+ Whatever was lost can't be replayed, so the block gets its marker. The next
+ mount won't find all the checkpoint blocks and does a full scan.
+ */
+static void flog_checkpoint_give_up(flog_block_idx_t block);
+
+/*!
+ @brief Restore the allocation state from the checkpoint blocks
+ @param[out] last_alloc The most recent journaled allocation (block will be
+                        FLOG_BLOCK_IDX_INVALID and age 0 if there was none)
+ @param[out] last_alloc_previous The block to point to last_alloc
+ @retval FLOG_SUCCESS The free bitmap, block counts, t, max_file_id, inode0 and
+                      allocate_head were restored
+ @retval FLOG_FAILURE A full scan is required
+
+ This also locates the checkpoint blocks so that new records can be written
+ even if the existing ones can't be trusted.
+ */
+static flog_result_t
+flog_checkpoint_restore(flog_checkpoint_journal_block_t * last_alloc,
+                        flog_block_idx_t * last_alloc_previous);
+
+/*!
+ @brief Write a new record of the complete allocation state
+ @note This requires the allocation lock
+ */
+static void flog_checkpoint_write();
+#endif
+
+/*!
+ @brief Journal the allocation of a block
+ @param block The newly-allocated block
+ @param previous The block whose tail sector will point to it, if any
+ @note This requires the allocation lock. It must be called after
+       flog_allocate_block() and before anything points to the block.
+ */
+static void flog_checkpoint_journal_alloc(flog_block_alloc_t const * block,
+                                          flog_block_idx_t previous);
+
+/*!
+ @brief Queue the freeing of a block to be journaled
+ @note This must be called after the block is erased
+ */
+static void flog_checkpoint_journal_free(flog_block_idx_t block,
+                                         flog_block_age_t age);
+
+/*!
+ @brief Write any queued journal entries
+ */
+static void flog_checkpoint_journal_flush();
+
+#if FLOG_BAD_BLOCK_SPARES
+/*!
+ @brief Journal a block set aside as a spare
+ @note This must be called after it's in the bad block table and before it's
+       erased
+ */
+static void flog_checkpoint_journal_spare(flog_block_alloc_t const * block);
+#endif
+
+/*!
+ @brief Journal a block gone bad
+ @param block The block
+ @param spare The spare now standing in for it, or FLOG_BLOCK_IDX_INVALID
+ @note This must be called after the copy and before the bad block marker
+ */
+static void flog_checkpoint_journal_bad(flog_block_idx_t block,
+                                        flog_block_idx_t spare);
+
+/*!
+ @brief Initialize an inode iterator
+ @param[in,out] iter The iterator structure
+ @param[in] inode0 The first inode block to use
+ */
+static void flog_inode_iterator_init(flog_inode_iterator_t * iter,
+                                     flog_block_idx_t inode0);
+
+/*!
+ @brief Advance an inode iterator to the next entry
+ @param[in,out] iter The iterator structure
+
+ This doesn't deal with any allocation. That is done with
+ flog_inode_prepare_new.
+
+ If the last entry of a block is used but the next block was never linked
+ (the program failed), the iterator is left past the end of the block, where
+ the entry reads as free.
+
+ @warning You MUST check on every iteration for the validity of the entry and
+ not iterate past an unallocated entry.
+ */
+static void flog_inode_iterator_next(flog_inode_iterator_t * iter);
+
+/*!
+ @brief Claim a new inode entry as your own.
+
+ @note This requires the @ref flogfs_t::allocate_lock. It might allocate
+ something.
+
+ @warning Please be sure that iter points to the first unallocated entry
+
+ @retval FLOG_FAILURE if there's no block for the table to grow into, or the
+         link to it failed to program. Nothing can be added past an iterator
+         left at the end of a block either.
+ */
+static flog_result_t flog_inode_prepare_new(flog_inode_iterator_t * iter);
+
+/*!
+ @brief Find out what the inode entry at an iterator holds
+ @param iter The entry
+ @param[out] name_hash The file name hash for @ref FLOG_INODE_ENTRY_LIVE
+ @param[out] flags The flog_inode_entry_flags_t of a live entry (0 if it has
+                   no summary), or null if not wanted
+ @return The state of the entry
+
+ Entries in the summary format are answered from their two spares, so a scan
+ only reads the sectors of live files it is interested in. Older entries fall
+ back to reading the file ID and invalidation timestamp. So does an entry
+ whose program failed before its spare, which is taken as deleted if what did
+ make it can't be a file.
+ */
+static flog_inode_entry_state_t
+flog_inode_get_entry_state(flog_inode_iterator_t const * iter,
+                           uint16_t * name_hash, uint8_t * flags);
+
+/*!
+ @brief Get the value of the next sector in sequence
+ @param sector The previous sector
+ @return Next sector
+
+ Sectors are written and read out of order so this is used to get the correct
+ sequence
+ */
+static inline uint16_t flog_increment_sector(uint16_t sector);
+
+static flog_result_t flog_flush_write(flog_write_file_t * file);
+
+/*!
+ @brief Add a free block candidate to the preallocation list
+
+ If the list is full, the oldest entry makes way for a younger block.
+ Invalid blocks and blocks already in the list are ignored.
+
+ @note This requires the allocation lock
+ */
+static void flog_prealloc_push(flog_block_idx_t block,
+                               flog_block_age_t age);
+
+/*!
+ @brief Take the youngest block from the preallocation list
+ @param threshold The age threshold the block must meet
+ @param plane Take the youngest block on this plane instead if it meets the
+              threshold (or FLOG_PLANE_ANY)
+ @retval Index The allocated block index
+ @retval FLOG_BLOCK_IDX_INVALID if empty or the youngest block is too old
+
+ @note This requires the allocation lock
+ */
+static flog_block_alloc_t flog_prealloc_pop(int32_t threshold,
+                                            uint_fast8_t plane);
+
+/*!
+ @brief Take an entry out of the preallocation list
+ @param i The heap index of the entry
+
+ @note This requires the allocation lock
+ */
+static void flog_prealloc_take(uint16_t i);
+
+/*!
+ @brief Drop a block from the preallocation list if it's there
+
+ @note This requires the allocation lock
+ */
+static void flog_prealloc_remove(flog_block_idx_t block);
+
+//! @brief Empty the preallocation list
+static void flog_prealloc_reset();
+
+#if FLOG_DELETE_QUEUE_LEN == 0
+/*!
+ @brief Invalidate a chain of blocks
+ @param base The first block in the chain
+ */
+static void
+flog_invalidate_chain(flog_block_idx_t base, flog_file_id_t file_id);
+#endif
+
+/*!
+ @brief Delete a file block chain now or queue it for later
+ @param base The first block
+ @param file_id The ID of the file that owns the chain
+
+ With @ref FLOG_DELETE_QUEUE_LEN this returns without erasing anything
+ unless the queue is full.
+ */
+static void flog_delete_chain(flog_block_idx_t base, flog_file_id_t file_id);
+
+/*!
+ @brief Erase the next block of a chain being deleted
+ @param erased The block erased, which is now the caller's to free or use
+ @retval 1 if a block was erased
+ @retval 0 once the chain is done
+
+ The stat sector of the erased block records the next block of the chain and
+ when it was erased, so an interrupted deletion can be followed on the next
+ mount even if the block has been used again since.
+
+ @note This requires flogfs_t::delete_lock
+ */
+static uint_fast8_t flog_deletion_step(flog_deletion_t * deletion,
+                                       flog_block_alloc_t * erased);
+
+/*!
+ @brief Finish a deletion found incomplete when mounting
+ @param base The first block of the chain
+ @param file_id The ID of the deleted file
+ @param timestamp When the file was deleted
+ */
+static void flog_resume_deletion(flog_block_idx_t base,
+                                 flog_file_id_t file_id,
+                                 flog_timestamp_t timestamp);
+
+/*!
+ @brief Free a block erased by a deletion if that was lost in a crash
+ @param block_stat The block's stat sector
+
+ @note This requires flogfs_t::delete_lock
+ */
+static void
+flog_reclaim_erased_block(flog_block_idx_t block,
+                          flog_block_stat_sector_t const * block_stat);
+
+#if FLOG_DELETE_QUEUE_LEN
+/*!
+ @brief Erase and free one block for the oldest queued deletion
+ @retval 1 if there is still work in the queue
+
+ @note This requires flogfs_t::delete_lock
+ */
+static uint_fast8_t flog_delete_queue_step();
+
+/*!
+ @brief Erase the next block of the oldest queued deletion and take it
+ @retval Index The erased block, which isn't free
+ @retval FLOG_BLOCK_IDX_INVALID if the queue is empty
+
+ @note This requires flogfs_t::delete_lock
+ */
+static flog_block_alloc_t flog_delete_queue_take();
+#endif
+
+
+/*!
+ @brief Check for a dirty block and flush it to allow for a new allocation
+
+ This writes an empty init sector to claim the block. The file notices
+ flog_write_file_t::init_written when it next commits and puts its data in the
+ following sector instead.
+
+ @note This requires the allocation lock
+ */
+static void flog_flush_dirty_block();
+
+/*!
+ @brief check to see if a block is sufficiently new against a threshold
+ @retval 1 if okay
+ @retval 0 if too old
+ */
+static uint_fast8_t
+flog_age_is_sufficient(int32_t threshold, flog_block_age_t age);
+
+static flog_result_t flog_commit_file_sector(flog_write_file_t * file,
+                                             uint8_t const * data,
+                                             flog_sector_nbytes_t n);
+
+/*!
+ @brief Move as much of the back buffer as fits into the sector buffer
+ */
+static void flog_take_back_buffer(flog_write_file_t * file);
+
+/*!
+ @brief Move everything in the back buffer into the sector buffer
+
+ The sector buffer is always full while the back buffer has anything in it,
+ so this commits a sector each time round. The last one may be left full.
+ */
+static flog_result_t flog_drain_back_buffer(flog_write_file_t * file);
+
+//! The header bytes at the start of a file sector
+static uint16_t flog_sector_header_size(uint16_t sector);
+
+//! The number of bytes given to a write file which are still in RAM
+static uint32_t flog_write_buffered(flog_write_file_t const * file);
+
+/*!
+ @brief The body of flogfs_write(), for callers holding the file and flash
+        locks with the back buffer drained
+ @returns The number of bytes written
+ */
+static uint32_t flog_write_locked(flog_write_file_t * file,
+                                  uint8_t const * src, uint32_t nbytes);
+
+/*!
+ @brief The body of flogfs_flush(), for callers holding the file and flash
+        locks
+ */
+static flog_result_t flog_flush_locked(flog_write_file_t * file);
+
+/*!
+ @brief Check if some of what a write file wrote may not have reached flash
+ @retval 1 if a program failed for good since it was opened, or its block has
+         been given up on
+ @retval 0 otherwise
+ @note This requires the flash lock. It's only sure once the flash has been
+       waited on.
+ */
+static uint_fast8_t flog_write_file_lost(flog_write_file_t const * file);
+
+/*!
+ @brief Check a write file against its group commit policy
+ @retval 1 if it should be flushed now
+ @retval 0 otherwise
+
+ The age limit is timed from the first call to see data waiting, so the data
+ may be a little older than that.
+ */
+static uint_fast8_t flog_group_commit_due(flog_write_file_t * file);
+
+/*!
+ @brief Flush write files whose group commit age limit has passed
+
+ Files locked by another call are left for the next step.
+
+ @note This requires the flash lock
+ */
+static void flog_group_commit_step();
+
+/*!
+ @brief Program a page of file data in one operation
+ @param file The file, which must be at the start of a page of data sectors
+             with nothing in the sector buffer (see flog_file_page_writable())
+ @param data The data (up to FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE bytes)
+ @param n The number of bytes
+
+ All sectors and spares go into the flash cache and are programmed together.
+ Sectors past the data are left free. This only moves the write head; the
+ caller accounts for the bytes.
+ */
+static void flog_commit_file_page(flog_write_file_t * file,
+                                  uint8_t const * data, uint16_t n);
+
+/*!
+ @brief Check if the write head is at the start of an empty page of data
+ */
+static inline uint_fast8_t
+flog_file_page_writable(flog_write_file_t const * file);
+
+static flog_timestamp_t flog_block_get_init_timestamp(flog_block_idx_t block);
+
+static flog_block_age_t flog_block_get_age(flog_block_idx_t block);
+
+static void flog_get_file_tail_sector(flog_block_idx_t block,
+                                      flog_file_tail_sector_header_t * header);
+
+static void flog_get_file_init_sector(flog_block_idx_t block,
+                                      flog_file_init_sector_header_t * header);
+
+static void
+flog_get_universal_tail_sector(flog_block_idx_t block,
+                               flog_universal_tail_sector_t * header);
+
+/*!
+ @brief Get the data bytes in a block from its tail sector header
+
+ Volumes from before @ref FLOG_VOLUME_FORMAT_WIDE_TAIL only wrote the first
+ 16 bits, with whatever was in the padding after them.
+ */
+static uint32_t
+flog_tail_bytes_in_block(flog_file_tail_sector_header_t const * header);
+
+static flog_block_type_t
+flog_get_block_type(flog_block_idx_t block);
+
+/*!
+ @brief Erase a block for a new volume and write its block stat again
+ @param block The block, with page 0 open
+ @param age Its age, kept across the format
+ @param num_checkpoint_blocks The checkpoint blocks set up so far. Until there
+        are @ref FLOG_CHECKPOINT_NUM_BLOCKS, the block becomes the next one.
+ @retval FLOG_SUCCESS if the block is free for the volume
+ @retval FLOG_FAILURE if it went bad or became a checkpoint block
+ */
+static flog_result_t flog_format_block(flog_block_idx_t block,
+                                       flog_block_age_t age,
+                                       uint_fast8_t * num_checkpoint_blocks);
+
+/*!
+ @brief Take the newer of two timestamps found by flogfs_format_quick()
+
+ A stamp of @ref FLOG_TIMESTAMP_INVALID (or one short of it, which would
+ leave the new generation on it) is ignored.
+ */
+static flog_timestamp_t flog_format_newer(flog_timestamp_t t,
+                                          flog_timestamp_t stamp);
+
+static flog_file_id_t
+flog_block_get_file_id(flog_block_idx_t block);
+
+static void
+flog_write_block_stat(flog_block_idx_t block,
+                      flog_block_stat_sector_t const * stat);
+
+static void
+flog_get_block_stat(flog_block_idx_t block, flog_block_stat_sector_t * stat);
+
+#endif // !FLOG_BUILD_CPP
+//! @}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Public implementations
+///////////////////////////////////////////////////////////////////////////////
+
+flog_result_t flogfs_init(){
+	// Start from nothing, as after a power up, so a mount only finds what's
+	// on the flash
+	memset(&flogfs, 0, sizeof(flogfs));
+
+	// Initialize locks
+	for(uint_fast8_t i = 0; i < FLOG_NUM_FILE_LOCKS; i++){
+		fs_lock_init(&flogfs.file_locks[i]);
+	}
+	fs_rwlock_init(&flogfs.inode_lock);
+	fs_lock_init(&flogfs.allocate_lock);
+	fs_lock_init(&flogfs.lock);
+	fs_lock_init(&flogfs.delete_lock);
+
+	flogfs.state = FLOG_STATE_RESET;
+	flog_page_cache_clear();
+#if FLOG_ENABLE_CHECKPOINT
+	flog_checkpoint_reset();
+#endif
+	flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+	return flash_init();
+}
+
+flog_result_t flogfs_format(){
+	flog_block_idx_t i;
+	flog_block_idx_t first_valid = FLOG_BLOCK_IDX_INVALID;
+	uint_fast8_t num_checkpoint_blocks = 0;
+
+	union {
+		flog_inode_init_sector_t main_buffer;
+		flog_inode_init_sector_spare_t spare_buffer;
+	};
+	
+	struct {
+		flog_block_stat_sector_t stat;
+		char key[sizeof(flog_block_stat_key)];
+	} stat_sector;
+	
+	FLOG_STATS_START();
+
+	flog_lock_inodes_write();
+	flash_lock();
+	
+	if(flogfs.state == FLOG_STATE_MOUNTED){
+		flogfs.state = FLOG_STATE_RESET;
+	}
+
+	// Spares are set aside again by mount
+	flog_bad_block_reset();
+
+#if FLOG_ENABLE_CHECKPOINT
+	// The blocks will be found and the first record written by mount
+	flog_checkpoint_reset();
+#endif
+
+	for(i = 0; i < FS_NUM_BLOCKS; i++){
+		flog_open_page(i, 0);
+		if(FLOG_SUCCESS == flog_block_is_bad()){
+			continue;
+		}
+		flog_read_sector((uint8_t *)&stat_sector, FLOG_BLK_STAT_SECTOR,
+		                  0, sizeof(stat_sector));
+		if(memcmp(stat_sector.key, flog_block_stat_key,
+		   sizeof(flog_block_stat_key)) != 0){
+			// Actually need to initialize this block
+			stat_sector.stat.age = 0;
+		}
+		if((FLOG_SUCCESS == flog_format_block(i, stat_sector.stat.age,
+		                                      &num_checkpoint_blocks)) &&
+		   (first_valid == FLOG_BLOCK_IDX_INVALID)){
+			first_valid = i;
+		}
+	}
+
+	// Really just assuming that at least 1 valid block was found
+
+	// Write the first file table
+	flog_open_sector(first_valid, FLOG_INIT_SECTOR);
+	main_buffer.timestamp = 0;
+	main_buffer.previous = FLOG_BLOCK_IDX_INVALID;
+	main_buffer.format = FLOG_VOLUME_FORMAT_WIDE_TAIL;
+	flog_write_sector((const uint8_t *)&main_buffer,
+	                   FLOG_INIT_SECTOR, 0, sizeof(main_buffer));
+	spare_buffer.inode_index = 0;
+	spare_buffer.type_id = FLOG_BLOCK_TYPE_INODE;
+	flog_write_spare((const uint8_t *)&spare_buffer, FLOG_INIT_SECTOR);
+	flog_commit();
+	flog_flash_wait();
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_FORMAT);
+	flash_unlock();
+	flog_unlock_inodes_write();
+	return FLOG_SUCCESS;
+}
+
+
+flog_result_t flogfs_format_quick(){
+	flog_result_t result = FLOG_FAILURE;
+	flog_block_idx_t i;
+	flog_block_idx_t inode0 = FLOG_BLOCK_IDX_INVALID;
+	// The newest timestamp from before
+	flog_timestamp_t t = 0;
+	flog_timestamp_t init;
+	flog_universal_tail_sector_t tail;
+	uint8_t type_id[4];
+	uint_fast8_t keep;
+	uint_fast8_t num_checkpoint_blocks = 0;
+#if FLOG_BAD_BLOCK_SPARES
+	flog_block_stat_spare_t stamp;
+#endif
+
+	union {
+		flog_inode_init_sector_t main_buffer;
+		flog_inode_init_sector_spare_t spare_buffer;
+	};
+
+	struct {
+		flog_block_stat_sector_t stat;
+		char key[sizeof(flog_block_stat_key)];
+	} stat_sector;
+
+	FLOG_STATS_START();
+
+	flog_lock_inodes_write();
+	flash_lock();
+
+	if(flogfs.state == FLOG_STATE_MOUNTED){
+		flogfs.state = FLOG_STATE_RESET;
+	}
+
+	flog_bad_block_reset();
+
+#if FLOG_ENABLE_CHECKPOINT
+	flog_checkpoint_reset();
+#endif
+
+	for(i = 0; i < FS_NUM_BLOCKS; i++){
+		flog_open_page(i, 0);
+		if(FLOG_SUCCESS == flog_block_is_bad()){
+			continue;
+		}
+		flog_read_sector((uint8_t *)&stat_sector, FLOG_BLK_STAT_SECTOR,
+		                  0, sizeof(stat_sector));
+		t = flog_format_newer(t, stat_sector.stat.timestamp);
+		flog_read_spare(type_id, FLOG_INIT_SECTOR);
+		switch(type_id[0]){
+		case FLOG_BLOCK_TYPE_INODE:
+		case FLOG_BLOCK_TYPE_FILE:
+			// Left for mount to find stale and allocation to erase
+			init = flog_block_get_init_timestamp(i);
+			t = flog_format_newer(t, init);
+			flog_get_universal_tail_sector(i, &tail);
+			// A tail programmed in full names the next block, which came later
+			if((init != FLOG_TIMESTAMP_INVALID) &&
+			   (tail.next_block < FS_NUM_BLOCKS) && (tail.timestamp >= init)){
+				t = flog_format_newer(t, tail.timestamp);
+			}
+			keep = 1;
+			break;
+		case FLOG_BLOCK_TYPE_UNALLOCATED:
+			keep = 1;
+			break;
+		default:
+			// An old checkpoint block or something unknown
+			keep = 0;
+			break;
+		}
+#if FLOG_ENABLE_CHECKPOINT
+		if(num_checkpoint_blocks < FLOG_CHECKPOINT_NUM_BLOCKS){
+			keep = 0;
+		}
+#endif
+		if(inode0 == FLOG_BLOCK_IDX_INVALID){
+			keep = 0;
+		}
+#if FLOG_BAD_BLOCK_SPARES
+		flog_read_spare((uint8_t *)&stamp, FLOG_BLK_STAT_SECTOR);
+		if(keep && (stamp.key == FLOG_BLOCK_STAT_SPARE_KEY)){
+			// Spares and stand-ins are left to mount as they are
+			continue;
+		}
+#endif
+
+		if(stat_sector.stat.age == FLOG_BLOCK_AGE_INVALID){
+			// Never formatted
+			stat_sector.stat.age = 0;
+			memcpy(stat_sector.key, flog_block_stat_key,
+			       sizeof(flog_block_stat_key));
+			if(keep){
+				// Still erased, so the block stat can go right on
+				stat_sector.stat.timestamp = 0;
+				stat_sector.stat.next_block = FLOG_BLOCK_IDX_INVALID;
+				stat_sector.stat.next_age = FLOG_BLOCK_AGE_INVALID;
+				flog_open_sector(i, FLOG_BLK_STAT_SECTOR);
+				flog_write_sector((uint8_t *)&stat_sector,
+				                  FLOG_BLK_STAT_SECTOR, 0, sizeof(stat_sector));
+				if(FLOG_FAILURE == flog_commit()){
+					flash_debug_warn("FLogFS:" LINESTR);
+					flog_set_bad_block(i);
+				}
+			}
+		}
+		if(keep){
+			continue;
+		}
+
+		if((FLOG_SUCCESS == flog_format_block(i, stat_sector.stat.age,
+		                                      &num_checkpoint_blocks)) &&
+		   (inode0 == FLOG_BLOCK_IDX_INVALID)){
+			inode0 = i;
+		}
+	}
+
+	if(inode0 == FLOG_BLOCK_IDX_INVALID){
+		flash_debug_error("FLogFS:" LINESTR);
+		goto done;
+	}
+
+	// The new generation starts after everything before it
+	flog_open_sector(inode0, FLOG_INIT_SECTOR);
+	main_buffer.timestamp = t + 1;
+	main_buffer.previous = FLOG_BLOCK_IDX_INVALID;
+	main_buffer.format = FLOG_VOLUME_FORMAT_WIDE_TAIL;
+	flog_write_sector((const uint8_t *)&main_buffer,
+	                   FLOG_INIT_SECTOR, 0, sizeof(main_buffer));
+	spare_buffer.inode_index = 0;
+	spare_buffer.type_id = FLOG_BLOCK_TYPE_INODE;
+	flog_write_spare((const uint8_t *)&spare_buffer, FLOG_INIT_SECTOR);
+	result = flog_commit();
+	flog_flash_wait();
+
+done:
+	FLOG_STATS_RECORD(FLOG_STATS_API_FORMAT_QUICK);
+	flash_unlock();
+	flog_unlock_inodes_write();
+	return result;
+}
+
+flog_result_t flogfs_mount(){
+	uint32_t i, done_scanning;
+	uint32_t scan;
+	flog_block_idx_t revisit[FLOG_BAD_BLOCK_TABLE_LEN];
+	uint32_t num_revisits = 0;
+#if FLOG_BAD_BLOCK_SPARES
+	flog_block_stat_spare_t stat_spare;
+#endif
+
+	////////////////////////////////////////////////////////////
+	// Data structures
+	////////////////////////////////////////////////////////////
+
+	// Use in search for highest allocation timestamp
+	struct {
+		flog_block_idx_t block;
+		flog_block_age_t age;
+		union {
+		flog_file_id_t file_id;
+		flog_block_idx_t previous_inode;
+		};
+		flog_timestamp_t timestamp;
+		flog_block_type_t block_type;
+	} last_allocation;
+
+	struct {
+		flog_block_idx_t first_block, last_block;
+		flog_file_id_t   file_id;
+		flog_timestamp_t timestamp;
+	} last_deletion[FLOG_RECENT_DELETIONS] = {};
+	flog_timestamp_t last_deletion_timestamp;
+	uint_fast8_t oldest_deletion;
+
+	// Find the freshest block to allocate. Why not?
+	struct {
+		flog_block_idx_t block;
+		flog_block_age_t age;
+	} min_age_block;
+
+	// The newest inode table 0 begins the current generation. Blocks from
+	// before it were left by flogfs_format_quick().
+	flog_block_idx_t inode0_idx;
+	flog_timestamp_t inode0_ts;
+	flog_timestamp_t timestamp;
+	// Blocks counted as in use so far
+	uint32_t num_used;
+
+	// Find the maximum block age
+	flog_block_age_t max_block_age;
+
+	flog_inode_iterator_t inode_iter;
+	flog_inode_entry_state_t inode_state;
+	uint16_t name_hash;
+	uint8_t entry_flags;
+
+	// The last wear leveling copy, which may not have finished
+	flog_inode_iterator_t copy_iter;
+	uint_fast8_t have_copy = 0;
+
+#if FLOG_ENABLE_CHECKPOINT
+	// The most recently journaled allocation, which may be incomplete
+	flog_checkpoint_journal_block_t journal_alloc;
+	flog_block_idx_t journal_alloc_previous;
+	uint_fast8_t restored;
+#endif
+
+#if FS_FILE_INDEX_SIZE
+	char filename[FLOG_MAX_FNAME_LEN];
+#endif
+
+	////////////////////////////////////////////////////////////
+	// Flexible buffers for flash reads
+	////////////////////////////////////////////////////////////
+
+	union {
+		uint8_t init_sector_buffer;
+		flog_file_init_sector_header_t file_init_sector_header;
+		flog_inode_init_sector_t inode_init_sector;
+		flog_inode_file_invalidation_t inode_file_invalidation_sector;
+	};
+
+	union {
+		uint8_t sector_buffer;
+		flog_file_tail_sector_header_t file_tail_sector_header;
+		flog_inode_file_allocation_header_t inode_file_allocation_sector;
+		flog_universal_invalidation_header_t universal_invalidation_header;
+		flog_block_stat_sector_t stat_sector;
+	};
+
+	union {
+		uint8_t spare_buffer;
+		flog_inode_init_sector_spare_t inode_spare0;
+		flog_file_sector_spare_t file_spare0;
+	};
+	
+	flog_universal_tail_sector_t universal_tail_sector;
+
+	flog_block_age_t age;
+
+	////////////////////////////////////////////////////////////
+	// Claim the disk and get this show started
+	////////////////////////////////////////////////////////////
+
+	FLOG_STATS_START();
+
+	flog_lock_inodes_write();
+	flash_lock();
+
+	if(flogfs.state == FLOG_STATE_MOUNTED){
+		FLOG_STATS_RECORD(FLOG_STATS_API_MOUNT);
+		flash_unlock();
+		flog_unlock_inodes_write();
+		return FLOG_SUCCESS;
+	}
+	
+	for(uint32_t i = 0; i < FS_NUM_BLOCKS/8; i++){
+		flogfs.free_block_bitmap[i] = 0;
+	}
+	flog_prealloc_reset();
+	flog_bad_block_reset();
+	
+	////////////////////////////////////////////////////////////
+	// Initialize data structures
+	////////////////////////////////////////////////////////////
+
+	last_allocation.block = FLOG_BLOCK_IDX_INVALID;
+	last_allocation.timestamp = 0;
+	last_allocation.age = 0;
+	last_allocation.block_type = FLOG_BLOCK_TYPE_UNALLOCATED;
+
+	for(uint_fast8_t k = 0; k < FLOG_RECENT_DELETIONS; k++){
+		last_deletion[k].timestamp = 0;
+		last_deletion[k].file_id = FLOG_FILE_ID_INVALID;
+	}
+#if FLOG_DELETE_QUEUE_LEN
+	flogfs.delete_queue.head = 0;
+	flogfs.delete_queue.n = 0;
+#endif
+#if FLOG_WEAR_LEVEL_SPREAD
+	// Take a look soon after mounting
+	flogfs.wear.allocations = FS_NUM_BLOCKS;
+	flogfs.wear.cursor = FS_NUM_BLOCKS;
+	flogfs.wear.migrate = FLOG_FILE_ID_INVALID;
+#endif
+
+	flogfs.num_free_blocks = 0;
+	flogfs.free_block_sum = 0;
+	flogfs.t_allocation_ceiling = FLOG_TIMESTAMP_INVALID;
+	flogfs.max_file_id = 0;
+	flogfs.t = 0;
+	
+	flogfs.cache_status = {0};
+	flog_page_cache_clear();
+#if FS_FILE_INDEX_SIZE
+	flog_file_index_clear();
+#endif
+	
+	flog_lock_fs();
+	flogfs.read_head = nullptr;
+	flogfs.write_head = nullptr;
+	flog_unlock_fs();
+	flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+
+	min_age_block.age = 0xFFFFFFFF;
+	min_age_block.block = FLOG_BLOCK_IDX_INVALID;
+
+	inode0_idx = FLOG_BLOCK_IDX_INVALID;
+	inode0_ts = 0;
+	flogfs.num_stale_blocks = 0;
+
+	max_block_age = 0;
+
+#if FLOG_ENABLE_CHECKPOINT
+	////////////////////////////////////////////////////////////
+	// Try to pick up where the checkpoint left off
+	////////////////////////////////////////////////////////////
+	restored = (FLOG_SUCCESS ==
+	            flog_checkpoint_restore(&journal_alloc,
+	                                    &journal_alloc_previous));
+	if(restored){
+		inode0_idx = flogfs.inode0;
+		goto scan_inodes;
+	}
+	// Nothing in there can be trusted. The scan starts from scratch.
+	flogfs.t = 0;
+#endif
+
+	////////////////////////////////////////////////////////////
+	// First, iterate through all blocks to find:
+	// - Most recent allocation time in a file block
+	// - Number of free blocks
+	// - Some free blocks that are fair to use
+	// - Oldest block age
+	// - Inode table 0
+	////////////////////////////////////////////////////////////
+rescan:
+	// This starts over if the current generation turns up late
+	num_used = 0;
+	num_revisits = 0;
+	for(uint32_t i = 0; i < FS_NUM_BLOCKS/8; i++){
+		flogfs.free_block_bitmap[i] = 0;
+	}
+	flog_prealloc_reset();
+	flog_bad_block_reset();
+	flogfs.num_free_blocks = 0;
+	flogfs.free_block_sum = 0;
+	flogfs.num_stale_blocks = 0;
+	flogfs.max_file_id = 0;
+	last_allocation.block = FLOG_BLOCK_IDX_INVALID;
+	last_allocation.timestamp = 0;
+	last_allocation.age = 0;
+	last_allocation.block_type = FLOG_BLOCK_TYPE_UNALLOCATED;
+	inode0_idx = FLOG_BLOCK_IDX_INVALID;
+	max_block_age = 0;
+	for(scan = 0; scan < FS_NUM_BLOCKS + num_revisits; scan++){
+		// Blocks whose stand-in only turned up later get another look
+		i = (scan < FS_NUM_BLOCKS) ? scan : revisit[scan - FS_NUM_BLOCKS];
+		// Everything can be determined from page 0
+		if(FLOG_FAILURE == flog_open_page(i, 0)){
+			continue;
+		}
+#if FLOG_MOUNT_PREFETCH
+		// The array can load the next block while this one is read out
+		if(scan + 1 < FS_NUM_BLOCKS){
+			flog_prefetch_page(scan + 1, 0);
+		}
+#endif
+		if(FLOG_SUCCESS == flog_block_is_bad()){
+			flash_debug_warn("FLogFS:" LINESTR);
+			flogfs.bad_block_bitmap[i / 8] |= 1 << (i % 8);
+			continue;
+		}
+#if FLOG_BAD_BLOCK_SPARES
+		// Spares and stand-ins are stamped
+		flog_read_spare((uint8_t *)&stat_spare, FLOG_BLK_STAT_SECTOR);
+		if((stat_spare.key == FLOG_BLOCK_STAT_SPARE_KEY) &&
+		   (stat_spare.replaces != i)){
+			if(flog_mount_bad_block_stamp(i, stat_spare.replaces)){
+				revisit[num_revisits++] = stat_spare.replaces;
+			}
+			continue;
+		}
+#endif
+		// Read the sector 0 spare to identify valid blocks
+		flog_read_spare((uint8_t *)&spare_buffer, FLOG_INIT_SECTOR);
+		
+		switch(inode_spare0.type_id) {
+		case FLOG_BLOCK_TYPE_INODE:
+			timestamp = flog_block_get_init_timestamp(i);
+			if(timestamp < inode0_ts){
+				goto stale;
+			}
+			if((inode_spare0.inode_index == 0) &&
+			   ((inode0_idx == FLOG_BLOCK_IDX_INVALID) ||
+			    (timestamp > inode0_ts))){
+				// Found the original gangster!
+				if(num_used && (timestamp > inode0_ts)){
+					// Everything counted so far is from an older generation
+					inode0_ts = timestamp;
+					goto rescan;
+				}
+				inode0_idx = i;
+				inode0_ts = timestamp;
+			}
+			num_used += 1;
+			flog_get_universal_tail_sector(i, &universal_tail_sector);
+			if((universal_tail_sector.timestamp != FLOG_TIMESTAMP_INVALID) &&
+			   (universal_tail_sector.timestamp > last_allocation.timestamp)){
+				// This is now the most recent allocation timestamp!
+				last_allocation.previous_inode = i;
+				last_allocation.block_type = FLOG_BLOCK_TYPE_INODE;
+				goto update_last_allocation;
+			}
+			break;
+		case FLOG_BLOCK_TYPE_FILE:
+			flog_get_universal_tail_sector(i, &universal_tail_sector);
 			flog_get_file_init_sector(i, &file_init_sector_header);
+			if(file_init_sector_header.file_id > flogfs.max_file_id){
+				// Even an old one, so its ID isn't used again
+				flogfs.max_file_id = file_init_sector_header.file_id;
+			}
+			if(file_init_sector_header.timestamp < inode0_ts){
+				goto stale;
+			}
+			num_used += 1;
 			if((universal_tail_sector.timestamp != FLOG_TIMESTAMP_INVALID) &&
 			   (universal_tail_sector.timestamp > last_allocation.timestamp)){
 				// This is now the most recent allocation timestamp!
 				last_allocation.file_id = file_init_sector_header.file_id;
 				last_allocation.block_type = FLOG_BLOCK_TYPE_FILE;
-				goto update_last_allocation;
+				goto update_last_allocation;
+			}
+			break;
+stale:
+			// It's erased when it's allocated
+			flogfs.num_stale_blocks += 1;
+			// Fall through
+		case FLOG_BLOCK_TYPE_UNALLOCATED:
+			flog_get_block_stat(i, &stat_sector);
+			flogfs.num_free_blocks += 1;
+			flogfs.free_block_bitmap[i / 8] |= (1 << (i % 8));
+			flogfs.free_block_sum += stat_sector.age;
+			flog_prealloc_push(i, stat_sector.age);
+			break;
+		case FLOG_BLOCK_TYPE_CHECKPOINT:
+			// Reserved
+			break;
+		default:
+			flash_debug_error("FLogFS:" LINESTR);
+			goto failure;
+		}
+		
+		age = flog_block_get_age(i);
+		// Check if this is a really old block
+		if((age != FLOG_BLOCK_AGE_INVALID) && (age > max_block_age)){
+			max_block_age = age;
+		}
+		
+		continue;
+update_last_allocation:
+		last_allocation.timestamp = universal_tail_sector.timestamp;
+		last_allocation.block = universal_tail_sector.next_block;
+		last_allocation.age = universal_tail_sector.next_age;
+	}
+
+#if FLOG_ENABLE_CHECKPOINT
+scan_inodes:
+	if(restored && (journal_alloc.block != FLOG_BLOCK_IDX_INVALID) &&
+	   (journal_alloc_previous != FLOG_BLOCK_IDX_INVALID) &&
+	   (flog_get_block_type(journal_alloc.block) ==
+	    FLOG_BLOCK_TYPE_UNALLOCATED)){
+		// The last allocation may not have completed. The scan would have
+		// found this from the tail of the previous block.
+		flog_get_universal_tail_sector(journal_alloc_previous,
+		                               &universal_tail_sector);
+		if((universal_tail_sector.timestamp != FLOG_TIMESTAMP_INVALID) &&
+		   (universal_tail_sector.next_block == journal_alloc.block)){
+			switch(flog_get_block_type(journal_alloc_previous)){
+			case FLOG_BLOCK_TYPE_INODE:
+				last_allocation.previous_inode = journal_alloc_previous;
+				last_allocation.block_type = FLOG_BLOCK_TYPE_INODE;
+				break;
+			case FLOG_BLOCK_TYPE_FILE:
+				flog_get_file_init_sector(journal_alloc_previous,
+				                          &file_init_sector_header);
+				last_allocation.file_id = file_init_sector_header.file_id;
+				last_allocation.block_type = FLOG_BLOCK_TYPE_FILE;
+				break;
+			default:
+				break;
+			}
+			last_allocation.timestamp = universal_tail_sector.timestamp;
+			last_allocation.block = universal_tail_sector.next_block;
+			last_allocation.age = universal_tail_sector.next_age;
+		}
+	}
+#endif
+	
+	flog_update_mean_free_age();
+	
+	if(inode0_idx == FLOG_BLOCK_IDX_INVALID){
+		flash_debug_error("FLogFS:" LINESTR);
+		goto failure;
+	}
+	flogfs.inode0 = inode0_idx;
+
+	// Anything else is taken for a legacy volume, whose tails are read as
+	// 16 bits
+	flog_open_sector(inode0_idx, FLOG_INIT_SECTOR);
+	flog_read_sector(&flogfs.format, FLOG_INIT_SECTOR,
+	                 offsetof(flog_inode_init_sector_t, format),
+	                 sizeof(flogfs.format));
+
+	////////////////////////////////////////////////////////////
+	// Now iterate through the inode chain, finding:
+	// - Most recent file deletion
+	// - Most recent file allocation
+	// - Max file ID
+	////////////////////////////////////////////////////////////
+
+	done_scanning = 0;
+#if FS_FILE_INDEX_SIZE
+	// Until something doesn't fit
+	flogfs.file_index.complete = 1;
+#endif
+	// THE OLD INODE CHAIN
+	for(flog_inode_iterator_init(&inode_iter, inode0_idx);;
+		flog_inode_iterator_next(&inode_iter)){
+		
+		inode_state = flog_inode_get_entry_state(&inode_iter, &name_hash,
+		                                         &entry_flags);
+		if(inode_state == FLOG_INODE_ENTRY_FREE){
+			// Passed the last file
+			// When iterating across an incomplete inode table deletion, this
+			// will also catch and finish the routine
+#if FS_FILE_INDEX_SIZE
+			flogfs.file_index.tail = inode_iter;
+#endif
+			break;
+		}
+		flog_open_sector(inode_iter.block, inode_iter.sector);
+		flog_read_sector(&sector_buffer, inode_iter.sector, 0,
+		                  sizeof(flog_inode_file_allocation_header_t));
+
+		// Keep track of the maximum file ID
+		if(inode_file_allocation_sector.file_id > flogfs.max_file_id){
+			flogfs.max_file_id = inode_file_allocation_sector.file_id;
+		}
+		
+		
+		// Was it deleted?
+		if(inode_state != FLOG_INODE_ENTRY_DELETED){
+			// This is still valid
+			if(entry_flags & FLOG_INODE_ENTRY_COPY){
+				copy_iter = inode_iter;
+				have_copy = 1;
+			}
+#if FS_FILE_INDEX_SIZE
+			if(inode_state == FLOG_INODE_ENTRY_LIVE_UNHASHED){
+				flog_read_sector((uint8_t *)filename, inode_iter.sector,
+				                 sizeof(flog_inode_file_allocation_header_t),
+				                 FLOG_MAX_FNAME_LEN);
+				name_hash = flog_filename_hash(filename);
+			}
+			flog_file_index_add(name_hash, &inode_iter,
+			                    inode_file_allocation_sector.first_block,
+			                    inode_file_allocation_sector.file_id);
+#endif
+
+			// Check if this is now the most recent allocation
+			if(inode_file_allocation_sector.timestamp >
+			   last_allocation.timestamp){
+				// This isn't really always true becase we also consider
+				// allocations in the file chain itself, which are not
+				// reflected
+				last_allocation.block =
+				  inode_file_allocation_sector.first_block;
+				last_allocation.file_id =
+				  inode_file_allocation_sector.file_id;
+				last_allocation.age =
+				  inode_file_allocation_sector.first_block_age;
+				last_allocation.timestamp =
+				  inode_file_allocation_sector.timestamp;
+				last_allocation.block_type = FLOG_BLOCK_TYPE_FILE;
+			}
+		} else {
+			flog_open_sector(inode_iter.block, inode_iter.sector + 1);
+			flog_read_sector(&init_sector_buffer, inode_iter.sector + 1, 0,
+			                  sizeof(flog_inode_file_invalidation_t));
+
+			// Keep the most recent deletions. Any of them may be unfinished.
+			oldest_deletion = 0;
+			for(uint_fast8_t k = 1; k < FLOG_RECENT_DELETIONS; k++){
+				if(last_deletion[k].timestamp <
+				   last_deletion[oldest_deletion].timestamp){
+					oldest_deletion = k;
+				}
+			}
+			if(inode_file_invalidation_sector.timestamp >
+			   last_deletion[oldest_deletion].timestamp){
+				last_deletion[oldest_deletion].first_block =
+				  inode_file_allocation_sector.first_block;
+				last_deletion[oldest_deletion].last_block =
+				  inode_file_invalidation_sector.last_block;
+				last_deletion[oldest_deletion].file_id =
+				  inode_file_allocation_sector.file_id;
+				last_deletion[oldest_deletion].timestamp =
+				  inode_file_invalidation_sector.timestamp;
+			}
+		}
+	}
+
+	last_deletion_timestamp = 0;
+	for(uint_fast8_t k = 0; k < FLOG_RECENT_DELETIONS; k++){
+		last_deletion_timestamp = MAX(last_deletion_timestamp,
+		                              last_deletion[k].timestamp);
+	}
+
+	// Resume the sequence after the most recent operation on disk
+	flogfs.t = MAX(MAX(flogfs.t, inode0_ts),
+	               MAX(last_allocation.timestamp, last_deletion_timestamp));
+
+	// Go check and (maybe) clean the last allocation. One past the end of the
+	// part came from a torn program and was never made.
+	if((last_allocation.timestamp > 0) &&
+	   (last_allocation.block < FS_NUM_BLOCKS)){
+		switch(last_allocation.block_type){
+		case FLOG_BLOCK_TYPE_FILE:
+			flog_open_sector(last_allocation.block, FLOG_INIT_SECTOR);
+			flog_read_sector(&init_sector_buffer, FLOG_INIT_SECTOR, 0,
+			                  sizeof(flog_file_init_sector_header_t));
+			if(file_init_sector_header.file_id != last_allocation.file_id){
+				// This block never got claimed
+				// Initialize it!
+				flog_open_sector(last_allocation.block, FLOG_INIT_SECTOR);
+				file_init_sector_header.timestamp = last_allocation.timestamp;
+				file_init_sector_header.age = last_allocation.age;
+				file_init_sector_header.file_id = last_allocation.file_id;
+				flog_write_sector(&init_sector_buffer, FLOG_INIT_SECTOR, 0,
+				                   sizeof(flog_file_init_sector_header_t));
+				file_spare0.nbytes = 0;
+				file_spare0.nothing = 0;
+				file_spare0.type_id = FLOG_BLOCK_TYPE_FILE;
+				flog_write_spare(&spare_buffer, FLOG_INIT_SECTOR);
+#if FLOG_SECTOR_CRC
+				flog_write_spare_check(flog_sector_crc(0,
+				   &init_sector_buffer, sizeof(flog_file_init_sector_header_t)),
+				   FLOG_INIT_SECTOR);
+#endif
+				flog_commit();
+				
+				// BOOOOOO
+				flog_mount_claim_block(last_allocation.block,
+				                       last_allocation.age);
+
+				flogfs.t = MAX(flogfs.t, last_allocation.timestamp + 1);
+			}
+			break;
+		case FLOG_BLOCK_TYPE_INODE:
+			flog_inode_init_sector_spare_t inode_init_spare;
+			flog_inode_init_sector_t inode_init;
+			if(flog_get_block_type(last_allocation.block) ==
+			   FLOG_BLOCK_TYPE_INODE)
+				break;
+			// Well, it seems the allocation was incomplete
+			flog_open_sector(last_allocation.previous_inode, FLOG_INIT_SECTOR);
+			flog_read_spare((uint8_t *)&inode_init_spare, FLOG_INIT_SECTOR);
+			inode_init.previous = last_allocation.previous_inode;
+			inode_init.timestamp = last_allocation.timestamp;
+			inode_init.format = flogfs.format;
+			inode_init_spare.inode_index += 1;
+			// Other fields should be valid...
+			flog_open_sector(last_allocation.block, FLOG_INIT_SECTOR);
+			flog_write_sector((uint8_t *)&inode_init, FLOG_INIT_SECTOR, 0,
+			                   sizeof(inode_init));
+			flog_write_spare((uint8_t *)&inode_init_sector, FLOG_INIT_SECTOR);
+			flog_commit();
+			
+			// BOOOOOO
+			flog_mount_claim_block(last_allocation.block, last_allocation.age);
+			break;
+		default:
+			// Huh?
+			break;
+		}
+	}
+
+	// Verify the completion of the most recent deletion operations
+	for(uint_fast8_t k = 0; k < FLOG_RECENT_DELETIONS; k++){
+		if((last_deletion[k].timestamp == 0) ||
+		   (last_deletion[k].last_block >= FS_NUM_BLOCKS)){
+			continue;
+		}
+		if(flog_get_block_type(last_deletion[k].last_block) !=
+		   FLOG_BLOCK_TYPE_FILE){
+			flog_get_block_stat(last_deletion[k].last_block, &stat_sector);
+			if((stat_sector.timestamp != FLOG_TIMESTAMP_INVALID) &&
+			   (stat_sector.timestamp >= last_deletion[k].timestamp)){
+				// Finished, but it may have been interrupted before the last
+				// block was accounted for
+				flog_lock_delete();
+				flog_reclaim_erased_block(last_deletion[k].last_block,
+				                          &stat_sector);
+				flog_checkpoint_journal_flush();
+				flog_unlock_delete();
+			}
+			continue;
+		}
+
+		flog_open_sector(last_deletion[k].last_block, FLOG_INIT_SECTOR);
+		flog_read_sector(&init_sector_buffer, FLOG_INIT_SECTOR, 0,
+		                  sizeof(flog_file_init_sector_header_t));
+		if(file_init_sector_header.file_id == last_deletion[k].file_id){
+			// This is the same file still, see if it's been invalidated
+			flog_open_sector(last_deletion[k].last_block,
+			                 FLOG_BLK_STAT_SECTOR);
+			flog_read_sector(&sector_buffer, FLOG_BLK_STAT_SECTOR, 0,
+			                  sizeof(flog_universal_invalidation_header_t));
+			if(universal_invalidation_header.timestamp != FLOG_TIMESTAMP_INVALID){
+				// Crap, this never got invalidated correctly
+				flog_resume_deletion(last_deletion[k].first_block,
+				                     last_deletion[k].file_id,
+				                     last_deletion[k].timestamp);
+			}
+		}
+	}
+
+	// Only the last copy can have been interrupted, since each replaces its
+	// original before the next is started
+	if(have_copy){
+		flog_mount_check_copy(&copy_iter);
+	}
+
+#if FLOG_BAD_BLOCK_SPARES
+	// Before any record, so it has them
+	flog_bad_block_check_spares();
+	flog_lock_allocate();
+	while(flog_bad_block_refill());
+	flog_unlock_allocate();
+#endif
+
+#if FLOG_ENABLE_CHECKPOINT
+	if(restored && (journal_alloc.block != FLOG_BLOCK_IDX_INVALID) &&
+	   !(flogfs.free_block_bitmap[journal_alloc.block / 8] &
+	     (1 << (journal_alloc.block % 8))) &&
+	   (flog_get_block_type(journal_alloc.block) ==
+	    FLOG_BLOCK_TYPE_UNALLOCATED)){
+		// Allocated but never used by anything
+		flog_free_block(journal_alloc.block, journal_alloc.age);
+	}
+	if(!restored || flogfs.checkpoint.journal_len ||
+	   flogfs.checkpoint.num_pending_free){
+		// Start a fresh journal so the next mount needn't repeat any of this
+		flog_checkpoint_write();
+	}
+#endif
+
+	flogfs.state = FLOG_STATE_MOUNTED;
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_MOUNT);
+	flash_unlock();
+	flog_unlock_inodes_write();
+	return FLOG_SUCCESS;
+
+failure:
+	FLOG_STATS_RECORD(FLOG_STATS_API_MOUNT);
+	flash_unlock();
+	flog_unlock_inodes_write();
+	return FLOG_FAILURE;
+}
+
+
+
+flog_result_t flogfs_unmount(){
+	flog_result_t result = FLOG_SUCCESS;
+	flog_lock_inodes_write();
+	if(flogfs.state != FLOG_STATE_MOUNTED){
+		flog_unlock_inodes_write();
+		return FLOG_SUCCESS;
+	}
+	flash_lock();
+#if FLOG_ENABLE_CHECKPOINT
+	flog_lock_allocate();
+	flog_checkpoint_write();
+	flog_unlock_allocate();
+#endif
+	flog_flash_wait();
+	if(flogfs.checkpoint_failed){
+		// Mounting falls back on a full scan
+		flogfs.checkpoint_failed = 0;
+		result = FLOG_FAILURE;
+	}
+	flogfs.state = FLOG_STATE_RESET;
+	flash_unlock();
+	flog_unlock_inodes_write();
+	return result;
+}
+
+flog_result_t flogfs_checkpoint(){
+#if FLOG_ENABLE_CHECKPOINT
+	flog_result_t result = FLOG_FAILURE;
+	flog_lock_inodes_read();
+	flash_lock();
+	flog_lock_allocate();
+	if((flogfs.state == FLOG_STATE_MOUNTED) &&
+	   (flogfs.checkpoint.blocks[0] != FLOG_BLOCK_IDX_INVALID)){
+		flog_checkpoint_write();
+		flog_flash_wait();
+		result = flogfs.checkpoint_failed ? FLOG_FAILURE : FLOG_SUCCESS;
+		flogfs.checkpoint_failed = 0;
+	}
+	flog_unlock_allocate();
+	flash_unlock();
+	flog_unlock_inodes_read();
+	return result;
+#else
+	return FLOG_FAILURE;
+#endif
+}
+
+
+flog_result_t flogfs_open_read(flog_read_file_t * file, char const * filename){
+	flog_inode_iterator_t inode_iter;
+	flog_read_file_t * file_iter;
+	flog_file_find_result_t find_result;
+
+	if(strlen(filename) >= FLOG_MAX_FNAME_LEN){
+		return FLOG_FAILURE;
+	}
+#if FLOG_BUILD_CPP
+	file->vol = this;
+#endif
+
+	FLOG_STATS_START();
+
+	flog_lock_inodes_read();
+	flash_lock();
+
+	find_result = flog_find_file(filename, &inode_iter);
+	if(find_result.first_block == FLOG_BLOCK_IDX_INVALID){
+		// File doesn't exist
+		goto failure;
+	}
+
+	file->block = find_result.first_block;
+	file->id = find_result.file_id;
+	file->first_block = find_result.first_block;
+	file->block_idx = 0;
+	file->block_start = 0;
+	file->read_head = 0;
+	file->skip_index = nullptr;
+#if FLOG_SECTOR_CRC
+	file->verify = 0;
+	file->checked = 0;
+	file->corrupt = 0;
+#endif
+#if FLOG_ENABLE_COMPRESSION
+	file->compressed = !!(find_result.flags & FLOG_INODE_ENTRY_COMPRESSED);
+	file->frame_len = 0;
+	file->frame_pos = 0;
+	if(flogfs.compress.decoded_file == file){
+		// Left by whatever was open here before
+		flogfs.compress.decoded_file = nullptr;
+	}
+#else
+	if(find_result.flags & FLOG_INODE_ENTRY_COMPRESSED){
+		// This can't be read without decompressing it
+		goto failure;
+	}
+#endif
+	/////////////
+	// Actual file search
+	/////////////
+
+
+	// Start before the data of the init sector. The first read goes and finds
+	// it, even if nothing has been written yet.
+	file->sector = FLOG_INIT_SECTOR;
+	file->offset = sizeof(flog_file_init_sector_header_t);
+	file->sector_remaining_bytes = 0;
+
+	// If we got this far...
+
+	// Add to list of read files
+	file->next = 0;
+	flog_lock_fs();
+	if(flogfs.read_head){
+		// Iterate to end of list
+		for(file_iter = flogfs.read_head; file_iter->next;
+			file_iter = file_iter->next);
+		file_iter->next = file;
+	} else {
+		flogfs.read_head = file;
+	}
+	flog_unlock_fs();
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_OPEN_READ);
+	flash_unlock();
+	flog_unlock_inodes_read();
+	return FLOG_SUCCESS;
+
+
+failure:
+	FLOG_STATS_RECORD(FLOG_STATS_API_OPEN_READ);
+	flash_unlock();
+	flog_unlock_inodes_read();
+	return FLOG_FAILURE;
+}
+
+flog_result_t flogfs_close_read(flog_read_file_t * file){
+	flog_read_file_t * iter;
+	FLOG_STATS_START();
+
+	flog_lock_file(file);
+	flog_lock_fs();
+	if(flogfs.read_head == file){
+		flogfs.read_head = file->next;
+	} else {
+		for(iter = flogfs.read_head; iter && (iter->next != file);
+		    iter = iter->next);
+		if(!iter){
+			// It wasn't open
+			goto failure;
+		}
+		iter->next = file->next;
+	}
+	flog_unlock_fs();
+#if FLOG_ENABLE_COMPRESSION
+	flash_lock();
+	if(flogfs.compress.decoded_file == file){
+		flogfs.compress.decoded_file = nullptr;
+	}
+	flash_unlock();
+#endif
+	flog_unlock_file(file);
+	FLOG_STATS_RECORD(FLOG_STATS_API_CLOSE_READ);
+	return FLOG_SUCCESS;
+
+failure:
+	flog_unlock_fs();
+	flog_unlock_file(file);
+	FLOG_STATS_RECORD(FLOG_STATS_API_CLOSE_READ);
+	return FLOG_FAILURE;
+}
+
+uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst, uint32_t nbytes){
+	uint32_t count = 0;
+	uint16_t to_read;
+
+#if FLOG_ENABLE_COMPRESSION
+	if(file->compressed){
+		return flog_read_compressed(file, dst, nbytes);
+	}
+#endif
+
+	FLOG_STATS_START();
+
+	flog_lock_file(file);
+	flash_lock();
+
+#if FLOG_SECTOR_CRC
+	if(file->corrupt){
+		// Stay stopped at the sector which failed until flogfs_seek()
+		nbytes = 0;
+	}
+#endif
+
+	while(nbytes){
+		if((file->sector_remaining_bytes == 0) &&
+		   (flog_read_file_advance(file, nullptr) != FLOG_SUCCESS)){
+			// End of file for now
+			break;
+		}
+
+		// Figure out how many to read
+		to_read = MIN(nbytes, file->sector_remaining_bytes);
+
+		// Read this sector now
+		if(flog_read_file_sector(file, dst, to_read) != FLOG_SUCCESS){
+			break;
+		}
+		count += to_read;
+		nbytes -= to_read;
+		dst += to_read;
+		// Update file stats
+		file->offset += to_read;
+		file->sector_remaining_bytes -= to_read;
+		file->read_head += to_read;
+		flog_flash_yield();
+	}
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_READ);
+	flash_unlock();
+	flog_unlock_file(file);
+
+	return count;
+}
+
+uint32_t flogfs_read_pages(flog_read_file_t * file, uint8_t * dst,
+                           uint32_t nbytes){
+	uint32_t count = 0;
+	uint16_t to_read;
+	uint_fast8_t run;
+	flog_spare_batch_t batch;
+
+#if FLOG_ENABLE_COMPRESSION
+	if(file->compressed){
+		return flog_read_compressed(file, dst, nbytes);
+	}
+#endif
+
+	FLOG_STATS_START();
+
+	batch.block = FLOG_BLOCK_IDX_INVALID;
+
+	flog_lock_file(file);
+	flash_lock();
+
+#if FLOG_SECTOR_CRC
+	if(file->corrupt){
+		// Stay stopped at the sector which failed until flogfs_seek()
+		nbytes = 0;
+	}
+#endif
+
+	while(nbytes){
+		if((file->sector_remaining_bytes == 0) &&
+		   (flog_read_file_advance(file, &batch) != FLOG_SUCCESS)){
+			// End of file for now
+			break;
+		}
+
+		to_read = MIN(nbytes, file->sector_remaining_bytes);
+
+		if((file->offset == 0) &&
+		   (file->sector_remaining_bytes == FS_SECTOR_SIZE) &&
+		   (file->sector >= FS_SECTORS_PER_PAGE) &&
+		   (nbytes >= 2 * FS_SECTOR_SIZE)){
+			// A data page with no headers. Take the following full sectors in
+			// the same transfer.
+			flog_get_file_spare(&batch, file->block, file->sector, nullptr);
+			for(run = 1; (file->sector % FS_SECTORS_PER_PAGE) + run <
+			             FS_SECTORS_PER_PAGE; run++){
+				if((batch.spares[(file->sector + run) %
+				                 FS_SECTORS_PER_PAGE].nbytes != FS_SECTOR_SIZE) ||
+				   ((uint32_t)(run + 1) * FS_SECTOR_SIZE > nbytes)){
+					break;
+				}
+			}
+			to_read = run * FS_SECTOR_SIZE;
+			file->sector += run - 1;
+		}
+
+		if(to_read > FS_SECTOR_SIZE){
+			flog_open_sector(file->block, file->sector);
+			flog_read_sector(dst, file->sector - to_read / FS_SECTOR_SIZE + 1,
+			                 0, to_read);
+			file->offset = FS_SECTOR_SIZE;
+			file->sector_remaining_bytes = 0;
+#if FLOG_SECTOR_CRC
+			if(file->verify){
+				run = to_read / FS_SECTOR_SIZE;
+				to_read = flog_check_run(file, dst, run);
+				if(to_read < run * FS_SECTOR_SIZE){
+					// Keep the sectors before the one which failed
+					count += to_read;
+					file->read_head += to_read;
+					break;
+				}
+			}
+#endif
+		} else {
+			if(flog_read_file_sector(file, dst, to_read) != FLOG_SUCCESS){
+				break;
+			}
+			file->offset += to_read;
+			file->sector_remaining_bytes -= to_read;
+		}
+		count += to_read;
+		nbytes -= to_read;
+		dst += to_read;
+		file->read_head += to_read;
+		// Spares in the batch may go stale in the meantime, but only by
+		// missing sectors written since. That just ends this read early.
+		flog_flash_yield();
+	}
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_READ_PAGES);
+	flash_unlock();
+	flog_unlock_file(file);
+
+	return count;
+}
+
+void flog_get_file_spare(flog_spare_batch_t * batch, flog_block_idx_t block,
+                         uint16_t sector, flog_file_sector_spare_t * spare){
+	if(!batch){
+		flog_open_sector(block, sector);
+		flog_read_spare((uint8_t *)spare, sector);
+		return;
+	}
+	if((batch->block != block) || (batch->page != sector / FS_SECTORS_PER_PAGE)){
+		batch->block = block;
+		batch->page = sector / FS_SECTORS_PER_PAGE;
+		flog_open_sector(block, sector);
+		flog_read_spares((uint8_t *)batch->spares);
+	}
+	if(spare){
+		*spare = batch->spares[sector % FS_SECTORS_PER_PAGE];
+	}
+}
+
+flog_result_t flog_read_file_sector(flog_read_file_t * file, uint8_t * dst,
+                                    uint16_t n){
+	flog_open_sector(file->block, file->sector);
+	flog_read_sector(dst, file->sector, file->offset, n);
+#if FLOG_SECTOR_CRC
+	if((file->offset == flog_sector_header_size(file->sector)) &&
+	   (n == file->sector_remaining_bytes)){
+		// That was all of it
+		return flog_check_file_sector(file, dst);
+	}
+	return flog_check_file_sector(file, nullptr);
+#else
+	return FLOG_SUCCESS;
+#endif
+}
+
+#if FLOG_SECTOR_CRC
+flog_result_t flog_check_sector(flog_block_idx_t block, uint16_t sector,
+                                uint16_t nbytes, uint8_t const * data){
+	uint16_t const header = flog_sector_header_size(sector);
+	uint8_t chunk[64];
+	uint32_t crc;
+	uint16_t i, n;
+
+	flog_open_sector(block, sector);
+	flog_read_sector(chunk, sector, 0, header);
+	crc = flog_sector_crc(0, chunk, header);
+	if(data){
+		crc = flog_sector_crc(crc, data, nbytes);
+	} else {
+		for(i = 0; i < nbytes; i += n){
+			n = MIN((uint16_t)(nbytes - i), (uint16_t)sizeof(chunk));
+			flog_read_sector(chunk, sector, header + i, n);
+			crc = flog_sector_crc(crc, chunk, n);
+		}
+	}
+	if(flog_read_spare_check(sector) != crc){
+		FLOG_STATS_INC(crc_failures);
+		flash_debug_warn("FLogFS:" LINESTR);
+		return FLOG_FAILURE;
+	}
+	return FLOG_SUCCESS;
+}
+
+flog_result_t flog_check_file_sector(flog_read_file_t * file,
+                                     uint8_t const * data){
+	uint16_t const nbytes = file->offset + file->sector_remaining_bytes -
+	                        flog_sector_header_size(file->sector);
+	if(!file->verify || file->checked){
+		return FLOG_SUCCESS;
+	}
+	if(flog_check_sector(file->block, file->sector, nbytes, data) !=
+	   FLOG_SUCCESS){
+		file->corrupt = 1;
+		return FLOG_FAILURE;
+	}
+	file->checked = 1;
+	return FLOG_SUCCESS;
+}
+
+uint16_t flog_check_run(flog_read_file_t * file, uint8_t const * data,
+                        uint_fast8_t run){
+	uint16_t const first = file->sector - run + 1;
+	for(uint_fast8_t i = 0; i < run; i++){
+		if(((i > 0) || !file->checked) &&
+		   (flog_check_sector(file->block, first + i, FS_SECTOR_SIZE,
+		                      data + i * FS_SECTOR_SIZE) != FLOG_SUCCESS)){
+			file->corrupt = 1;
+			file->sector = first + i;
+			file->offset = 0;
+			file->sector_remaining_bytes = FS_SECTOR_SIZE;
+			file->checked = 0;
+			return i * FS_SECTOR_SIZE;
+		}
+	}
+	return run * FS_SECTOR_SIZE;
+}
+#endif
+
+flog_result_t flog_read_file_advance(flog_read_file_t * file,
+                                     flog_spare_batch_t * batch){
+	flog_block_idx_t block;
+	uint16_t sector;
+	uint32_t block_bytes;
+
+#if FLOG_SECTOR_CRC
+	file->checked = 0;
+#endif
+
+	union {
+		uint8_t sector_header;
+		flog_file_tail_sector_header_t file_tail_sector_header;
+		flog_file_init_sector_header_t file_init_sector_header;
+	};
+
+	union {
+		uint8_t sector_spare;
+		flog_file_sector_spare_t file_sector_spare;
+	};
+
+	// We are/were at the end of file, look into the existence of new data
+	// This block is responsible for setting:
+	// -- file->sector_remaining_bytes
+	// -- file->offset
+	// -- file->sector
+	// -- file->block
+	// and bailing if EOF is encountered
+	if(file->sector == FLOG_TAIL_SECTOR){
+		// This was the last sector in the block, check the next
+		flog_open_sector(file->block, FLOG_TAIL_SECTOR);
+		flog_read_sector(&sector_header, FLOG_TAIL_SECTOR, 0,
+						sizeof(flog_file_tail_sector_header_t));
+		block = file_tail_sector_header.next_block;
+		block_bytes = flog_tail_bytes_in_block(&file_tail_sector_header);
+		if(block >= FS_NUM_BLOCKS){
+			// Torn, so there's nothing after
+			return FLOG_FAILURE;
+		}
+		// Now check out that new block and make sure it's legit
+		flog_open_sector(block, FLOG_INIT_SECTOR);
+		flog_read_sector(&sector_header, FLOG_INIT_SECTOR, 0,
+						sizeof(flog_file_init_sector_header_t));
+		if(file_init_sector_header.file_id != file->id){
+			// This next block hasn't been written. EOF for now
+			return FLOG_FAILURE;
+		}
+		flog_get_file_spare(batch, block, FLOG_INIT_SECTOR, &file_sector_spare);
+		if(file_sector_spare.nbytes == FLOG_SECTOR_NBYTES_INVALID){
+			// The header made it but the program failed before the spare
+			return FLOG_FAILURE;
+		}
+
+		file->block = block;
+#if FLOG_ENABLE_COMPRESSION
+		// Compressed files count decoded bytes. Frames don't straddle blocks,
+		// and only advancing past the last frame gets here.
+		file->block_start = file->compressed ? file->read_head :
+		                    file->block_start + block_bytes;
+#else
+		file->block_start += block_bytes;
+#endif
+		file->block_idx += 1;
+		flog_skip_index_record(file);
+
+		file->sector = FLOG_INIT_SECTOR;
+		if(file_sector_spare.nbytes == 0){
+			// It's possible for the first sector to have 0 bytes
+			// Data is in next sector
+			file->offset = sizeof(flog_file_init_sector_header_t);
+			file->sector_remaining_bytes = 0;
+			return flog_read_file_advance(file, batch);
+		}
+	} else {
+		if((file->sector == FLOG_INIT_SECTOR) &&
+		   (file->offset == sizeof(flog_file_init_sector_header_t))){
+			// Nothing was read from the init sector. It may not have been
+			// written when we last looked.
+			flog_get_file_spare(batch, file->block, FLOG_INIT_SECTOR,
+			                    &file_sector_spare);
+			if(file_sector_spare.nbytes == FLOG_SECTOR_NBYTES_INVALID){
+				return FLOG_FAILURE;
+			}
+			if(file_sector_spare.nbytes != 0){
+				file->sector_remaining_bytes = file_sector_spare.nbytes;
+				return FLOG_SUCCESS;
+			}
+		}
+
+		// Increment to next sector but don't necessarily update file
+		// state
+		sector = flog_increment_sector(file->sector);
+
+		flog_get_file_spare(batch, file->block, sector, &file_sector_spare);
+
+		if(file_sector_spare.nbytes == FLOG_SECTOR_NBYTES_INVALID){
+			// We're looking at an empty sector, GTFO
+			return FLOG_FAILURE;
+		} else {
+			file->sector = sector;
+		}
+	}
+
+	file->sector_remaining_bytes = file_sector_spare.nbytes;
+	switch(file->sector){
+	case FLOG_TAIL_SECTOR:
+		file->offset = sizeof(flog_file_tail_sector_header_t);
+		break;
+	case FLOG_INIT_SECTOR:
+		file->offset = sizeof(flog_file_init_sector_header_t);
+		break;
+	default:
+		file->offset = 0;
+	}
+	return FLOG_SUCCESS;
+}
+
+uint16_t flog_sector_header_size(uint16_t sector){
+	switch(sector){
+	case FLOG_TAIL_SECTOR:
+		return sizeof(flog_file_tail_sector_header_t);
+	case FLOG_INIT_SECTOR:
+		return sizeof(flog_file_init_sector_header_t);
+	default:
+		return 0;
+	}
+}
+
+uint32_t flog_write_buffered(flog_write_file_t const * file){
+#if FLOG_ENABLE_COMPRESSION
+	if(file->compress_buffer){
+		return file->compress_fill + file->page_fill + file->offset -
+		       flog_sector_header_size(file->sector);
+	}
+#endif
+	return file->page_fill + file->back_fill + file->offset -
+	       flog_sector_header_size(file->sector);
+}
+
+uint32_t flog_write_locked(flog_write_file_t * file, uint8_t const * src,
+                           uint32_t nbytes){
+	uint32_t count = 0;
+	flog_sector_nbytes_t bytes_written;
+
+#if FLOG_ENABLE_COMPRESSION
+	if(file->compress_buffer){
+		return flog_compress_write(file, src, nbytes);
+	}
+#endif
+
+	while(nbytes){
+		if(flog_block_out_of_use(file->block)){
+			// See flog_commit_file_sector()
+			break;
+		}
+		if((file->page_fill == 0) &&
+		   (nbytes >= FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE) &&
+		   flog_file_page_writable(file)){
+			// Skip the buffers entirely
+			flog_commit_file_page(file, src, FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE);
+			src += FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+			nbytes -= FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+			count += FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+			file->bytes_in_block += FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+			file->write_head += FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+		} else if(file->page_buffer && flog_file_page_writable(file)){
+			// Collect a whole page
+			bytes_written = MIN(nbytes, (uint32_t)(FS_SECTORS_PER_PAGE *
+			                                       FS_SECTOR_SIZE -
+			                                       file->page_fill));
+			memcpy(file->page_buffer + file->page_fill, src, bytes_written);
+			file->page_fill += bytes_written;
+			src += bytes_written;
+			nbytes -= bytes_written;
+			count += bytes_written;
+			file->bytes_in_block += bytes_written;
+			file->write_head += bytes_written;
+			if(file->page_fill == FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE){
+				flog_commit_file_page(file, file->page_buffer, file->page_fill);
+				file->page_fill = 0;
+			}
+		} else if(nbytes >= file->sector_remaining_bytes){
+			bytes_written = file->sector_remaining_bytes;
+			if(flog_commit_file_sector(file, src,
+				file->sector_remaining_bytes) == FLOG_FAILURE){
+				// Couldn't allocate or something
+				break;
+			}
+
+			// Now that sector is completely written
+			src += bytes_written;
+			nbytes -= bytes_written;
+			count += bytes_written;
+		} else {
+			// This is smaller than a sector; cache it
+			memcpy(file->sector_buffer + file->offset, src, nbytes);
+			count += nbytes;
+			file->sector_remaining_bytes -= nbytes;
+			file->offset += nbytes;
+			file->bytes_in_block += nbytes;
+			file->write_head += nbytes;
+			nbytes = 0;
+		}
+		flog_flash_yield();
+	}
+	return count;
+}
+
+uint_fast8_t flog_group_commit_due(flog_write_file_t * file){
+	uint32_t buffered;
+	uint32_t now;
+
+	if(!file->commit_bytes && !file->commit_us){
+		return 0;
+	}
+	buffered = flog_write_buffered(file);
+	if(!buffered){
+		file->commit_armed = 0;
+		return 0;
+	}
+	if(file->commit_bytes && (buffered >= file->commit_bytes)){
+		return 1;
+	}
+	if(!file->commit_us){
+		return 0;
+	}
+	now = fs_get_time_us();
+	if(!file->commit_armed){
+		// Start timing the oldest data we know to be waiting
+		file->commit_armed = 1;
+		file->commit_since = now;
+		return 0;
+	}
+	return now - file->commit_since >= file->commit_us;
+}
+
+uint32_t flogfs_write(flog_write_file_t * file, uint8_t const * src,
+                      uint32_t nbytes){
+	uint32_t count = 0;
+
+	FLOG_STATS_START();
+
+	flog_lock_file(file);
+	flash_lock();
+
+	if(flog_drain_back_buffer(file) == FLOG_SUCCESS){
+		count = flog_write_locked(file, src, nbytes);
+		if(flog_group_commit_due(file)){
+			flog_flush_locked(file);
+		}
+	}
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_WRITE);
+	flash_unlock();
+	flog_unlock_file(file);
+
+	return count;
+}
+
+uint32_t flogfs_writev(flog_write_file_t * file, flog_iovec_t const * iov,
+                       uint16_t iovcnt){
+	uint32_t count = 0;
+	uint32_t n;
+
+	FLOG_STATS_START();
+
+	flog_lock_file(file);
+	flash_lock();
+
+	if(flog_drain_back_buffer(file) == FLOG_SUCCESS){
+		for(uint16_t i = 0; i < iovcnt; i++){
+			n = flog_write_locked(file, iov[i].base, iov[i].len);
+			count += n;
+			if(n < iov[i].len){
+				break;
+			}
+		}
+		if(flog_group_commit_due(file)){
+			flog_flush_locked(file);
+		}
+	}
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_WRITEV);
+	flash_unlock();
+	flog_unlock_file(file);
+
+	return count;
+}
+
+void flogfs_set_group_commit(flog_write_file_t * file, uint32_t max_bytes,
+                             uint32_t max_ms){
+	flog_lock_file(file);
+	file->commit_bytes = max_bytes;
+	file->commit_us = max_ms * 1000;
+	file->commit_armed = 0;
+	flog_unlock_file(file);
+}
+
+uint32_t flogfs_write_try(flog_write_file_t * file, uint8_t const * src,
+                          uint32_t nbytes){
+	uint32_t count = 0;
+	flog_sector_nbytes_t n;
+	flog_result_t result;
+
+	FLOG_STATS_START();
+
+	if(!flog_trylock_file(file)){
+		FLOG_STATS_TRY_RECORD(FLOG_STATS_API_WRITE_TRY);
+		return 0;
+	}
+#if FLOG_ENABLE_COMPRESSION
+	if(file->compress_buffer){
+		flog_unlock_file(file);
+		FLOG_STATS_TRY_RECORD(FLOG_STATS_API_WRITE_TRY);
+		return 0;
+	}
+#endif
+	if(file->page_buffer){
+		flog_unlock_file(file);
+		FLOG_STATS_TRY_RECORD(FLOG_STATS_API_WRITE_TRY);
+		return 0;
+	}
+
+	while(nbytes){
+		if(file->sector_remaining_bytes){
+			n = MIN(nbytes, file->sector_remaining_bytes);
+			memcpy(file->sector_buffer + file->offset, src, n);
+			file->sector_remaining_bytes -= n;
+			file->offset += n;
+			file->bytes_in_block += n;
+			file->write_head += n;
+		} else if(flog_flash_trylock()){
+			// Hand the full sector over and carry on in the space it leaves
+			result = flog_flush_write(file);
+			if(result == FLOG_SUCCESS){
+				flog_take_back_buffer(file);
+			}
+			flash_unlock();
+			if(result != FLOG_SUCCESS){
+				break;
+			}
+			continue;
+		} else if(file->back_buffer && (file->back_fill < FS_SECTOR_SIZE)){
+			n = MIN(nbytes, (uint32_t)(FS_SECTOR_SIZE - file->back_fill));
+			memcpy(file->back_buffer + file->back_fill, src, n);
+			file->back_fill += n;
+		} else {
+			break;
+		}
+		src += n;
+		nbytes -= n;
+		count += n;
+	}
+
+	flog_unlock_file(file);
+	FLOG_STATS_TRY_RECORD(FLOG_STATS_API_WRITE_TRY);
+	return count;
+}
+
+void flog_skip_index_record(flog_read_file_t * file){
+	flog_skip_index_t * const index = file->skip_index;
+	if(!index || (file->block_idx % index->interval)){
+		return;
+	}
+	if(file->block_idx / index->interval != index->n){
+		// Already have it (or can't tell where it goes)
+		return;
+	}
+	if(index->n == index->size){
+		// Thin it out
+		for(uint16_t i = 0; 2 * i < index->n; i++){
+			index->entries[i] = index->entries[2 * i];
+		}
+		index->n = (index->n + 1) / 2;
+		index->interval *= 2;
+		if((file->block_idx % index->interval) ||
+		   (file->block_idx / index->interval != index->n)){
+			return;
+		}
+	}
+	index->entries[index->n].block = file->block;
+	index->entries[index->n].offset = file->block_start;
+	index->n += 1;
+}
+
+void flogfs_set_page_buffer(flog_write_file_t * file, uint8_t * buffer){
+	flog_lock_file(file);
+	flash_lock();
+	if(file->page_fill){
+		flog_commit_file_page(file, file->page_buffer, file->page_fill);
+		file->page_fill = 0;
+	}
+	file->page_buffer = buffer;
+	flash_unlock();
+	flog_unlock_file(file);
+}
+
+void flogfs_set_back_buffer(flog_write_file_t * file, uint8_t * buffer){
+	flog_lock_file(file);
+	flash_lock();
+	flog_drain_back_buffer(file);
+	file->back_buffer = buffer;
+	flash_unlock();
+	flog_unlock_file(file);
+}
+
+flog_result_t flog_flush_locked(flog_write_file_t * file){
+	flog_result_t result;
+
+	result = flog_drain_back_buffer(file);
+#if FLOG_ENABLE_COMPRESSION
+	if(result == FLOG_SUCCESS){
+		result = flog_compress_flush(file);
+	}
+#endif
+
+	if(file->page_fill){
+		flog_commit_file_page(file, file->page_buffer, file->page_fill);
+		file->page_fill = 0;
+	} else if((result == FLOG_SUCCESS) &&
+	          (file->offset > flog_sector_header_size(file->sector))){
+		result = flog_flush_write(file);
+	}
+	flog_flash_wait();
+	file->commit_armed = 0;
+	if(flog_write_file_lost(file)){
+		result = FLOG_FAILURE;
+	}
+	return result;
+}
+
+uint_fast8_t flog_write_file_lost(flog_write_file_t const * file){
+	return (file->lost_programs != flogfs.lost_programs) ||
+	       flog_block_out_of_use(file->block);
+}
+
+flog_result_t flogfs_flush(flog_write_file_t * file){
+	flog_result_t result;
+
+	flog_lock_file(file);
+	flash_lock();
+	result = flog_flush_locked(file);
+	flash_unlock();
+	flog_unlock_file(file);
+	return result;
+}
+
+flog_result_t flogfs_seek(flog_read_file_t * file, uint32_t index){
+	flog_result_t result = FLOG_SUCCESS;
+	flog_file_tail_sector_header_t tail;
+	flog_file_init_sector_header_t init;
+	flog_file_sector_spare_t spare;
+	uint16_t sector;
+	uint16_t header_size;
+	uint32_t remaining;
+
+	FLOG_STATS_START();
+
+	flog_lock_file(file);
+	flash_lock();
+
+#if FLOG_SECTOR_CRC
+	// Give whatever failed another try
+	file->checked = 0;
+	file->corrupt = 0;
+#endif
+
+#if FLOG_ENABLE_COMPRESSION
+	if(file->compressed){
+		result = flog_seek_frames(file, index);
+		FLOG_STATS_RECORD(FLOG_STATS_API_SEEK);
+		flash_unlock();
+		flog_unlock_file(file);
+		return result;
+	}
+#endif
+
+	if(index < file->block_start){
+		// Start over from the beginning
+		file->block = file->first_block;
+		file->block_idx = 0;
+		file->block_start = 0;
+	}
+
+	flog_skip_index_seek(file, index);
+
+	// Hop over whole blocks
+	while(1){
+		flog_open_sector(file->block, FLOG_TAIL_SECTOR);
+		flog_read_sector((uint8_t *)&tail, FLOG_TAIL_SECTOR, 0, sizeof(tail));
+		if((tail.timestamp == FLOG_TIMESTAMP_INVALID) ||
+		   (tail.next_block >= FS_NUM_BLOCKS) ||
+		   (index < file->block_start + flog_tail_bytes_in_block(&tail))){
+			break;
+		}
+		flog_open_sector(tail.next_block, FLOG_INIT_SECTOR);
+		flog_read_sector((uint8_t *)&init, FLOG_INIT_SECTOR, 0, sizeof(init));
+		if(init.file_id != file->id){
+			// The next block hasn't been written yet
+			break;
+		}
+		file->block = tail.next_block;
+		file->block_start += flog_tail_bytes_in_block(&tail);
+		file->block_idx += 1;
+		flog_skip_index_record(file);
+		flog_flash_yield();
+	}
+
+	// Find the sector within the block
+	remaining = index - file->block_start;
+	file->sector = FLOG_INIT_SECTOR;
+	file->offset = sizeof(flog_file_init_sector_header_t);
+	file->sector_remaining_bytes = 0;
+	for(sector = FLOG_INIT_SECTOR;; sector = flog_increment_sector(sector)){
+		flog_open_sector(file->block, sector);
+		flog_read_spare((uint8_t *)&spare, sector);
+		if(spare.nbytes == FLOG_SECTOR_NBYTES_INVALID){
+			// Past the end; stay at the end of the last sector
+			result = FLOG_FAILURE;
+			break;
+		}
+		switch(sector){
+		case FLOG_TAIL_SECTOR:
+			header_size = sizeof(flog_file_tail_sector_header_t);
+			break;
+		case FLOG_INIT_SECTOR:
+			header_size = sizeof(flog_file_init_sector_header_t);
+			break;
+		default:
+			header_size = 0;
+		}
+		file->sector = sector;
+		if(remaining <= spare.nbytes){
+			file->offset = header_size + remaining;
+			file->sector_remaining_bytes = spare.nbytes - remaining;
+			remaining = 0;
+			break;
+		}
+		remaining -= spare.nbytes;
+		file->offset = header_size + spare.nbytes;
+		if(sector == FLOG_TAIL_SECTOR){
+			result = FLOG_FAILURE;
+			break;
+		}
+	}
+	file->read_head = index - remaining;
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_SEEK);
+	flash_unlock();
+	flog_unlock_file(file);
+	return result;
+}
+
+uint_fast8_t flog_skip_index_seek(flog_read_file_t * file, uint32_t index){
+	flog_skip_index_t const * const skip = file->skip_index;
+	uint16_t lo = 0, hi;
+
+	if(!skip || !skip->n){
+		return 0;
+	}
+	// Find the last entry at or before index
+	hi = skip->n;
+	while(hi - lo > 1){
+		uint16_t const mid = lo + (hi - lo) / 2;
+		if(skip->entries[mid].offset <= index){
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	if((skip->entries[lo].offset > index) ||
+	   (skip->entries[lo].offset <= file->block_start)){
+		return 0;
+	}
+	file->block = skip->entries[lo].block;
+	file->block_idx = lo * skip->interval;
+	file->block_start = skip->entries[lo].offset;
+	return 1;
+}
+
+void flogfs_set_skip_index(flog_read_file_t * file, flog_skip_index_t * index,
+                           flog_skip_entry_t * entries, uint16_t size,
+                           uint16_t interval){
+	flog_lock_file(file);
+	index->entries = entries;
+	index->size = size;
+	index->n = 0;
+	index->interval = interval ? interval : 1;
+	file->skip_index = size ? index : nullptr;
+	if(file->skip_index){
+		// The first block is always known
+		index->entries[0].block = file->first_block;
+		index->entries[0].offset = 0;
+		index->n = 1;
+	}
+	flog_unlock_file(file);
+}
+
+#if FLOG_SECTOR_CRC
+void flogfs_set_verify(flog_read_file_t * file, uint8_t verify){
+	flog_lock_file(file);
+	file->verify = verify;
+	file->checked = 0;
+	flog_unlock_file(file);
+}
+#endif
+
+void flog_write_file_reset(flog_write_file_t * file){
+#if FLOG_BUILD_CPP
+	file->vol = this;
+#endif
+	file->base_threshold = 0;
+	file->page_buffer = nullptr;
+	file->page_fill = 0;
+	file->back_buffer = nullptr;
+	file->back_fill = 0;
+	file->init_written = 0;
+	file->commit_bytes = 0;
+	file->commit_us = 0;
+	file->commit_armed = 0;
+	file->cold = 0;
+#if FLOG_ENABLE_COMPRESSION
+	file->compress_buffer = nullptr;
+	file->compress_fill = 0;
+#endif
+}
+
+flog_result_t flog_file_create(flog_write_file_t * file, char const * filename,
+                               uint8_t flags, flog_inode_iterator_t * iter){
+	flog_block_alloc_t alloc_block;
+
+	union {
+		uint8_t sector_buffer;
+		flog_inode_file_allocation_t inode_file_allocation_sector;
+	};
+	union {
+		uint8_t spare_buffer;
+		flog_inode_entry_spare_t inode_entry_spare;
+	};
+
+	// Get a new inode entry
+	if(flog_inode_prepare_new(iter) != FLOG_SUCCESS){
+		// Somehow couldn't allocate an inode entry
+		return FLOG_FAILURE;
+	}
+#if FS_FILE_INDEX_SIZE
+	// This may have linked a new inode block
+	flogfs.file_index.tail = *iter;
+#endif
+
+	// Configure inode to write
+	strcpy(inode_file_allocation_sector.filename, filename);
+	inode_file_allocation_sector.filename[FLOG_MAX_FNAME_LEN-1] = '\0';
+
+	file->id = flogfs.max_file_id + 1;
+
+	flog_lock_allocate();
+
+	flog_flush_dirty_block();
+
+	if(file->cold){
+		alloc_block = flog_allocate_worn_block();
+	} else {
+		alloc_block = flog_allocate_block(file->base_threshold,
+		                                  FLOG_PLANE_ANY);
+	}
+	if(alloc_block.block == FLOG_BLOCK_IDX_INVALID){
+		flog_unlock_allocate();
+		// Couldn't allocate a block
+		return FLOG_FAILURE;
+	}
+
+	flog_checkpoint_journal_alloc(&alloc_block, FLOG_BLOCK_IDX_INVALID);
+
+	flogfs.dirty_block.block = alloc_block.block;
+	flogfs.dirty_block.age = alloc_block.age + 1;
+	flogfs.dirty_block.file_id = file->id;
+	flogfs.dirty_block.file = file;
+
+	flog_unlock_allocate();
+
+	inode_file_allocation_sector.header.file_id = ++flogfs.max_file_id;
+	inode_file_allocation_sector.header.first_block = alloc_block.block;
+	inode_file_allocation_sector.header.first_block_age = ++alloc_block.age;
+	inode_file_allocation_sector.header.timestamp = ++flogfs.t;
+
+	inode_entry_spare.format = FLOG_INODE_ENTRY_FORMAT_SUMMARY;
+	inode_entry_spare.flags = flags;
+	inode_entry_spare.name_hash =
+	   flog_filename_hash(inode_file_allocation_sector.filename);
+
+	// Write the new inode entry
+	flog_open_sector(iter->block,iter->sector);
+	flog_write_sector(&sector_buffer, iter->sector, 0,
+	                   sizeof(flog_inode_file_allocation_t));
+	flog_write_spare(&spare_buffer, iter->sector);
+	flog_commit();
+
+#if FS_FILE_INDEX_SIZE
+	if(!(flags & FLOG_INODE_ENTRY_COPY)){
+		flog_file_index_add(inode_entry_spare.name_hash, iter,
+		                    alloc_block.block,
+		                    flogfs.max_file_id);
+	}
+	flog_inode_iterator_next(&flogfs.file_index.tail);
+#endif
+
+	file->block = alloc_block.block;
+	file->block_age = alloc_block.age;
+	file->bytes_in_block = 0;
+	file->write_head = 0;
+	file->sector = FLOG_INIT_SECTOR;
+	file->offset = sizeof(flog_file_init_sector_header_t);
+	file->sector_remaining_bytes = FS_SECTOR_SIZE -
+	                               sizeof(flog_file_init_sector_header_t);
+
+	return FLOG_SUCCESS;
+}
+
+flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename){
+	flog_write_file_reset(file);
+	return flog_open_write(file, filename);
+}
+
+#if FLOG_ENABLE_COMPRESSION
+flog_result_t flogfs_open_write_compressed(flog_write_file_t * file,
+                                           char const * filename,
+                                           flog_compression_t codec,
+                                           uint16_t record_size,
+                                           uint8_t * buffer){
+	if(!buffer || (record_size & 1) || (record_size > 510) ||
+	   ((codec != FLOG_COMPRESS_LZ) && (codec != FLOG_COMPRESS_DELTA))){
+		return FLOG_FAILURE;
+	}
+	flog_write_file_reset(file);
+	file->compress_buffer = buffer;
+	file->codec = codec;
+	file->codec_param = record_size ? record_size / 2 : 1;
+	return flog_open_write(file, filename);
+}
+#endif
+
+flog_result_t flog_open_write(flog_write_file_t * file, char const * filename){
+	flog_inode_iterator_t inode_iter;
+	flog_file_find_result_t find_result;
+	flog_file_tail_t tail;
+	uint8_t flags = 0;
+
+	FLOG_STATS_START();
+
+#if FLOG_ENABLE_COMPRESSION
+	if(file->compress_buffer){
+		flags = FLOG_INODE_ENTRY_COMPRESSED;
+	}
+#endif
+
+	flog_lock_inodes_write();
+	flash_lock();
+
+	file->lost_programs = flogfs.lost_programs;
+	find_result = flog_find_file(filename, &inode_iter);
+
+	if(find_result.first_block != FLOG_BLOCK_IDX_INVALID){
+		// TODO: Make sure file isn't already open for writing
+
+		if((find_result.flags & FLOG_INODE_ENTRY_COMPRESSED) != flags){
+			// Mixing plain and compressed data would garble it
+			goto failure;
+		}
+
+		// File already exists
+		file->id = find_result.file_id;
+		flog_file_get_tail(find_result.first_block, file->id, &tail);
+		// It's about to move
+		flog_file_set_tail(file->id, nullptr);
+
+		file->block = tail.block;
+		file->sector = tail.sector;
+		file->write_head = tail.length;
+		file->bytes_in_block = tail.bytes_in_block;
+		if(file->sector == FLOG_TAIL_SECTOR){
+			file->offset = sizeof(flog_file_tail_sector_header_t);
+		} else {
+			file->offset = 0;
+		}
+		file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+	} else {
+		// File doesn't exist
+		if(flog_file_create(file, filename, flags, &inode_iter) !=
+		   FLOG_SUCCESS){
+			goto failure;
+		}
+	}
+
+	// Add it to that list
+	file->next = 0;
+	flog_lock_fs();
+	if(flogfs.write_head == 0){
+		flogfs.write_head = file;
+	} else {
+		flog_write_file_t * file_iter;
+		for(file_iter = flogfs.write_head;
+		    file_iter->next;
+		    file_iter = file_iter->next);
+		file_iter->next = file;
+	}
+	flog_unlock_fs();
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_OPEN_WRITE);
+	flash_unlock();
+	flog_unlock_inodes_write();
+
+	return FLOG_SUCCESS;
+
+failure:
+	FLOG_STATS_RECORD(FLOG_STATS_API_OPEN_WRITE);
+	flash_unlock();
+	flog_unlock_inodes_write();
+
+	return FLOG_FAILURE;
+}
+
+flog_result_t flog_finish_write(flog_write_file_t * file){
+	flog_result_t result = FLOG_SUCCESS;
+
+#if FLOG_ENABLE_COMPRESSION
+	result = flog_compress_flush(file);
+#endif
+	if(file->page_fill){
+		flog_commit_file_page(file, file->page_buffer, file->page_fill);
+		file->page_fill = 0;
+	}
+	if(result == FLOG_SUCCESS){
+		result = flog_drain_back_buffer(file);
+	}
+	if(result == FLOG_SUCCESS){
+		result = flog_flush_write(file);
+	}
+
+	flog_lock_allocate();
+	if(flogfs.dirty_block.file == file){
+		// Ending right at a block boundary leaves a fresh block behind. Don't
+		// leave it to be initialized through a stale file structure.
+		flog_flush_dirty_block();
+	}
+	flog_unlock_allocate();
+	flog_flash_wait();
+	if(flog_write_file_lost(file)){
+		result = FLOG_FAILURE;
+	}
+	return result;
+}
+
+void flog_remember_write_tail(flog_write_file_t const * file,
+                              flog_result_t result){
+	flog_file_tail_t tail;
+
+	if(result != FLOG_SUCCESS){
+		flog_file_set_tail(file->id, nullptr);
+		return;
+	}
+	tail.block = file->block;
+	tail.sector = file->sector;
+	if(tail.sector == FLOG_INIT_SECTOR){
+		// The tail sector went last. The next block's init sector was
+		// just written without data.
+		tail.sector = flog_increment_sector(FLOG_INIT_SECTOR);
+	}
+	tail.bytes_in_block = file->bytes_in_block;
+	tail.length = file->write_head;
+	flog_file_set_tail(file->id, &tail);
+}
+
+/*!
+ @details
+ ### Internals
+ To close a write, all outstanding data must simply be flushed to flash. If any
+ blocks are newly-allocated, they must be committed. Where the file now ends is
+ remembered so reopening it doesn't have to walk the chain.
+
+ TODO: Deal with files that can't be flushed due to no space for allocation
+ */
+flog_result_t flogfs_close_write(flog_write_file_t * file){
+	flog_write_file_t * iter;
+	flog_result_t result;
+
+
+	FLOG_STATS_START();
+
+	flog_lock_file(file);
+	flog_lock_fs();
+	if(flogfs.write_head == file){
+		flogfs.write_head = file->next;
+	} else {
+		for(iter = flogfs.write_head; iter && (iter->next != file);
+		    iter = iter->next);
+		if(!iter){
+			// It wasn't open
+			flog_unlock_fs();
+			goto failure;
+		}
+		iter->next = file->next;
+	}
+	flog_unlock_fs();
+
+	flash_lock();
+
+	result = flog_finish_write(file);
+	flog_remember_write_tail(file, result);
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_CLOSE_WRITE);
+	flash_unlock();
+	flog_unlock_file(file);
+
+	return result;
+
+failure:
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_CLOSE_WRITE);
+	flog_unlock_file(file);
+	return FLOG_FAILURE;
+}
+
+flog_result_t flog_file_remove(flog_inode_iterator_t const * iter,
+                               flog_file_find_result_t const * file,
+                               char const * filename){
+	flog_block_idx_t block, next_block;
+	uint32_t const lost_programs = flogfs.lost_programs;
+
+	union {
+		uint8_t sector_buffer;
+		flog_inode_file_invalidation_t invalidation_buffer;
+	};
+	union {
+		uint8_t spare_buffer;
+		flog_inode_entry_spare_t inode_entry_spare;
+	};
+
+	// Navigate to the end to find the last block
+	block = file->first_block;
+	while(1){
+		next_block = flog_universal_get_next_block(block);
+		if(next_block == FLOG_BLOCK_IDX_INVALID){
+			// THIS IS THE LAST BLOCK
+			break;
+		}
+		block = next_block;
+	}
+
+	// Invalidate the inode entry
+	invalidation_buffer.last_block = block;
+	invalidation_buffer.timestamp = ++flogfs.t;
+	// Marking the spare lets scans skip the entry without reading it
+	inode_entry_spare.format = FLOG_INODE_ENTRY_FORMAT_SUMMARY;
+	inode_entry_spare.flags = 0;
+	inode_entry_spare.name_hash = flog_filename_hash(filename);
+	flog_open_sector(iter->block, iter->sector + 1);
+	flog_write_sector(&sector_buffer, iter->sector + 1, 0,
+	                   sizeof(flog_inode_file_invalidation_t));
+	flog_write_spare(&spare_buffer, iter->sector + 1);
+	flog_commit();
+	// A disk failure here can be recovered in mounting
+	flog_flash_wait_plane(flog_block_plane(iter->block));
+	if(flogfs.lost_programs != lost_programs){
+		// The entry may still lead to them
+		return FLOG_FAILURE;
+	}
+
+#if FS_FILE_INDEX_SIZE
+	flog_file_index_remove(filename, iter);
+#endif
+
+	// Invalidate the file block chain
+	flog_delete_chain(file->first_block, file->file_id);
+	return FLOG_SUCCESS;
+}
+
+#if FLOG_WEAR_LEVEL_SPREAD
+void flog_inode_find_free(flog_inode_iterator_t * iter){
+	uint16_t name_hash;
+
+#if FS_FILE_INDEX_SIZE
+	if(flogfs.file_index.complete){
+		*iter = flogfs.file_index.tail;
+		return;
+	}
+#endif
+	for(flog_inode_iterator_init(iter, flogfs.inode0);
+	    flog_inode_get_entry_state(iter, &name_hash, nullptr) !=
+	    FLOG_INODE_ENTRY_FREE;
+	    flog_inode_iterator_next(iter));
+}
+#endif
+
+void flog_mount_check_copy(flog_inode_iterator_t const * iter){
+	flog_inode_iterator_t current;
+	flog_file_find_result_t copy;
+
+	union {
+		uint8_t sector_buffer;
+		flog_inode_file_allocation_t inode_file_allocation_sector;
+	};
+
+	flog_open_sector(iter->block, iter->sector);
+	flog_read_sector(&sector_buffer, iter->sector, 0,
+	                  sizeof(flog_inode_file_allocation_t));
+	flog_find_file(inode_file_allocation_sector.filename, &current);
+	if((current.block == iter->block) && (current.sector == iter->sector)){
+		// The original is gone, so the copy is all there is
+		return;
+	}
+	// The original is intact and the copy may not be
+	copy.first_block = inode_file_allocation_sector.header.first_block;
+	copy.file_id = inode_file_allocation_sector.header.file_id;
+	flog_file_remove(iter, &copy, inode_file_allocation_sector.filename);
+}
+
+flog_result_t flogfs_rm(char const * filename){
+	flog_file_find_result_t find_result;
+	flog_inode_iterator_t inode_iter;
+	uint32_t lost_programs;
+
+	FLOG_STATS_START();
+
+	flog_lock_inodes_write();
+	flash_lock();
+
+	find_result = flog_find_file(filename, &inode_iter);
+
+	if(find_result.first_block == FLOG_BLOCK_IDX_INVALID){
+		// Cool! The file already doesn't exist.
+		// No work to be done here.
+		goto failure;
+	}
+
+	lost_programs = flogfs.lost_programs;
+	flog_file_remove(&inode_iter, &find_result, filename);
+	flog_flash_wait();
+	if(flogfs.lost_programs != lost_programs){
+		// The deletion may not have made it
+		goto failure;
+	}
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_RM);
+	flash_unlock();
+	flog_unlock_inodes_write();
+	return FLOG_SUCCESS;
+
+failure:
+	FLOG_STATS_RECORD(FLOG_STATS_API_RM);
+	flash_unlock();
+	flog_unlock_inodes_write();
+	return FLOG_FAILURE;
+}
+
+
+/*!
+ @details
+ ### Internals
+ An open writer knows its own length. Otherwise this is the length recorded by
+ the last close or walk, if the file index has it.
+ */
+flog_result_t flogfs_size(char const * filename, uint32_t * size){
+	flog_file_find_result_t find_result;
+	flog_inode_iterator_t inode_iter;
+
+	FLOG_STATS_START();
+
+	flog_lock_inodes_read();
+	flash_lock();
+
+	find_result = flog_find_file(filename, &inode_iter);
+	if(find_result.first_block == FLOG_BLOCK_IDX_INVALID){
+		FLOG_STATS_RECORD(FLOG_STATS_API_SIZE);
+		flash_unlock();
+		flog_unlock_inodes_read();
+		return FLOG_FAILURE;
+	}
+	*size = flog_file_size(find_result.first_block, find_result.file_id);
+
+	FLOG_STATS_RECORD(FLOG_STATS_API_SIZE);
+	flash_unlock();
+	flog_unlock_inodes_read();
+	return FLOG_SUCCESS;
+}
+
+#if FLOG_ENABLE_COMPRESSION
+flog_result_t flogfs_size_decompressed(char const * filename, uint32_t * size){
+	flog_read_file_t file;
+
+	if(flogfs_open_read(&file, filename) != FLOG_SUCCESS){
+		return FLOG_FAILURE;
+	}
+	if(!file.compressed){
+		flogfs_close_read(&file);
+		return flogfs_size(filename, size);
+	}
+	// Every frame is passed over without being decoded
+	flogfs_seek(&file, 0xFFFFFFFF);
+	*size = file.read_head;
+	flogfs_close_read(&file);
+	return FLOG_SUCCESS;
+}
+#endif
+
+uint32_t flog_file_size(flog_block_idx_t first_block, flog_file_id_t file_id){
+	flog_write_file_t * writer;
+	flog_file_tail_t tail;
+	uint32_t size;
+
+	flog_lock_fs();
+	while(1){
+		for(writer = flogfs.write_head; writer; writer = writer->next){
+			if(writer->id == file_id){
+				break;
 			}
-			
-			if(file_init_sector_header.file_id > flogfs.max_file_id){
-				flogfs.max_file_id = file_init_sector_header.file_id;
+		}
+		// Its length only holds still under its lock
+		if(!writer || flog_trylock_file(writer)){
+			break;
+		}
+		// It's busy writing. Let it have the flash and look again.
+		flog_unlock_fs();
+		flog_flash_yield();
+		flog_lock_fs();
+	}
+	flog_unlock_fs();
+
+	if(writer){
+		// It can't leave the list while we hold its lock
+		size = writer->write_head + writer->back_fill;
+		flog_unlock_file(writer);
+	} else {
+		flog_file_get_tail(first_block, file_id, &tail);
+		size = tail.length;
+	}
+	return size;
+}
+
+
+
+/*!
+ @details
+ ### Internals
+ Entries are added in timestamp order, so the listing ends at the first one
+ newer than flogfs_t::t at the start. Wear leveling is the one thing that
+ would move a file to a new entry, so it waits.
+ */
+void flogfs_start_ls(flogfs_ls_iterator_t * iter){
+	flog_lock_inodes_read();
+	flash_lock();
+	flog_inode_iterator_init(&iter->inode, flogfs.inode0);
+	iter->timestamp = flogfs.t;
+#if FLOG_WEAR_LEVEL_SPREAD
+	flog_lock_allocate();
+	flogfs.wear.listings += 1;
+	flog_unlock_allocate();
+#endif
+	flash_unlock();
+	flog_unlock_inodes_read();
+#if FLOG_BUILD_CPP
+	iter->vol = this;
+#endif
+}
+
+uint_fast8_t flog_ls_next(flogfs_ls_iterator_t * iter,
+                          flog_inode_file_allocation_t * entry){
+	flog_inode_entry_state_t state;
+	uint16_t name_hash;
+
+	if(iter->inode.block == FLOG_BLOCK_IDX_INVALID){
+		// Stopped
+		return 0;
+	}
+	while(1){
+		state = flog_inode_get_entry_state(&iter->inode, &name_hash, nullptr);
+		if(state == FLOG_INODE_ENTRY_FREE){
+			// Nothing here. Done.
+			return 0;
+		}
+		if(state != FLOG_INODE_ENTRY_DELETED){
+			// This file's good
+			flog_open_sector(iter->inode.block, iter->inode.sector);
+			flog_read_sector((uint8_t *)entry, iter->inode.sector, 0,
+			                  sizeof(flog_inode_file_allocation_t));
+			if(entry->header.timestamp > iter->timestamp){
+				// Created since the start, as is everything after it
+				return 0;
+			}
+			entry->filename[FLOG_MAX_FNAME_LEN-1] = '\0';
+			flog_inode_iterator_next(&iter->inode);
+			return 1;
+		}
+		flog_inode_iterator_next(&iter->inode);
+	}
+}
+
+uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t * iter, char * fname_dst){
+	union {
+		uint8_t sector_buffer;
+		flog_inode_file_allocation_t inode_file_allocation_sector;
+	};
+	uint_fast8_t result;
+
+	flog_lock_inodes_read();
+	flash_lock();
+	result = flog_ls_next(iter, &inode_file_allocation_sector);
+	if(result){
+		memcpy(fname_dst, inode_file_allocation_sector.filename,
+		       FLOG_MAX_FNAME_LEN);
+	}
+	flash_unlock();
+	flog_unlock_inodes_read();
+	return result;
+}
+
+uint_fast8_t flogfs_ls_iterate_entry(flogfs_ls_iterator_t * iter,
+                                     char const * prefix,
+                                     flogfs_ls_entry_t * entry){
+	union {
+		uint8_t sector_buffer;
+		flog_inode_file_allocation_t inode_file_allocation_sector;
+	};
+	size_t const prefix_len = prefix ? strlen(prefix) : 0;
+	uint_fast8_t result;
+
+	flog_lock_inodes_read();
+	flash_lock();
+	while((result = flog_ls_next(iter, &inode_file_allocation_sector))){
+		if(!prefix || (strncmp(inode_file_allocation_sector.filename, prefix,
+		                       prefix_len) == 0)){
+			break;
+		}
+	}
+	if(result){
+		memcpy(entry->name, inode_file_allocation_sector.filename,
+		       FLOG_MAX_FNAME_LEN);
+		entry->file_id = inode_file_allocation_sector.header.file_id;
+		entry->first_block = inode_file_allocation_sector.header.first_block;
+		entry->timestamp = inode_file_allocation_sector.header.timestamp;
+		entry->size = flog_file_size(entry->first_block, entry->file_id);
+	}
+	flash_unlock();
+	flog_unlock_inodes_read();
+	return result;
+}
+
+void flogfs_stop_ls(flogfs_ls_iterator_t * iter){
+	if(iter->inode.block == FLOG_BLOCK_IDX_INVALID){
+		// Already stopped, and mustn't let another listing's count go
+		return;
+	}
+	// Iterating from here on finds nothing
+	iter->inode.block = FLOG_BLOCK_IDX_INVALID;
+#if FLOG_WEAR_LEVEL_SPREAD
+	flog_lock_allocate();
+	if(flogfs.wear.listings){
+		flogfs.wear.listings -= 1;
+	}
+	flog_unlock_allocate();
+#endif
+}
+
+#if FLOG_ENABLE_STATS
+void flogfs_get_stats(flogfs_stats_t * stats){
+	flash_lock();
+	flog_lock_fs();
+	*stats = flogfs.stats;
+	flog_unlock_fs();
+	flash_unlock();
+}
+
+void flogfs_reset_stats(){
+	flash_lock();
+	flog_lock_fs();
+	memset(&flogfs.stats, 0, sizeof(flogfs.stats));
+	flog_unlock_fs();
+	flash_unlock();
+}
+#endif
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Static implementations
+///////////////////////////////////////////////////////////////////////////////
+
+flog_result_t flog_commit_file_sector(flog_write_file_t * file,
+                                      uint8_t const * data,
+                                      flog_sector_nbytes_t n){
+	flog_file_sector_spare_t file_sector_spare;
+	if(flog_block_out_of_use(file->block)){
+		// Nothing took over when it failed, so it can't be trusted with more
+		return FLOG_FAILURE;
+	}
+	if(file->sector == FLOG_TAIL_SECTOR){
+		// We need a new block
+		flog_block_alloc_t next_block;
+		flog_file_tail_sector_header_t * const file_tail_sector_header =
+		   (flog_file_tail_sector_header_t *) file->sector_buffer;
+
+		flog_lock_allocate();
+
+		flog_flush_dirty_block();
+
+		if(file->cold){
+			next_block = flog_allocate_worn_block();
+		} else {
+			// Keep consecutive blocks off the same plane
+			next_block = flog_allocate_block(file->base_threshold,
+			                                 flog_block_plane(file->block + 1));
+		}
+		if(next_block.block == FLOG_BLOCK_IDX_INVALID){
+			// Can't write the last sector without sealing the file.
+			// Bailing
+			flog_unlock_allocate();
+			return FLOG_FAILURE;
+		}
+
+		flog_checkpoint_journal_alloc(&next_block, file->block);
+
+		// Our erase makes it one older, as the tail will say
+		flogfs.dirty_block.block = next_block.block;
+		flogfs.dirty_block.age = next_block.age + 1;
+		flogfs.dirty_block.file_id = file->id;
+		flogfs.dirty_block.file = file;
+		file->init_written = 0;
+
+		flog_unlock_allocate();
+
+		// Prepare the header
+		file_tail_sector_header->next_age = next_block.age + 1;
+		file_tail_sector_header->next_block = next_block.block;
+		file_tail_sector_header->timestamp = ++flogfs.t;
+		// Buffered bytes were already counted
+		file->bytes_in_block += n;
+		file_sector_spare.nbytes =
+			file->offset + n - sizeof(flog_file_tail_sector_header_t);
+		file_tail_sector_header->bytes_in_block = file->bytes_in_block;
+
+		flog_open_sector(file->block, FLOG_TAIL_SECTOR);
+		// First write what was already buffered (and the header)
+		flog_write_sector((uint8_t const *)file_tail_sector_header,
+						FLOG_TAIL_SECTOR, 0, file->offset);
+		// Now write the rest of the data
+		if(n){
+			flog_write_sector(data, FLOG_TAIL_SECTOR, file->offset, n);
+		}
+		flog_write_spare((uint8_t const *)&file_sector_spare,
+		                  FLOG_TAIL_SECTOR);
+#if FLOG_SECTOR_CRC
+		flog_write_spare_check(flog_sector_crc(flog_sector_crc(0,
+		   file->sector_buffer, file->offset), data, n), FLOG_TAIL_SECTOR);
+#endif
+		flog_commit();
+
+		// Ready the file structure for the next block/sector
+		file->block = next_block.block;
+		file->block_age = next_block.age + 1;
+		file->sector = FLOG_INIT_SECTOR;
+		file->sector_remaining_bytes =
+		   FS_SECTOR_SIZE - sizeof(flog_file_init_sector_header_t);
+		file->bytes_in_block = 0;
+		file->offset = sizeof(flog_file_init_sector_header_t);
+		file->write_head += n;
+		return FLOG_SUCCESS;
+	} else {
+		flog_file_init_sector_header_t * const file_init_sector_header =
+			(flog_file_init_sector_header_t *) file->sector_buffer;
+		uint_fast8_t init_written;
+
+		flog_lock_allocate();
+		// So if this block is the dirty block...
+		if(flogfs.dirty_block.file == file){
+			flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+			flogfs.dirty_block.file = nullptr;
+		}
+		init_written = file->init_written;
+		file->init_written = 0;
+		flog_unlock_allocate();
+
+		if(init_written){
+			// The init sector was claimed without us. Move anything buffered
+			// for it along to the next sector.
+			file->offset -= sizeof(flog_file_init_sector_header_t);
+			memmove(file->sector_buffer, file->sector_buffer +
+			        sizeof(flog_file_init_sector_header_t), file->offset);
+			file->sector = flog_increment_sector(FLOG_INIT_SECTOR);
+			file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+			if(file->offset + n == 0){
+				return FLOG_SUCCESS;
 			}
+		}
 
-			break;
-		case FLOG_BLOCK_TYPE_UNALLOCATED:
-			flog_get_block_stat(i, &stat_sector);
-			flogfs.num_free_blocks += 1;
-			flogfs.free_block_bitmap[i / 8] |= (1 << (i % 8));
-			flogfs.free_block_sum += stat_sector.age;
-			break;
-		default:
-			flash_debug_error("FLogFS:" LINESTR);
-			goto failure;
+		file_sector_spare.type_id = FLOG_BLOCK_TYPE_FILE;
+		file_sector_spare.nbytes = file->offset + n;
+
+		// We need to just write the data and advance
+		if(file->sector == FLOG_INIT_SECTOR){
+			// Need to prepare sector 0 header
+			file_init_sector_header->timestamp = flogfs.t;
+			file_init_sector_header->file_id = file->id;
+			file_init_sector_header->age = file->block_age;
+			file_sector_spare.nbytes -= sizeof(flog_file_init_sector_header_t);
 		}
-		
-		age = flog_block_get_age(i);
-		// Check if this is a really old block
-		if((age != FLOG_BLOCK_AGE_INVALID) && (age > max_block_age)){
-			max_block_age = age;
+
+		flog_open_sector(file->block, file->sector);
+		if(file->offset){
+			// This is either sector 0 or there was data already
+			// First write prior data/header
+			flog_write_sector(file->sector_buffer, file->sector, 0, file->offset);
 		}
-		
-		continue;
-update_last_allocation:
-		last_allocation.timestamp = universal_tail_sector.timestamp;
-		last_allocation.block = universal_tail_sector.next_block;
-		last_allocation.age = universal_tail_sector.next_age;
+		if(n){
+			flog_write_sector(data, file->sector, file->offset, n);
+		}
+		flog_write_spare((uint8_t const *)&file_sector_spare, file->sector);
+#if FLOG_SECTOR_CRC
+		flog_write_spare_check(flog_sector_crc(flog_sector_crc(0,
+		   file->sector_buffer, file->offset), data, n), file->sector);
+#endif
+		flog_commit();
+
+		// Now update stuff for the new sector
+		file->sector = flog_increment_sector(file->sector);
+		if(file->sector == FLOG_TAIL_SECTOR){
+			file->offset = sizeof(flog_file_tail_sector_header_t);
+		} else {
+			file->offset = 0;
+		}
+		file->bytes_in_block += n;
+		file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+		file->write_head += n;
+		return FLOG_SUCCESS;
 	}
-	
-	flogfs.mean_free_age = flogfs.free_block_sum / flogfs.num_free_blocks;
-	
-	if(inode0_idx == FLOG_BLOCK_IDX_INVALID){
-		flash_debug_error("FLogFS:" LINESTR);
-		goto failure;
+}
+
+uint_fast8_t flog_file_page_writable(flog_write_file_t const * file){
+	// Page 0 holds the headers and the tail sector. Every other page is
+	// nothing but data sectors.
+	return (file->offset == 0) &&
+	       (file->sector >= FS_SECTORS_PER_PAGE) &&
+	       (file->sector % FS_SECTORS_PER_PAGE == 0);
+}
+
+void flog_commit_file_page(flog_write_file_t * file, uint8_t const * data,
+                           uint16_t n){
+	flog_file_sector_spare_t file_sector_spare;
+	uint_fast8_t i;
+
+	file_sector_spare.type_id = FLOG_BLOCK_TYPE_FILE;
+
+	flog_open_sector(file->block, file->sector);
+	for(i = 0; n; i++){
+		file_sector_spare.nbytes = MIN(n, FS_SECTOR_SIZE);
+		flog_write_sector(data, file->sector + i, 0, file_sector_spare.nbytes);
+		flog_write_spare((uint8_t const *)&file_sector_spare,
+		                 file->sector + i);
+#if FLOG_SECTOR_CRC
+		flog_write_spare_check(flog_sector_crc(0, data,
+		                                       file_sector_spare.nbytes),
+		                       file->sector + i);
+#endif
+		data += file_sector_spare.nbytes;
+		n -= file_sector_spare.nbytes;
 	}
+	flog_commit();
 
-	////////////////////////////////////////////////////////////
-	// Now iterate through the inode chain, finding:
-	// - Most recent file deletion
-	// - Most recent file allocation
-	// - Max file ID
-	////////////////////////////////////////////////////////////
+	file->sector = flog_increment_sector(file->sector + i - 1);
+	if(file->sector == FLOG_TAIL_SECTOR){
+		file->offset = sizeof(flog_file_tail_sector_header_t);
+	} else {
+		file->offset = 0;
+	}
+	file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+}
 
-	done_scanning = 0;
-	// THE OLD INODE CHAIN
-	for(flog_inode_iterator_init(&inode_iter, inode0_idx);;
-		flog_inode_iterator_next(&inode_iter)){
-		
-		flog_open_sector(inode_iter.block, inode_iter.sector);
-		flash_read_sector(&sector_buffer, inode_iter.sector, 0,
-		                  sizeof(flog_inode_file_allocation_header_t));
-		if(inode_file_allocation_sector.file_id == FLOG_FILE_ID_INVALID){
-			// Passed the last file
-			// When iterating across an incomplete inode table deletion, this
-			// will also catch and finish the routine
-			break;
+flog_result_t flog_flush_write (flog_write_file_t * file ){
+	return flog_commit_file_sector(file, 0, 0);
+}
+
+void flog_take_back_buffer(flog_write_file_t * file){
+	flog_sector_nbytes_t const n =
+	   MIN(file->back_fill, file->sector_remaining_bytes);
+	if(n == 0){
+		return;
+	}
+	memcpy(file->sector_buffer + file->offset, file->back_buffer, n);
+	file->sector_remaining_bytes -= n;
+	file->offset += n;
+	file->bytes_in_block += n;
+	file->write_head += n;
+	file->back_fill -= n;
+	memmove(file->back_buffer, file->back_buffer + n, file->back_fill);
+}
+
+flog_result_t flog_drain_back_buffer(flog_write_file_t * file){
+	while(file->back_fill){
+		if(flog_flush_write(file) != FLOG_SUCCESS){
+			return FLOG_FAILURE;
 		}
-		flog_open_sector(inode_iter.block, inode_iter.sector + 1);
-		flash_read_sector(&init_sector_buffer, inode_iter.sector + 1, 0,
-		                  sizeof(flog_inode_file_invalidation_t));
+		flog_take_back_buffer(file);
+	}
+	return FLOG_SUCCESS;
+}
 
-		// Keep track of the maximum file ID
-		if(inode_file_allocation_sector.file_id > flogfs.max_file_id){
-			flogfs.max_file_id = inode_file_allocation_sector.file_id;
+#if FLOG_ENABLE_COMPRESSION
+uint8_t * flog_frame_space(flog_write_file_t * file, uint16_t * space){
+	if(file->page_buffer && flog_file_page_writable(file)){
+		// Sectors of the page buffer are in order from its start
+		*space = FS_SECTOR_SIZE - file->page_fill % FS_SECTOR_SIZE;
+		return file->page_buffer + file->page_fill;
+	}
+	if((file->sector_remaining_bytes == 0) &&
+	   (flog_flush_write(file) != FLOG_SUCCESS)){
+		return nullptr;
+	}
+	*space = file->sector_remaining_bytes;
+	return file->sector_buffer + file->offset;
+}
+
+flog_result_t flog_frame_commit(flog_write_file_t * file, uint16_t n){
+	file->bytes_in_block += n;
+	file->write_head += n;
+	if(file->page_buffer && flog_file_page_writable(file)){
+		file->page_fill += n;
+		if(file->page_fill == FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE){
+			flog_commit_file_page(file, file->page_buffer, file->page_fill);
+			file->page_fill = 0;
 		}
-		
-		
-		// Was it deleted?
-		if(inode_file_invalidation_sector.timestamp ==
-			FLOG_TIMESTAMP_INVALID){
-			// This is still valid
+		return FLOG_SUCCESS;
+	}
+	file->offset += n;
+	file->sector_remaining_bytes -= n;
+	if(file->sector_remaining_bytes == 0){
+		return flog_flush_write(file);
+	}
+	return FLOG_SUCCESS;
+}
 
-			// Check if this is now the most recent allocation
-			if(inode_file_allocation_sector.timestamp >
-			   last_allocation.timestamp){
-				// This isn't really always true becase we also consider
-				// allocations in the file chain itself, which are not
-				// reflected
-				last_allocation.block =
-				  inode_file_allocation_sector.first_block;
-				last_allocation.file_id =
-				  inode_file_allocation_sector.file_id;
-				last_allocation.age =
-				  inode_file_allocation_sector.first_block_age;
-				last_allocation.timestamp =
-				  inode_file_allocation_sector.timestamp;
-				last_allocation.block_type = FLOG_BLOCK_TYPE_FILE;
-			}
-		} else {
-			// Check if this was the most recent deletion
-			if(inode_file_invalidation_sector.timestamp >
-			   last_deletion.timestamp){
-				last_deletion.first_block =
-				  inode_file_allocation_sector.first_block;
-				last_deletion.last_block =
-				  inode_file_invalidation_sector.last_block;
-				last_deletion.file_id =
-				  inode_file_allocation_sector.file_id;
-				last_deletion.timestamp =
-				  inode_file_invalidation_sector.timestamp;
-			}
+#if FLOG_WEAR_LEVEL_SPREAD
+flog_result_t flog_write_frame(flog_write_file_t * file, uint8_t const * frame,
+                               uint16_t n){
+	uint16_t space;
+	uint8_t * dst;
+
+	dst = flog_frame_space(file, &space);
+	if(dst && (n > space)){
+		memset(dst, 0, space);
+		if(flog_frame_commit(file, space) != FLOG_SUCCESS){
+			return FLOG_FAILURE;
+		}
+		dst = flog_frame_space(file, &space);
+	}
+	if(!dst || (n > space)){
+		return FLOG_FAILURE;
+	}
+	memcpy(dst, frame, n);
+	return flog_frame_commit(file, n);
+}
+
+flog_result_t flog_write_frames(flog_write_file_t * file, uint8_t const * data,
+                                uint16_t n){
+	flog_frame_header_t header;
+	uint16_t len;
+
+	while(n >= sizeof(header)){
+		memcpy(&header, data, sizeof(header));
+		len = sizeof(header) + header.stored_len;
+		if((header.codec == FLOG_FRAME_PAD) || (len > n) ||
+		   (len > FLOG_FRAME_MAX)){
+			// The rest is padding (or garbage, which is no use either)
+			break;
 		}
+		if(flog_write_frame(file, data, len) != FLOG_SUCCESS){
+			return FLOG_FAILURE;
+		}
+		data += len;
+		n -= len;
 	}
+	return FLOG_SUCCESS;
+}
+#endif
 
-	// Go check and (maybe) clean the last allocation
-	if(last_allocation.timestamp > 0){
-		switch(last_allocation.block_type){
-		case FLOG_BLOCK_TYPE_FILE:
-			flog_open_sector(last_allocation.block, FLOG_INIT_SECTOR);
-			flash_read_sector(&init_sector_buffer, FLOG_INIT_SECTOR, 0,
-			                  sizeof(flog_file_init_sector_header_t));
-			if(file_init_sector_header.file_id != last_allocation.file_id){
-				// This block never got claimed
-				// Initialize it!
-				flog_open_sector(last_allocation.block, FLOG_INIT_SECTOR);
-				file_init_sector_header.timestamp = last_allocation.timestamp;
-				file_init_sector_header.age = last_allocation.age;
-				file_init_sector_header.file_id = last_allocation.file_id;
-				flash_write_sector(&init_sector_buffer, FLOG_INIT_SECTOR, 0,
-				                   sizeof(flog_file_init_sector_header_t));
-				file_spare0.nbytes = 0;
-				file_spare0.nothing = 0;
-				file_spare0.type_id = FLOG_BLOCK_TYPE_FILE;
-				flash_write_spare(&spare_buffer, FLOG_INIT_SECTOR);
-				flash_commit();
-				
-				// BOOOOOO
-				flogfs.num_free_blocks -= 1;
-				flogfs.free_block_sum -= last_allocation.age;
-				flogfs.mean_free_age = 
-				   flogfs.free_block_sum / flogfs.num_free_blocks;
+uint32_t flog_compress_write(flog_write_file_t * file, uint8_t const * src,
+                             uint32_t nbytes){
+	uint32_t count = 0;
+	uint16_t n;
 
-				flogfs.t = last_allocation.timestamp + 1;
+	while(nbytes){
+		if(file->compress_fill == FLOG_COMPRESS_FRAME_SIZE){
+			if(flog_compress_step(file) != FLOG_SUCCESS){
+				break;
 			}
+			flog_flash_yield();
+			continue;
+		}
+		n = MIN(nbytes, (uint32_t)(FLOG_COMPRESS_FRAME_SIZE -
+		                           file->compress_fill));
+		memcpy(file->compress_buffer + file->compress_fill, src, n);
+		file->compress_fill += n;
+		src += n;
+		nbytes -= n;
+		count += n;
+	}
+	return count;
+}
+
+flog_result_t flog_compress_step(flog_write_file_t * file){
+	uint16_t space;
+	uint16_t n;
+	uint16_t len;
+	uint8_t * dst;
+
+	dst = flog_frame_space(file, &space);
+	if(dst && (space < FLOG_FRAME_MIN_SPACE)){
+		// Not worth a frame
+		memset(dst, 0, space);
+		FLOG_STATS_ADD(compress_out, space);
+		if(flog_frame_commit(file, space) != FLOG_SUCCESS){
+			return FLOG_FAILURE;
+		}
+		dst = flog_frame_space(file, &space);
+	}
+	if(!dst){
+		return FLOG_FAILURE;
+	}
+
+	n = file->compress_fill;
+	len = flog_frame_encode(file, dst, MIN(space, (uint16_t)FLOG_FRAME_MAX),
+	                        &n);
+	file->compress_fill -= n;
+	memmove(file->compress_buffer, file->compress_buffer + n,
+	        file->compress_fill);
+	FLOG_STATS_ADD(compress_in, n);
+	FLOG_STATS_ADD(compress_out, len);
+	// The frame is in, even if its sector has to wait for a block
+	return flog_frame_commit(file, len);
+}
+
+flog_result_t flog_compress_flush(flog_write_file_t * file){
+	while(file->compress_fill){
+		if(flog_compress_step(file) != FLOG_SUCCESS){
+			return FLOG_FAILURE;
+		}
+	}
+	return FLOG_SUCCESS;
+}
+
+uint16_t flog_frame_encode(flog_write_file_t const * file, uint8_t * dst,
+                           uint16_t space, uint16_t * n){
+	flog_frame_header_t header;
+	uint8_t * const body = dst + sizeof(header);
+	uint16_t const cap = space - sizeof(header);
+	uint16_t taken = *n;
+
+	header.codec = file->codec;
+	header.param = file->codec_param;
+	if(header.codec == FLOG_COMPRESS_DELTA){
+		header.stored_len = flog_delta_encode(header.param,
+		                                      file->compress_buffer, &taken,
+		                                      body, cap);
+	} else {
+		header.stored_len = flog_lz_encode(file->compress_buffer, &taken,
+		                                   body, cap);
+	}
+	if((taken == 0) || (header.stored_len >= taken)){
+		// No better than the data itself
+		header.codec = FLOG_FRAME_STORED;
+		header.param = 0;
+		taken = MIN(*n, cap);
+		memcpy(body, file->compress_buffer, taken);
+		header.stored_len = taken;
+	}
+	header.raw_len = taken;
+	memcpy(dst, &header, sizeof(header));
+	*n = taken;
+	return sizeof(header) + header.stored_len;
+}
+
+flog_result_t flog_frame_decode(flog_frame_header_t const * header,
+                                uint8_t const * src, uint8_t * dst){
+	switch(header->codec){
+	case FLOG_FRAME_STORED:
+		if(header->stored_len != header->raw_len){
+			return FLOG_FAILURE;
+		}
+		memcpy(dst, src, header->raw_len);
+		return FLOG_SUCCESS;
+	case FLOG_COMPRESS_LZ:
+		return flog_lz_decode(src, header->stored_len, dst, header->raw_len);
+	case FLOG_COMPRESS_DELTA:
+		return flog_delta_decode(header->param, src, header->stored_len, dst,
+		                         header->raw_len);
+	default:
+		return FLOG_FAILURE;
+	}
+}
+
+//! The extra bytes an LZ sequence needs to hold a length
+FLOG_STATIC inline uint16_t flog_lz_length_bytes(uint16_t len){
+	return (len < 15) ? 0 : (len - 15) / 255 + 1;
+}
+
+//! Write the extra bytes of an LZ length (see flog_lz_length_bytes())
+FLOG_STATIC inline uint8_t * flog_lz_put_length(uint8_t * dst, uint16_t len){
+	if(len < 15){
+		return dst;
+	}
+	for(len -= 15; len >= 255; len -= 255){
+		*dst++ = 255;
+	}
+	*dst++ = len;
+	return dst;
+}
+
+FLOG_STATIC inline uint32_t flog_lz_read32(uint8_t const * p){
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+uint16_t flog_lz_encode(uint8_t const * src, uint16_t * n, uint8_t * dst,
+                        uint16_t cap){
+	uint16_t * const table = flogfs.compress.lz_table;
+	uint16_t const end = *n;
+	uint16_t ip = 0;
+	uint16_t anchor = 0;
+	uint16_t op = 0;
+	uint16_t literals, match, ref, room, cost;
+	uint32_t hash;
+
+	// Matches only reach back within the frame
+	memset(table, 0xFF, sizeof(flogfs.compress.lz_table));
+
+	while(ip + 4 <= end){
+		hash = (flog_lz_read32(src + ip) * 2654435761u) >>
+		       (32 - FLOG_LZ_HASH_BITS);
+		ref = table[hash];
+		table[hash] = ip;
+		if((ref == 0xFFFF) ||
+		   (flog_lz_read32(src + ref) != flog_lz_read32(src + ip))){
+			ip += 1;
+			continue;
+		}
+		for(match = 4; (ip + match < end) &&
+		               (src[ref + match] == src[ip + match]); match++);
+
+		literals = ip - anchor;
+		cost = 1 + flog_lz_length_bytes(literals) + literals + 2 +
+		       flog_lz_length_bytes(match - 4);
+		if(op + cost > cap){
 			break;
-		case FLOG_BLOCK_TYPE_INODE:
-			flog_inode_init_sector_spare_t inode_init_spare;
-			flog_inode_init_sector_t inode_init;
-			if(flog_get_block_type(last_allocation.block) ==
-			   FLOG_BLOCK_TYPE_INODE)
-				break;
-			// Well, it seems the allocation was incomplete
-			flog_open_sector(last_allocation.previous_inode, FLOG_INIT_SECTOR);
-			flash_read_spare((uint8_t *)&inode_init_spare, FLOG_INIT_SECTOR);
-			inode_init.previous = last_allocation.previous_inode;
-			inode_init.timestamp = last_allocation.timestamp;
-			inode_init_spare.inode_index += 1;
-			// Other fields should be valid...
-			flog_open_sector(last_allocation.block, FLOG_INIT_SECTOR);
-			flash_write_sector((uint8_t *)&inode_init, FLOG_INIT_SECTOR, 0,
-			                   sizeof(inode_init));
-			flash_write_spare((uint8_t *)&inode_init_sector, FLOG_INIT_SECTOR);
-			flash_commit();
-			
-			// BOOOOOO
-			flogfs.num_free_blocks -= 1;
-			flogfs.free_block_sum -= last_allocation.age;
-			flogfs.mean_free_age = 
-			   flogfs.free_block_sum / flogfs.num_free_blocks;
+		}
+		dst[op] = (MIN(literals, 15) << 4) | MIN(match - 4, 15);
+		op = flog_lz_put_length(dst + op + 1, literals) - dst;
+		memcpy(dst + op, src + anchor, literals);
+		op += literals;
+		dst[op++] = (ip - ref) & 0xFF;
+		dst[op++] = (ip - ref) >> 8;
+		op = flog_lz_put_length(dst + op, match - 4) - dst;
+		ip += match;
+		anchor = ip;
+	}
+
+	// Finish with as many literals as fit
+	literals = end - anchor;
+	room = cap - op;
+	if(room < 2){
+		literals = 0;
+	} else if(literals > room - 1){
+		literals = room - 1;
+	}
+	while(literals &&
+	      (1 + flog_lz_length_bytes(literals) + literals > room)){
+		literals -= 1;
+	}
+	if(literals){
+		dst[op] = MIN(literals, 15) << 4;
+		op = flog_lz_put_length(dst + op + 1, literals) - dst;
+		memcpy(dst + op, src + anchor, literals);
+		op += literals;
+	}
+	*n = anchor + literals;
+	return op;
+}
+
+flog_result_t flog_lz_decode(uint8_t const * src, uint16_t n, uint8_t * dst,
+                             uint16_t raw_len){
+	uint16_t ip = 0;
+	uint16_t op = 0;
+	uint32_t len;
+	uint16_t offset;
+	uint8_t token, b;
+
+	while(ip < n){
+		token = src[ip++];
+		len = token >> 4;
+		if(len == 15){
+			do {
+				if(ip == n){
+					return FLOG_FAILURE;
+				}
+				b = src[ip++];
+				len += b;
+			} while(b == 255);
+		}
+		if((len > (uint32_t)(n - ip)) || (len > (uint32_t)(raw_len - op))){
+			return FLOG_FAILURE;
+		}
+		memcpy(dst + op, src + ip, len);
+		ip += len;
+		op += len;
+		if(ip == n){
 			break;
-		default:
-			// Huh?
+		}
+
+		if(n - ip < 2){
+			return FLOG_FAILURE;
+		}
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if((offset == 0) || (offset > op)){
+			return FLOG_FAILURE;
+		}
+		len = (token & 15) + 4;
+		if((token & 15) == 15){
+			do {
+				if(ip == n){
+					return FLOG_FAILURE;
+				}
+				b = src[ip++];
+				len += b;
+			} while(b == 255);
+		}
+		if(len > (uint32_t)(raw_len - op)){
+			return FLOG_FAILURE;
+		}
+		// One byte at a time, as a match may overlap what it copies
+		for(; len; len--, op++){
+			dst[op] = dst[op - offset];
+		}
+	}
+	return FLOG_RESULT(op == raw_len);
+}
+
+uint16_t flog_delta_encode(uint8_t stride, uint8_t const * src, uint16_t * n,
+                           uint8_t * dst, uint16_t cap){
+	uint16_t const samples = *n / 2;
+	uint16_t op = 0;
+	uint16_t i;
+	uint16_t sample, prediction, zigzag;
+
+	for(i = 0; i < samples; i++){
+		sample = src[2 * i] | (src[2 * i + 1] << 8);
+		prediction = (i >= stride) ?
+		             (src[2 * (i - stride)] | (src[2 * (i - stride) + 1] << 8)) :
+		             0;
+		sample -= prediction;
+		zigzag = (sample & 0x8000) ? ~(sample << 1) : (sample << 1);
+		if(op + ((zigzag < 0x80) ? 1 : (zigzag < 0x4000) ? 2 : 3) > cap){
 			break;
 		}
+		while(zigzag >= 0x80){
+			dst[op++] = (zigzag & 0x7F) | 0x80;
+			zigzag >>= 7;
+		}
+		dst[op++] = zigzag;
 	}
+	*n = 2 * i;
+	return op;
+}
 
-	// Verify the completion of the most recent deletion operation
-	if((last_deletion.timestamp > 0) &&
-	   (flog_get_block_type(last_deletion.last_block) ==
-	      FLOG_BLOCK_TYPE_FILE)){
+flog_result_t flog_delta_decode(uint8_t stride, uint8_t const * src,
+                                uint16_t n, uint8_t * dst, uint16_t raw_len){
+	uint16_t ip = 0;
+	uint16_t i;
+	uint16_t sample, zigzag;
+	uint_fast8_t shift;
 
-		flog_open_sector(last_deletion.last_block, FLOG_INIT_SECTOR);
-		flash_read_sector(&init_sector_buffer, FLOG_INIT_SECTOR, 0,
-		                  sizeof(flog_file_init_sector_header_t));
-		if(file_init_sector_header.file_id == last_deletion.file_id){
-			// This is the same file still, see if it's been invalidated
-			flog_open_sector(last_deletion.last_block,
-			                 FLOG_BLK_STAT_SECTOR);
-			flash_read_sector(&sector_buffer, FLOG_BLK_STAT_SECTOR, 0,
-			                  sizeof(flog_universal_invalidation_header_t));
-			if(universal_invalidation_header.timestamp != FLOG_TIMESTAMP_INVALID){
-				// Crap, this never got invalidated correctly
-				flog_invalidate_chain(last_deletion.first_block,
-				                      last_deletion.file_id);
+	if((raw_len & 1) || (stride == 0)){
+		return FLOG_FAILURE;
+	}
+	for(i = 0; i < raw_len / 2; i++){
+		zigzag = 0;
+		for(shift = 0;; shift += 7){
+			if((ip == n) || (shift > 14)){
+				return FLOG_FAILURE;
+			}
+			zigzag |= (src[ip] & 0x7F) << shift;
+			if(!(src[ip++] & 0x80)){
+				break;
 			}
 		}
+		sample = (zigzag & 1) ? ~(zigzag >> 1) : (zigzag >> 1);
+		if(i >= stride){
+			sample += dst[2 * (i - stride)] | (dst[2 * (i - stride) + 1] << 8);
+		}
+		dst[2 * i] = sample & 0xFF;
+		dst[2 * i + 1] = sample >> 8;
 	}
+	return FLOG_RESULT(ip == n);
+}
 
-	flogfs.state = FLOG_STATE_MOUNTED;
-
-	flash_unlock();
-	flog_unlock_fs();
-	return FLOG_SUCCESS;
+flog_result_t flog_read_frame(flog_read_file_t * file, uint32_t skip_to){
+	flog_frame_header_t header;
+	uint16_t len;
 
-failure:
-	flash_unlock();
-	flog_unlock_fs();
-	return FLOG_FAILURE;
+	while(1){
+		if(file->sector_remaining_bytes < sizeof(header)){
+			// Whatever is left of the sector is padding
+			file->offset += file->sector_remaining_bytes;
+			file->sector_remaining_bytes = 0;
+			if(flog_read_file_advance(file, nullptr) != FLOG_SUCCESS){
+				return FLOG_FAILURE;
+			}
+			continue;
+		}
+		flog_open_sector(file->block, file->sector);
+		flog_read_sector((uint8_t *)&header, file->sector, file->offset,
+		                 sizeof(header));
+		if(header.codec == FLOG_FRAME_PAD){
+			file->offset += file->sector_remaining_bytes;
+			file->sector_remaining_bytes = 0;
+			continue;
+		}
+		len = sizeof(header) + header.stored_len;
+		if((len > file->sector_remaining_bytes) ||
+		   (header.raw_len > FLOG_COMPRESS_FRAME_SIZE)){
+			flash_debug_warn("FLogFS:" LINESTR);
+			return FLOG_FAILURE;
+		}
+		if(file->read_head + header.raw_len > skip_to){
+#if FLOG_SECTOR_CRC
+			if(flog_check_file_sector(file, nullptr) != FLOG_SUCCESS){
+				return FLOG_FAILURE;
+			}
+#endif
+			file->frame_block = file->block;
+			file->frame_sector = file->sector;
+			file->frame_offset = file->offset;
+			if(flog_frame_load(file, &header) != FLOG_SUCCESS){
+				return FLOG_FAILURE;
+			}
+			file->offset += len;
+			file->sector_remaining_bytes -= len;
+			file->frame_len = header.raw_len;
+			file->frame_pos = 0;
+			return FLOG_SUCCESS;
+		}
+		file->offset += len;
+		file->sector_remaining_bytes -= len;
+		file->read_head += header.raw_len;
+	}
 }
 
+flog_result_t flog_frame_load(flog_read_file_t * file,
+                              flog_frame_header_t const * header){
+	flogfs.compress.decoded_file = nullptr;
+	flog_open_sector(file->frame_block, file->frame_sector);
+	flog_read_sector(flogfs.compress.frame, file->frame_sector,
+	                 file->frame_offset + sizeof(*header), header->stored_len);
+	if(flog_frame_decode(header, flogfs.compress.frame,
+	                     flogfs.compress.decoded) != FLOG_SUCCESS){
+		flash_debug_warn("FLogFS:" LINESTR);
+		return FLOG_FAILURE;
+	}
+	flogfs.compress.decoded_file = file;
+	return FLOG_SUCCESS;
+}
 
+uint8_t const * flog_frame_data(flog_read_file_t * file){
+	flog_frame_header_t header;
 
-flog_result_t flogfs_open_read(flog_read_file_t * file, char const * filename){
-	flog_inode_iterator_t inode_iter;
-	flog_read_file_t * file_iter;
-	flog_file_find_result_t find_result;
+	if(flogfs.compress.decoded_file == file){
+		return flogfs.compress.decoded;
+	}
+	flog_open_sector(file->frame_block, file->frame_sector);
+	flog_read_sector((uint8_t *)&header, file->frame_sector,
+	                 file->frame_offset, sizeof(header));
+	if((header.raw_len != file->frame_len) ||
+	   (file->frame_offset + sizeof(header) + header.stored_len >
+	    FS_SECTOR_SIZE) ||
+	   (flog_frame_load(file, &header) != FLOG_SUCCESS)){
+		flash_debug_warn("FLogFS:" LINESTR);
+		return nullptr;
+	}
+	return flogfs.compress.decoded;
+}
 
-	union {
-		uint8_t sector_buffer;;
-		flog_inode_file_allocation_t inode_file_allocation_sector;
-		flog_inode_file_invalidation_t inode_file_invalidation_sector;
-		flog_file_init_sector_header_t file_init_sector_header;
-	};
-	union {
-		uint8_t spare_buffer;
-		flog_file_sector_spare_t file_sector_spare;
-	};
+uint32_t flog_read_compressed(flog_read_file_t * file, uint8_t * dst,
+                              uint32_t nbytes){
+	uint8_t const * frame;
+	uint32_t count = 0;
+	uint16_t n;
 
-	if(strlen(filename) >= FLOG_MAX_FNAME_LEN){
-		return FLOG_FAILURE;
-	}
+	FLOG_STATS_START();
 
-	flog_lock_fs();
+	flog_lock_file(file);
 	flash_lock();
 
-	find_result = flog_find_file(filename, &inode_iter);
-	if(find_result.first_block == FLOG_BLOCK_IDX_INVALID){
-		// File doesn't exist
-		goto failure;
+#if FLOG_SECTOR_CRC
+	if(file->corrupt){
+		// Stay stopped at the sector which failed until flogfs_seek()
+		nbytes = 0;
 	}
+#endif
 
-	file->block = find_result.first_block;
-	file->id = find_result.file_id;
-	/////////////
-	// Actual file search
-	/////////////
+	while(nbytes){
+		if((file->frame_pos == file->frame_len) &&
+		   (flog_read_frame(file, 0) != FLOG_SUCCESS)){
+			// End of file for now
+			break;
+		}
+		// Another file may have had the frame buffer since the last yield
+		frame = flog_frame_data(file);
+		if(!frame){
+			break;
+		}
+		n = MIN(nbytes, (uint32_t)(file->frame_len - file->frame_pos));
+		memcpy(dst, frame + file->frame_pos, n);
+		file->frame_pos += n;
+		file->read_head += n;
+		dst += n;
+		nbytes -= n;
+		count += n;
+		flog_flash_yield();
+	}
 
+	FLOG_STATS_RECORD(FLOG_STATS_API_READ);
+	flash_unlock();
+	flog_unlock_file(file);
+
+	return count;
+}
 
-	// Now go find the start of file data (either first or second sector)
-	// and adjust some settings
-	flog_open_sector(file->block, FLOG_INIT_SECTOR);
-	flash_read_spare(&spare_buffer, FLOG_INIT_SECTOR);
+flog_result_t flog_seek_frames(flog_read_file_t * file, uint32_t index){
+	uint32_t const frame_start = file->read_head - file->frame_pos;
+	uint_fast8_t restart = 0;
 
-	if(file_sector_spare.nbytes != 0){
-		// The first sector has some stuff in it!
+	if((index >= frame_start) && (index - frame_start <= file->frame_len)){
+		// In the frame already decoded
+		file->frame_pos = index - frame_start;
+		file->read_head = index;
+		return FLOG_SUCCESS;
+	}
+
+	if(index < frame_start){
+		file->block = file->first_block;
+		file->block_idx = 0;
+		file->block_start = 0;
+		restart = 1;
+	}
+	restart |= flog_skip_index_seek(file, index);
+	if(restart){
+		// From the first frame of the block
 		file->sector = FLOG_INIT_SECTOR;
 		file->offset = sizeof(flog_file_init_sector_header_t);
+		file->sector_remaining_bytes = 0;
+		file->read_head = file->block_start;
 	} else {
-		flog_open_sector(file->block, 1);
-		flash_read_spare(&spare_buffer, 1);
-		file->sector = flog_increment_sector(FLOG_INIT_SECTOR);
-		file->offset = 0;
+		file->read_head = frame_start + file->frame_len;
 	}
+	file->frame_len = 0;
+	file->frame_pos = 0;
 
-	file->sector_remaining_bytes = file_sector_spare.nbytes;
-
-	// If we got this far...
-
-	// Add to list of read files
-	file->next = 0;
-	if(flogfs.read_head){
-		// Iterate to end of list
-		for(file_iter = flogfs.read_head; file_iter->next;
-			file_iter = file_iter->next);
-		file_iter->next = file;
-	} else {
-		flogfs.read_head = file;
+	if(flog_read_frame(file, index) != FLOG_SUCCESS){
+		// The read head is left at the end
+		return FLOG_RESULT(file->read_head == index);
 	}
-
-	flash_unlock();
-	flog_unlock_fs();
+	file->frame_pos = index - file->read_head;
+	file->read_head = index;
 	return FLOG_SUCCESS;
-
-
-failure:
-	flash_unlock();
-	flog_unlock_fs();
-	return FLOG_FAILURE;
 }
+#endif
 
-flog_result_t flogfs_close_read(flog_read_file_t * file){
-	flog_read_file_t * iter;
-	flog_lock_fs();
-	if(flogfs.read_head == file){
-		flogfs.read_head = file->next;
-	} else {
-		iter = flogfs.read_head;
-		while(iter->next){
-			if(iter->next == file){
-				iter->next = file->next;
-				break;
-			}
-			iter = iter->next;
-		}
-		goto failure;
-	}
-	flog_unlock_fs();
-	return FLOG_SUCCESS;
 
-failure:
-	flog_unlock_fs();
-	return FLOG_FAILURE;
+void flog_prealloc_iterate() {
+	flog_block_alloc_t block;
+	block = flog_allocate_block_iterate();
+	flog_prealloc_push(block.block, block.age);
 }
 
-uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst, uint32_t nbytes){
-	uint32_t count = 0;
-	uint16_t to_read;
-
-	flog_block_idx_t block;
-	uint16_t sector;
 
+flog_block_alloc_t flog_allocate_block_iterate(){
+	flog_block_alloc_t block;
 	union {
-		uint8_t sector_header;
-		flog_file_tail_sector_header_t file_tail_sector_header;
-		flog_file_init_sector_header_t file_init_sector_header;
+		uint8_t init_sector_buffer;
+		flog_universal_init_sector_header_t universal_init_sector_header;
 	};
 
 	union {
-		uint8_t sector_spare;
-		flog_file_sector_spare_t file_sector_spare;
+		uint8_t invalidation_buffer;
+		flog_universal_invalidation_header_t universal_invalidation_header;
 	};
 
-	flog_lock_fs();
-	flash_lock();
-
-	while(nbytes){
-		if(file->sector_remaining_bytes == 0){
-			// We are/were at the end of file, look into the existence of new data
-			// This block is responsible for setting:
-			// -- file->sector_remaining_bytes
-			// -- file->offset
-			// -- file->sector
-			// -- file->block
-			// and bailing on the loop if EOF is encountered
-			if(file->sector == FLOG_TAIL_SECTOR){
-				// This was the last sector in the block, check the next
-				flog_open_sector(file->block, FLOG_TAIL_SECTOR);
-				flash_read_sector(&sector_header, FLOG_TAIL_SECTOR, 0,
-								sizeof(flog_file_tail_sector_header_t));
-				block = file_tail_sector_header.next_block;
-				// Now check out that new block and make sure it's legit
-				flog_open_sector(block, FLOG_INIT_SECTOR);
-				flash_read_sector(&sector_header, FLOG_INIT_SECTOR, 0,
-								sizeof(flog_file_init_sector_header_t));
-				if(file_init_sector_header.file_id != file->id){
-					// This next block hasn't been written. EOF for now
-					goto done;
-				}
+	flog_block_stat_sector_t block_stat_sector;
 
-				file->block = block;
+	block.block = FLOG_BLOCK_IDX_INVALID;
 
-				flash_read_spare(&sector_spare, FLOG_INIT_SECTOR);
-				if(file_sector_spare.nbytes == 0){
-					// It's possible for the first sector to have 0 bytes
-					// Data is in next sector
-					file->sector = flog_increment_sector(FLOG_INIT_SECTOR);
-				} else {
-					file->sector = FLOG_INIT_SECTOR;
-				}
-			} else {
-				// Increment to next sector but don't necessarily update file
-				// state
-				sector = flog_increment_sector(file->sector);
+	FLOG_STATS_INC(allocator_iterations);
+	
+	if((flogfs.free_block_bitmap[flogfs.allocate_head / 8] &
+	    ~flogfs.prealloc.member[flogfs.allocate_head / 8]) &
+	   (1 << (flogfs.allocate_head % 8))){
+		// This block is okay to look at (and isn't in the list already)
+		flog_get_block_stat(flogfs.allocate_head, &block_stat_sector);
+		block.age = block_stat_sector.age;
+		block.block = flogfs.allocate_head;
+	}
 
-				flog_open_sector(file->block, sector);
-				flash_read_spare(&sector_spare, sector);
+	// Move the head
+	flogfs.allocate_head = (flogfs.allocate_head + 1) % FS_NUM_BLOCKS;
 
-				if(file_sector_spare.nbytes == FLOG_SECTOR_NBYTES_INVALID){
-					// We're looking at an empty sector, GTFO
-					goto done;
-				} else {
-					file->sector = sector;
-				}
-			}
+	return block;
+}
 
-			file->sector_remaining_bytes = file_sector_spare.nbytes;
-			switch(file->sector){
-			case FLOG_TAIL_SECTOR:
-				file->offset = sizeof(flog_file_tail_sector_header_t);
-				break;
-			case FLOG_INIT_SECTOR:
-				file->offset = sizeof(flog_file_init_sector_header_t);
-				break;
-			default:
-				file->offset = 0;
-			}
+/*!
+ @brief Move a preallocation heap entry towards the root until it's in order
+ */
+FLOG_STATIC void flog_prealloc_sift_up(uint16_t i){
+	flog_block_alloc_t const entry = flogfs.prealloc.blocks[i];
+	while(i){
+		uint16_t const parent = (i - 1) / 2;
+		if(flogfs.prealloc.blocks[parent].age <= entry.age){
+			break;
 		}
-
-		// Figure out how many to read
-		to_read = MIN(nbytes, file->sector_remaining_bytes);
-
-		// Read this sector now
-		flog_open_sector(file->block, file->sector);
-		flash_read_sector(dst, file->sector, file->offset, to_read);
-		count += to_read;
-		nbytes -= to_read;
-		dst += to_read;
-		// Update file stats
-		file->offset += to_read;
-		file->sector_remaining_bytes -= to_read;
-		file->read_head += to_read;
+		flogfs.prealloc.blocks[i] = flogfs.prealloc.blocks[parent];
+		i = parent;
 	}
-
-
-done:
-	flash_unlock();
-	flog_unlock_fs();
-
-	return count;
+	flogfs.prealloc.blocks[i] = entry;
 }
 
-uint32_t flogfs_write(flog_write_file_t * file, uint8_t const * src,
-                      uint32_t nbytes){
-	uint32_t count = 0;
-	flog_sector_nbytes_t bytes_written;
-
-	flog_lock_fs();
-	flash_lock();
-
-	while(nbytes){
-		if(nbytes >= file->sector_remaining_bytes){
-			bytes_written = file->sector_remaining_bytes;
-			if(flog_commit_file_sector(file, src,
-				file->sector_remaining_bytes) == FLOG_FAILURE){
-				// Couldn't allocate or something
-				goto done;
-			}
-
-			// Now that sector is completely written
-			src += bytes_written;
-			nbytes -= bytes_written;
-			count += bytes_written;
-		} else {
-			// This is smaller than a sector; cache it
-			memcpy(file->sector_buffer + file->offset, src, nbytes);
-			count += nbytes;
-			file->sector_remaining_bytes -= nbytes;
-			file->offset += nbytes;
-			file->bytes_in_block += nbytes;
-			file->write_head += nbytes;
-			nbytes = 0;
+/*!
+ @brief Move a preallocation heap entry towards the leaves until it's in order
+ */
+FLOG_STATIC void flog_prealloc_sift_down(uint16_t i){
+	flog_block_alloc_t const entry = flogfs.prealloc.blocks[i];
+	while(1){
+		uint16_t child = 2 * i + 1;
+		if(child >= flogfs.prealloc.n){
+			break;
+		}
+		if((child + 1 < flogfs.prealloc.n) &&
+		   (flogfs.prealloc.blocks[child + 1].age <
+		    flogfs.prealloc.blocks[child].age)){
+			child += 1;
 		}
+		if(entry.age <= flogfs.prealloc.blocks[child].age){
+			break;
+		}
+		flogfs.prealloc.blocks[i] = flogfs.prealloc.blocks[child];
+		i = child;
 	}
+	flogfs.prealloc.blocks[i] = entry;
+}
 
-done:
-	flash_unlock();
-	flog_unlock_fs();
-
-	return count;
+void flog_prealloc_reset(){
+	flogfs.prealloc.n = 0;
+	memset(flogfs.prealloc.member, 0, sizeof(flogfs.prealloc.member));
 }
 
-flog_result_t flogfs_seek(flog_read_file_t * file, uint32_t index){
-	return FLOG_FAILURE;
+FLOG_STATIC void flog_prealloc_push(flog_block_idx_t block,
+                               flog_block_age_t age){
+	uint16_t i;
+
+	if((block == FLOG_BLOCK_IDX_INVALID) ||
+	   (flogfs.prealloc.member[block / 8] & (1 << (block % 8)))){
+		return;
+	}
+
+	if(flogfs.prealloc.n < FS_PREALLOCATE_SIZE){
+		i = flogfs.prealloc.n++;
+	} else {
+		// The oldest entry is one of the leaves
+		i = flogfs.prealloc.n / 2;
+		for(uint16_t j = i + 1; j < flogfs.prealloc.n; j++){
+			if(flogfs.prealloc.blocks[j].age > flogfs.prealloc.blocks[i].age){
+				i = j;
+			}
+		}
+		if(flogfs.prealloc.blocks[i].age <= age){
+			// This block sucks
+			return;
+		}
+		flogfs.prealloc.member[flogfs.prealloc.blocks[i].block / 8] &=
+		   ~(1 << (flogfs.prealloc.blocks[i].block % 8));
+	}
+
+	flogfs.prealloc.blocks[i].block = block;
+	flogfs.prealloc.blocks[i].age = age;
+	flogfs.prealloc.member[block / 8] |= 1 << (block % 8);
+	flog_prealloc_sift_up(i);
 }
 
-flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename){
-	flog_inode_iterator_t inode_iter;
-	flog_block_alloc_t alloc_block;
-	flog_file_find_result_t find_result;
+void flog_prealloc_remove(flog_block_idx_t block){
+	uint16_t i;
 
-	union {
-		uint8_t sector_buffer;;
-		flog_inode_file_allocation_t inode_file_allocation_sector;
-		flog_file_init_sector_header_t file_init_sector_header;
-		flog_file_tail_sector_header_t file_tail_sector_header;
-	};
-	union {
-		uint8_t spare_buffer;
-		flog_file_sector_spare_t file_sector_spare;
-	};
+	if(!(flogfs.prealloc.member[block / 8] & (1 << (block % 8)))){
+		return;
+	}
+	for(i = 0; flogfs.prealloc.blocks[i].block != block; i++);
+	flog_prealloc_take(i);
+}
 
-	flog_lock_fs();
-	flash_lock();
+void flog_prealloc_take(uint16_t i){
+	flog_block_idx_t const block = flogfs.prealloc.blocks[i].block;
+	flogfs.prealloc.member[block / 8] &= ~(1 << (block % 8));
 
-	find_result = flog_find_file(filename, &inode_iter);
-	
-	file->base_threshold = 0;
+	flogfs.prealloc.n -= 1;
+	if(i == flogfs.prealloc.n){
+		return;
+	}
+	// Fill the hole with the last entry, which may belong above or below
+	flogfs.prealloc.blocks[i] = flogfs.prealloc.blocks[flogfs.prealloc.n];
+	flog_prealloc_sift_up(i);
+	flog_prealloc_sift_down(i);
+}
 
-	if(find_result.first_block != FLOG_BLOCK_IDX_INVALID){
-		// TODO: Make sure file isn't already open for writing
+uint_fast8_t flog_age_is_sufficient(int32_t threshold,
+                                    flog_block_age_t age){
+	if((int32_t)flogfs.mean_free_age - (int32_t)age >= threshold)
+		return 1;
+	return 0;
+}
 
-		// File already exists
-		file->block = find_result.first_block;
-		file->id = find_result.file_id;
-		file->sector = FLOG_INIT_SECTOR;
-		// Count bytes from 0
-		file->write_head = 0;
-		// Iterate to the end of the file
-		// First check each terminated block
-		while(1){
-			flog_open_sector(file->block, FLOG_TAIL_SECTOR);
-			flash_read_sector(&sector_buffer, FLOG_TAIL_SECTOR, 0,
-			                  sizeof(flog_file_tail_sector_header_t));
-			if(file_tail_sector_header.timestamp == FLOG_TIMESTAMP_INVALID){
-				// This block is incomplete
-				break;
+FLOG_STATIC flog_block_alloc_t flog_prealloc_pop(int32_t threshold,
+                                            uint_fast8_t plane) {
+	flog_block_alloc_t block;
+	uint16_t i = 0;
+	if((FS_NUM_PLANES > 1) && (plane != FLOG_PLANE_ANY)){
+		// The heap isn't ordered by plane, so look at everything
+		uint16_t best = flogfs.prealloc.n;
+		for(uint16_t j = 0; j < flogfs.prealloc.n; j++){
+			if((flog_block_plane(flogfs.prealloc.blocks[j].block) == plane) &&
+			   ((best == flogfs.prealloc.n) ||
+			    (flogfs.prealloc.blocks[j].age <
+			     flogfs.prealloc.blocks[best].age))){
+				best = j;
 			}
-			file->block = file_tail_sector_header.next_block;
-			file->write_head += file_tail_sector_header.bytes_in_block;
 		}
-		// Now file->block is the first incomplete block
-		// Scan it sector-by-sector
+		if((best < flogfs.prealloc.n) &&
+		   flog_age_is_sufficient(threshold, flogfs.prealloc.blocks[best].age)){
+			i = best;
+		}
+	}
+	if((flogfs.prealloc.n == 0) ||
+	   !flog_age_is_sufficient(threshold, flogfs.prealloc.blocks[i].age)){
+		block.block = FLOG_BLOCK_IDX_INVALID;
+		return block;
+	}
+
+	block = flogfs.prealloc.blocks[i];
+	flog_prealloc_take(i);
+	return block;
+}
+
+#if FS_PAGE_CACHE_SIZE
+/*!
+ @brief Pick an entry to replace with the clock algorithm
+ */
+FLOG_STATIC flog_page_cache_entry_t * flog_page_cache_victim(){
+	flog_page_cache_entry_t * entry;
+	while(1){
+		entry = &flogfs.page_cache.entries[flogfs.page_cache.hand];
+		flogfs.page_cache.hand = (flogfs.page_cache.hand + 1) % FS_PAGE_CACHE_SIZE;
+		if((entry->block == FLOG_BLOCK_IDX_INVALID) || !entry->referenced){
+			return entry;
+		}
+		entry->referenced = 0;
+	}
+}
 
-		// Check out init sector no matter what and move on.
-		// It might have no data
-		flog_open_sector(file->block, FLOG_INIT_SECTOR);
-		flash_read_spare(&spare_buffer, FLOG_INIT_SECTOR);
-		file->write_head += file_sector_spare.nbytes;
-		file->sector = flog_increment_sector(file->sector);
-		while(1){
-			// For each block in the file
-			flog_open_sector(file->block, file->sector);
-			flash_read_spare(&spare_buffer, file->sector);
-			if(file_sector_spare.nbytes == FLOG_SECTOR_NBYTES_INVALID){
-				// No data
-				// We will write here!
-				if(file->sector == FLOG_TAIL_SECTOR){
-					file->offset = sizeof(flog_file_tail_sector_header_t);
-				} else {
-					file->offset = 0;
-				}
-				file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
-				break;
+/*!
+ @brief Drop the cached copy of a page (or a whole block)
+ @param block The block
+ @param page The page or FS_PAGES_PER_BLOCK for all pages in the block
+ */
+FLOG_STATIC void flog_page_cache_invalidate(flog_block_idx_t block,
+                                            uint16_t page){
+	for(uint_fast8_t i = 0; i < FS_PAGE_CACHE_SIZE; i++){
+		flog_page_cache_entry_t * const entry = &flogfs.page_cache.entries[i];
+		if((entry->block == block) &&
+		   ((page == FS_PAGES_PER_BLOCK) || (entry->page == page))){
+			entry->block = FLOG_BLOCK_IDX_INVALID;
+			if(flogfs.page_cache.current == entry){
+				flogfs.page_cache.current = 0;
 			}
-			file->write_head += file_sector_spare.nbytes;
-			file->sector = flog_increment_sector(file->sector);
 		}
-	} else {
-		// File doesn't exist
+	}
+}
+#endif
 
-		// Get a new inode entry
-		if(flog_inode_prepare_new(&inode_iter) != FLOG_SUCCESS){
-			// Somehow couldn't allocate an inode entry
-			goto failure;
+void flog_page_cache_clear(){
+#if FS_PAGE_CACHE_SIZE
+	for(uint_fast8_t i = 0; i < FS_PAGE_CACHE_SIZE; i++){
+		flogfs.page_cache.entries[i].block = FLOG_BLOCK_IDX_INVALID;
+	}
+	flogfs.page_cache.current = 0;
+	flogfs.page_cache.hand = 0;
+#endif
+}
+
+FLOG_STATIC flog_result_t flog_open_page(uint16_t block, uint16_t page){
+	flogfs.cache_status.current_open_block = block;
+	flogfs.cache_status.current_open_page = page;
+
+#if FS_PAGE_CACHE_SIZE
+	flog_page_cache_entry_t * entry;
+	for(uint_fast8_t i = 0; i < FS_PAGE_CACHE_SIZE; i++){
+		entry = &flogfs.page_cache.entries[i];
+		if((entry->block == block) && (entry->page == page)){
+			// The flash is only touched if a read misses
+			FLOG_STATS_INC(page_cache_hits);
+			entry->referenced = 1;
+			flogfs.page_cache.current = entry;
+			return FLOG_SUCCESS;
 		}
+	}
+#endif
 
-		// Configure inode to write
-		strcpy(inode_file_allocation_sector.filename, filename);
-		inode_file_allocation_sector.filename[FLOG_MAX_FNAME_LEN-1] = '\0';
+	if(flogfs.cache_status.page_open &&
+	   (flogfs.cache_status.loaded_block == block) &&
+	   (flogfs.cache_status.loaded_page == page)){
+		// Still in the flash cache
+		FLOG_STATS_INC(page_cache_hits);
+	}
 
-		flog_lock_allocate();
+#if FS_PAGE_CACHE_SIZE
+	entry = flog_page_cache_victim();
+	entry->block = block;
+	entry->page = page;
+	entry->referenced = 1;
+	entry->spare_valid = 0;
+	for(uint_fast8_t i = 0; i < FS_SECTORS_PER_PAGE; i++){
+		entry->valid[i] = 0;
+	}
+	flogfs.page_cache.current = entry;
+	if(flog_load_page() != FLOG_SUCCESS){
+		// Don't remember pages that couldn't be read
+		entry->block = FLOG_BLOCK_IDX_INVALID;
+		flogfs.page_cache.current = 0;
+		return FLOG_FAILURE;
+	}
+	return FLOG_SUCCESS;
+#else
+	return flog_load_page();
+#endif
+}
 
-		flog_flush_dirty_block();
+flog_result_t flog_load_page(){
+	flog_flash_wait_plane(
+	   flog_block_plane(flogfs.cache_status.current_open_block));
+	if(flogfs.cache_status.page_open &&
+	   (flogfs.cache_status.loaded_block ==
+	    flogfs.cache_status.current_open_block) &&
+	   (flogfs.cache_status.loaded_page ==
+	    flogfs.cache_status.current_open_page)){
+		return flogfs.cache_status.page_open_result;
+	}
+	FLOG_STATS_INC(page_opens);
+#if FLOG_ASYNC_FLASH
+	flogfs.cache_status.cache_busy = 0;
+#endif
+	flogfs.cache_status.page_open_result =
+	   flash_open_page(
+	      flog_block_physical(flogfs.cache_status.current_open_block),
+	      flogfs.cache_status.current_open_page);
+	flogfs.cache_status.page_open = 1;
+	flogfs.cache_status.loaded_block = flogfs.cache_status.current_open_block;
+	flogfs.cache_status.loaded_page = flogfs.cache_status.current_open_page;
 
-		alloc_block = flog_allocate_block(file->base_threshold);
-		if(alloc_block.block == FLOG_BLOCK_IDX_INVALID){
-			flog_unlock_allocate();
-			// Couldn't allocate a block
-			goto failure;
+	return flogfs.cache_status.page_open_result;
+}
+
+#if FLOG_MOUNT_PREFETCH || FLOG_TAIL_PREFETCH
+void flog_prefetch_page(uint16_t block, uint16_t page){
+	flog_flash_wait_plane(flog_block_plane(block));
+#if FLOG_ASYNC_FLASH
+	flogfs.cache_status.cache_busy = 0;
+#endif
+	// Only a hint; the open will read the page itself if this failed
+	flash_prefetch_page(flog_block_physical(block), page);
+}
+#endif
+
+flog_result_t flog_open_sector(uint16_t block, uint16_t sector){
+	return flog_open_page(block, sector / FS_SECTORS_PER_PAGE);
+}
+
+void flog_close_sector(){
+	flogfs.cache_status.page_open = 0;
+}
+
+flog_result_t flog_read_sector(uint8_t * dst, uint8_t sector,
+                               uint16_t offset, uint16_t n){
+	flog_result_t result;
+#if FS_PAGE_CACHE_SIZE
+	flog_page_cache_entry_t * const entry = flogfs.page_cache.current;
+	uint_fast8_t const idx = sector % FS_SECTORS_PER_PAGE;
+	if(entry && (offset + n <= entry->valid[idx])){
+		memcpy(dst, &entry->data[idx][offset], n);
+		return FLOG_SUCCESS;
+	}
+#endif
+	flog_load_page();
+	result = flash_read_sector(dst, sector, offset, n);
+#if FS_PAGE_CACHE_SIZE
+	// Extend the cached prefix if this read is contiguous with it
+	if(entry && (result == FLOG_SUCCESS) && (offset <= entry->valid[idx]) &&
+	   (offset < FS_PAGE_CACHE_BYTES)){
+		uint16_t const end = MIN(offset + n, FS_PAGE_CACHE_BYTES);
+		if(end > entry->valid[idx]){
+			memcpy(&entry->data[idx][offset], dst, end - offset);
+			entry->valid[idx] = end;
 		}
+	}
+#endif
+	return result;
+}
 
-		flogfs.dirty_block.block = alloc_block.block;
-		flogfs.dirty_block.file = file;
+flog_result_t flog_read_spare(uint8_t * dst, uint8_t sector){
+	flog_result_t result;
+#if FS_PAGE_CACHE_SIZE
+	flog_page_cache_entry_t * const entry = flogfs.page_cache.current;
+	uint_fast8_t const idx = sector % FS_SECTORS_PER_PAGE;
+	if(entry && (entry->spare_valid & (1 << idx))){
+		memcpy(dst, entry->spare[idx], sizeof(entry->spare[idx]));
+		return FLOG_SUCCESS;
+	}
+#endif
+	FLOG_STATS_INC(spare_reads);
+	flog_load_page();
+	result = flash_read_spare(dst, sector);
+#if FS_PAGE_CACHE_SIZE
+	if(entry && (result == FLOG_SUCCESS)){
+		memcpy(entry->spare[idx], dst, sizeof(entry->spare[idx]));
+		entry->spare_valid |= 1 << idx;
+	}
+#endif
+	return result;
+}
 
-		flog_unlock_allocate();
+flog_result_t flog_read_spares(uint8_t * dst){
+	flog_result_t result;
+#if FS_PAGE_CACHE_SIZE
+	flog_page_cache_entry_t * const entry = flogfs.page_cache.current;
+	if(entry && (entry->spare_valid == (1 << FS_SECTORS_PER_PAGE) - 1)){
+		memcpy(dst, entry->spare, sizeof(entry->spare));
+		return FLOG_SUCCESS;
+	}
+#endif
+	FLOG_STATS_INC(spare_reads);
+	flog_load_page();
+	result = flash_read_spares(dst);
+#if FS_PAGE_CACHE_SIZE
+	if(entry && (result == FLOG_SUCCESS)){
+		memcpy(entry->spare, dst, sizeof(entry->spare));
+		entry->spare_valid = (1 << FS_SECTORS_PER_PAGE) - 1;
+	}
+#endif
+	return result;
+}
+
+void flog_write_sector(uint8_t const * src, uint8_t sector,
+                       uint16_t offset, uint16_t n){
+	flog_load_page();
+	flash_write_sector(src, sector, offset, n);
+}
 
-		inode_file_allocation_sector.header.file_id = ++flogfs.max_file_id;
-		inode_file_allocation_sector.header.first_block = alloc_block.block;
-		inode_file_allocation_sector.header.first_block_age = ++alloc_block.age;
-		inode_file_allocation_sector.header.timestamp = ++flogfs.t;
+void flog_write_spare(uint8_t const * src, uint8_t sector){
+	flog_load_page();
+	flash_write_spare(src, sector);
+}
 
-		// Write the new inode entry
-		flog_open_sector(inode_iter.block,inode_iter.sector);
-		flash_write_sector(&sector_buffer, inode_iter.sector, 0,
-		                   sizeof(flog_inode_file_allocation_t));
-		flash_commit();
+#if FLOG_SECTOR_CRC
+uint32_t flog_read_spare_check(uint8_t sector){
+	uint32_t crc;
+	flog_load_page();
+	flash_read_spare_check((uint8_t *)&crc, sector);
+	return crc;
+}
 
-		file->block = alloc_block.block;
-		file->block_age = alloc_block.age;
-		file->id = flogfs.max_file_id;
-		file->bytes_in_block = 0;
-		file->write_head = 0;
-		file->sector = FLOG_INIT_SECTOR;
-		file->offset = sizeof(flog_file_init_sector_header_t);
-		file->sector_remaining_bytes = FS_SECTOR_SIZE -
-		                               sizeof(flog_file_init_sector_header_t);
+void flog_write_spare_check(uint32_t crc, uint8_t sector){
+	flog_load_page();
+	flash_write_spare_check((uint8_t const *)&crc, sector);
+}
+#endif
+
+flog_result_t flog_block_is_bad(){
+	flog_load_page();
+	return flash_block_is_bad();
+}
+
+flog_result_t flog_commit(){
+	FLOG_STATS_INC(sector_programs);
+#if FS_PAGE_CACHE_SIZE
+	flog_page_cache_invalidate(flogfs.cache_status.loaded_block,
+	                           flogfs.cache_status.loaded_page);
+#endif
+#if FLOG_ASYNC_FLASH
+	uint_fast8_t const plane = flog_block_plane(flogfs.cache_status.loaded_block);
+	flash_commit_start();
+	flogfs.cache_status.busy |= 1 << plane;
+	flogfs.cache_status.busy_block[plane] = flogfs.cache_status.loaded_block;
+	flogfs.cache_status.busy_page[plane] = flogfs.cache_status.loaded_page;
+	flogfs.cache_status.cache_busy = 1 << plane;
+	return FLOG_SUCCESS;
+#else
+	if(flash_commit() == FLOG_SUCCESS){
+		return FLOG_SUCCESS;
 	}
+	return flog_program_failed(flogfs.cache_status.loaded_block,
+	                           flogfs.cache_status.loaded_page, 1);
+#endif
+}
 
-	// Add it to that list
-	file->next = 0;
-	if(flogfs.write_head == 0){
-		flogfs.write_head = file;
-	} else {
-		flog_write_file_t * file_iter;
-		for(file_iter = flogfs.write_head;
-		    file_iter->next;
-		    file_iter = file_iter->next);
-		file_iter->next = file;
+void flog_flash_wait_plane(uint_fast8_t plane){
+#if FLOG_ASYNC_FLASH
+	if(flogfs.cache_status.busy & (1 << plane)){
+		flogfs.cache_status.busy &= ~(1 << plane);
+		if(flash_wait(plane) != FLOG_SUCCESS){
+			// This can come in the middle of anything, so whatever was open is
+			// opened again after. If another plane's page has been loaded
+			// since, the page can only be copied as it reads back.
+			flog_block_idx_t const block =
+			   flogfs.cache_status.current_open_block;
+			uint16_t const page = flogfs.cache_status.current_open_page;
+			flash_debug_error("FLogFS:" LINESTR);
+			flog_program_failed(flogfs.cache_status.busy_block[plane],
+			                    flogfs.cache_status.busy_page[plane],
+			                    (flogfs.cache_status.cache_busy >> plane) & 1);
+			flogfs.cache_status.current_open_block = block;
+			flogfs.cache_status.current_open_page = page;
+			flogfs.cache_status.page_open = 0;
+		}
 	}
+#else
+	(void)plane;
+#endif
+}
 
-	flash_unlock();
-	flog_unlock_fs();
+void flog_flash_wait(){
+	for(uint_fast8_t i = 0; i < FS_NUM_PLANES; i++){
+		flog_flash_wait_plane(i);
+	}
+}
+
+flog_result_t flog_erase_block(uint16_t block){
+	FLOG_STATS_INC(erases);
+#if FS_PAGE_CACHE_SIZE
+	flog_page_cache_invalidate(block, FS_PAGES_PER_BLOCK);
+#endif
+	if(flogfs.cache_status.loaded_block == block){
+		flogfs.cache_status.page_open = 0;
+	}
+	flog_flash_wait_plane(flog_block_plane(block));
+	if(flash_erase_block(flog_block_physical(block)) == FLOG_SUCCESS){
+		return FLOG_SUCCESS;
+	}
+	FLOG_STATS_INC(erase_failures);
+	flash_debug_warn("FLogFS:" LINESTR);
+#if FLOG_ENABLE_CHECKPOINT
+	if(flog_block_is_checkpoint(block)){
+		flog_checkpoint_give_up(block);
+		return FLOG_FAILURE;
+	}
+#endif
+	if(flog_block_out_of_use(block)){
+		return FLOG_FAILURE;
+	}
+	return flog_bad_block(block, FS_PAGES_PER_BLOCK, 0);
+}
 
+flog_result_t flog_program_failed(flog_block_idx_t block, uint16_t page,
+                                  uint_fast8_t in_cache){
+	FLOG_STATS_INC(program_failures);
+	flash_debug_warn("FLogFS:" LINESTR);
+#if FLOG_ENABLE_CHECKPOINT
+	if(flog_block_is_checkpoint(block)){
+		flog_checkpoint_give_up(block);
+		return FLOG_FAILURE;
+	}
+#endif
+	if(flog_block_out_of_use(block)){
+#if FLOG_BAD_BLOCK_SPARES
+		if(flog_bad_block_is_spare(block)){
+			// Being prepared. Copying onto it fails later and drops it.
+			return FLOG_FAILURE;
+		}
+#endif
+		// Given up on already, but still in use until it's freed
+		flogfs.lost_programs += 1;
+		return FLOG_FAILURE;
+	}
+	if(flog_bad_block(block, page, in_cache) != FLOG_SUCCESS){
+		// Whatever was going into that page is gone
+		flogfs.lost_programs += 1;
+		return FLOG_FAILURE;
+	}
 	return FLOG_SUCCESS;
+}
 
-failure:
-	flash_unlock();
-	flog_unlock_fs();
+flog_result_t flog_bad_block(flog_block_idx_t block, uint16_t page,
+                             uint_fast8_t in_cache){
+	flog_block_idx_t const old = flog_block_physical(block);
+	flog_result_t result = FLOG_FAILURE;
+#if FLOG_BAD_BLOCK_SPARES
+	flog_block_idx_t failed_src = in_cache ? FLOG_BLOCK_IDX_INVALID : old;
+	flog_block_idx_t spare;
+	// Spares which fail too, marked after so the cache is left alone
+	flog_block_idx_t dead[FLOG_BAD_BLOCK_TABLE_LEN];
+	uint_fast8_t num_dead = 0;
+
+#if FS_PAGE_CACHE_SIZE
+	flog_page_cache_invalidate(block, FS_PAGES_PER_BLOCK);
+#endif
+	while((spare = flog_bad_block_take_spare()) != FLOG_BLOCK_IDX_INVALID){
+		if(flog_bad_block_copy(block, old, spare, page, &failed_src) ==
+		   FLOG_SUCCESS){
+			flog_bad_block_set(block, spare);
+			flog_checkpoint_journal_bad(block, spare);
+			flog_set_bad_block(old);
+			FLOG_STATS_INC(blocks_replaced);
+			result = FLOG_SUCCESS;
+			break;
+		}
+		flash_debug_warn("FLogFS:" LINESTR);
+		dead[num_dead++] = spare;
+	}
+	// They stay out of use
+	while(num_dead--){
+		flog_checkpoint_journal_bad(dead[num_dead], FLOG_BLOCK_IDX_INVALID);
+		flog_set_bad_block(dead[num_dead]);
+	}
+	if(result == FLOG_SUCCESS){
+		return result;
+	}
+#else
+	(void)in_cache;
+#endif
+	// Nothing can take over, but the block may still hold live data. It gets
+	// its marker once that's deleted, unless what says whose it is was lost
+	// with page 0. Then a mount would take it for a free block.
+	flash_debug_error("FLogFS:" LINESTR);
+	flogfs.bad_block_bitmap[block / 8] |= 1 << (block % 8);
+	flog_checkpoint_journal_bad(block, FLOG_BLOCK_IDX_INVALID);
+	if((page == FS_PAGES_PER_BLOCK) || (page == 0)){
+		flog_set_bad_block(old);
+	}
+	return result;
+}
 
-	return FLOG_FAILURE;
+void flog_set_bad_block(flog_block_idx_t block){
+	flog_flash_wait_plane(block % FS_NUM_PLANES);
+	flogfs.cache_status.page_open = 0;
+	flash_set_bad_block(block);
 }
 
-/*!
- @details
- ### Internals
- To close a write, all outstanding data must simply be flushed to flash. If any
- blocks are newly-allocated, they must be committed.
+void flog_bad_block_reset(){
+	memset(flogfs.bad_block_bitmap, 0, sizeof(flogfs.bad_block_bitmap));
+#if FLOG_BAD_BLOCK_SPARES
+	flogfs.bad_block_table.n = 0;
+	flogfs.bad_block_table.num_spares = 0;
+#endif
+}
 
- TODO: Deal with files that can't be flushed due to no space for allocation
- */
-flog_result_t flogfs_close_write(flog_write_file_t * file){
-	flog_write_file_t * iter;
-	flog_result_t result;
+#if FLOG_BAD_BLOCK_SPARES
+flog_result_t flog_bad_block_copy(flog_block_idx_t block,
+                                  flog_block_idx_t old,
+                                  flog_block_idx_t spare,
+                                  uint16_t failed,
+                                  flog_block_idx_t * failed_src){
+	// These bypass flog_load_page() so the flash cache has to be reloaded after
+	flog_flash_wait();
+	flogfs.cache_status.page_open = 0;
+
+	if(failed == FS_PAGES_PER_BLOCK){
+		// An erase failed, so there's nothing to keep. The block stat written
+		// next carries the stamp.
+		return FLOG_SUCCESS;
+	}
+
+	// The failed page first, while the cache may still have it. Page 0 keeps
+	// the spare's stamp until the end, since a full mount scan takes a stamped
+	// block as a finished copy.
+	if(*failed_src != FLOG_BLOCK_IDX_INVALID){
+		flash_open_page(*failed_src, failed);
+	}
+	if(failed == 0){
+		flog_bad_block_stamp(FLOG_BLOCK_IDX_INVALID);
+	}
+	if(flash_commit_to(spare, failed) != FLOG_SUCCESS){
+		return FLOG_FAILURE;
+	}
+	*failed_src = spare;
 
+	for(uint16_t page = 0; page < FS_PAGES_PER_BLOCK; page++){
+		if(page == failed){
+			continue;
+		}
+		if(flash_open_page(old, page) != FLOG_SUCCESS){
+			// Keep what can be read
+			flash_debug_warn("FLogFS:" LINESTR);
+		}
+		if(page == 0){
+			flog_bad_block_stamp(FLOG_BLOCK_IDX_INVALID);
+		} else if(flog_flash_page_is_blank()){
+			// Leave it to be programmed for the first time
+			continue;
+		}
+		if(flash_commit_to(spare, page) != FLOG_SUCCESS){
+			return FLOG_FAILURE;
+		}
+	}
 
-	flog_lock_fs();
-	flash_lock();
+	flash_open_page(spare, 0);
+	flog_bad_block_stamp(block);
+	return flash_commit_to(spare, 0);
+}
 
-	if(flogfs.write_head == file){
-		flogfs.write_head = file->next;
-	} else {
-		iter = flogfs.write_head;
-		while(iter->next){
-			if(iter->next == file){
-				iter->next = file->next;
-				break;
+uint_fast8_t flog_flash_page_is_blank(){
+	uint8_t buffer[64];
+	uint_fast16_t i;
+	// Programmed sectors nearly always have spares, so check those first
+	flash_read_spares(buffer);
+	for(i = 0; i < FS_SECTORS_PER_PAGE * 4; i++){
+		if(buffer[i] != 0xFF){
+			return 0;
+		}
+	}
+	for(uint_fast8_t sector = 0; sector < FS_SECTORS_PER_PAGE; sector++){
+		for(uint16_t offset = 0; offset < FS_SECTOR_SIZE;
+		    offset += sizeof(buffer)){
+			flash_read_sector(buffer, sector, offset, sizeof(buffer));
+			for(i = 0; i < sizeof(buffer); i++){
+				if(buffer[i] != 0xFF){
+					return 0;
+				}
 			}
-			iter = iter->next;
 		}
-		goto failure;
 	}
+	return 1;
+}
 
-	result = flog_flush_write(file);
-
-	flash_unlock();
-	flog_unlock_fs();
-
-	return result;
+void flog_bad_block_stamp(flog_block_idx_t replaces){
+	flog_block_stat_spare_t stamp;
+	stamp.key = FLOG_BLOCK_STAT_SPARE_KEY;
+	stamp.nothing = 0;
+	stamp.replaces = replaces;
+	flash_write_spare((uint8_t const *)&stamp, FLOG_BLK_STAT_SECTOR);
+}
 
-failure:
+flog_block_idx_t flog_bad_block_take_spare(){
+	for(uint_fast8_t i = 0; i < flogfs.bad_block_table.n; i++){
+		flog_bad_block_entry_t * const entry = &flogfs.bad_block_table.entries[i];
+		if(entry->bad == FLOG_BLOCK_IDX_INVALID){
+			flog_block_idx_t const block = entry->block;
+			*entry = flogfs.bad_block_table.entries[--flogfs.bad_block_table.n];
+			flogfs.bad_block_table.num_spares -= 1;
+			return block;
+		}
+	}
+	return FLOG_BLOCK_IDX_INVALID;
+}
 
-	flash_unlock();
-	flog_unlock_fs();
-	return FLOG_FAILURE;
+void flog_bad_block_set(flog_block_idx_t bad, flog_block_idx_t block){
+	uint_fast8_t i;
+	for(i = 0; i < flogfs.bad_block_table.n; i++){
+		if(flogfs.bad_block_table.entries[i].bad == bad){
+			break;
+		}
+	}
+	if(i == flogfs.bad_block_table.n){
+		// Taking a spare always leaves room
+		flogfs.bad_block_table.n += 1;
+	}
+	flogfs.bad_block_table.entries[i].bad = bad;
+	flogfs.bad_block_table.entries[i].block = block;
 }
 
-flog_result_t flogfs_rm(char const * filename){
-	flog_file_find_result_t find_result;
-	flog_inode_iterator_t inode_iter;
-	flog_block_idx_t block, next_block;	
-	
-	union {
-		uint8_t sector_buffer;
-		flog_inode_file_invalidation_t invalidation_buffer;
-	};
+flog_result_t flog_bad_block_prepare(flog_block_idx_t block){
+	if(flog_erase_block(block) != FLOG_SUCCESS){
+		return FLOG_FAILURE;
+	}
+	flog_open_sector(block, FLOG_BLK_STAT_SECTOR);
+	flog_load_page();
+	flog_bad_block_stamp(FLOG_BLOCK_IDX_INVALID);
+	return flog_commit();
+}
 
-	flog_lock_fs();
-	flash_lock();
+uint_fast8_t flog_bad_block_refill(){
+	flog_block_alloc_t spare;
+	flog_block_idx_t block;
+	if((flogfs.bad_block_table.num_spares >= FLOG_BAD_BLOCK_SPARES) ||
+	   (flogfs.bad_block_table.n >= FLOG_BAD_BLOCK_TABLE_LEN)){
+		return 0;
+	}
+	spare = flog_allocate_block(0, FLOG_PLANE_ANY);
+	if(spare.block == FLOG_BLOCK_IDX_INVALID){
+		return 0;
+	}
+	// A program failing while this is in the table but not yet erased would
+	// take it, so have those found first
+	flog_flash_wait();
+	// The spare is wherever the block really is
+	block = flog_block_physical(spare.block);
+	flog_bad_block_add_spare(spare.block);
+	// Journaled first so a crash leaves a spare to prepare again, not a free
+	// block without a stat
+	flog_checkpoint_journal_spare(&spare);
+	if(flog_bad_block_prepare(block) != FLOG_SUCCESS){
+		flash_debug_warn("FLogFS:" LINESTR);
+		flog_bad_block_drop_spare(block);
+		flog_checkpoint_journal_bad(block, FLOG_BLOCK_IDX_INVALID);
+		flog_set_bad_block(block);
+	}
+	return 1;
+}
 
-	find_result = flog_find_file(filename, &inode_iter);
+void flog_bad_block_check_spares(){
+	struct {
+		flog_block_stat_sector_t stat;
+		char key[sizeof(flog_block_stat_key)];
+	} stat_sector;
+	flog_block_stat_spare_t stamp;
+	uint_fast8_t i = 0;
+
+	while(i < flogfs.bad_block_table.n){
+		flog_bad_block_entry_t const entry = flogfs.bad_block_table.entries[i];
+		uint_fast8_t blank = 1;
+		i += 1;
+		if(entry.bad != FLOG_BLOCK_IDX_INVALID){
+			continue;
+		}
+		// Any copy begins with page 0
+		flog_open_page(entry.block, 0);
+		flog_read_spare((uint8_t *)&stamp, FLOG_BLK_STAT_SECTOR);
+		flog_read_sector((uint8_t *)&stat_sector, FLOG_BLK_STAT_SECTOR, 0,
+		                 sizeof(stat_sector));
+		for(uint_fast8_t k = 0; k < sizeof(stat_sector); k++){
+			if(((uint8_t const *)&stat_sector)[k] != 0xFF){
+				blank = 0;
+			}
+		}
+		if(blank && (stamp.key == FLOG_BLOCK_STAT_SPARE_KEY) &&
+		   (stamp.replaces == FLOG_BLOCK_IDX_INVALID)){
+			continue;
+		}
+		flash_debug_warn("FLogFS:" LINESTR);
+		if(flog_bad_block_prepare(entry.block) != FLOG_SUCCESS){
+			flog_bad_block_drop_spare(entry.block);
+			flog_checkpoint_journal_bad(entry.block, FLOG_BLOCK_IDX_INVALID);
+			flog_set_bad_block(entry.block);
+			// Another entry moved into this one
+			i -= 1;
+		}
+	}
+}
 
-	if(find_result.first_block == FLOG_BLOCK_IDX_INVALID){
-		// Cool! The file already doesn't exist.
-		// No work to be done here.
-		goto failure;
+uint_fast8_t flog_mount_bad_block_stamp(flog_block_idx_t block,
+                                        flog_block_idx_t replaces){
+	flogfs.bad_block_bitmap[block / 8] |= 1 << (block % 8);
+	if(replaces == FLOG_BLOCK_IDX_INVALID){
+		flog_bad_block_add_spare(block);
+		return 0;
+	}
+	if((replaces >= FS_NUM_BLOCKS) ||
+	   (flogfs.bad_block_table.n == FLOG_BAD_BLOCK_TABLE_LEN) ||
+	   (flog_block_physical(replaces) != replaces)){
+		// Left out of use
+		flash_debug_error("FLogFS:" LINESTR);
+		return 0;
+	}
+	flog_bad_block_set(replaces, block);
+#if FS_PAGE_CACHE_SIZE
+	flog_page_cache_invalidate(replaces, FS_PAGES_PER_BLOCK);
+#endif
+	flogfs.cache_status.page_open = 0;
+	if(replaces > block){
+		// Seen through the stand-in when the scan gets there
+		return 0;
+	}
+	if(flog_block_out_of_use(replaces)){
+		// Skipped for its marker
+		flogfs.bad_block_bitmap[replaces / 8] &= ~(1 << (replaces % 8));
+		return 1;
 	}
+	// The copy finished but the marker never made it. What the scan found
+	// there is what the stand-in has.
+	flog_set_bad_block(replaces);
+	return 0;
+}
 
-	// Navigate to the end to find the last block
-	block = find_result.first_block;
-	while(1){
-		next_block = flog_universal_get_next_block(block);
-		if(next_block == FLOG_BLOCK_IDX_INVALID){
-			// THIS IS THE LAST BLOCK
-			break;
+void flog_bad_block_add_spare(flog_block_idx_t block){
+	flog_bad_block_entry_t * entry;
+	flogfs.bad_block_bitmap[block / 8] |= 1 << (block % 8);
+	for(uint_fast8_t i = 0; i < flogfs.bad_block_table.n; i++){
+		entry = &flogfs.bad_block_table.entries[i];
+		if(entry->bad == block){
+			// The stand-in is already out of use and the block itself has its
+			// marker
+			entry->bad = FLOG_BLOCK_IDX_INVALID;
+			flogfs.bad_block_table.num_spares += 1;
+			return;
 		}
-		block = next_block;
 	}
+	if(flogfs.bad_block_table.n == FLOG_BAD_BLOCK_TABLE_LEN){
+		// Left out of use
+		return;
+	}
+	for(uint_fast8_t i = 0; i < flogfs.bad_block_table.n; i++){
+		entry = &flogfs.bad_block_table.entries[i];
+		if((entry->bad == FLOG_BLOCK_IDX_INVALID) && (entry->block == block)){
+			return;
+		}
+	}
+	entry = &flogfs.bad_block_table.entries[flogfs.bad_block_table.n++];
+	entry->bad = FLOG_BLOCK_IDX_INVALID;
+	entry->block = block;
+	flogfs.bad_block_table.num_spares += 1;
+}
 
-	// Invalidate the inode entry
-	invalidation_buffer.last_block = block;
-	invalidation_buffer.timestamp = ++flogfs.t;
-	flog_open_sector(inode_iter.block, inode_iter.sector + 1);
-	flash_write_sector(&sector_buffer, inode_iter.sector + 1, 0,
-	                   sizeof(flog_inode_file_invalidation_t));
-	flash_commit();
-	// A disk failure here can be recovered in mounting
+void flog_bad_block_drop_spare(flog_block_idx_t block){
+	for(uint_fast8_t i = 0; i < flogfs.bad_block_table.n; i++){
+		flog_bad_block_entry_t * const entry = &flogfs.bad_block_table.entries[i];
+		if((entry->bad == FLOG_BLOCK_IDX_INVALID) && (entry->block == block)){
+			*entry = flogfs.bad_block_table.entries[--flogfs.bad_block_table.n];
+			flogfs.bad_block_table.num_spares -= 1;
+			return;
+		}
+	}
+}
 
-	// Invalidate the file block chain
-	flog_invalidate_chain(find_result.first_block, find_result.file_id);
+uint_fast8_t flog_bad_block_is_spare(flog_block_idx_t block){
+	for(uint_fast8_t i = 0; i < flogfs.bad_block_table.n; i++){
+		flog_bad_block_entry_t const * const entry =
+		   &flogfs.bad_block_table.entries[i];
+		if((entry->bad == FLOG_BLOCK_IDX_INVALID) && (entry->block == block)){
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
 
-	flash_unlock();
-	flog_unlock_fs();
-	return FLOG_SUCCESS;
+#if FLOG_ENABLE_CHECKPOINT
+void flog_read_page_data(uint8_t * dst, uint16_t offset, uint16_t n){
+	uint16_t const first_sector =
+	   flogfs.cache_status.current_open_page * FS_SECTORS_PER_PAGE;
+	while(n){
+		uint16_t const chunk =
+		   MIN(n, FS_SECTOR_SIZE - offset % FS_SECTOR_SIZE);
+		flog_read_sector(dst, first_sector + offset / FS_SECTOR_SIZE,
+		                 offset % FS_SECTOR_SIZE, chunk);
+		dst += chunk;
+		offset += chunk;
+		n -= chunk;
+	}
+}
 
-failure:
-	flash_unlock();
-	flog_unlock_fs();
-	return FLOG_FAILURE;
+void flog_write_page_data(uint8_t const * src, uint16_t offset, uint16_t n){
+	uint16_t const first_sector =
+	   flogfs.cache_status.current_open_page * FS_SECTORS_PER_PAGE;
+	while(n){
+		uint16_t const chunk =
+		   MIN(n, FS_SECTOR_SIZE - offset % FS_SECTOR_SIZE);
+		flog_write_sector(src, first_sector + offset / FS_SECTOR_SIZE,
+		                  offset % FS_SECTOR_SIZE, chunk);
+		src += chunk;
+		offset += chunk;
+		n -= chunk;
+	}
 }
+#endif
 
+#if FLOG_ENABLE_CHECKPOINT || (FLOG_SECTOR_CRC == 1)
+uint32_t flog_crc32(uint32_t crc, uint8_t const * data, uint32_t n){
+	crc = ~crc;
+#if FLOG_SECTOR_CRC == 1
+	uint32_t const (* const table)[256] = flog_crc32_table;
+	uint32_t lo, hi;
+	for(; n >= 8; n -= 8, data += 8){
+		lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) |
+		            ((uint32_t)data[3] << 24));
+		hi = data[4] | (data[5] << 8) | (data[6] << 16) |
+		     ((uint32_t)data[7] << 24);
+		crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+		      table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+		      table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+		      table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+	}
+	while(n--){
+		crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+	}
+#else
+	while(n--){
+		crc ^= *data++;
+		for(uint_fast8_t k = 0; k < 8; k++){
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+#endif
+	return ~crc;
+}
+#endif
 
+#if FLOG_SECTOR_CRC
+uint32_t flog_sector_crc(uint32_t crc, uint8_t const * data, uint32_t n){
+#if FLOG_SECTOR_CRC == 2
+	return flash_crc32(crc, data, n);
+#else
+	return flog_crc32(crc, data, n);
+#endif
+}
+#endif
 
+void flog_free_block(flog_block_idx_t block, flog_block_age_t age){
+	if(flog_block_out_of_use(block)){
+		// It failed while in use and can be given up on now
+		flog_set_bad_block(flog_block_physical(block));
+		return;
+	}
+	flogfs.free_block_bitmap[block / 8] |= 1 << (block % 8);
+	flogfs.num_free_blocks += 1;
+	flogfs.free_block_sum += age;
+	flog_update_mean_free_age();
+	flog_prealloc_push(block, age);
+	flog_checkpoint_journal_free(block, age);
+}
 
+void flog_mount_claim_block(flog_block_idx_t block, flog_block_age_t age){
+	if(!(flogfs.free_block_bitmap[block / 8] & (1 << (block % 8)))){
+		// Already accounted for
+		return;
+	}
+	flogfs.free_block_bitmap[block / 8] &= ~(1 << (block % 8));
+	flog_prealloc_remove(block);
+	flogfs.num_free_blocks -= 1;
+	flogfs.free_block_sum -= age;
+	flog_update_mean_free_age();
+}
 
-void flogfs_start_ls(flogfs_ls_iterator_t * iter){
-	// TODO: Lock something?
+#if FLOG_ENABLE_CHECKPOINT
 
-	flog_inode_iterator_init(iter, flogfs.inode0);
-}
+#if !FLOG_BUILD_CPP
+#if (FS_NUM_BLOCKS / 4 + 32 + FLOG_BAD_BLOCK_TABLE_LEN * 4) > \
+    (FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE)
+#error "The block bitmaps don't fit in a checkpoint record page"
+#endif
+#endif
 
-uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t * iter, char * fname_dst){
-	union {
-		uint8_t sector_buffer;
-		flog_file_id_t file_id;
-		flog_timestamp_t timestamp;
-	};
-	while(1){
-		flog_open_sector(iter->block, iter->sector);
-		flash_read_sector(&sector_buffer, iter->sector,
-		                  0, sizeof(flog_file_id_t));
-		if(file_id == FLOG_FILE_ID_INVALID){
-			// Nothing here. Done.
-			return 0;
-		}
-		// Now check to see if it's valid
-		flog_open_sector(iter->block, iter->sector + 1);
-		flash_read_sector(&sector_buffer, iter->sector+1,
-		                  0, sizeof(flog_timestamp_t));
-		if(timestamp == FLOG_TIMESTAMP_INVALID){
-			// This file's good
-			// Now check to see if it's valid
-			// Go read the filename
-			flog_open_sector(iter->block, iter->sector);
-			flash_read_sector((uint8_t *)fname_dst, iter->sector,
-			                  sizeof(flog_inode_file_allocation_header_t),
-							  FLOG_MAX_FNAME_LEN);
-			fname_dst[FLOG_MAX_FNAME_LEN-1] = '\0';
-			flog_inode_iterator_next(iter);
-			return 1;
-		} else {
-			flog_inode_iterator_next(iter);
-		}
+void flog_checkpoint_reset(){
+	for(uint_fast8_t i = 0; i < FLOG_CHECKPOINT_NUM_BLOCKS; i++){
+		flogfs.checkpoint.blocks[i] = FLOG_BLOCK_IDX_INVALID;
 	}
+	flogfs.checkpoint.current = 0;
+	flogfs.checkpoint.sequence = 0;
+	flogfs.checkpoint.sector = FS_SECTORS_PER_BLOCK;
+	flogfs.checkpoint.journal_len = 0;
+	flogfs.checkpoint.num_pending_free = 0;
 }
 
-void flogfs_stop_ls(flogfs_ls_iterator_t * iter){
-	// TODO: Unlock something?
+void flog_checkpoint_give_up(flog_block_idx_t block){
+	flash_debug_error("FLogFS:" LINESTR);
+	flogfs.checkpoint_failed = 1;
+	flog_checkpoint_reset();
+	flog_set_bad_block(block);
 }
 
+/*!
+ @brief Erase the next checkpoint block and make it the current one
+ */
+FLOG_STATIC void flog_checkpoint_next_block(){
+	struct {
+		flog_block_stat_sector_t stat;
+		char key[sizeof(flog_block_stat_key)];
+	} stat_sector;
+	flog_checkpoint_init_sector_spare_t spare;
+	flog_block_idx_t block;
 
+	flogfs.checkpoint.current =
+	   (flogfs.checkpoint.current + 1) % FLOG_CHECKPOINT_NUM_BLOCKS;
+	block = flogfs.checkpoint.blocks[flogfs.checkpoint.current];
 
-///////////////////////////////////////////////////////////////////////////////
-// Static implementations
-///////////////////////////////////////////////////////////////////////////////
-
-flog_result_t flog_commit_file_sector(flog_write_file_t * file,
-                                      uint8_t const * data,
-                                      flog_sector_nbytes_t n){
-	flog_file_sector_spare_t file_sector_spare;
-	if(file->sector == FLOG_TAIL_SECTOR){
-		// We need a new block
-		flog_block_alloc_t next_block;
-		flog_file_tail_sector_header_t * const file_tail_sector_header =
-		   (flog_file_tail_sector_header_t *) file->sector_buffer;
+	stat_sector.stat.age = flog_block_get_age(block) + 1;
+	stat_sector.stat.next_block = FLOG_BLOCK_IDX_INVALID;
+	stat_sector.stat.next_age = FLOG_BLOCK_AGE_INVALID;
+	stat_sector.stat.timestamp = 0;
+	memcpy(stat_sector.key, flog_block_stat_key, sizeof(flog_block_stat_key));
 
-		flog_lock_allocate();
+	spare.type_id = FLOG_BLOCK_TYPE_CHECKPOINT;
+	spare.nothing = 0;
+	spare.reserved = 0;
 
-		flog_flush_dirty_block();
+	if(FLOG_FAILURE == flog_erase_block(block)){
+		// Given up on
+		return;
+	}
+	flog_open_page(block, 0);
+	flog_write_sector((uint8_t const *)&stat_sector, FLOG_BLK_STAT_SECTOR, 0,
+	                  sizeof(stat_sector));
+	flog_write_spare((uint8_t const *)&spare, FLOG_INIT_SECTOR);
+	flog_commit();
 
-		next_block = flog_allocate_block(file->base_threshold);
-		if(next_block.block == FLOG_BLOCK_IDX_INVALID){
-			// Can't write the last sector without sealing the file.
-			// Bailing
-			flog_unlock_allocate();
-			return FLOG_FAILURE;
-		}
+	flogfs.checkpoint.sector = FS_SECTORS_PER_PAGE;
+}
 
-		flogfs.dirty_block.block = next_block.block;
-		flogfs.dirty_block.file = file;
+void flog_checkpoint_write(){
+	flog_checkpoint_header_t header;
+	uint32_t crc;
+	uint16_t page;
+	uint16_t offset;
 
-		flogfs.num_free_blocks -= 1;
+	if(flogfs.checkpoint.blocks[0] == FLOG_BLOCK_IDX_INVALID){
+		return;
+	}
 
-		flog_unlock_allocate();
+	// Have any failed programs dealt with (and journaled) before starting.
+	// Checkpoints may have been given up on by that, or by the erase.
+	flog_flash_wait();
+	if(flogfs.checkpoint.blocks[0] == FLOG_BLOCK_IDX_INVALID){
+		return;
+	}
 
-		// Prepare the header
-		file_tail_sector_header->next_age = next_block.age + 1;
-		file_tail_sector_header->next_block = next_block.block;
-		file_tail_sector_header->timestamp = ++flogfs.t;
-		file->bytes_in_block +=
-			FS_SECTOR_SIZE - sizeof(flog_file_tail_sector_header_t);
-		file_sector_spare.nbytes =
-			FS_SECTOR_SIZE - sizeof(flog_file_tail_sector_header_t);
-		file_tail_sector_header->bytes_in_block = file->bytes_in_block;
+	// Records hold everything that's pending
+	flogfs.checkpoint.num_pending_free = 0;
 
-		flog_open_sector(file->block, FLOG_TAIL_SECTOR);
-		// First write what was already buffered (and the header)
-		flash_write_sector((uint8_t const *)file_tail_sector_header,
-						FLOG_TAIL_SECTOR, 0, file->offset);
-		// Now write the rest of the data
-		if(n){
-			flash_write_sector(data, FLOG_TAIL_SECTOR, file->offset, n);
+	// Records start on a page and leave room for at least one more
+	page = (flogfs.checkpoint.sector + FS_SECTORS_PER_PAGE - 1) /
+	       FS_SECTORS_PER_PAGE;
+	if(page >= FS_PAGES_PER_BLOCK - 1){
+		flog_checkpoint_next_block();
+		if(flogfs.checkpoint.blocks[0] == FLOG_BLOCK_IDX_INVALID){
+			return;
 		}
-		flash_write_spare((uint8_t const *)&file_sector_spare,
-		                  FLOG_TAIL_SECTOR);
-		flash_commit();
+		page = 1;
+	}
 
-		// Ready the file structure for the next block/sector
-		file->block = next_block.block;
-		file->block_age = next_block.age;
-		file->sector = FLOG_INIT_SECTOR;
-		file->sector_remaining_bytes =
-		   FS_SECTOR_SIZE - sizeof(flog_file_init_sector_header_t);
-		file->bytes_in_block = 0;
-		file->offset = sizeof(flog_file_init_sector_header_t);
-		file->write_head += n;
-		return FLOG_SUCCESS;
-	} else {
-		flog_file_init_sector_header_t * const file_init_sector_header =
-			(flog_file_init_sector_header_t *) file->sector_buffer;
+	header.magic = FLOG_CHECKPOINT_RECORD_MAGIC;
+	header.sequence = ++flogfs.checkpoint.sequence;
+	header.t = flogfs.t;
+	header.max_file_id = flogfs.max_file_id;
+	header.free_block_sum = flogfs.free_block_sum;
+	header.inode0 = flogfs.inode0;
+	header.num_stale_blocks = flogfs.num_stale_blocks;
+	header.allocate_head = flogfs.allocate_head;
+	header.num_free_blocks = flogfs.num_free_blocks;
+#if FLOG_BAD_BLOCK_SPARES
+	header.num_bad_entries = flogfs.bad_block_table.n;
+#else
+	header.num_bad_entries = 0;
+#endif
+	header.crc = 0;
+	crc = flog_crc32(0, (uint8_t const *)&header, sizeof(header));
+	crc = flog_crc32(crc, flogfs.free_block_bitmap,
+	                 sizeof(flogfs.free_block_bitmap));
+	crc = flog_crc32(crc, flogfs.bad_block_bitmap,
+	                 sizeof(flogfs.bad_block_bitmap));
+#if FLOG_BAD_BLOCK_SPARES
+	crc = flog_crc32(crc, (uint8_t const *)flogfs.bad_block_table.entries,
+	                 header.num_bad_entries * sizeof(flog_bad_block_entry_t));
+#endif
+	header.crc = crc;
+
+	flog_open_page(flogfs.checkpoint.blocks[flogfs.checkpoint.current], page);
+	offset = 0;
+	flog_write_page_data((uint8_t const *)&header, offset, sizeof(header));
+	offset += sizeof(header);
+	flog_write_page_data(flogfs.free_block_bitmap, offset,
+	                     sizeof(flogfs.free_block_bitmap));
+	offset += sizeof(flogfs.free_block_bitmap);
+	flog_write_page_data(flogfs.bad_block_bitmap, offset,
+	                     sizeof(flogfs.bad_block_bitmap));
+#if FLOG_BAD_BLOCK_SPARES
+	offset += sizeof(flogfs.bad_block_bitmap);
+	flog_write_page_data((uint8_t const *)flogfs.bad_block_table.entries,
+	                     offset,
+	                     header.num_bad_entries * sizeof(flog_bad_block_entry_t));
+#endif
+	flog_commit();
 
-		flog_lock_allocate();
-		// So if this block is the dirty block...
-		if(flogfs.dirty_block.file == file){
-			flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
-		}
-		flog_unlock_allocate();
-		file_sector_spare.type_id = FLOG_BLOCK_TYPE_FILE;
-		file_sector_spare.nbytes = file->offset + n;
+	flogfs.checkpoint.sector = (page + 1) * FS_SECTORS_PER_PAGE;
+	flogfs.checkpoint.journal_len = 0;
+}
 
-		// We need to just write the data and advance
-		if(file->sector == FLOG_INIT_SECTOR){
-			// Need to prepare sector 0 header
-			file_init_sector_header->file_id = file->id;
-			file_init_sector_header->age = file->block_age;
-			file_sector_spare.nbytes -= sizeof(flog_file_init_sector_header_t);
-		}
+/*!
+ @brief Write one journal sector
+ @param type A flog_checkpoint_journal_type_t
+ @param previous For allocations, the block that will point to the new one
+ @param blocks The blocks to record
+ @param count The number of blocks
+ */
+FLOG_STATIC void
+flog_checkpoint_journal_write(uint8_t type, flog_block_idx_t previous,
+                              flog_checkpoint_journal_block_t const * blocks,
+                              uint_fast8_t count){
+	flog_checkpoint_journal_header_t header;
+	flog_block_idx_t block;
 
-		flog_open_sector(file->block, file->sector);
-		if(file->offset){
-			// This is either sector 0 or there was data already
-			// First write prior data/header
-			flash_write_sector(file->sector_buffer, file->sector, 0, file->offset);
-		}
-		if(n){
-			flash_write_sector(data, file->sector, file->offset, n);
-		}
-		flash_write_spare((uint8_t const *)&file_sector_spare, file->sector);
-		flash_commit();
+	if(flogfs.checkpoint.blocks[0] == FLOG_BLOCK_IDX_INVALID){
+		return;
+	}
+
+	// Have any failed programs dealt with (and journaled) before starting
+	// (see flog_checkpoint_write())
+	flog_flash_wait();
+	if(flogfs.checkpoint.blocks[0] == FLOG_BLOCK_IDX_INVALID){
+		return;
+	}
 
-		// Now update stuff for the new sector
-		file->sector = flog_increment_sector(file->sector);
-		if(file->sector == FLOG_TAIL_SECTOR){
-			file->offset = sizeof(flog_file_tail_sector_header_t);
-		} else {
-			file->offset = 0;
+	if((flogfs.checkpoint.journal_len >= FLOG_CHECKPOINT_JOURNAL_LEN) ||
+	   (flogfs.checkpoint.sector >= FS_SECTORS_PER_BLOCK)){
+		// Out of journal; a new record holds everything so far
+		flog_checkpoint_write();
+		if((type != FLOG_CHECKPOINT_JOURNAL_ALLOC) ||
+		   (flogfs.checkpoint.blocks[0] == FLOG_BLOCK_IDX_INVALID)){
+			return;
 		}
-		file->bytes_in_block += n;
-		file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
-		file->write_head += n;
-		return FLOG_SUCCESS;
+		// Allocations are still journaled to remember who points to them
 	}
-}
 
-flog_result_t flog_flush_write (flog_write_file_t * file ){
-	return flog_commit_file_sector(file, 0, 0);
+	header.magic = FLOG_CHECKPOINT_JOURNAL_MAGIC;
+	header.sequence = flogfs.checkpoint.sequence;
+	header.t = flogfs.t;
+	header.type = type;
+	header.count = count;
+	header.previous = previous;
+
+	block = flogfs.checkpoint.blocks[flogfs.checkpoint.current];
+	flog_open_sector(block, flogfs.checkpoint.sector);
+	flog_write_sector((uint8_t const *)&header, flogfs.checkpoint.sector, 0,
+	                  sizeof(header));
+	flog_write_sector((uint8_t const *)blocks, flogfs.checkpoint.sector,
+	                  sizeof(header),
+	                  count * sizeof(flog_checkpoint_journal_block_t));
+	flog_commit();
+
+	flogfs.checkpoint.sector += 1;
+	flogfs.checkpoint.journal_len += 1;
 }
 
-
-void flog_prealloc_iterate() {
-	flog_block_alloc_t block;
-	block = flog_allocate_block_iterate();
-	flog_prealloc_push(block.block, block.age);
+/*!
+ @brief Replay a journaled spare
+ */
+FLOG_STATIC void flog_checkpoint_replay_spare(flog_block_idx_t block){
+#if FLOG_BAD_BLOCK_SPARES
+	flog_bad_block_add_spare(block);
+#else
+	flogfs.bad_block_bitmap[block / 8] |= 1 << (block % 8);
+#endif
 }
 
+/*!
+ @brief Replay a journaled bad block
+ @param block The block
+ @param spare The spare standing in for it, or FLOG_BLOCK_IDX_INVALID
+ */
+FLOG_STATIC void flog_checkpoint_replay_bad(flog_block_idx_t block,
+                                            flog_block_idx_t spare){
+#if FLOG_BAD_BLOCK_SPARES
+	// A spare may have been what went bad
+	flog_bad_block_drop_spare(block);
+	if(spare < FS_NUM_BLOCKS){
+		flog_bad_block_drop_spare(spare);
+		if((flog_block_physical(block) != block) ||
+		   (flogfs.bad_block_table.n < FLOG_BAD_BLOCK_TABLE_LEN)){
+			flog_bad_block_set(block, spare);
+			return;
+		}
+	}
+#else
+	(void)spare;
+#endif
+	flogfs.bad_block_bitmap[block / 8] |= 1 << (block % 8);
+}
 
-flog_block_alloc_t flog_allocate_block_iterate(){
-	flog_block_alloc_t block;
+flog_result_t
+flog_checkpoint_restore(flog_checkpoint_journal_block_t * last_alloc,
+                        flog_block_idx_t * last_alloc_previous){
 	union {
-		uint8_t init_sector_buffer;
-		flog_universal_init_sector_header_t universal_init_sector_header;
+		flog_checkpoint_header_t header;
+		flog_checkpoint_journal_header_t journal;
 	};
+	flog_checkpoint_init_sector_spare_t spare;
+	flog_checkpoint_journal_block_t entry;
+	flog_block_idx_t block;
+	uint32_t crc;
+	uint32_t record_crc;
+	uint32_t sequence = 0;
+	uint16_t offset;
+	uint16_t page;
+	uint16_t record_page = 0;
+	uint16_t sector;
+	uint_fast8_t record_idx = FLOG_CHECKPOINT_NUM_BLOCKS;
+	uint_fast8_t n = 0;
 
-	union {
-		uint8_t invalidation_buffer;
-		flog_universal_invalidation_header_t universal_invalidation_header;
-	};
+	last_alloc->block = FLOG_BLOCK_IDX_INVALID;
+	last_alloc->age = 0;
+	*last_alloc_previous = FLOG_BLOCK_IDX_INVALID;
 
-	flog_block_stat_sector_t block_stat_sector;
+	flog_checkpoint_reset();
 
-	block.block = FLOG_BLOCK_IDX_INVALID;
-	
-	if(flogfs.free_block_bitmap[flogfs.allocate_head] &
-	   (1 << (flogfs.allocate_head % 8))){
-		// This block is okay to look at
-		flog_get_block_stat(flogfs.allocate_head, &block_stat_sector);
-		block.age = block_stat_sector.age;
-		block.block = flogfs.allocate_head;
+	// The reserved blocks are the first good ones
+	for(block = 0; (block < FS_NUM_BLOCKS) &&
+	               (n < FLOG_CHECKPOINT_NUM_BLOCKS); block++){
+		if(FLOG_FAILURE == flog_open_page(block, 0)){
+			continue;
+		}
+		if(FLOG_SUCCESS == flog_block_is_bad()){
+			continue;
+		}
+		flog_read_spare((uint8_t *)&spare, FLOG_INIT_SECTOR);
+		if(spare.type_id != FLOG_BLOCK_TYPE_CHECKPOINT){
+			break;
+		}
+		flogfs.checkpoint.blocks[n++] = block;
+	}
+	if(n < FLOG_CHECKPOINT_NUM_BLOCKS){
+		// Formatted without checkpoints
+		flog_checkpoint_reset();
+		return FLOG_FAILURE;
 	}
 
-	// Move the head
-	flogfs.allocate_head = (flogfs.allocate_head + 1) % FS_NUM_BLOCKS;
-
-	return block;
-}
-
-static void flog_prealloc_push(flog_block_idx_t block,
-                               flog_block_age_t age){
-	if(flogfs.prealloc.n == 0){
-		flogfs.prealloc.blocks[0].block = block;
-		flogfs.prealloc.blocks[0].age = age;
-		flogfs.prealloc.n = 1;
-		flogfs.prealloc.age_sum += age;
-		return;
+	// Find the most recent record. Pages are written in order so the first
+	// one without a record or journal is the end of the block.
+	for(uint_fast8_t i = 0; i < FLOG_CHECKPOINT_NUM_BLOCKS; i++){
+		for(page = 1; page < FS_PAGES_PER_BLOCK; page++){
+			flog_open_page(flogfs.checkpoint.blocks[i], page);
+			flog_read_sector((uint8_t *)&header, page * FS_SECTORS_PER_PAGE,
+			                 0, sizeof(header));
+			if(header.magic == FLOG_CHECKPOINT_RECORD_MAGIC){
+				if((record_idx == FLOG_CHECKPOINT_NUM_BLOCKS) ||
+				   (header.sequence > sequence)){
+					record_idx = i;
+					record_page = page;
+					sequence = header.sequence;
+				}
+			} else if(header.magic != FLOG_CHECKPOINT_JOURNAL_MAGIC){
+				break;
+			}
+		}
+	}
+	if(record_idx == FLOG_CHECKPOINT_NUM_BLOCKS){
+		// Never written; the next record goes at the start of the first block
+		flogfs.checkpoint.current = FLOG_CHECKPOINT_NUM_BLOCKS - 1;
+		return FLOG_FAILURE;
 	}
 
-	if((flogfs.prealloc.n == FS_PREALLOCATE_SIZE) &&
-	   (flogfs.prealloc.blocks[flogfs.prealloc.n - 1].age < age)){
-		// This block sucks
-		return;
+	// New records go after this one (or into the next block)
+	block = flogfs.checkpoint.blocks[record_idx];
+	flogfs.checkpoint.current = record_idx;
+	flogfs.checkpoint.sequence = sequence;
+	flogfs.checkpoint.sector = (record_page + 1) * FS_SECTORS_PER_PAGE;
+
+	flog_open_page(block, record_page);
+	offset = 0;
+	flog_read_page_data((uint8_t *)&header, offset, sizeof(header));
+	offset += sizeof(header);
+	flog_read_page_data(flogfs.free_block_bitmap, offset,
+	                    sizeof(flogfs.free_block_bitmap));
+	offset += sizeof(flogfs.free_block_bitmap);
+	flog_read_page_data(flogfs.bad_block_bitmap, offset,
+	                    sizeof(flogfs.bad_block_bitmap));
+	crc = header.crc;
+	header.crc = 0;
+	record_crc = flog_crc32(0, (uint8_t const *)&header, sizeof(header));
+	record_crc = flog_crc32(record_crc, flogfs.free_block_bitmap,
+	                        sizeof(flogfs.free_block_bitmap));
+	record_crc = flog_crc32(record_crc, flogfs.bad_block_bitmap,
+	                        sizeof(flogfs.bad_block_bitmap));
+#if FLOG_BAD_BLOCK_SPARES
+	if(header.num_bad_entries <= FLOG_BAD_BLOCK_TABLE_LEN){
+		offset += sizeof(flogfs.bad_block_bitmap);
+		flog_read_page_data((uint8_t *)flogfs.bad_block_table.entries, offset,
+		                    header.num_bad_entries *
+		                    sizeof(flog_bad_block_entry_t));
+		record_crc = flog_crc32(record_crc,
+		                        (uint8_t const *)flogfs.bad_block_table.entries,
+		                        header.num_bad_entries *
+		                        sizeof(flog_bad_block_entry_t));
+		flogfs.bad_block_table.n = header.num_bad_entries;
+		for(uint_fast8_t i = 0; i < flogfs.bad_block_table.n; i++){
+			if(flogfs.bad_block_table.entries[i].bad == FLOG_BLOCK_IDX_INVALID){
+				flogfs.bad_block_table.num_spares += 1;
+			}
+		}
+	}
+	if(header.num_bad_entries > FLOG_BAD_BLOCK_TABLE_LEN){
+#else
+	if(header.num_bad_entries){
+#endif
+		// Written with a bigger table
+		record_crc = ~crc;
+	}
+	if(crc != record_crc){
+		// Torn or corrupt
+		flash_debug_warn("FLogFS:" LINESTR);
+		flog_bad_block_reset();
+		flogfs.checkpoint.sector = FS_SECTORS_PER_BLOCK;
+		return FLOG_FAILURE;
 	}
-	for(flog_block_idx_t i = flogfs.prealloc.n - 1; i; i--){
-		// Search for the right place (start at end)
-		if(age <= flogfs.prealloc.blocks[i].age){
-			if(flogfs.prealloc.n == FS_PREALLOCATE_SIZE){
-				// Last block will be discarded
-				flogfs.prealloc.age_sum -=
-				  flogfs.prealloc.blocks[FS_PREALLOCATE_SIZE - 1].age;
+
+	flogfs.t = header.t;
+	flogfs.max_file_id = header.max_file_id;
+	flogfs.free_block_sum = header.free_block_sum;
+	flogfs.inode0 = header.inode0;
+	flogfs.num_stale_blocks = header.num_stale_blocks;
+	flogfs.allocate_head = header.allocate_head;
+	flogfs.num_free_blocks = header.num_free_blocks;
+
+	// Replay everything journaled since. Entries are idempotent.
+	for(sector = flogfs.checkpoint.sector; sector < FS_SECTORS_PER_BLOCK;
+	    sector++){
+		flog_open_sector(block, sector);
+		flog_read_sector((uint8_t *)&journal, sector, 0, sizeof(journal));
+		if((journal.magic != FLOG_CHECKPOINT_JOURNAL_MAGIC) ||
+		   (journal.sequence != sequence)){
+			if(journal.magic != 0xFFFFFFFF){
+				// Don't write over a torn sector
+				sector = FS_SECTORS_PER_BLOCK;
 			}
-			for(flog_block_idx_t j = MIN(flogfs.prealloc.n,
-			                             FS_PREALLOCATE_SIZE - 1);
-			    j > i; j--){
-				// Shift all older blocks
-				flogfs.prealloc.blocks[j].age =
-				   flogfs.prealloc.blocks[j - 1].age;
-				flogfs.prealloc.blocks[j].block =
-				   flogfs.prealloc.blocks[j - 1].block;
+			break;
+		}
+		flogfs.checkpoint.journal_len += 1;
+		flogfs.t = MAX(flogfs.t, journal.t);
+		for(uint_fast8_t i = 0; (i < journal.count) &&
+		                        (i < FLOG_CHECKPOINT_JOURNAL_MAX_BLOCKS); i++){
+			uint8_t * byte;
+			uint8_t mask;
+			flog_read_sector((uint8_t *)&entry, sector,
+			                 sizeof(journal) + i * sizeof(entry),
+			                 sizeof(entry));
+			if(entry.block >= FS_NUM_BLOCKS){
+				continue;
 			}
-			if(flogfs.prealloc.n < FS_PREALLOCATE_SIZE){
-				flogfs.prealloc.n += 1;
+			byte = &flogfs.free_block_bitmap[entry.block / 8];
+			mask = 1 << (entry.block % 8);
+			switch(journal.type){
+			case FLOG_CHECKPOINT_JOURNAL_ALLOC:
+			case FLOG_CHECKPOINT_JOURNAL_SPARE:
+				if(*byte & mask){
+					*byte &= ~mask;
+					flogfs.num_free_blocks -= 1;
+					flogfs.free_block_sum -= entry.age;
+				}
+				if(journal.type == FLOG_CHECKPOINT_JOURNAL_ALLOC){
+					*last_alloc = entry;
+					*last_alloc_previous = journal.previous;
+				} else {
+					flog_checkpoint_replay_spare(entry.block);
+				}
+				break;
+			case FLOG_CHECKPOINT_JOURNAL_FREE:
+				if(!(*byte & mask)){
+					*byte |= mask;
+					flogfs.num_free_blocks += 1;
+					flogfs.free_block_sum += entry.age;
+				}
+				break;
+			case FLOG_CHECKPOINT_JOURNAL_BAD:
+				flog_checkpoint_replay_bad(entry.block, journal.previous);
+				break;
 			}
-			flogfs.prealloc.blocks[i].age = age;
-			flogfs.prealloc.blocks[i].block = block;
-
-			flogfs.prealloc.age_sum += age;
-			return;
 		}
 	}
-}
+	flogfs.checkpoint.sector = sector;
 
-uint_fast8_t flog_age_is_sufficient(int32_t threshold,
-                                    flog_block_age_t age){
-	if((int32_t)flogfs.mean_free_age - (int32_t)age >= threshold)
-		return 1;
-	return 0;
+	return FLOG_SUCCESS;
 }
+#endif
 
-static flog_block_alloc_t flog_prealloc_pop(int32_t threshold) {
-	flog_block_alloc_t block;
-	if((flogfs.prealloc.n == 0) ||
-	   !flog_age_is_sufficient(threshold, flogfs.prealloc.blocks[0].age)){
-		block.block = FLOG_BLOCK_IDX_INVALID;
-		return block;
-	}
-
-	block.block = flogfs.prealloc.blocks[0].block;
-	block.age = flogfs.prealloc.blocks[0].age;
-
-	// Shift all of the other entries forward
-	flogfs.prealloc.n -= 1;
-	for(flog_block_idx_t i = 0; i < flogfs.prealloc.n; i++){
-		flogfs.prealloc.blocks[i].age = flogfs.prealloc.blocks[i + 1].age;
-		flogfs.prealloc.blocks[i].block = flogfs.prealloc.blocks[i + 1].block;
-	}
-	return block;
+void flog_checkpoint_journal_alloc(flog_block_alloc_t const * block,
+                                   flog_block_idx_t previous){
+#if FLOG_ENABLE_CHECKPOINT
+	flog_checkpoint_journal_block_t entry;
+	entry.block = block->block;
+	entry.age = block->age;
+	flog_checkpoint_journal_write(FLOG_CHECKPOINT_JOURNAL_ALLOC, previous,
+	                              &entry, 1);
+#else
+	(void)block;
+	(void)previous;
+#endif
 }
 
-static flog_result_t flog_open_page(uint16_t block, uint16_t page){
-	if(flogfs.cache_status.page_open &&
-	   (flogfs.cache_status.current_open_block == block) &&
-	   (flogfs.cache_status.current_open_page == page)){
-		return flogfs.cache_status.page_open_result;
+void flog_checkpoint_journal_free(flog_block_idx_t block,
+                                  flog_block_age_t age){
+#if FLOG_ENABLE_CHECKPOINT
+	uint_fast8_t const n = flogfs.checkpoint.num_pending_free;
+	flogfs.checkpoint.pending_free[n].block = block;
+	flogfs.checkpoint.pending_free[n].age = age;
+	flogfs.checkpoint.num_pending_free = n + 1;
+	if(flogfs.checkpoint.num_pending_free ==
+	   sizeof(flogfs.checkpoint.pending_free) /
+	   sizeof(flogfs.checkpoint.pending_free[0])){
+		flog_checkpoint_journal_flush();
 	}
-	flogfs.cache_status.page_open_result = flash_open_page(block, page);
-	flogfs.cache_status.page_open = 1;
-	flogfs.cache_status.current_open_block = block;
-	flogfs.cache_status.current_open_page = page;
+#else
+	(void)block;
+	(void)age;
+#endif
+}
 
-	return flogfs.cache_status.page_open_result;
+#if FLOG_BAD_BLOCK_SPARES
+void flog_checkpoint_journal_spare(flog_block_alloc_t const * block){
+#if FLOG_ENABLE_CHECKPOINT
+	flog_checkpoint_journal_block_t entry;
+	entry.block = block->block;
+	entry.age = block->age;
+	flog_checkpoint_journal_write(FLOG_CHECKPOINT_JOURNAL_SPARE,
+	                              FLOG_BLOCK_IDX_INVALID, &entry, 1);
+#else
+	(void)block;
+#endif
 }
+#endif
 
-flog_result_t flog_open_sector(uint16_t block, uint16_t sector){
-	return flog_open_page(block, sector / FS_SECTORS_PER_PAGE);
+void flog_checkpoint_journal_bad(flog_block_idx_t block,
+                                 flog_block_idx_t spare){
+#if FLOG_ENABLE_CHECKPOINT
+	flog_checkpoint_journal_block_t entry;
+	entry.block = block;
+	entry.age = FLOG_BLOCK_AGE_INVALID;
+	flog_checkpoint_journal_write(FLOG_CHECKPOINT_JOURNAL_BAD, spare,
+	                              &entry, 1);
+#else
+	(void)block;
+	(void)spare;
+#endif
 }
 
-void flog_close_sector(){
-	flogfs.cache_status.page_open = 0;
+void flog_checkpoint_journal_flush(){
+#if FLOG_ENABLE_CHECKPOINT
+	if(flogfs.checkpoint.num_pending_free){
+		flog_checkpoint_journal_write(FLOG_CHECKPOINT_JOURNAL_FREE,
+		                              FLOG_BLOCK_IDX_INVALID,
+		                              flogfs.checkpoint.pending_free,
+		                              flogfs.checkpoint.num_pending_free);
+		flogfs.checkpoint.num_pending_free = 0;
+	}
+#endif
 }
 
 flog_block_idx_t
 flog_universal_get_next_block(flog_block_idx_t block){
-	if(block == FLOG_BLOCK_IDX_INVALID)
-		return block;
+	if(block >= FS_NUM_BLOCKS)
+		return FLOG_BLOCK_IDX_INVALID;
 	flog_open_sector(block, FLOG_TAIL_SECTOR);
-	flash_read_sector((uint8_t*)&block, FLOG_TAIL_SECTOR,
+	flog_read_sector((uint8_t*)&block, FLOG_TAIL_SECTOR,
 	                  0, sizeof(block));
-	return block;
+	// A torn tail can point anywhere
+	return (block < FS_NUM_BLOCKS) ? block : FLOG_BLOCK_IDX_INVALID;
 }
 
 
@@ -1614,12 +6696,10 @@ void flog_inode_iterator_init(flog_inode_iterator_t * iter,
 		flog_inode_init_sector_spare_t inode_init_sector_spare;
 	};
 	iter->block = inode0;
-	flog_open_sector(inode0, FLOG_TAIL_SECTOR);
-	flash_read_sector((uint8_t *)&iter->next_block, FLOG_TAIL_SECTOR, 0,
-	                  sizeof(flog_block_idx_t));
+	iter->next_block = flog_universal_get_next_block(inode0);
 	// Get the current inode block index
 	flog_open_sector(inode0, FLOG_INIT_SECTOR);
-	flash_read_spare(&spare_buffer, FLOG_INIT_SECTOR);
+	flog_read_spare(&spare_buffer, FLOG_INIT_SECTOR);
 	iter->inode_block_idx = inode_init_sector_spare.inode_index;
 
 	// This is zero anyways
@@ -1642,6 +6722,10 @@ void flog_inode_iterator_next(flog_inode_iterator_t * iter){
 	iter->inode_idx += 1;
 	if(iter->sector >= FS_SECTORS_PER_BLOCK){
 		// The next sector is in ANOTHER BLOCK!!!
+		if(iter->next_block == FLOG_BLOCK_IDX_INVALID){
+			// It may have been added since we got here
+			iter->next_block = flog_universal_get_next_block(iter->block);
+		}
 		if(iter->next_block != FLOG_BLOCK_IDX_INVALID){
 			// The next block actually already exists
 			iter->block = iter->next_block;
@@ -1651,11 +6735,10 @@ void flog_inode_iterator_next(flog_inode_iterator_t * iter){
 			// Point to the first inode sector of the next block
 			iter->sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
 		} else {
-			// The next doesn't exist
-			// WTF?
+			// The next doesn't exist, and never will if the link to it was
+			// lost. Stay past the end so this looks like the end of the table.
 			flash_debug_warn("FLogFS:" LINESTR);
-			// Don't do anything; this is dumb
-			iter->sector -= 2;
+			iter->sector = FS_SECTORS_PER_BLOCK;
 			iter->inode_idx -= 1;
 		}
 	}
@@ -1667,7 +6750,7 @@ flog_inode_get_prev_block(flog_block_idx_t block){
 	if(block == FLOG_BLOCK_IDX_INVALID)
 		return block;
 	flog_open_sector(block, FLOG_INIT_SECTOR);
-	flash_read_sector((uint8_t*)&block, FLOG_INIT_SECTOR,
+	flog_read_sector((uint8_t*)&block, FLOG_INIT_SECTOR,
 	                  sizeof(flog_timestamp_t), sizeof(block));
 	return block;
 }
@@ -1694,12 +6777,17 @@ void flog_inode_iterator_prev(flog_inode_iterator_t * iter){
 
 flog_result_t flog_inode_prepare_new (flog_inode_iterator_t * iter) {
 	flog_block_alloc_t block_alloc;
+	uint32_t lost_programs;
 	union{
 		uint8_t sector_buffer;
 		flog_universal_tail_sector_t inode_tail_sector;
 		flog_inode_init_sector_t inode_init_sector;
 		flog_inode_init_sector_spare_t inode_init_sector_spare;
 	};
+	if(iter->sector >= FS_SECTORS_PER_BLOCK){
+		// See flog_inode_iterator_next()
+		return FLOG_FAILURE;
+	}
 	if(iter->sector == FS_SECTORS_PER_BLOCK - 2){
 		if(iter->next_block != FLOG_BLOCK_IDX_INVALID){
 			flash_debug_warn("FLogFS:" LINESTR);
@@ -1713,35 +6801,45 @@ flog_result_t flog_inode_prepare_new (flog_inode_iterator_t * iter) {
 
 		flog_flush_dirty_block();
 
-		block_alloc = flog_allocate_block(0);
+		block_alloc = flog_allocate_block(0, FLOG_PLANE_ANY);
 		if(block_alloc.block == FLOG_BLOCK_IDX_INVALID){
 			// Couldn't allocate a new block!
 			flog_unlock_allocate();
 			return FLOG_FAILURE;
 		}
 
-		flogfs.num_free_blocks -= 1;
+		flog_checkpoint_journal_alloc(&block_alloc, iter->block);
 
 		flog_unlock_allocate();
 
 		// Go write the tail sector
+		lost_programs = flogfs.lost_programs;
 		flog_open_sector(iter->block, FLOG_TAIL_SECTOR);
 		inode_tail_sector.next_age = block_alloc.age + 1;
 		inode_tail_sector.next_block = block_alloc.block;
 		inode_tail_sector.timestamp = ++flogfs.t;
-		flash_write_sector(&sector_buffer, FLOG_TAIL_SECTOR, 0,
+		flog_write_sector(&sector_buffer, FLOG_TAIL_SECTOR, 0,
 		                   sizeof(flog_universal_tail_sector_t));
-		flash_commit();
+		flog_commit();
+		flog_flash_wait_plane(flog_block_plane(iter->block));
+		if(flogfs.lost_programs != lost_programs){
+			// Nothing leads to the block, so it can go back
+			flog_lock_allocate();
+			flog_free_block(block_alloc.block, block_alloc.age);
+			flog_unlock_allocate();
+			return FLOG_FAILURE;
+		}
 
 		// And prepare the header
 		flog_open_sector(block_alloc.block, FLOG_INIT_SECTOR);
 		inode_init_sector.timestamp = flogfs.t;
-		flash_write_sector(&sector_buffer, FLOG_INIT_SECTOR, 0,
+		inode_init_sector.format = flogfs.format;
+		flog_write_sector(&sector_buffer, FLOG_INIT_SECTOR, 0,
 		                   sizeof(flog_inode_init_sector_t));
 		inode_init_sector_spare.type_id = FLOG_BLOCK_TYPE_INODE;
 		inode_init_sector_spare.inode_index = ++iter->inode_block_idx;
-		flash_write_spare(&sector_buffer, 0);
-		flash_commit();
+		flog_write_spare(&sector_buffer, FLOG_INIT_SECTOR);
+		flog_commit();
 
 		iter->next_block = block_alloc.block;
 	}
@@ -1750,10 +6848,75 @@ flog_result_t flog_inode_prepare_new (flog_inode_iterator_t * iter) {
 	return FLOG_SUCCESS;
 }
 
+/*!
+ @details
+ ### Internals
+ A summary on the invalidation sector means deleted even when the allocation
+ predates the format, since flogfs_rm() always writes one. The invalidation is
+ checked first so deleted entries cost a single spare read.
+ */
+flog_inode_entry_state_t
+flog_inode_get_entry_state(flog_inode_iterator_t const * iter,
+                           uint16_t * name_hash, uint8_t * flags){
+	union {
+		uint8_t spare_buffer;
+		flog_inode_entry_spare_t inode_entry_spare;
+	};
+	union {
+		uint8_t sector_buffer;
+		flog_file_id_t file_id;
+		flog_timestamp_t timestamp;
+		flog_inode_file_allocation_t inode_file_allocation_sector;
+	};
+
+	if(iter->sector >= FS_SECTORS_PER_BLOCK){
+		// A dead end (see flog_inode_iterator_next())
+		return FLOG_INODE_ENTRY_FREE;
+	}
+	flog_open_sector(iter->block, iter->sector + 1);
+	flog_read_spare(&spare_buffer, iter->sector + 1);
+	if(inode_entry_spare.format == FLOG_INODE_ENTRY_FORMAT_SUMMARY){
+		return FLOG_INODE_ENTRY_DELETED;
+	}
+	flog_open_sector(iter->block, iter->sector);
+	flog_read_spare(&spare_buffer, iter->sector);
+	if(inode_entry_spare.format == FLOG_INODE_ENTRY_FORMAT_SUMMARY){
+		*name_hash = inode_entry_spare.name_hash;
+		if(flags){
+			*flags = inode_entry_spare.flags;
+		}
+		return FLOG_INODE_ENTRY_LIVE;
+	}
+	if(flags){
+		*flags = 0;
+	}
+
+	// Blank spares: either the end of the table or an older entry
+	flog_read_sector(&sector_buffer, iter->sector, 0,
+	                 sizeof(flog_inode_file_allocation_t));
+	if(file_id == FLOG_FILE_ID_INVALID){
+		return FLOG_INODE_ENTRY_FREE;
+	}
+	if((inode_file_allocation_sector.header.first_block >= FS_NUM_BLOCKS) ||
+	   (inode_file_allocation_sector.filename[0] == '\0') ||
+	   (memchr(inode_file_allocation_sector.filename, '\0',
+	           FLOG_MAX_FNAME_LEN) == nullptr)){
+		// Torn
+		return FLOG_INODE_ENTRY_DELETED;
+	}
+	flog_open_sector(iter->block, iter->sector + 1);
+	flog_read_sector(&sector_buffer, iter->sector + 1, 0,
+	                  sizeof(flog_timestamp_t));
+	if(timestamp != FLOG_TIMESTAMP_INVALID){
+		return FLOG_INODE_ENTRY_DELETED;
+	}
+	return FLOG_INODE_ENTRY_LIVE_UNHASHED;
+}
+
 flog_file_id_t flog_block_get_file_id(flog_block_idx_t block){
 	flog_file_id_t id;
 	flog_open_sector(block, FLOG_INIT_SECTOR);
-	flash_read_sector((uint8_t *)&id, FLOG_INIT_SECTOR,
+	flog_read_sector((uint8_t *)&id, FLOG_INIT_SECTOR,
 	                  sizeof(flog_block_age_t), sizeof(flog_file_id_t));
 	return id;
 }
@@ -1761,105 +6924,485 @@ flog_file_id_t flog_block_get_file_id(flog_block_idx_t block){
 void flog_write_block_stat(flog_block_idx_t block,
                            flog_block_stat_sector_t const * stat){
 	flog_open_sector(block, FLOG_BLK_STAT_SECTOR);
-	flash_write_sector((uint8_t const *)stat,
+	flog_write_sector((uint8_t const *)stat,
 	                   FLOG_BLK_STAT_SECTOR, 0,
 	                   sizeof(flog_block_stat_sector_t));
-	flash_commit();
+#if FLOG_BAD_BLOCK_SPARES
+	if(flog_block_physical(block) != block){
+		// The stand-in's stamp went with the erase
+		flog_bad_block_stamp(block);
+	}
+#endif
+	flog_commit();
 }
 
 void flog_get_block_stat(flog_block_idx_t block,
                            flog_block_stat_sector_t * stat){
 	flog_open_sector(block, FLOG_BLK_STAT_SECTOR);
-	flash_read_sector((uint8_t *)stat,
+	flog_read_sector((uint8_t *)stat,
 	                   FLOG_BLK_STAT_SECTOR, 0,
 	                   sizeof(flog_block_stat_sector_t));
 }
 
+#if FLOG_DELETE_QUEUE_LEN == 0
 void flog_invalidate_chain (flog_block_idx_t base, flog_file_id_t file_id) {
+	flog_deletion_t deletion;
+	flog_block_alloc_t block;
+
+	deletion.next = base;
+	deletion.file_id = file_id;
+
+	flog_lock_delete();
+
+	flogfs.t_allocation_ceiling = flogfs.t;
+
+	while(flog_deletion_step(&deletion, &block)){
+		flog_free_block(block.block, block.age);
+	}
+	flog_checkpoint_journal_flush();
+
+	flogfs.t_allocation_ceiling = FLOG_TIMESTAMP_INVALID;
+	flog_unlock_delete();
+}
+#endif
+
+uint_fast8_t flog_deletion_step(flog_deletion_t * deletion,
+                                flog_block_alloc_t * erased){
 	union {
 		uint8_t invalidation_sector_buffer;
 		flog_file_invalidation_sector_t file_invalidation_sector;
 		flog_file_init_sector_header_t init_sector;
 	};
 	union {
-		uint8_t tail_sector_buffer;
-		flog_file_tail_sector_header_t file_tail_sector;
+		uint8_t tail_sector_buffer;
+		flog_file_tail_sector_header_t file_tail_sector;
+	};
+	flog_block_stat_sector_t block_stat;
+	flog_block_idx_t const block = deletion->next;
+
+	// Stop after encoutering a block with no next block (or a corrupt one)
+	// ...or a block assigned to a different file
+	//    since that could only happen if the operation had completed
+	if((block >= FS_NUM_BLOCKS) ||
+	   (flog_get_block_type(block) != FLOG_BLOCK_TYPE_FILE)){
+		return 0;
+	}
+
+	// Check if this is indeed still the correct file
+	flog_open_sector(block, FLOG_INIT_SECTOR);
+	flog_read_sector((uint8_t *)&init_sector, FLOG_INIT_SECTOR, 0,
+	                  sizeof(flog_file_init_sector_header_t));
+	if((deletion->file_id == FLOG_FILE_ID_INVALID) ||
+	   (init_sector.file_id != deletion->file_id)){
+		// Already reused
+		return 0;
+	}
+
+	// Well it's time to invalidate this
+	// Get the age of this block
+	// The the age and index of the next block
+	block_stat.age = init_sector.age;
+	flog_open_sector(block, FLOG_TAIL_SECTOR);
+	flog_read_sector((uint8_t *)&file_tail_sector,
+	                  FLOG_TAIL_SECTOR, 0,
+	                  sizeof(flog_file_tail_sector_header_t));
+	block_stat.next_block = file_tail_sector.next_block;
+	block_stat.next_age = file_tail_sector.next_age;
+	block_stat.timestamp = ++flogfs.t;
+	// Need to clear cache
+	flog_close_sector();
+
+	if(flog_erase_block(block) == FLOG_SUCCESS){
+		flog_write_block_stat(block, &block_stat);
+	}
+
+	erased->block = block;
+	erased->age = block_stat.age;
+	deletion->next = block_stat.next_block;
+	return 1;
+}
+
+void flog_resume_deletion(flog_block_idx_t base, flog_file_id_t file_id,
+                          flog_timestamp_t timestamp){
+	flog_block_stat_sector_t block_stat;
+
+	// Skip the blocks erased since the deletion. Their stat sectors still say
+	// where the chain went, even if they've been used again since. A block
+	// past the end of the part ends the chain too; only a torn or failed
+	// program leaves one.
+	flog_lock_delete();
+	for(flog_block_idx_t i = FS_NUM_BLOCKS; i && (base < FS_NUM_BLOCKS); i--){
+		flog_get_block_stat(base, &block_stat);
+		if((block_stat.timestamp == FLOG_TIMESTAMP_INVALID) ||
+		   (block_stat.timestamp < timestamp)){
+			break;
+		}
+		flog_reclaim_erased_block(base, &block_stat);
+		base = block_stat.next_block;
+	}
+	flog_checkpoint_journal_flush();
+	flog_unlock_delete();
+
+	flog_delete_chain(base, file_id);
+}
+
+void flog_reclaim_erased_block(flog_block_idx_t block,
+                               flog_block_stat_sector_t const * block_stat){
+	if(!(flogfs.free_block_bitmap[block / 8] & (1 << (block % 8))) &&
+	   (flog_get_block_type(block) == FLOG_BLOCK_TYPE_UNALLOCATED)){
+		// Erased, but the free never made it to the checkpoint journal
+		flog_free_block(block, block_stat->age);
+	}
+}
+
+void flog_delete_chain(flog_block_idx_t base, flog_file_id_t file_id){
+#if FLOG_DELETE_QUEUE_LEN
+	flog_deletion_t * deletion;
+
+	flog_lock_delete();
+	while(flogfs.delete_queue.n == FLOG_DELETE_QUEUE_LEN){
+		// Make room
+		flog_delete_queue_step();
+	}
+	deletion = &flogfs.delete_queue.entries[
+	   (flogfs.delete_queue.head + flogfs.delete_queue.n) %
+	   FLOG_DELETE_QUEUE_LEN];
+	deletion->next = base;
+	deletion->file_id = file_id;
+	flogfs.delete_queue.n += 1;
+	flog_unlock_delete();
+#else
+	flog_invalidate_chain(base, file_id);
+#endif
+}
+
+#if FLOG_DELETE_QUEUE_LEN
+uint_fast8_t flog_delete_queue_step(){
+	flog_block_alloc_t block = flog_delete_queue_take();
+	if(block.block == FLOG_BLOCK_IDX_INVALID){
+		return 0;
+	}
+	flog_free_block(block.block, block.age);
+	// This may be a while before the next step, so don't sit on it
+	flog_checkpoint_journal_flush();
+	return flogfs.delete_queue.n != 0;
+}
+
+flog_block_alloc_t flog_delete_queue_take(){
+	flog_block_alloc_t block;
+	while(flogfs.delete_queue.n){
+		if(flog_deletion_step(
+		      &flogfs.delete_queue.entries[flogfs.delete_queue.head], &block)){
+			return block;
+		}
+		// That one's done
+		flogfs.delete_queue.head =
+		   (flogfs.delete_queue.head + 1) % FLOG_DELETE_QUEUE_LEN;
+		flogfs.delete_queue.n -= 1;
+	}
+	block.block = FLOG_BLOCK_IDX_INVALID;
+	return block;
+}
+#endif
+
+void flog_group_commit_step(){
+	flog_write_file_t * file;
+
+	flog_lock_fs();
+	file = flogfs.write_head;
+	while(file){
+		// A writer holding its lock already has the chance to commit
+		if(flog_trylock_file(file)){
+			// Its settings only hold still under its lock
+			if(file->commit_us && flog_group_commit_due(file)){
+				flog_unlock_fs();
+				flog_flush_locked(file);
+				// It can't leave the list while we hold its lock
+				flog_lock_fs();
+			}
+			flog_unlock_file(file);
+		}
+		file = file->next;
+	}
+	flog_unlock_fs();
+}
+
+#if FLOG_WEAR_LEVEL_SPREAD
+uint_fast8_t flog_wear_level_scan_step(){
+	flog_file_init_sector_header_t header;
+	flog_block_idx_t block;
+
+	flog_lock_allocate();
+	if(flogfs.wear.cursor == FS_NUM_BLOCKS){
+		if((flogfs.wear.allocations < FS_NUM_BLOCKS) ||
+		   (flogfs.wear.migrate != FLOG_FILE_ID_INVALID)){
+			flog_unlock_allocate();
+			return 0;
+		}
+		// Ages have moved on enough to look again
+		flogfs.wear.allocations = 0;
+		flogfs.wear.cursor = 0;
+		flogfs.wear.youngest_age = FLOG_BLOCK_AGE_INVALID;
+		flogfs.wear.youngest_file = FLOG_FILE_ID_INVALID;
+	}
+
+	block = flogfs.wear.cursor++;
+	if(!flog_block_out_of_use(block) &&
+	   !(flogfs.free_block_bitmap[block / 8] & (1 << (block % 8))) &&
+	   (flog_get_block_type(block) == FLOG_BLOCK_TYPE_FILE)){
+		flog_get_file_init_sector(block, &header);
+		if(header.age < flogfs.wear.youngest_age){
+			flogfs.wear.youngest_age = header.age;
+			flogfs.wear.youngest_file = header.file_id;
+		}
+	}
+
+	if((flogfs.wear.cursor == FS_NUM_BLOCKS) &&
+	   (flogfs.wear.youngest_file != FLOG_FILE_ID_INVALID) &&
+	   ((int32_t)flogfs.mean_free_age - (int32_t)flogfs.wear.youngest_age >
+	    FLOG_WEAR_LEVEL_SPREAD)){
+		flogfs.wear.migrate = flogfs.wear.youngest_file;
+	}
+	flog_unlock_allocate();
+	return 1;
+}
+
+uint_fast8_t flog_wear_level_pending(){
+	uint_fast8_t pending;
+	flog_lock_allocate();
+	pending = (flogfs.wear.migrate != FLOG_FILE_ID_INVALID) &&
+	          !flogfs.wear.listings;
+	flog_unlock_allocate();
+	return pending;
+}
+
+void flog_wear_level_migrate(){
+	flog_write_file_t * const copy = &flogfs.wear.copy;
+	flog_inode_iterator_t iter, copy_iter;
+	flog_file_find_result_t original, replacement;
+	flog_inode_entry_state_t state;
+	flog_read_file_t src;
+	flog_file_id_t id;
+	flog_result_t result;
+	uint16_t name_hash;
+	uint16_t n;
+	uint8_t flags;
+	uint_fast8_t busy;
+
+	union {
+		uint8_t sector_buffer;
+		flog_inode_file_allocation_t inode_file_allocation_sector;
 	};
-	flog_block_stat_sector_t block_stat;
-	
-	flog_block_idx_t num_freed = 0;
-	
-	flog_lock_delete();
-	
-	flogfs.t_allocation_ceiling = flogfs.t;
 
-	while(1){
-		// Stop loop after encoutering a block with no next block
-		// ...or a block assigned to a different file
-		//    since that could only happen if the operation had completed
+	flog_lock_inodes_write();
+	if(flogfs.state != FLOG_STATE_MOUNTED){
+		flog_unlock_inodes_write();
+		return;
+	}
+	flash_lock();
 
-		// First check if the block is free
-		// If so, check the next block
-		
-		if(base == FLOG_BLOCK_IDX_INVALID){
-			break;
-		}
+	flog_lock_allocate();
+	if(flogfs.wear.listings){
+		// It would look like a new file to them
+		flog_unlock_allocate();
+		goto done;
+	}
+	id = flogfs.wear.migrate;
+	flogfs.wear.migrate = FLOG_FILE_ID_INVALID;
+	flog_unlock_allocate();
+	if(id == FLOG_FILE_ID_INVALID){
+		goto done;
+	}
 
-		switch(flog_get_block_type(base)){
-		case FLOG_BLOCK_TYPE_UNALLOCATED:
-			flog_get_block_stat(base, &block_stat);
-			base = block_stat.next_block;
+	// Find what's left of it
+	for(flog_inode_iterator_init(&iter, flogfs.inode0);;
+	    flog_inode_iterator_next(&iter)){
+		state = flog_inode_get_entry_state(&iter, &name_hash, &flags);
+		if(state == FLOG_INODE_ENTRY_FREE){
+			// Deleted since the sweep
 			goto done;
+		}
+		if(state == FLOG_INODE_ENTRY_DELETED){
+			continue;
+		}
+		flog_open_sector(iter.block, iter.sector);
+		flog_read_sector(&sector_buffer, iter.sector, 0,
+		                  sizeof(flog_inode_file_allocation_t));
+		if(inode_file_allocation_sector.header.file_id == id){
 			break;
-// 		case FLOG_BLOCK_TYPE_ERROR:
-// 			break;
-// 		case FLOG_BLOCK_TYPE_INODE:
-// 			// It's already been allocated to something else, quit
-// 			return;
-		case FLOG_BLOCK_TYPE_FILE:
-			// Check if this is indeed still the correct file
-			flog_open_sector(base, FLOG_INIT_SECTOR);
-			flash_read_sector((uint8_t *)&init_sector, FLOG_INIT_SECTOR, 0,
-			                  sizeof(flog_file_init_sector_header_t));
-			if((file_id != FLOG_FILE_ID_INVALID) &&
-			   (init_sector.file_id == file_id)){
-				// Well it's time to invalidate this
-				// Get the age of this block
-				// The the age and index of the next block
-				block_stat.age = init_sector.age;
-				flog_open_sector(base, FLOG_TAIL_SECTOR);
-				flash_read_sector((uint8_t *)&file_tail_sector,
-				                  FLOG_TAIL_SECTOR, 0,
-				                  sizeof(flog_file_tail_sector_header_t));
-				block_stat.next_block = file_tail_sector.next_block;
-				block_stat.next_age = file_tail_sector.next_age;
-				block_stat.timestamp = ++flogfs.t;
-				// Need to clear cache
-				flog_close_sector();
-				
-				flash_erase_block(base);
-				
-				flog_write_block_stat(base, &block_stat);
-				flogfs.free_block_bitmap[base / 8] |= 1 << (base % 8);
-				
-				num_freed += 1;
-				
-				flogfs.free_block_sum += block_stat.age;
-				
-				base = block_stat.next_block;
-			}
+		}
+	}
+	original.first_block = inode_file_allocation_sector.header.first_block;
+	original.file_id = id;
+
+	// Anything open keeps its blocks until the next sweep
+	busy = 0;
+	flog_lock_fs();
+	for(flog_read_file_t * r = flogfs.read_head; r; r = r->next){
+		busy |= (r->id == id);
+	}
+	for(flog_write_file_t * w = flogfs.write_head; w; w = w->next){
+		busy |= (w->id == id);
+	}
+	flog_unlock_fs();
+	if(busy){
+		goto done;
+	}
+#if !FLOG_ENABLE_COMPRESSION
+	// Copying frames as plain data would break them at the sector ends
+	if(flags & FLOG_INODE_ENTRY_COMPRESSED){
+		goto done;
+	}
+#endif
+
+	flog_write_file_reset(copy);
+	copy->cold = 1;
+	copy->lost_programs = flogfs.lost_programs;
+	flog_inode_find_free(&copy_iter);
+	flags = FLOG_INODE_ENTRY_COPY | (flags & FLOG_INODE_ENTRY_COMPRESSED);
+	if(flog_file_create(copy, inode_file_allocation_sector.filename, flags,
+	                    &copy_iter) != FLOG_SUCCESS){
+		goto done;
+	}
+	replacement.first_block = copy->block;
+	replacement.file_id = copy->id;
+
+	src.id = id;
+	src.first_block = original.first_block;
+	src.block = original.first_block;
+	src.block_idx = 0;
+	src.block_start = 0;
+	src.read_head = 0;
+	src.skip_index = nullptr;
+#if FLOG_SECTOR_CRC
+	// Don't give bad data a fresh CRC
+	src.verify = 1;
+	src.checked = 0;
+	src.corrupt = 0;
+#endif
+	src.sector = FLOG_INIT_SECTOR;
+	src.offset = sizeof(flog_file_init_sector_header_t);
+	src.sector_remaining_bytes = 0;
+#if FLOG_ENABLE_COMPRESSION
+	// The frames are copied as they are
+	src.compressed = 0;
+#endif
+
+	result = FLOG_SUCCESS;
+	while(flog_read_file_advance(&src, nullptr) == FLOG_SUCCESS){
+		n = src.sector_remaining_bytes;
+		if(flog_read_file_sector(&src, flogfs.wear.buffer, n) != FLOG_SUCCESS){
+			result = FLOG_FAILURE;
 			break;
-		default:
-			while(1);
+		}
+		src.offset += n;
+		src.sector_remaining_bytes = 0;
+		src.read_head += n;
+#if FLOG_ENABLE_COMPRESSION
+		if(flags & FLOG_INODE_ENTRY_COMPRESSED){
+			result = flog_write_frames(copy, flogfs.wear.buffer, n);
+		} else
+#endif
+		if(flog_write_locked(copy, flogfs.wear.buffer, n) != n){
+			result = FLOG_FAILURE;
+		}
+		if(result != FLOG_SUCCESS){
 			break;
 		}
+	}
+	if(result == FLOG_SUCCESS){
+		result = flog_finish_write(copy);
+	}
+	if(result != FLOG_SUCCESS){
+		// Probably out of space. The original stays.
+		flog_file_remove(&copy_iter, &replacement,
+		                 inode_file_allocation_sector.filename);
+		goto done;
+	}
 
+	// The copy takes over
+	if(flog_file_remove(&iter, &original,
+	                    inode_file_allocation_sector.filename) != FLOG_SUCCESS){
+		// Unless the original is still there
+		flog_file_remove(&copy_iter, &replacement,
+		                 inode_file_allocation_sector.filename);
+		goto done;
 	}
+#if FS_FILE_INDEX_SIZE
+	flog_file_index_add(
+	   flog_filename_hash(inode_file_allocation_sector.filename), &copy_iter,
+	   replacement.first_block, replacement.file_id);
+#endif
+	flog_remember_write_tail(copy, FLOG_SUCCESS);
+	FLOG_STATS_INC(wear_level_moves);
+
 done:
-	flogfs.num_free_blocks += num_freed;
-	flogfs.mean_free_age = flogfs.free_block_sum / flogfs.num_free_blocks;
-	flogfs.t_allocation_ceiling = FLOG_TIMESTAMP_INVALID;
-	flog_unlock_delete();
+	flash_unlock();
+	flog_unlock_inodes_write();
+}
+#endif
+
+uint_fast8_t flogfs_background_step(uint32_t budget_us){
+	uint32_t const t0 = fs_get_time_us();
+	uint_fast8_t more;
+
+	flog_lock_inodes_read();
+	if(flogfs.state != FLOG_STATE_MOUNTED){
+		flog_unlock_inodes_read();
+		return 0;
+	}
+	flash_lock();
+
+	flog_group_commit_step();
+
+	do {
+		flog_flash_yield();
+#if FLOG_DELETE_QUEUE_LEN && !FLOG_LAZY_ERASE
+		// Erase deleted files first to get their blocks back
+		flog_lock_delete();
+		more = flog_delete_queue_step();
+		flog_unlock_delete();
+		if(more){
+			continue;
+		}
+#endif
+#if FLOG_BAD_BLOCK_SPARES
+		// Replace any spares used up
+		flog_lock_allocate();
+		more = flog_bad_block_refill();
+		flog_unlock_allocate();
+		if(more){
+			continue;
+		}
+#endif
+		// Then fill the preallocation list so allocation needn't search
+		flog_lock_allocate();
+		if((flogfs.prealloc.n < FS_PREALLOCATE_SIZE) &&
+		   (flogfs.prealloc.n < flogfs.num_free_blocks)){
+			flog_prealloc_iterate();
+		}
+		more = (flogfs.prealloc.n < FS_PREALLOCATE_SIZE) &&
+		       (flogfs.prealloc.n < flogfs.num_free_blocks);
+		flog_unlock_allocate();
+#if FLOG_WEAR_LEVEL_SPREAD
+		if(!more){
+			// Last of all, look for cold data
+			more = flog_wear_level_scan_step();
+		}
+#endif
+	} while(more && (fs_get_time_us() - t0 < budget_us));
+
+	flash_unlock();
+	flog_unlock_inodes_read();
+
+#if FLOG_WEAR_LEVEL_SPREAD
+	if(!more && (fs_get_time_us() - t0 < budget_us)){
+		// This needs the inode table to itself
+		flog_wear_level_migrate();
+	}
+	more = more || flog_wear_level_pending();
+#endif
+	return more;
 }
 
 flog_block_type_t flog_get_block_type(flog_block_idx_t block){
@@ -1867,16 +7410,42 @@ flog_block_type_t flog_get_block_type(flog_block_idx_t block){
 	if(flog_open_sector(block, FLOG_INIT_SECTOR) != FLOG_SUCCESS){
 		return FLOG_BLOCK_TYPE_ERROR;
 	}
-	flash_read_spare(type_id, FLOG_INIT_SECTOR);
+	flog_read_spare(type_id, FLOG_INIT_SECTOR);
 	return (flog_block_type_t)type_id[0];
 }
 
-flog_block_alloc_t flog_allocate_block(int32_t threshold){
+flog_block_alloc_t flog_allocate_block(int32_t threshold,
+                                       uint_fast8_t plane){
 	flog_block_alloc_t block;
 
 	// Don't lock because that should be done at higher level
 
 	//flog_lock_allocate();
+	if(plane == FLOG_PLANE_ANY){
+		// Spread out whatever is written next
+		plane = flogfs.next_plane;
+	}
+#if FLOG_LAZY_ERASE
+	// Recycle deleted blocks first. This is where they get erased.
+	flog_lock_delete();
+	block = flog_delete_queue_take();
+	flog_unlock_delete();
+	if(block.block != FLOG_BLOCK_IDX_INVALID){
+#if FLOG_WEAR_LEVEL_SPREAD
+		flogfs.wear.allocations = MIN(flogfs.wear.allocations + 1,
+		                              FS_NUM_BLOCKS);
+#endif
+		return block;
+	}
+#endif
+#if FLOG_DELETE_QUEUE_LEN
+	if(flogfs.num_free_blocks == 0){
+		// There may be space waiting in the deletion queue
+		flog_lock_delete();
+		while((flogfs.num_free_blocks == 0) && flog_delete_queue_step());
+		flog_unlock_delete();
+	}
+#endif
 	if(flogfs.num_free_blocks == 0){
 		// No free blocks in the system. GTFO.
 		block.block = FLOG_BLOCK_IDX_INVALID;
@@ -1884,34 +7453,37 @@ flog_block_alloc_t flog_allocate_block(int32_t threshold){
 		return block;
 	}
 
-	// Preallocate is empty
-	// Go search for another
-	// TODO: Make this efficient
+	if(flogfs.prealloc.n == flogfs.num_free_blocks){
+		// Every free block is in the list so there's no point in searching.
+		// The youngest is the best there is, though one on the plane asked
+		// for will still do if it's good enough.
+		block = flogfs.prealloc.blocks[0];
+		threshold = MIN(threshold,
+		                (int32_t)flogfs.mean_free_age - (int32_t)block.age);
+	}
+
+	// Take from the list if possible, otherwise go search for another
 	for(flog_block_idx_t i = FS_NUM_BLOCKS; i; i--){
-		block = flog_prealloc_pop(threshold);
+		block = flog_prealloc_pop(threshold, plane);
 		if(block.block != FLOG_BLOCK_IDX_INVALID){
 			// Got a block! Yahtzee!
 			//flog_unlock_allocate();
-			flogfs.num_free_blocks -= 1;
-			flogfs.free_block_sum -= block.age;
-			flogfs.mean_free_age = 
-			   flogfs.free_block_sum / flogfs.num_free_blocks;
-			return block;
+			flogfs.next_plane = flog_block_plane(block.block + 1);
+			if(flog_claim_free_block(&block) == FLOG_SUCCESS){
+				return block;
+			}
+			continue;
 		}
 		
 		block = flog_allocate_block_iterate();
 		if(block.block != FLOG_BLOCK_IDX_INVALID){
 			// Found a block
 			if(flog_age_is_sufficient(threshold, block.age)){
-				flogfs.free_block_bitmap[block.age / 8] &=
-				   ~(1 << (block.age % 8));
-				// BOOOOOO
-				flogfs.num_free_blocks -= 1;
-				flogfs.free_block_sum -= block.age;
-				flogfs.mean_free_age = 
-				   flogfs.free_block_sum / flogfs.num_free_blocks;
 				// It's actually okay!
-				break;
+				if(flog_claim_free_block(&block) == FLOG_SUCCESS){
+					break;
+				}
+				block.block = FLOG_BLOCK_IDX_INVALID;
 			} else {
 				// Leave it for someone else
 				flog_prealloc_push(block.block, block.age);
@@ -1924,6 +7496,82 @@ flog_block_alloc_t flog_allocate_block(int32_t threshold){
 	return block;
 }
 
+flog_block_alloc_t flog_allocate_worn_block(){
+	flog_block_alloc_t block;
+	uint16_t oldest;
+
+	for(flog_block_idx_t i = FS_NUM_BLOCKS;
+	    i && (flogfs.prealloc.n < flogfs.num_free_blocks); i--){
+		block = flog_allocate_block_iterate();
+		if(block.block == FLOG_BLOCK_IDX_INVALID){
+			continue;
+		}
+		if(block.age >= flogfs.mean_free_age){
+			if(flog_claim_free_block(&block) == FLOG_SUCCESS){
+				return block;
+			}
+			continue;
+		}
+		// Better kept for data that changes
+		flog_prealloc_push(block.block, block.age);
+	}
+
+	if(flogfs.prealloc.n){
+		oldest = 0;
+		for(uint16_t j = 1; j < flogfs.prealloc.n; j++){
+			if(flogfs.prealloc.blocks[j].age >
+			   flogfs.prealloc.blocks[oldest].age){
+				oldest = j;
+			}
+		}
+		block = flogfs.prealloc.blocks[oldest];
+		flog_prealloc_take(oldest);
+		if(flog_claim_free_block(&block) == FLOG_SUCCESS){
+			return block;
+		}
+	}
+
+	// Maybe there's something in the deletion queue
+	return flog_allocate_block(0, FLOG_PLANE_ANY);
+}
+
+flog_result_t flog_claim_free_block(flog_block_alloc_t * block){
+	flog_block_stat_sector_t block_stat;
+
+	flogfs.free_block_bitmap[block->block / 8] &= ~(1 << (block->block % 8));
+	flogfs.num_free_blocks -= 1;
+	flogfs.free_block_sum -= block->age;
+	flog_update_mean_free_age();
+#if FLOG_WEAR_LEVEL_SPREAD
+	flogfs.wear.allocations = MIN(flogfs.wear.allocations + 1, FS_NUM_BLOCKS);
+#endif
+
+	if(!flogfs.num_stale_blocks ||
+	   (flog_get_block_type(block->block) == FLOG_BLOCK_TYPE_UNALLOCATED)){
+		return FLOG_SUCCESS;
+	}
+	// Left from an older generation. Nothing points here, so it's erased
+	// like a block from the deletion queue but with no chain to follow.
+	flogfs.num_stale_blocks -= 1;
+	block_stat.age = block->age + 1;
+	block_stat.timestamp = 0;
+	block_stat.next_block = FLOG_BLOCK_IDX_INVALID;
+	block_stat.next_age = FLOG_BLOCK_AGE_INVALID;
+	flog_close_sector();
+	if(flog_erase_block(block->block) != FLOG_SUCCESS){
+		return FLOG_FAILURE;
+	}
+	flog_write_block_stat(block->block, &block_stat);
+	block->age = block_stat.age;
+	return FLOG_SUCCESS;
+}
+
+void flog_update_mean_free_age(){
+	// A full disk has no free blocks to average
+	flogfs.mean_free_age = flogfs.num_free_blocks ?
+	   flogfs.free_block_sum / flogfs.num_free_blocks : 0;
+}
+
 uint16_t flog_increment_sector(uint16_t sector){
 	switch(sector){
 	case FLOG_TAIL_SECTOR - 1:
@@ -1935,20 +7583,142 @@ uint16_t flog_increment_sector(uint16_t sector){
 	}
 }
 
+uint16_t flog_filename_hash(char const * filename){
+	// FNV-1a, folded
+	uint32_t h = 2166136261u;
+	for(uint_fast8_t i = 0; (i < FLOG_MAX_FNAME_LEN) && filename[i]; i++){
+		h = (h ^ (uint8_t)filename[i]) * 16777619u;
+	}
+	return (uint16_t)(h ^ (h >> 16));
+}
+
+#if FS_FILE_INDEX_SIZE
+void flog_file_index_clear(){
+	for(uint16_t i = 0; i < FS_FILE_INDEX_SIZE; i++){
+		flogfs.file_index.entries[i].inode_block = FLOG_BLOCK_IDX_INVALID;
+	}
+	flogfs.file_index.count = 0;
+	flogfs.file_index.complete = 0;
+}
+
+void flog_file_index_add(uint16_t hash,
+                         flog_inode_iterator_t const * iter,
+                         flog_block_idx_t first_block,
+                         flog_file_id_t file_id){
+	uint16_t i = hash % FS_FILE_INDEX_SIZE;
+
+	if(flogfs.file_index.count >= FS_FILE_INDEX_SIZE - 1){
+		// Always leave an empty slot to end probing
+		flogfs.file_index.complete = 0;
+		return;
+	}
+	while(flogfs.file_index.entries[i].inode_block != FLOG_BLOCK_IDX_INVALID){
+		i = (i + 1) % FS_FILE_INDEX_SIZE;
+	}
+	flogfs.file_index.entries[i].hash = hash;
+	flogfs.file_index.entries[i].inode_block = iter->block;
+	flogfs.file_index.entries[i].inode_sector = iter->sector;
+	flogfs.file_index.entries[i].first_block = first_block;
+	flogfs.file_index.entries[i].file_id = file_id;
+	flogfs.file_index.entries[i].tail.block = FLOG_BLOCK_IDX_INVALID;
+	flogfs.file_index.count += 1;
+}
+
+void flog_file_index_remove(char const * filename,
+                            flog_inode_iterator_t const * iter){
+	flog_file_index_entry_t * const entries = flogfs.file_index.entries;
+	uint16_t i = flog_filename_hash(filename) % FS_FILE_INDEX_SIZE;
+	uint16_t j, home;
+
+	for(;; i = (i + 1) % FS_FILE_INDEX_SIZE){
+		if(entries[i].inode_block == FLOG_BLOCK_IDX_INVALID){
+			// Not indexed
+			return;
+		}
+		if((entries[i].inode_block == iter->block) &&
+		   (entries[i].inode_sector == iter->sector)){
+			break;
+		}
+	}
+
+	// Shift back any entries that probed past this slot
+	for(j = (i + 1) % FS_FILE_INDEX_SIZE;
+	    entries[j].inode_block != FLOG_BLOCK_IDX_INVALID;
+	    j = (j + 1) % FS_FILE_INDEX_SIZE){
+		home = entries[j].hash % FS_FILE_INDEX_SIZE;
+		// Entry j can move to i if its home isn't cyclically in (i, j]
+		if((i <= j) ? ((home <= i) || (home > j)) :
+		              ((home <= i) && (home > j))){
+			entries[i] = entries[j];
+			i = j;
+		}
+	}
+	entries[i].inode_block = FLOG_BLOCK_IDX_INVALID;
+	flogfs.file_index.count -= 1;
+}
+
+flog_file_index_entry_t * flog_file_index_find_id(flog_file_id_t id){
+	for(uint16_t i = 0; i < FS_FILE_INDEX_SIZE; i++){
+		if((flogfs.file_index.entries[i].inode_block != FLOG_BLOCK_IDX_INVALID) &&
+		   (flogfs.file_index.entries[i].file_id == id)){
+			return &flogfs.file_index.entries[i];
+		}
+	}
+	return nullptr;
+}
+#endif
+
 flog_file_find_result_t flog_find_file(char const * filename,
                                               flog_inode_iterator_t * iter){
 	union {
 		uint8_t sector_buffer;;
 		flog_inode_file_allocation_t inode_file_allocation_sector;
-		flog_inode_file_invalidation_t inode_file_invalidation_sector;
 	};
 	union {
 		uint8_t spare_buffer;
-		flog_file_sector_spare_t file_sector_spare;
+		flog_inode_entry_spare_t inode_entry_spare;
 	};
+	flog_inode_entry_state_t state;
+	uint16_t name_hash;
+	uint8_t flags;
 
 	flog_file_find_result_t result;
 
+	uint16_t const hash = flog_filename_hash(filename);
+#if FS_FILE_INDEX_SIZE
+	for(uint16_t i = hash % FS_FILE_INDEX_SIZE;
+	    flogfs.file_index.entries[i].inode_block != FLOG_BLOCK_IDX_INVALID;
+	    i = (i + 1) % FS_FILE_INDEX_SIZE){
+		flog_file_index_entry_t const * const entry =
+		   &flogfs.file_index.entries[i];
+		if(entry->hash != hash){
+			continue;
+		}
+		// Confirm the name to rule out a collision
+		flog_open_sector(entry->inode_block, entry->inode_sector);
+		flog_read_sector(&sector_buffer, entry->inode_sector, 0,
+		                  sizeof(flog_inode_file_allocation_t));
+		if(strncmp(filename, inode_file_allocation_sector.filename,
+		   FLOG_MAX_FNAME_LEN) != 0){
+			continue;
+		}
+		flog_read_spare(&spare_buffer, entry->inode_sector);
+		iter->block = entry->inode_block;
+		iter->sector = entry->inode_sector;
+		result.first_block = entry->first_block;
+		result.file_id = entry->file_id;
+		result.flags = (inode_entry_spare.format ==
+		                FLOG_INODE_ENTRY_FORMAT_SUMMARY) ?
+		               inode_entry_spare.flags : 0;
+		return result;
+	}
+	if(flogfs.file_index.complete){
+		// Definitely not there
+		*iter = flogfs.file_index.tail;
+		goto failure;
+	}
+#endif
+
 	for(flog_inode_iterator_init(iter, flogfs.inode0);;
 	    flog_inode_iterator_next(iter)){
 
@@ -1957,12 +7727,9 @@ flog_file_find_result_t flog_find_file(char const * filename,
 		/////////////
 
 		// Check if the entry is valid
-		flog_open_sector(iter->block, iter->sector);
-		flash_read_sector(&sector_buffer, iter->sector, 0,
-		                  sizeof(flog_inode_file_allocation_t));
+		state = flog_inode_get_entry_state(iter, &name_hash, &flags);
 
-		if(inode_file_allocation_sector.header.file_id ==
-		   FLOG_FILE_ID_INVALID){
+		if(state == FLOG_INODE_ENTRY_FREE){
 			// This file is the end.
 			// Do a quick check to make sure there are no foolish errors
 			if(iter->next_block != FLOG_BLOCK_IDX_INVALID){
@@ -1971,7 +7738,15 @@ flog_file_find_result_t flog_find_file(char const * filename,
 			goto failure;
 		}
 
+		if((state == FLOG_INODE_ENTRY_DELETED) ||
+		   ((state == FLOG_INODE_ENTRY_LIVE) && (name_hash != hash))){
+			continue;
+		}
+
 		// Check if the name matches
+		flog_open_sector(iter->block, iter->sector);
+		flog_read_sector(&sector_buffer, iter->sector, 0,
+		                  sizeof(flog_inode_file_allocation_t));
 		if(strncmp(filename, inode_file_allocation_sector.filename,
 		   FLOG_MAX_FNAME_LEN) != 0){
 			continue;
@@ -1979,16 +7754,7 @@ flog_file_find_result_t flog_find_file(char const * filename,
 
 		result.first_block = inode_file_allocation_sector.header.first_block;
 		result.file_id = inode_file_allocation_sector.header.file_id;
-
-		// Now check if it's been deleted
-		flog_open_sector(iter->block, iter->sector+1);
-		flash_read_sector(&sector_buffer, iter->sector+1, 0,
-		                  sizeof(flog_timestamp_t));
-
-		if(inode_file_invalidation_sector.timestamp != FLOG_TIMESTAMP_INVALID){
-			// This one is invalid
-			continue;
-		}
+		result.flags = flags;
 
 		// This seems to be fine
 		return result;
@@ -1999,18 +7765,139 @@ failure:
 	return result;
 }
 
+void flog_file_get_tail(flog_block_idx_t first_block, flog_file_id_t file_id,
+                        flog_file_tail_t * tail){
+	union {
+		uint8_t sector_buffer;
+		flog_file_tail_sector_header_t file_tail_sector_header;
+	};
+	union {
+		uint8_t spare_buffer;
+		flog_file_sector_spare_t file_sector_spare;
+	};
+
+#if FS_FILE_INDEX_SIZE
+	flog_file_index_entry_t const * const entry =
+	   flog_file_index_find_id(file_id);
+	if(entry && (entry->tail.block != FLOG_BLOCK_IDX_INVALID)){
+		*tail = entry->tail;
+		return;
+	}
+#endif
+
+	tail->block = first_block;
+	// Count bytes from 0
+	tail->length = 0;
+	// Iterate to the end of the file
+	// First check each terminated block
+	while(1){
+		flog_open_sector(tail->block, FLOG_TAIL_SECTOR);
+		flog_read_sector(&sector_buffer, FLOG_TAIL_SECTOR, 0,
+		                  sizeof(flog_file_tail_sector_header_t));
+		if(file_tail_sector_header.timestamp == FLOG_TIMESTAMP_INVALID){
+			// This block is incomplete
+			break;
+		}
+		tail->block = file_tail_sector_header.next_block;
+		tail->length += flog_tail_bytes_in_block(&file_tail_sector_header);
+		flog_flash_yield();
+	}
+	// Now tail->block is the first incomplete block
+	// Scan it sector-by-sector
+
+	// Check out init sector no matter what and move on.
+	// It might have no data
+	flog_open_sector(tail->block, FLOG_INIT_SECTOR);
+	flog_read_spare(&spare_buffer, FLOG_INIT_SECTOR);
+	if(file_sector_spare.nbytes == FLOG_SECTOR_NBYTES_INVALID){
+		// Its program failed, and reads find nothing in it either
+		file_sector_spare.nbytes = 0;
+	}
+	tail->length += file_sector_spare.nbytes;
+	tail->bytes_in_block = file_sector_spare.nbytes;
+	tail->sector = flog_increment_sector(FLOG_INIT_SECTOR);
+	while(1){
+		flog_open_sector(tail->block, tail->sector);
+#if FLOG_TAIL_PREFETCH
+		if((tail->sector % FS_SECTORS_PER_PAGE == 0) &&
+		   (tail->sector + FS_SECTORS_PER_PAGE < FS_SECTORS_PER_BLOCK)){
+			// Sectors are written in order, so a full page means the next one
+			// is worth loading while this one is read out
+			flog_read_spare(&spare_buffer,
+			                tail->sector + FS_SECTORS_PER_PAGE - 1);
+			if(file_sector_spare.nbytes != FLOG_SECTOR_NBYTES_INVALID){
+				flog_prefetch_page(tail->block,
+				                   tail->sector / FS_SECTORS_PER_PAGE + 1);
+			}
+		}
+#endif
+		flog_read_spare(&spare_buffer, tail->sector);
+		if(file_sector_spare.nbytes == FLOG_SECTOR_NBYTES_INVALID){
+			// No data
+			// We will write here!
+			break;
+		}
+		tail->length += file_sector_spare.nbytes;
+		tail->bytes_in_block += file_sector_spare.nbytes;
+		tail->sector = flog_increment_sector(tail->sector);
+	}
+
+	flog_file_set_tail(file_id, tail);
+}
+
+void flog_file_set_tail(flog_file_id_t file_id, flog_file_tail_t const * tail){
+#if FS_FILE_INDEX_SIZE
+	flog_file_index_entry_t * const entry = flog_file_index_find_id(file_id);
+	if(!entry){
+		return;
+	}
+	if(tail){
+		entry->tail = *tail;
+	} else {
+		entry->tail.block = FLOG_BLOCK_IDX_INVALID;
+	}
+#else
+	(void)file_id;
+	(void)tail;
+#endif
+}
+
 void flog_flush_dirty_block(){
-	if(flogfs.dirty_block.block != FLOG_BLOCK_IDX_INVALID){
-		flog_flush_write(flogfs.dirty_block.file);
-		flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+	flog_file_init_sector_header_t header;
+	flog_file_sector_spare_t spare;
+
+	if(flogfs.dirty_block.block == FLOG_BLOCK_IDX_INVALID){
+		return;
 	}
+
+	// No earlier than the allocation, which is all a mount needs to know
+	header.timestamp = flogfs.t;
+	header.age = flogfs.dirty_block.age;
+	header.file_id = flogfs.dirty_block.file_id;
+	spare.type_id = FLOG_BLOCK_TYPE_FILE;
+	spare.nothing = 0;
+	spare.nbytes = 0;
+
+	flog_open_sector(flogfs.dirty_block.block, FLOG_INIT_SECTOR);
+	flog_write_sector((uint8_t const *)&header, FLOG_INIT_SECTOR, 0,
+	                  sizeof(header));
+	flog_write_spare((uint8_t const *)&spare, FLOG_INIT_SECTOR);
+#if FLOG_SECTOR_CRC
+	flog_write_spare_check(flog_sector_crc(0, (uint8_t const *)&header,
+	                                       sizeof(header)), FLOG_INIT_SECTOR);
+#endif
+	flog_commit();
+
+	flogfs.dirty_block.file->init_written = 1;
+	flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+	flogfs.dirty_block.file = nullptr;
 }
 
 
 flog_timestamp_t flog_block_get_init_timestamp(flog_block_idx_t block){
 	flog_timestamp_t ts;
 	flog_open_sector(block, FLOG_INIT_SECTOR);
-	flash_read_sector((uint8_t *)&ts, FLOG_INIT_SECTOR,
+	flog_read_sector((uint8_t *)&ts, FLOG_INIT_SECTOR,
 	                  0, sizeof(flog_timestamp_t));
 	return ts;
 }
@@ -2018,32 +7905,101 @@ flog_timestamp_t flog_block_get_init_timestamp(flog_block_idx_t block){
 flog_block_age_t flog_block_get_age(flog_block_idx_t block){
 	flog_block_age_t age;
 	flog_open_sector(block, FLOG_BLK_STAT_SECTOR);
-	flash_read_sector((uint8_t *)&age, FLOG_BLK_STAT_SECTOR,
-	                  0, sizeof(flog_block_stat_sector_t));
+	flog_read_sector((uint8_t *)&age, FLOG_BLK_STAT_SECTOR,
+	                  0, sizeof(age));
 	return age;
 }
 
 void flog_get_file_tail_sector(flog_block_idx_t block,
                                flog_file_tail_sector_header_t * header){
 	flog_open_sector(block, FLOG_TAIL_SECTOR);
-	flash_read_sector((uint8_t *)header, FLOG_TAIL_SECTOR, 0,
+	flog_read_sector((uint8_t *)header, FLOG_TAIL_SECTOR, 0,
 	                  sizeof(flog_file_tail_sector_header_t));
 }
 
 void flog_get_file_init_sector(flog_block_idx_t block,
                                flog_file_init_sector_header_t * header){
 	flog_open_sector(block, FLOG_INIT_SECTOR);
-	flash_read_sector((uint8_t *)header, FLOG_INIT_SECTOR, 0,
+	flog_read_sector((uint8_t *)header, FLOG_INIT_SECTOR, 0,
 	                  sizeof(flog_file_init_sector_header_t));
 }
 
+flog_result_t flog_format_block(flog_block_idx_t block, flog_block_age_t age,
+                                uint_fast8_t * num_checkpoint_blocks){
+	struct {
+		flog_block_stat_sector_t stat;
+		char key[sizeof(flog_block_stat_key)];
+	} stat_sector;
+#if FLOG_ENABLE_CHECKPOINT
+	flog_checkpoint_init_sector_spare_t checkpoint_spare;
+	uint_fast8_t const checkpoint =
+		*num_checkpoint_blocks < FLOG_CHECKPOINT_NUM_BLOCKS;
+#else
+	(void)num_checkpoint_blocks;
+#endif
+
+	stat_sector.stat.age = age;
+	stat_sector.stat.next_block = FLOG_BLOCK_IDX_INVALID;
+	stat_sector.stat.next_age = FLOG_BLOCK_AGE_INVALID;
+	stat_sector.stat.timestamp = 0;
+	memcpy(stat_sector.key, flog_block_stat_key, sizeof(flog_block_stat_key));
+	flog_close_sector();
+	// Go erase it. One that fails has been marked bad.
+	if(FLOG_FAILURE == flog_erase_block(block)){
+		flash_debug_warn("FLogFS:" LINESTR);
+		return FLOG_FAILURE;
+	}
+	flog_open_sector(block, FLOG_BLK_STAT_SECTOR);
+	flog_write_sector((uint8_t *)&stat_sector, FLOG_BLK_STAT_SECTOR,
+	                   0, sizeof(stat_sector));
+#if FLOG_ENABLE_CHECKPOINT
+	if(checkpoint){
+		// The first good blocks are reserved for checkpoints
+		checkpoint_spare.type_id = FLOG_BLOCK_TYPE_CHECKPOINT;
+		checkpoint_spare.nothing = 0;
+		checkpoint_spare.reserved = 0;
+		flog_write_spare((uint8_t const *)&checkpoint_spare, FLOG_INIT_SECTOR);
+	}
+#endif
+	if(FLOG_FAILURE == flog_commit()){
+		flash_debug_warn("FLogFS:" LINESTR);
+		flog_set_bad_block(block);
+		return FLOG_FAILURE;
+	}
+#if FLOG_ENABLE_CHECKPOINT
+	if(checkpoint){
+		*num_checkpoint_blocks += 1;
+		return FLOG_FAILURE;
+	}
+#endif
+	return FLOG_SUCCESS;
+}
+
+flog_timestamp_t flog_format_newer(flog_timestamp_t t, flog_timestamp_t stamp){
+	if(stamp >= FLOG_TIMESTAMP_INVALID - 1){
+		return t;
+	}
+	return MAX(t, stamp);
+}
+
 void flog_get_universal_tail_sector(flog_block_idx_t block,
                                     flog_universal_tail_sector_t * header){
 	flog_open_sector(block, FLOG_TAIL_SECTOR);
-	flash_read_sector((uint8_t *)header, FLOG_TAIL_SECTOR, 0,
+	flog_read_sector((uint8_t *)header, FLOG_TAIL_SECTOR, 0,
 	                  sizeof(flog_universal_tail_sector_t));
 }
 
+uint32_t
+flog_tail_bytes_in_block(flog_file_tail_sector_header_t const * header){
+	flog_sector_nbytes_t legacy;
+	if(flogfs.format == FLOG_VOLUME_FORMAT_WIDE_TAIL){
+		return header->bytes_in_block;
+	}
+	// The old count is in the first bytes of the wider field
+	memcpy(&legacy, &header->bytes_in_block, sizeof(legacy));
+	return legacy;
+}
+
 
 #ifndef IS_DOXYGEN
 #if !FLOG_BUILD_CPP
@@ -35,8 +35,231 @@ either expressed or implied, of the FLogFS Project.
  *
  * @brief An outrageously stupid wrapper around flogfs.c to compile as C++
  *
+ * With @ref FLOG_BUILD_CPP this is instead the flogfs.h API over flogfs_volume
+ * instances.
  */
 
+#include "flogfs.h"
+
+#if FLOG_BUILD_CPP
+
+#include "flogfs.hpp"
+
+//! The volume behind the calls without a flogfs_vol_t
+static flogfs_volume<> flog_volume;
+
+flog_result_t flogfs_init(){return flog_volume.flogfs_init();}
+
+flog_result_t flogfs_format(){return flog_volume.flogfs_format();}
+
+flog_result_t flogfs_format_quick(){return flog_volume.flogfs_format_quick();}
+
+flog_result_t flogfs_mount(){return flog_volume.flogfs_mount();}
+
+flog_result_t flogfs_unmount(){return flog_volume.flogfs_unmount();}
+
+uint_fast8_t flogfs_background_step(uint32_t budget_us){
+	return flog_volume.flogfs_background_step(budget_us);
+}
+
+flog_result_t flogfs_checkpoint(){return flog_volume.flogfs_checkpoint();}
+
+flog_result_t flogfs_open_read(flog_read_file_t * file, char const * filename){
+	return flog_volume.flogfs_open_read(file, filename);
+}
+
+flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename){
+	return flog_volume.flogfs_open_write(file, filename);
+}
+#if FLOG_ENABLE_COMPRESSION
+flog_result_t flogfs_open_write_compressed(flog_write_file_t * file,
+                                           char const * filename,
+                                           flog_compression_t codec,
+                                           uint16_t record_size,
+                                           uint8_t * buffer){
+	return flog_volume.flogfs_open_write_compressed(file, filename, codec,
+	                                                record_size, buffer);
+}
+#endif
+
+flog_result_t flogfs_rm(char const * filename){
+	return flog_volume.flogfs_rm(filename);
+}
+
+flog_result_t flogfs_size(char const * filename, uint32_t * size){
+	return flog_volume.flogfs_size(filename, size);
+}
+#if FLOG_ENABLE_COMPRESSION
+flog_result_t flogfs_size_decompressed(char const * filename, uint32_t * size){
+	return flog_volume.flogfs_size_decompressed(filename, size);
+}
+#endif
+
+void flogfs_start_ls(flogfs_ls_iterator_t * iter){
+	flog_volume.flogfs_start_ls(iter);
+}
+
+#if FLOG_ENABLE_STATS
+void flogfs_get_stats(flogfs_stats_t * stats){
+	flog_volume.flogfs_get_stats(stats);
+}
+
+void flogfs_reset_stats(){flog_volume.flogfs_reset_stats();}
+#endif
+
+flog_result_t flogfs_init(flogfs_vol_t * vol){return vol->flogfs_init();}
+
+flog_result_t flogfs_format(flogfs_vol_t * vol){return vol->flogfs_format();}
+
+flog_result_t flogfs_format_quick(flogfs_vol_t * vol){
+	return vol->flogfs_format_quick();
+}
+
+flog_result_t flogfs_mount(flogfs_vol_t * vol){return vol->flogfs_mount();}
+
+flog_result_t flogfs_unmount(flogfs_vol_t * vol){return vol->flogfs_unmount();}
+
+uint_fast8_t flogfs_background_step(flogfs_vol_t * vol, uint32_t budget_us){
+	return vol->flogfs_background_step(budget_us);
+}
+
+flog_result_t flogfs_checkpoint(flogfs_vol_t * vol){
+	return vol->flogfs_checkpoint();
+}
+
+flog_result_t flogfs_open_read(flogfs_vol_t * vol, flog_read_file_t * file,
+                               char const * filename){
+	return vol->flogfs_open_read(file, filename);
+}
+
+flog_result_t flogfs_open_write(flogfs_vol_t * vol, flog_write_file_t * file,
+                                char const * filename){
+	return vol->flogfs_open_write(file, filename);
+}
+#if FLOG_ENABLE_COMPRESSION
+flog_result_t flogfs_open_write_compressed(flogfs_vol_t * vol,
+                                           flog_write_file_t * file,
+                                           char const * filename,
+                                           flog_compression_t codec,
+                                           uint16_t record_size,
+                                           uint8_t * buffer){
+	return vol->flogfs_open_write_compressed(file, filename, codec,
+	                                         record_size, buffer);
+}
+#endif
+
+flog_result_t flogfs_rm(flogfs_vol_t * vol, char const * filename){
+	return vol->flogfs_rm(filename);
+}
+
+flog_result_t flogfs_size(flogfs_vol_t * vol, char const * filename,
+                          uint32_t * size){
+	return vol->flogfs_size(filename, size);
+}
+#if FLOG_ENABLE_COMPRESSION
+flog_result_t flogfs_size_decompressed(flogfs_vol_t * vol,
+                                       char const * filename, uint32_t * size){
+	return vol->flogfs_size_decompressed(filename, size);
+}
+#endif
+
+void flogfs_start_ls(flogfs_vol_t * vol, flogfs_ls_iterator_t * iter){
+	vol->flogfs_start_ls(iter);
+}
+
+#if FLOG_ENABLE_STATS
+void flogfs_get_stats(flogfs_vol_t * vol, flogfs_stats_t * stats){
+	vol->flogfs_get_stats(stats);
+}
+
+void flogfs_reset_stats(flogfs_vol_t * vol){vol->flogfs_reset_stats();}
+#endif
+
+// Everything else goes to the volume the file or listing is open on
+
+void flogfs_set_page_buffer(flog_write_file_t * file, uint8_t * buffer){
+	file->vol->flogfs_set_page_buffer(file, buffer);
+}
+
+void flogfs_set_back_buffer(flog_write_file_t * file, uint8_t * buffer){
+	file->vol->flogfs_set_back_buffer(file, buffer);
+}
+
+flog_result_t flogfs_flush(flog_write_file_t * file){
+	return file->vol->flogfs_flush(file);
+}
+
+flog_result_t flogfs_close_read(flog_read_file_t * file){
+	return file->vol->flogfs_close_read(file);
+}
+
+flog_result_t flogfs_close_write(flog_write_file_t * file){
+	return file->vol->flogfs_close_write(file);
+}
+
+uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst, uint32_t nbytes){
+	return file->vol->flogfs_read(file, dst, nbytes);
+}
+
+uint32_t flogfs_read_pages(flog_read_file_t * file, uint8_t * dst,
+                           uint32_t nbytes){
+	return file->vol->flogfs_read_pages(file, dst, nbytes);
+}
+
+flog_result_t flogfs_seek(flog_read_file_t * file, uint32_t index){
+	return file->vol->flogfs_seek(file, index);
+}
+
+void flogfs_set_skip_index(flog_read_file_t * file, flog_skip_index_t * index,
+                           flog_skip_entry_t * entries, uint16_t size,
+                           uint16_t interval){
+	file->vol->flogfs_set_skip_index(file, index, entries, size, interval);
+}
+
+#if FLOG_SECTOR_CRC
+void flogfs_set_verify(flog_read_file_t * file, uint8_t verify){
+	file->vol->flogfs_set_verify(file, verify);
+}
+#endif
+
+uint32_t flogfs_write(flog_write_file_t * file, uint8_t const * src,
+                      uint32_t nbytes){
+	return file->vol->flogfs_write(file, src, nbytes);
+}
+
+uint32_t flogfs_writev(flog_write_file_t * file, flog_iovec_t const * iov,
+                       uint16_t iovcnt){
+	return file->vol->flogfs_writev(file, iov, iovcnt);
+}
+
+void flogfs_set_group_commit(flog_write_file_t * file, uint32_t max_bytes,
+                             uint32_t max_ms){
+	file->vol->flogfs_set_group_commit(file, max_bytes, max_ms);
+}
+
+uint32_t flogfs_write_try(flog_write_file_t * file, uint8_t const * src,
+                          uint32_t nbytes){
+	return file->vol->flogfs_write_try(file, src, nbytes);
+}
+
+uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t * iter, char * fname_dst){
+	return iter->vol->flogfs_ls_iterate(iter, fname_dst);
+}
+
+uint_fast8_t flogfs_ls_iterate_entry(flogfs_ls_iterator_t * iter,
+                                     char const * prefix,
+                                     flogfs_ls_entry_t * entry){
+	return iter->vol->flogfs_ls_iterate_entry(iter, prefix, entry);
+}
+
+void flogfs_stop_ls(flogfs_ls_iterator_t * iter){
+	iter->vol->flogfs_stop_ls(iter);
+}
+
+#else
+
 #ifndef IS_DOXYGEN
 #include "flogfs.c"
 #endif
+
+#endif